@@ -4,9 +4,36 @@
 ////////////////////////////////////////////////////////////////////////////////
 
 
+// Collect the conversion statistics, to test the instrumentation
+#define UNICODECONVATL_ENABLE_INSTRUMENTATION
+#define UNICODECONVATL_DEFINE_TRACE_PROVIDER
+
 #include "UnicodeConvAtl.h"     // Module to test
+#include "UnicodeConvAtlFile.h" // File conversions
+#include "UnicodeConvAtlParallel.h" // Parallel conversions
+#include "UnicodeConvAtlArena.h" // Arena string manager
+#include "UnicodeConvAtlCache.h" // Conversion caches
+#include "UnicodeConvAtlEncodings.h" // UTF-32, Latin-1, WTF-8 and CESU-8 conversions
+#include "UnicodeConvAtlPipeline.h" // Overlapped conversion pipeline
+#include "UnicodeConvAtlGenerator.h" // Lazy chunked conversions
+#include "UnicodeConvAtlIncremental.h" // Incremental conversions
+#include "UnicodeConvAtlOffsetIndex.h" // Offset index of conversions
+#include "UnicodeConvAtlLiteral.h" // Compile-time conversions
+#include "UnicodeConvAtlLargePages.h" // Large-page string manager
 
 #include <iostream>             // For console output
+#include <utility>              // std::move
+
+// The UnicodeConvAtlCpp20 project builds these tests in C++20 mode,
+// so the features that need it must be compiled there
+#ifdef UNICODECONVATL_TEST_CPP20
+#ifndef UNICODECONVATL_HAS_COROUTINES
+#error The C++20 tests need coroutines (__cpp_impl_coroutine >= 201902L)
+#endif
+#ifndef UNICODECONVATL_HAS_UTF8_LITERAL
+#error The C++20 tests need consteval and class types as template arguments
+#endif
+#endif
 
 
 // Convenient function to print PASSED/FAILED on a single test,
@@ -77,6 +104,1746 @@ void TestStringLengths()
 }
 
 
+void TestSinglePassConversion()
+{
+    // Mix of ASCII, Japanese kanji U+5B66 and an emoji (U+1F600, encoded
+    // in UTF-16 as the surrogate pair 0xD83D 0xDE00), to exercise all
+    // the UTF-8 sequence lengths
+    CStringW utf16 = L"Kanji \x5B66, emoji \xD83D\xDE00";
+
+    CStringA utf8 = UnicodeConvAtl::ToUtf8SinglePass(utf16);
+    ATLASSERT(utf8 == UnicodeConvAtl::ToUtf8(utf16));
+    Check(utf8 == UnicodeConvAtl::ToUtf8(utf16), "Single-pass UTF-8 conversion");
+
+    CStringA utf8Shrunk = UnicodeConvAtl::ToUtf8SinglePass(utf16, true);
+    ATLASSERT(utf8Shrunk == utf8);
+    Check(utf8Shrunk == utf8, "Single-pass UTF-8 conversion with shrink");
+
+    CStringW utf16Again = UnicodeConvAtl::ToUtf16SinglePass(utf8);
+    ATLASSERT(utf16Again == utf16);
+    Check(utf16Again == utf16, "Single-pass UTF-16 conversion");
+
+    CStringW utf16Shrunk = UnicodeConvAtl::ToUtf16SinglePass(utf8, true);
+    ATLASSERT(utf16Shrunk == utf16);
+    Check(utf16Shrunk == utf16, "Single-pass UTF-16 conversion with shrink");
+}
+
+
+void TestAsciiFastPath()
+{
+    // Pure ASCII strings, long enough to exercise the vectorized code paths
+    CStringW utf16 = L"Pure ASCII text: abcdefghijklmnopqrstuvwxyz 0123456789";
+    CStringA utf8 = UnicodeConvAtl::ToUtf8(utf16);
+    ATLASSERT(utf8 == "Pure ASCII text: abcdefghijklmnopqrstuvwxyz 0123456789");
+    Check(utf8 == "Pure ASCII text: abcdefghijklmnopqrstuvwxyz 0123456789",
+          "ASCII fast path to UTF-8");
+
+    CStringW utf16Again = UnicodeConvAtl::ToUtf16(utf8);
+    ATLASSERT(utf16Again == utf16);
+    Check(utf16Again == utf16, "ASCII fast path to UTF-16");
+
+    // Non-ASCII text following a long ASCII prefix
+    CStringW mixed = L"A long ASCII prefix, followed by kanji \x5B66 and more ASCII";
+    CStringA mixedUtf8 = UnicodeConvAtl::ToUtf8(mixed);
+    ATLASSERT(mixedUtf8.GetLength() == mixed.GetLength() + 2);
+    Check(mixedUtf8.GetLength() == mixed.GetLength() + 2, "ASCII prefix + kanji UTF-8 length");
+    Check(UnicodeConvAtl::ToUtf16(mixedUtf8) == mixed, "ASCII prefix + kanji round trip");
+    Check(UnicodeConvAtl::ToUtf8SinglePass(mixed) == mixedUtf8, "ASCII prefix + kanji single-pass");
+
+    // Invalid UTF-16 (unpaired high surrogate) after an ASCII prefix must still throw
+    bool thrown = false;
+    try
+    {
+        UnicodeConvAtl::ToUtf8(CStringW(L"A long ASCII prefix, then \xD83D"));
+    }
+    catch (const CAtlException& e)
+    {
+        thrown = (HRESULT(e) == HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION));
+    }
+    ATLASSERT(thrown);
+    Check(thrown, "Invalid UTF-16 after ASCII prefix");
+
+    // The vectorized helpers (AVX2 when available, SSE2, then scalar code)
+    // at every alignment and length, with a non-ASCII code unit at every
+    // position, or none at all
+    using namespace UnicodeConvAtl::Detail;
+    const int kMaxLength = 80;
+    wchar_t wideBuffer[kMaxLength + 4];
+    char narrowBuffer[kMaxLength + 4];
+    bool matching = true;
+    for (int offset = 0; offset < 4; offset++)
+    {
+        for (int length = 0; length <= kMaxLength; length++)
+        {
+            for (int nonAscii = 0; nonAscii <= length; nonAscii++)
+            {
+                wchar_t* wide = wideBuffer + offset;
+                char* narrow = narrowBuffer + offset;
+                for (int i = 0; i < length; i++)
+                {
+                    wide[i] = static_cast<wchar_t>(L'!' + i % 90);
+                    narrow[i] = static_cast<char>(wide[i]);
+                }
+                if (nonAscii < length)
+                {
+                    wide[nonAscii] = L'\x0100';
+                    narrow[nonAscii] = static_cast<char>(0xC4);
+                }
+
+                char narrowed[kMaxLength];
+                wchar_t widened[kMaxLength];
+                matching = matching
+                    && (AsciiPrefixLength(wide, length) == nonAscii)
+                    && (AsciiPrefixLength(narrow, length) == nonAscii)
+                    && (NarrowAsciiPrefix(wide, length, narrowed) == nonAscii)
+                    && (memcmp(narrowed, narrow, nonAscii) == 0)
+                    && (WidenAsciiPrefix(narrow, length, widened) == nonAscii)
+                    && (memcmp(widened, wide, nonAscii * sizeof(wchar_t)) == 0);
+            }
+        }
+    }
+    ATLASSERT(matching);
+    Check(matching, "ASCII helpers at every offset and length");
+}
+
+
+void TestNativeEngine()
+{
+    // Mix of ASCII, 2-char (U+00E8), 3-char (U+5B66) and 4-char (U+1F600)
+    // UTF-8 sequences
+    CStringW utf16 = L"Native engine: caff\xE8, kanji \x5B66, emoji \xD83D\xDE00";
+
+    CStringA utf8 = UnicodeConvAtl::ToUtf8Native(utf16);
+    ATLASSERT(utf8 == UnicodeConvAtl::ToUtf8(utf16));
+    Check(utf8 == UnicodeConvAtl::ToUtf8(utf16), "Native engine UTF-8 conversion");
+
+    CStringW utf16Again = UnicodeConvAtl::ToUtf16Native(utf8);
+    ATLASSERT(utf16Again == utf16);
+    Check(utf16Again == utf16, "Native engine UTF-16 conversion");
+
+    // Invalid UTF-8: overlong encoding of '/' (0xC0 0xAF)
+    bool thrown = false;
+    try
+    {
+        UnicodeConvAtl::ToUtf16Native(CStringA("Overlong \xC0\xAF"));
+    }
+    catch (const CAtlException& e)
+    {
+        thrown = (HRESULT(e) == HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION));
+    }
+    ATLASSERT(thrown);
+    Check(thrown, "Native engine invalid UTF-8");
+
+    // The multilingual kernels (AVX2 when available) against the scalar
+    // code at every alignment and length, with an invalid code unit
+    // at every position, or none at all
+    using namespace UnicodeConvAtl::Detail;
+    const wchar_t kPattern[] = L"\xE8\x5B66\xD83D\xDE00" L"a\x0416\xD55C\x20AC\xFF01\x00A9";
+    const wchar_t kInvalidUtf16[] = { L'\xDC00', L'\xD800' };
+    const unsigned char kInvalidUtf8[] = { 0xF8, 0x80, 0xC0, 0xED };
+    const int kPatternLength = _countof(kPattern) - 1;
+    const int kMaxLength = 80;
+    wchar_t wideBuffer[kMaxLength + 4];
+    char narrowBuffer[4 * kMaxLength + 4];
+    char utf8Output[4 * kMaxLength];
+    wchar_t utf16Output[4 * kMaxLength];
+    char utf8Expected[4 * kMaxLength];
+    wchar_t utf16Expected[4 * kMaxLength];
+    bool matching = true;
+    for (int offset = 0; offset < 4; offset++)
+    {
+        for (int length = 0; length <= kMaxLength; length++)
+        {
+            wchar_t* wide = wideBuffer + offset;
+            for (int i = 0; i < length; i++)
+            {
+                wide[i] = kPattern[i % kPatternLength];
+            }
+
+            // Don't split the last surrogate pair
+            if (length > 0 && IsHighSurrogate(static_cast<unsigned int>(wide[length - 1])))
+            {
+                wide[length - 1] = L'z';
+            }
+
+            char* narrow = narrowBuffer + offset;
+            const int narrowLength = NativeUtf16ToUtf8(wide, length, narrow, 4 * kMaxLength).Written;
+
+            for (int invalid = 0; invalid <= narrowLength; invalid++)
+            {
+                // Unpaired surrogates in UTF-16; invalid lead byte, unexpected
+                // continuation byte, overlong or surrogate sequences in UTF-8
+                const wchar_t savedWide = (invalid < length) ? wide[invalid] : L'\0';
+                const char savedNarrow = (invalid < narrowLength) ? narrow[invalid] : '\0';
+                if (invalid < length)
+                {
+                    wide[invalid] = kInvalidUtf16[invalid % 2];
+                }
+                if (invalid < narrowLength)
+                {
+                    narrow[invalid] = static_cast<char>(kInvalidUtf8[invalid % 4]);
+                }
+
+                if (invalid <= length)
+                {
+                    const UnicodeConvAtl::ConversionResult expected =
+                        NativeUtf16ToUtf8(wide, length, utf8Expected, 4 * kMaxLength);
+                    int invalidOffset = -1;
+                    const long long utf8Length = NativeUtf8Length(wide, length, &invalidOffset);
+                    if (expected.Status == UnicodeConvAtl::ConversionStatus::Success)
+                    {
+                        const char* end = NativeUtf16ToUtf8Unchecked(wide, length, utf8Output);
+                        matching = matching
+                            && (utf8Length == expected.Written)
+                            && (end - utf8Output == expected.Written)
+                            && (memcmp(utf8Output, utf8Expected, expected.Written) == 0);
+                    }
+                    else
+                    {
+                        matching = matching && (utf8Length == -1) && (invalidOffset == expected.Consumed);
+                    }
+                }
+
+                const UnicodeConvAtl::ConversionResult expected =
+                    NativeUtf8ToUtf16(narrow, narrowLength, utf16Expected, 4 * kMaxLength);
+                int invalidOffset = -1;
+                const int utf16Length = NativeUtf16Length(narrow, narrowLength, &invalidOffset);
+                if (expected.Status == UnicodeConvAtl::ConversionStatus::Success)
+                {
+                    const wchar_t* end = NativeUtf8ToUtf16Unchecked(narrow, narrowLength, utf16Output);
+                    matching = matching
+                        && (utf16Length == expected.Written)
+                        && (end - utf16Output == expected.Written)
+                        && (memcmp(utf16Output, utf16Expected, expected.Written * sizeof(wchar_t)) == 0);
+                }
+                else
+                {
+                    matching = matching && (utf16Length == -1) && (invalidOffset == expected.Consumed);
+                }
+
+                if (invalid < length)
+                {
+                    wide[invalid] = savedWide;
+                }
+                if (invalid < narrowLength)
+                {
+                    narrow[invalid] = savedNarrow;
+                }
+            }
+        }
+    }
+    ATLASSERT(matching);
+    Check(matching, "Native engine multilingual text at every offset and length");
+}
+
+
+void TestOutputParameterConversions()
+{
+    // Convert into a scratch string: its buffer must be reused
+    // when the next result fits into it
+    CStringA utf8;
+    UnicodeConvAtl::ToUtf8(CStringW(L"A longer string with kanji \x5B66 inside"), utf8);
+    const char* utf8Buffer = utf8.GetString();
+
+    UnicodeConvAtl::ToUtf8(CStringW(L"Short \x5B66"), utf8);
+    ATLASSERT(utf8 == UnicodeConvAtl::ToUtf8(CStringW(L"Short \x5B66")));
+    Check(utf8 == UnicodeConvAtl::ToUtf8(CStringW(L"Short \x5B66")), "UTF-8 output parameter");
+    ATLASSERT(utf8.GetString() == utf8Buffer);
+    Check(utf8.GetString() == utf8Buffer, "UTF-8 output parameter buffer reuse");
+
+    CStringW utf16;
+    UnicodeConvAtl::ToUtf16(utf8, utf16);
+    ATLASSERT(utf16 == L"Short \x5B66");
+    Check(utf16 == L"Short \x5B66", "UTF-16 output parameter");
+
+    // Append conversions to existing strings
+    UnicodeConvAtl::AppendUtf8(CStringW(L" + \x5B66"), utf8);
+    ATLASSERT(UnicodeConvAtl::ToUtf16(utf8) == L"Short \x5B66 + \x5B66");
+    Check(UnicodeConvAtl::ToUtf16(utf8) == L"Short \x5B66 + \x5B66", "Append UTF-8");
+
+    UnicodeConvAtl::AppendUtf16(CStringA(" + ASCII"), utf16);
+    ATLASSERT(utf16 == L"Short \x5B66 + ASCII");
+    Check(utf16 == L"Short \x5B66 + ASCII", "Append UTF-16");
+
+    // On error, the destination string is left unchanged
+    try
+    {
+        UnicodeConvAtl::AppendUtf16(CStringA("Invalid \xFF"), utf16);
+    }
+    catch (const CAtlException&)
+    {
+    }
+    ATLASSERT(utf16 == L"Short \x5B66 + ASCII");
+    Check(utf16 == L"Short \x5B66 + ASCII", "Append UTF-16 error keeps destination");
+
+    try
+    {
+        UnicodeConvAtl::ToUtf16(CStringA("Invalid \xFF"), utf16);
+    }
+    catch (const CAtlException&)
+    {
+    }
+    ATLASSERT(utf16 == L"Short \x5B66 + ASCII");
+    Check(utf16 == L"Short \x5B66 + ASCII", "UTF-16 output parameter error keeps destination");
+
+    const CStringA utf8Before = utf8;
+    try
+    {
+        UnicodeConvAtl::ToUtf8(CStringW(L"Unpaired \xD800 surrogate"), utf8);
+    }
+    catch (const CAtlException&)
+    {
+    }
+    ATLASSERT(utf8 == utf8Before);
+    Check(utf8 == utf8Before, "UTF-8 output parameter error keeps destination");
+
+    // An empty input replaces the previous content
+    UnicodeConvAtl::ToUtf16(CStringA(), utf16);
+    ATLASSERT(utf16.IsEmpty());
+    Check(utf16.IsEmpty(), "UTF-16 output parameter empty input");
+}
+
+
+void TestPointerAndLengthConversions()
+{
+    // Convert only a part of a larger buffer, without copying it into a CString
+    const wchar_t utf16Buffer[] = L"Kanji \x5B66 and trailing text";
+    CStringA utf8 = UnicodeConvAtl::ToUtf8(utf16Buffer, 7);
+    ATLASSERT(utf8 == UnicodeConvAtl::ToUtf8(CStringW(L"Kanji \x5B66")));
+    Check(utf8 == UnicodeConvAtl::ToUtf8(CStringW(L"Kanji \x5B66")), "UTF-8 from pointer and length");
+
+    CStringW utf16 = UnicodeConvAtl::ToUtf16(utf8.GetString(), 6);
+    ATLASSERT(utf16 == L"Kanji ");
+    Check(utf16 == L"Kanji ", "UTF-16 from pointer and length");
+
+    // NUL-terminated strings
+    ATLASSERT(UnicodeConvAtl::ToUtf16(UnicodeConvAtl::ToUtf8(L"\x5B66")) == L"\x5B66");
+    Check(UnicodeConvAtl::ToUtf16(UnicodeConvAtl::ToUtf8(L"\x5B66")) == L"\x5B66",
+          "NUL-terminated strings");
+
+#ifdef UNICODECONVATL_HAS_STRING_VIEW
+    // String views
+    const std::wstring_view utf16View(utf16Buffer, 7);
+    ATLASSERT(UnicodeConvAtl::ToUtf8(utf16View) == utf8);
+    Check(UnicodeConvAtl::ToUtf8(utf16View) == utf8, "UTF-8 from std::wstring_view");
+
+    const std::string_view utf8View(utf8.GetString(), utf8.GetLength());
+    ATLASSERT(UnicodeConvAtl::ToUtf16(utf8View) == CStringW(utf16Buffer, 7));
+    Check(UnicodeConvAtl::ToUtf16(utf8View) == CStringW(utf16Buffer, 7), "UTF-16 from std::string_view");
+#endif
+}
+
+
+void TestFixedBufferConversions()
+{
+    using UnicodeConvAtl::ConversionResult;
+    using UnicodeConvAtl::ConversionStatus;
+
+    // Convert into a stack buffer
+    const wchar_t utf16[] = L"Kanji \x5B66";
+    const int utf16Length = _countof(utf16) - 1;
+    char utf8[16];
+    ConversionResult result = UnicodeConvAtl::ConvertUtf16ToUtf8(utf16, utf16Length, utf8, _countof(utf8));
+    ATLASSERT(result.Status == ConversionStatus::Success);
+    Check(result.Status == ConversionStatus::Success && result.Written == 9
+          && result.Consumed == utf16Length
+          && memcmp(utf8, "Kanji \xE5\xAD\xA6", 9) == 0,
+          "UTF-8 fixed buffer conversion");
+
+    // The destination buffer is too small: the conversion must stop
+    // before the 3-char sequence of the kanji
+    result = UnicodeConvAtl::ConvertUtf16ToUtf8(utf16, utf16Length, utf8, 8);
+    ATLASSERT(result.Status == ConversionStatus::InsufficientBuffer);
+    Check(result.Status == ConversionStatus::InsufficientBuffer
+          && result.Written == 6 && result.Consumed == 6,
+          "UTF-8 fixed buffer too small");
+
+    // Back to UTF-16
+    wchar_t utf16Again[16];
+    result = UnicodeConvAtl::ConvertUtf8ToUtf16(utf8, 9, utf16Again, _countof(utf16Again));
+    ATLASSERT(result.Status == ConversionStatus::Success);
+    Check(result.Status == ConversionStatus::Success && result.Written == utf16Length
+          && memcmp(utf16Again, utf16, utf16Length * sizeof(wchar_t)) == 0,
+          "UTF-16 fixed buffer conversion");
+
+    // Invalid input: the offset of the invalid sequence is reported
+    const char invalidUtf8[] = "Bad \xC0\xAF";
+    result = UnicodeConvAtl::ConvertUtf8ToUtf16(invalidUtf8, _countof(invalidUtf8) - 1,
+                                                utf16Again, _countof(utf16Again));
+    ATLASSERT(result.Status == ConversionStatus::InvalidInput);
+    Check(result.Status == ConversionStatus::InvalidInput
+          && result.Consumed == 4 && result.Written == 4,
+          "UTF-16 fixed buffer invalid input");
+}
+
+
+void TestNonThrowingConversions()
+{
+    CStringA utf8;
+    HRESULT hr = UnicodeConvAtl::TryToUtf8(CStringW(L"Kanji \x5B66"), utf8);
+    ATLASSERT(SUCCEEDED(hr));
+    Check(hr == S_OK && utf8 == UnicodeConvAtl::ToUtf8(CStringW(L"Kanji \x5B66")),
+          "TryToUtf8 success");
+
+    CStringW utf16;
+    hr = UnicodeConvAtl::TryToUtf16(utf8, utf16);
+    ATLASSERT(SUCCEEDED(hr));
+    Check(hr == S_OK && utf16 == L"Kanji \x5B66", "TryToUtf16 success");
+
+    // Unpaired low surrogate at offset 4
+    int invalidOffset = 0;
+    hr = UnicodeConvAtl::TryToUtf8(CStringW(L"Bad \xDC00 surrogate"), utf8, &invalidOffset);
+    ATLASSERT(FAILED(hr));
+    Check(hr == HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION) && invalidOffset == 4,
+          "TryToUtf8 invalid input offset");
+
+    // Truncated 3-char sequence at offset 6
+    hr = UnicodeConvAtl::TryToUtf16(CStringA("Kanji \xE5\xAD"), utf16, &invalidOffset);
+    ATLASSERT(FAILED(hr));
+    Check(hr == HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION) && invalidOffset == 6
+          && utf16 == L"Kanji \x5B66",
+          "TryToUtf16 invalid input offset");
+}
+
+
+void TestStackBufferConversions()
+{
+    using UnicodeConvAtl::CW2Utf8;
+    using UnicodeConvAtl::CUtf82W;
+
+    // Short string: converted in the inline buffer
+    const CStringW shortUtf16 = L"caff\xE8 \x5B66 \xD83D\xDE00";
+    const CStringA shortUtf8 = UnicodeConvAtl::ToUtf8(shortUtf16);
+    const CW2Utf8 shortResult(shortUtf16);
+    const bool shortMatches = (CStringA(shortResult) == shortUtf8)
+                              && (shortResult.GetLength() == shortUtf8.GetLength());
+    ATLASSERT(shortMatches);
+    Check(shortMatches, "UTF-8 stack buffer conversion");
+
+    // Long string: converted on the heap, with a sequence straddling
+    // the end of the inline buffer
+    CStringW longUtf16;
+    while (longUtf16.GetLength() < 300)
+    {
+        longUtf16 += shortUtf16;
+    }
+    const CStringA longUtf8 = UnicodeConvAtl::ToUtf8(longUtf16);
+    const bool longMatches = (CStringA(CW2Utf8(longUtf16)) == longUtf8)
+                             && (CStringW(CUtf82W(longUtf8)) == longUtf16)
+                             && (CStringW(UnicodeConvAtl::CUtf82WEX<8>(shortUtf8)) == shortUtf16);
+    ATLASSERT(longMatches);
+    Check(longMatches, "Stack buffer conversion overflowing to the heap");
+
+    const wchar_t* const nullUtf16 = nullptr;
+    const bool nullMatches = (static_cast<const char*>(CW2Utf8(nullUtf16)) == nullptr);
+    ATLASSERT(nullMatches);
+    Check(nullMatches, "Stack buffer conversion of null pointer");
+
+    bool thrown = false;
+    try
+    {
+        CUtf82W invalid("Invalid \xC0\xAF");
+    }
+    catch (const CAtlException& e)
+    {
+        thrown = (HRESULT(e) == HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION));
+    }
+    ATLASSERT(thrown);
+    Check(thrown, "Stack buffer conversion of invalid input");
+}
+
+
+void TestStreamingConversions()
+{
+    // UTF-8 text with 2-char, 3-char and 4-char sequences
+    const CStringW utf16 = L"caff\xE8 \x5B66 \xD83D\xDE00 end";
+    const CStringA utf8 = UnicodeConvAtl::ToUtf8(utf16);
+
+    // Feed the UTF-8 text one char at a time, so every multi-char
+    // sequence is split across chunks
+    UnicodeConvAtl::Utf8ToUtf16Stream utf8Stream;
+    CStringW utf16Result;
+    for (int i = 0; i < utf8.GetLength(); ++i)
+    {
+        utf8Stream.Convert(utf8.GetString() + i, 1, utf16Result);
+    }
+    utf8Stream.Finish();
+    ATLASSERT(utf16Result == utf16);
+    Check(utf16Result == utf16, "UTF-8 to UTF-16 stream");
+
+    // Same for UTF-16, splitting the surrogate pair
+    UnicodeConvAtl::Utf16ToUtf8Stream utf16Stream;
+    CStringA utf8Result;
+    for (int i = 0; i < utf16.GetLength(); ++i)
+    {
+        utf16Stream.Convert(utf16.GetString() + i, 1, utf8Result);
+    }
+    utf16Stream.Finish();
+    ATLASSERT(utf8Result == utf8);
+    Check(utf8Result == utf8, "UTF-16 to UTF-8 stream");
+
+    // A stream ending with a truncated sequence is invalid
+    utf8Stream.Convert(utf8.GetString(), 8, utf16Result);
+    ATLASSERT(utf8Stream.HasPendingInput());
+    bool thrown = false;
+    try
+    {
+        utf8Stream.Finish();
+    }
+    catch (const CAtlException&)
+    {
+        thrown = true;
+    }
+    ATLASSERT(thrown);
+    Check(thrown && !utf8Stream.HasPendingInput(), "Truncated UTF-8 stream");
+}
+
+
+// Write raw bytes to a file, replacing it
+void WriteTestFile(LPCWSTR path, const void* data, DWORD size)
+{
+    CHandle file(UnicodeConvAtl::Detail::OpenFileHandle(path, GENERIC_WRITE, 0, CREATE_ALWAYS));
+    UnicodeConvAtl::Detail::WriteFileData(file, data, size);
+}
+
+
+// Read the raw bytes of a file
+CStringA ReadTestFile(LPCWSTR path)
+{
+    CHandle file(UnicodeConvAtl::Detail::OpenFileHandle(
+        path, GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING));
+
+    LARGE_INTEGER fileSize;
+    ATLVERIFY(::GetFileSizeEx(file, &fileSize));
+
+    CStringA data;
+    const DWORD size = static_cast<DWORD>(fileSize.QuadPart);
+    DWORD read = 0;
+    ATLVERIFY(::ReadFile(file, data.GetBuffer(size), size, &read, nullptr));
+    data.ReleaseBuffer(read);
+    return data;
+}
+
+
+void TestInvalidInputPolicies()
+{
+    using UnicodeConvAtl::InvalidInputPolicy;
+
+    // Example from the Unicode Standard (chapter 3, "U+FFFD Substitution
+    // of Maximal Subparts"): each maximal subpart becomes one U+FFFD
+    const CStringA invalidUtf8("\x61\xF1\x80\x80\xE1\x80\xC2\x62\x80\x63\x80\xBF\x64");
+
+    const CStringW replaced = UnicodeConvAtl::ToUtf16(invalidUtf8, InvalidInputPolicy::Replace);
+    ATLASSERT(replaced == L"a\xFFFD\xFFFD\xFFFD" L"b\xFFFD" L"c\xFFFD\xFFFD" L"d");
+    Check(replaced == L"a\xFFFD\xFFFD\xFFFD" L"b\xFFFD" L"c\xFFFD\xFFFD" L"d",
+          "UTF-16 conversion replacing invalid input");
+
+    const CStringW skipped = UnicodeConvAtl::ToUtf16(invalidUtf8, InvalidInputPolicy::Skip);
+    ATLASSERT(skipped == L"abcd");
+    Check(skipped == L"abcd", "UTF-16 conversion skipping invalid input");
+
+    // Unpaired surrogates
+    const CStringW invalidUtf16(L"a\xD800" L"b\xDC00");
+
+    const CStringA replacedUtf8 = UnicodeConvAtl::ToUtf8(invalidUtf16, InvalidInputPolicy::Replace);
+    ATLASSERT(replacedUtf8 == "a\xEF\xBF\xBD" "b\xEF\xBF\xBD");
+    Check(replacedUtf8 == "a\xEF\xBF\xBD" "b\xEF\xBF\xBD",
+          "UTF-8 conversion replacing invalid input");
+
+    const CStringA skippedUtf8 = UnicodeConvAtl::ToUtf8(invalidUtf16, InvalidInputPolicy::Skip);
+    ATLASSERT(skippedUtf8 == "ab");
+    Check(skippedUtf8 == "ab", "UTF-8 conversion skipping invalid input");
+
+    // Valid input is converted as usual, whatever the policy
+    const CStringW utf16 = L"caff\xE8 \x5B66 \xD83D\xDE00";
+    const bool validMatches =
+        UnicodeConvAtl::ToUtf8(utf16, InvalidInputPolicy::Replace) == UnicodeConvAtl::ToUtf8(utf16)
+        && UnicodeConvAtl::ToUtf16(UnicodeConvAtl::ToUtf8(utf16), InvalidInputPolicy::Skip) == utf16;
+    ATLASSERT(validMatches);
+    Check(validMatches, "Valid input with policies");
+
+    bool thrown = false;
+    try
+    {
+        UnicodeConvAtl::ToUtf16(invalidUtf8, InvalidInputPolicy::Throw);
+    }
+    catch (const CAtlException& e)
+    {
+        thrown = (HRESULT(e) == HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION));
+    }
+    ATLASSERT(thrown);
+    Check(thrown, "Invalid input with the Throw policy");
+}
+
+
+void TestPolicyBasedConversions()
+{
+    using namespace UnicodeConvAtl;
+
+    const CStringW utf16 = L"caff\xE8 \x5B66 \xD83D\xDE00";
+    const CStringA utf8 = ToUtf8(utf16);
+
+    // Default policies: same as ToUtf8/ToUtf16
+    CStringA utf8Result;
+    ConvertToUtf8<>(utf16.GetString(), utf16.GetLength(), utf8Result);
+    CStringW utf16Result;
+    ConvertToUtf16<>(utf8.GetString(), utf8.GetLength(), utf16Result);
+    ATLASSERT(utf8Result == utf8 && utf16Result == utf16);
+    Check(utf8Result == utf8 && utf16Result == utf16, "Default policies");
+
+    // Trusted input: no validation
+    ConvertToUtf8<ThrowOnError, CStringAllocPolicy, TrustInput>(
+        utf16.GetString(), utf16.GetLength(), utf8Result);
+    ConvertToUtf16<ThrowOnError, CStringAllocPolicy, TrustInput>(
+        utf8.GetString(), utf8.GetLength(), utf16Result);
+    ATLASSERT(utf8Result == utf8 && utf16Result == utf16);
+    Check(utf8Result == utf8 && utf16Result == utf16, "Trusted input");
+
+    // Errors returned as HRESULTs
+    const CStringA invalidUtf8("Invalid \xC0\xAF");
+    HRESULT hr = ConvertToUtf16<ReturnHResult>(
+        invalidUtf8.GetString(), invalidUtf8.GetLength(), utf16Result);
+    ATLASSERT(hr == HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION));
+    Check(hr == HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION) && utf16Result.IsEmpty(),
+          "HRESULT error policy");
+
+    // Invalid input replaced
+    ConvertToUtf16<ReplaceInvalidInput>(
+        invalidUtf8.GetString(), invalidUtf8.GetLength(), utf16Result);
+    ATLASSERT(utf16Result == L"Invalid \xFFFD\xFFFD");
+    Check(utf16Result == L"Invalid \xFFFD\xFFFD", "Replacement error policy");
+}
+
+
+void TestValidationAndLengthQueries()
+{
+    const CStringW utf16 = L"caff\xE8 \x5B66 \xD83D\xDE00";
+    const CStringA utf8 = UnicodeConvAtl::ToUtf8(utf16);
+
+    const bool lengthsMatch = (UnicodeConvAtl::Utf8LengthOf(utf16) == utf8.GetLength())
+                              && (UnicodeConvAtl::Utf16LengthOf(utf8) == utf16.GetLength());
+    ATLASSERT(lengthsMatch);
+    Check(lengthsMatch, "Length queries");
+
+    const bool validStrings = UnicodeConvAtl::IsValidUtf8(utf8)
+                              && UnicodeConvAtl::IsValidUtf16(utf16)
+                              && UnicodeConvAtl::IsValidUtf8(CStringA())
+                              && UnicodeConvAtl::IsValidUtf16(CStringW());
+    ATLASSERT(validStrings);
+    Check(validStrings, "Valid strings");
+
+    // Encoded surrogate at offset 2, unpaired surrogate at offset 3
+    int invalidUtf8Offset = -1;
+    int invalidUtf16Offset = -1;
+    const bool invalidStrings =
+        !UnicodeConvAtl::IsValidUtf8(CStringA("ab\xED\xA0\x80"), &invalidUtf8Offset)
+        && !UnicodeConvAtl::IsValidUtf16(CStringW(L"abc\xDE00"), &invalidUtf16Offset)
+        && invalidUtf8Offset == 2 && invalidUtf16Offset == 3;
+    ATLASSERT(invalidStrings);
+    Check(invalidStrings, "Invalid strings");
+
+    bool thrown = false;
+    try
+    {
+        UnicodeConvAtl::Utf8LengthOf(CStringW(L"\xD800"));
+    }
+    catch (const CAtlException& e)
+    {
+        thrown = (HRESULT(e) == HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION));
+    }
+    ATLASSERT(thrown);
+    Check(thrown, "Length query of invalid string");
+}
+
+
+void TestBatchConversions()
+{
+    const CStringW utf16Strings[] =
+    {
+        L"Connie",
+        L"",
+        L"caff\xE8 \x5B66",
+        L"\xD83D\xDE00",
+    };
+    const size_t count = _countof(utf16Strings);
+
+    CStringA utf8;
+    CAtlArray<int> offsets;
+    UnicodeConvAtl::ToUtf8Batch(utf16Strings, count, utf8, offsets);
+
+    bool utf8Matches = (offsets.GetCount() == count + 1)
+                       && (offsets[count] == utf8.GetLength());
+    for (size_t i = 0; utf8Matches && i < count; ++i)
+    {
+        // Each converted string is NUL-terminated in the batch buffer
+        const CStringA expected = UnicodeConvAtl::ToUtf8(utf16Strings[i]);
+        const int length = offsets[i + 1] - offsets[i] - 1;
+        utf8Matches = (length == expected.GetLength())
+                      && (CStringA(utf8.GetString() + offsets[i]) == expected);
+    }
+    ATLASSERT(utf8Matches);
+    Check(utf8Matches, "UTF-8 batch conversion");
+
+    // Convert the UTF-8 batch back to UTF-16
+    CAtlArray<CStringA> utf8Strings;
+    for (size_t i = 0; i < count; ++i)
+    {
+        utf8Strings.Add(CStringA(utf8.GetString() + offsets[i]));
+    }
+
+    CStringW utf16;
+    UnicodeConvAtl::ToUtf16Batch(utf8Strings, utf16, offsets);
+
+    bool utf16Matches = (offsets.GetCount() == count + 1)
+                        && (offsets[count] == utf16.GetLength());
+    for (size_t i = 0; utf16Matches && i < count; ++i)
+    {
+        utf16Matches = (CStringW(utf16.GetString() + offsets[i]) == utf16Strings[i]);
+    }
+    ATLASSERT(utf16Matches);
+    Check(utf16Matches, "UTF-16 batch conversion");
+
+    // An invalid string fails the whole batch, leaving the destination unchanged
+    const CStringW invalidStrings[] = { L"Connie", L"\xD800" };
+    const CStringA previousUtf8 = utf8;
+    bool thrown = false;
+    try
+    {
+        UnicodeConvAtl::ToUtf8Batch(invalidStrings, _countof(invalidStrings), utf8, offsets);
+    }
+    catch (const CAtlException& e)
+    {
+        thrown = (HRESULT(e) == HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION));
+    }
+    ATLASSERT(thrown && utf8 == previousUtf8);
+    Check(thrown && utf8 == previousUtf8, "Invalid UTF-8 batch conversion");
+}
+
+
+void TestParallelConversions()
+{
+    // Build a text long enough to be split in several chunks, with 2-char,
+    // 3-char and 4-char UTF-8 sequences, and surrogate pairs, all around
+    // the chunk boundaries
+    CStringW utf16;
+    while (utf16.GetLength() < 1024 * 1024)
+    {
+        utf16 += L"caff\xE8 \x5B66\xD83D\xDE00";
+    }
+    const CStringA utf8 = UnicodeConvAtl::ToUtf8(utf16);
+
+    // Force the parallel conversion with a zero threshold
+    const CStringA utf8Parallel = UnicodeConvAtl::ToUtf8Parallel(utf16, 0);
+    ATLASSERT(utf8Parallel == utf8);
+    Check(utf8Parallel == utf8, "UTF-8 parallel conversion");
+
+    const CStringW utf16Parallel = UnicodeConvAtl::ToUtf16Parallel(utf8, 0);
+    ATLASSERT(utf16Parallel == utf16);
+    Check(utf16Parallel == utf16, "UTF-16 parallel conversion");
+
+    // An unpaired surrogate in the middle of the input is detected
+    CStringW invalidUtf16 = utf16;
+    invalidUtf16.SetAt(invalidUtf16.GetLength() / 2, L'\xDC00');
+    bool thrown = false;
+    try
+    {
+        UnicodeConvAtl::ToUtf8Parallel(invalidUtf16, 0);
+    }
+    catch (const CAtlException& e)
+    {
+        thrown = (HRESULT(e) == HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION));
+    }
+    ATLASSERT(thrown);
+    Check(thrown, "Invalid UTF-16 parallel conversion");
+}
+
+
+void TestParallelBatchConversions()
+{
+    // Many strings of very uneven lengths, so the batch is split in ranges
+    CAtlArray<CStringW> utf16Strings;
+    for (int i = 0; i < 2000; ++i)
+    {
+        CStringW utf16;
+        const int repeatCount = (i % 100 == 0) ? 5000 : (i % 7);
+        for (int j = 0; j < repeatCount; ++j)
+        {
+            utf16 += L"caff\xE8 \x5B66\xD83D\xDE00";
+        }
+        utf16Strings.Add(utf16);
+    }
+
+    CStringA utf8;
+    CAtlArray<int> offsets;
+    UnicodeConvAtl::ToUtf8Batch(utf16Strings, utf8, offsets);
+
+    // Force the parallel conversion with a zero threshold
+    CStringA utf8Parallel;
+    CAtlArray<int> parallelOffsets;
+    UnicodeConvAtl::ToUtf8BatchParallel(utf16Strings, utf8Parallel, parallelOffsets, 0);
+
+    bool utf8Matches = (utf8Parallel == utf8)
+                       && (parallelOffsets.GetCount() == offsets.GetCount());
+    for (size_t i = 0; utf8Matches && i < offsets.GetCount(); ++i)
+    {
+        utf8Matches = (parallelOffsets[i] == offsets[i]);
+    }
+    ATLASSERT(utf8Matches);
+    Check(utf8Matches, "UTF-8 parallel batch conversion");
+
+    // Convert the UTF-8 batch back to UTF-16
+    CAtlArray<CStringA> utf8Strings;
+    for (size_t i = 0; i < utf16Strings.GetCount(); ++i)
+    {
+        utf8Strings.Add(CStringA(utf8.GetString() + offsets[i]));
+    }
+
+    CStringW utf16;
+    UnicodeConvAtl::ToUtf16Batch(utf8Strings, utf16, offsets);
+
+    CStringW utf16Parallel;
+    UnicodeConvAtl::ToUtf16BatchParallel(utf8Strings, utf16Parallel, parallelOffsets, 0);
+
+    bool utf16Matches = (utf16Parallel == utf16)
+                        && (parallelOffsets.GetCount() == offsets.GetCount());
+    for (size_t i = 0; utf16Matches && i < offsets.GetCount(); ++i)
+    {
+        utf16Matches = (parallelOffsets[i] == offsets[i]);
+    }
+    ATLASSERT(utf16Matches);
+    Check(utf16Matches, "UTF-16 parallel batch conversion");
+
+    // An invalid string fails the whole batch
+    utf16Strings[1500] += L"\xD800";
+    bool thrown = false;
+    try
+    {
+        UnicodeConvAtl::ToUtf8BatchParallel(utf16Strings, utf8Parallel, parallelOffsets, 0);
+    }
+    catch (const CAtlException& e)
+    {
+        thrown = (HRESULT(e) == HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION));
+    }
+    ATLASSERT(thrown);
+    Check(thrown, "Invalid UTF-8 parallel batch conversion");
+}
+
+
+void TestArenaConversions()
+{
+    using UnicodeConvAtl::CArenaMemMgr;
+    using UnicodeConvAtl::CArenaStringMgr;
+
+    const CStringW utf16 = L"caff\xE8 \x5B66 \xD83D\xDE00";
+    const CStringA utf8 = UnicodeConvAtl::ToUtf8(utf16);
+
+    {
+        CArenaStringMgr arena;
+
+        const CStringA utf8Arena = UnicodeConvAtl::ToUtf8(utf16, &arena);
+        const CStringW utf16Arena = UnicodeConvAtl::ToUtf16(utf8, &arena);
+        const bool arenaMatches = (utf8Arena == utf8) && (utf16Arena == utf16)
+                                  && (utf8Arena.GetManager() == &arena)
+                                  && (utf16Arena.GetManager() == &arena);
+        ATLASSERT(arenaMatches);
+        Check(arenaMatches, "Conversions with arena string manager");
+    }
+
+    // Exercise the arena memory manager the way CString does:
+    // grow the most recent allocation, then release everything at once
+    CArenaMemMgr memMgr(1024);
+
+    char* first = static_cast<char*>(memMgr.Allocate(10));
+    memcpy(first, "123456789", 10);
+    char* grown = static_cast<char*>(memMgr.Reallocate(first, 500));
+    const bool grownInPlace = (grown == first) && (memMgr.GetSize(grown) == 500);
+
+    void* second = memMgr.Allocate(100);
+    char* moved = static_cast<char*>(memMgr.Reallocate(grown, 2000));
+    const bool movedKeepsContent = (moved != grown) && (strcmp(moved, "123456789") == 0)
+                                   && (memMgr.GetSize(moved) == 2000);
+
+    memMgr.Reset();
+    const bool reusedAfterReset = (memMgr.Allocate(10) == first);
+
+    const bool arenaWorks = grownInPlace && (second != nullptr) && movedKeepsContent
+                            && reusedAfterReset && (memMgr.Allocate(static_cast<size_t>(INT_MAX) + 1) == nullptr);
+    ATLASSERT(arenaWorks);
+    Check(arenaWorks, "Arena memory manager");
+}
+
+
+void TestInstrumentation()
+{
+    const UnicodeConvAtl::ConversionStatistics before =
+        UnicodeConvAtl::GetThreadConversionStatistics();
+
+    // ASCII and non-ASCII UTF-16 to UTF-8 conversions
+    const CStringA ascii = UnicodeConvAtl::ToUtf8(L"abc");
+    const CStringA kanji = UnicodeConvAtl::ToUtf8(L"\x5B66");
+
+    // Failed UTF-8 to UTF-16 conversions
+    bool thrown = false;
+    try
+    {
+        UnicodeConvAtl::ToUtf16("\xC0\xAF");
+    }
+    catch (const CAtlException&)
+    {
+        thrown = true;
+    }
+    CStringW utf16;
+    const HRESULT hr = UnicodeConvAtl::TryToUtf16("\xFF", 1, utf16);
+
+    const UnicodeConvAtl::ConversionStatistics after =
+        UnicodeConvAtl::GetThreadConversionStatistics();
+
+    const bool utf8CountersMatch =
+           (after.toUtf8.calls - before.toUtf8.calls == 2)
+        && (after.toUtf8.inputBytes - before.toUtf8.inputBytes == 4 * sizeof(wchar_t))
+        && (after.toUtf8.outputBytes - before.toUtf8.outputBytes == 6)
+        && (after.toUtf8.errors == before.toUtf8.errors)
+        && (after.toUtf8.fallbacks - before.toUtf8.fallbacks == 1);
+    ATLASSERT(utf8CountersMatch);
+    Check(utf8CountersMatch, "Instrumentation counters of UTF-8 conversions");
+
+    const bool utf16CountersMatch = thrown && FAILED(hr)
+        && (after.toUtf16.calls - before.toUtf16.calls == 2)
+        && (after.toUtf16.inputBytes - before.toUtf16.inputBytes == 3)
+        && (after.toUtf16.outputBytes == before.toUtf16.outputBytes)
+        && (after.toUtf16.errors - before.toUtf16.errors == 2);
+    ATLASSERT(utf16CountersMatch);
+    Check(utf16CountersMatch, "Instrumentation counters of UTF-16 conversions");
+
+    // The statistics of all the threads include the ones of this thread
+    const UnicodeConvAtl::ConversionStatistics total = UnicodeConvAtl::GetConversionStatistics();
+    const bool totalIncludesThread = (total.toUtf8.calls >= after.toUtf8.calls)
+                                     && (total.toUtf16.errors >= after.toUtf16.errors);
+    ATLASSERT(totalIncludesThread);
+    Check(totalIncludesThread, "Instrumentation statistics of all threads");
+}
+
+
+void TestMovedInputConversions()
+{
+    const CStringW kanji = L"\x5B66\x6821 ASCII";
+
+    // The moved input strings are released after the conversion
+    CStringW utf16 = L"\x5B66\x6821 ASCII";
+    const CStringA utf8 = UnicodeConvAtl::ToUtf8(std::move(utf16));
+    CStringA utf8Copy = utf8;
+    const CStringW roundTrip = UnicodeConvAtl::ToUtf16(std::move(utf8Copy));
+    const bool movedMatches = (utf8 == UnicodeConvAtl::ToUtf8(kanji)) && (roundTrip == kanji)
+                              && utf16.IsEmpty() && utf8Copy.IsEmpty();
+    ATLASSERT(movedMatches);
+    Check(movedMatches, "Conversions of moved input strings");
+
+    // On error, the moved input string is left unchanged
+    CStringA invalid = "Invalid \xFF";
+    try
+    {
+        UnicodeConvAtl::ToUtf16(std::move(invalid));
+    }
+    catch (const CAtlException&)
+    {
+    }
+    ATLASSERT(invalid == "Invalid \xFF");
+    Check(invalid == "Invalid \xFF", "Conversion error keeps moved input string");
+}
+
+
+void TestConversionCache()
+{
+    UnicodeConvAtl::Utf16ToUtf8Cache cache(2, 16);
+    const CStringW kanji = L"\x5B66\x6821";
+    const CStringW ascii = L"metric.name";
+
+    // The repeated conversions are served by the cache, without converting again
+    const CStringA first = cache.Convert(kanji);
+    const UnicodeConvAtl::ConversionStatistics before =
+        UnicodeConvAtl::GetThreadConversionStatistics();
+    const CStringA second = cache.Convert(kanji);
+    const UnicodeConvAtl::ConversionStatistics after =
+        UnicodeConvAtl::GetThreadConversionStatistics();
+    const bool hitMatches = (first == UnicodeConvAtl::ToUtf8(kanji)) && (second == first)
+                            && (after.toUtf8.calls == before.toUtf8.calls)
+                            && (cache.GetCount() == 1);
+    ATLASSERT(hitMatches);
+    Check(hitMatches, "Conversion cache hit");
+
+    // When the cache is full, the strings not requested recently are evicted
+    cache.Convert(ascii);
+    cache.Convert(kanji);
+    cache.Convert(L"tag.key");
+    const UnicodeConvAtl::ConversionStatistics beforeEviction =
+        UnicodeConvAtl::GetThreadConversionStatistics();
+    const bool kanjiKept = (cache.Convert(kanji) == first);
+    const UnicodeConvAtl::ConversionStatistics afterKanji =
+        UnicodeConvAtl::GetThreadConversionStatistics();
+    const bool asciiEvicted = (cache.Convert(ascii) == "metric.name");
+    const UnicodeConvAtl::ConversionStatistics afterAscii =
+        UnicodeConvAtl::GetThreadConversionStatistics();
+    const bool evictionMatches = kanjiKept && asciiEvicted && (cache.GetCount() == 2)
+        && (afterKanji.toUtf8.calls == beforeEviction.toUtf8.calls)
+        && (afterAscii.toUtf8.calls - afterKanji.toUtf8.calls == 1);
+    ATLASSERT(evictionMatches);
+    Check(evictionMatches, "Conversion cache eviction");
+
+    // Long strings are converted without being cached, invalid strings throw
+    const CStringW longString = L"a long string, longer than the maximum cached length";
+    cache.Clear();
+    const bool longMatches = (cache.Convert(longString) == UnicodeConvAtl::ToUtf8(longString))
+                             && (cache.GetCount() == 0);
+    bool thrown = false;
+    try
+    {
+        cache.Convert(L"\xD800");
+    }
+    catch (const CAtlException& e)
+    {
+        thrown = (HRESULT(e) == HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION));
+    }
+    ATLASSERT(longMatches && thrown && cache.GetCount() == 0);
+    Check(longMatches && thrown && cache.GetCount() == 0, "Conversion cache bypass");
+
+    // Strings with embedded NULs whose hashes collide are different entries
+    UnicodeConvAtl::Utf8ToUtf16Cache nulCache(16);
+    const CStringA firstNul("a\0flbvs", 7);
+    const CStringA secondNul("a\0xacxa", 7);
+    const CStringW firstNulResult = nulCache.Convert(firstNul);
+    const CStringW secondNulResult = nulCache.Convert(secondNul);
+    const bool nulMatches = (firstNulResult.GetLength() == 7)
+        && (memcmp(firstNulResult.GetString(), L"a\0flbvs", 7 * sizeof(wchar_t)) == 0)
+        && (secondNulResult.GetLength() == 7)
+        && (memcmp(secondNulResult.GetString(), L"a\0xacxa", 7 * sizeof(wchar_t)) == 0)
+        && (nulCache.GetCount() == 2);
+    ATLASSERT(nulMatches);
+    Check(nulMatches, "Conversion cache embedded NULs");
+
+    // Many threads sharing a cache, with more strings than it can hold
+    UnicodeConvAtl::Utf8ToUtf16Cache sharedCache(256);
+    volatile LONG mismatchCount = 0;
+    concurrency::parallel_for(0, 20000, [&](int i)
+    {
+        const int key = i % 500;
+        CStringA utf8 = "caff\xC3\xA8.";
+        utf8 += static_cast<char>('a' + key / 26);
+        utf8 += static_cast<char>('a' + key % 26);
+        CStringW expected = L"caff\xE8.";
+        expected += static_cast<wchar_t>(L'a' + key / 26);
+        expected += static_cast<wchar_t>(L'a' + key % 26);
+        if (sharedCache.Convert(utf8) != expected)
+        {
+            ::InterlockedIncrement(&mismatchCount);
+        }
+    });
+    ATLASSERT(mismatchCount == 0 && sharedCache.GetCount() <= 256);
+    Check(mismatchCount == 0 && sharedCache.GetCount() <= 256, "Conversion cache shared by threads");
+}
+
+
+void TestAdditionalEncodings()
+{
+    // UTF-32, with ASCII runs long enough for the block paths
+    const CStringW utf16 = L"ASCII text, long enough: caff\xE8 \x5B66\x6821 \xD83D\xDE00";
+    const CStringA utf8 = UnicodeConvAtl::ToUtf8(utf16);
+    CAtlArray<char32_t> utf32;
+    UnicodeConvAtl::Utf16ToUtf32(utf16, utf32);
+    CAtlArray<char32_t> utf32FromUtf8;
+    UnicodeConvAtl::Utf8ToUtf32(utf8, utf32FromUtf8);
+    const bool utf32Matches = (utf32.GetCount() == static_cast<size_t>(utf16.GetLength() - 1))
+        && (utf32[utf32.GetCount() - 1] == 0x1F600) && (utf32[29] == 0xE8)
+        && (utf32FromUtf8.GetCount() == utf32.GetCount())
+        && (memcmp(utf32FromUtf8.GetData(), utf32.GetData(),
+                   utf32.GetCount() * sizeof(char32_t)) == 0)
+        && (UnicodeConvAtl::Utf32ToUtf16(utf32) == utf16)
+        && (UnicodeConvAtl::Utf32ToUtf8(utf32) == utf8);
+    ATLASSERT(utf32Matches);
+    Check(utf32Matches, "UTF-32 conversions");
+
+    // Surrogates and code points above U+10FFFF are invalid in UTF-32
+    const char32_t invalidUtf32[] = { U'a', 0xD800, 0x110000, U'b' };
+    bool thrown = false;
+    try
+    {
+        UnicodeConvAtl::Utf32ToUtf8(invalidUtf32, 4);
+    }
+    catch (const CAtlException& e)
+    {
+        thrown = (HRESULT(e) == HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION));
+    }
+    CStringA utf8FromInvalid;
+    const HRESULT hr = UnicodeConvAtl::ConvertEncoding<UnicodeConvAtl::Utf32Encoding,
+        UnicodeConvAtl::Utf8Encoding, UnicodeConvAtl::ReturnHResult>(invalidUtf32, 4, utf8FromInvalid);
+    const bool invalidUtf32Matches = thrown
+        && (hr == HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION)) && utf8FromInvalid.IsEmpty()
+        && (UnicodeConvAtl::Utf32ToUtf16(invalidUtf32, 4, UnicodeConvAtl::InvalidInputPolicy::Replace)
+            == L"a\xFFFD\xFFFD" L"b");
+    ATLASSERT(invalidUtf32Matches);
+    Check(invalidUtf32Matches, "Invalid UTF-32 conversions");
+
+    // Latin-1: all the chars from 0x20 to 0xFF
+    CStringA latin1;
+    CStringW latin1Utf16;
+    for (int ch = 0x20; ch <= 0xFF; ++ch)
+    {
+        latin1 += static_cast<char>(ch);
+        latin1Utf16 += static_cast<wchar_t>(ch);
+    }
+    const bool latin1Matches = (UnicodeConvAtl::Latin1ToUtf16(latin1) == latin1Utf16)
+        && (UnicodeConvAtl::Latin1ToUtf8(latin1) == UnicodeConvAtl::ToUtf8(latin1Utf16))
+        && (UnicodeConvAtl::Utf16ToLatin1(latin1Utf16) == latin1)
+        && (UnicodeConvAtl::Utf8ToLatin1(UnicodeConvAtl::ToUtf8(latin1Utf16)) == latin1);
+    ATLASSERT(latin1Matches);
+    Check(latin1Matches, "Latin-1 conversions");
+
+    // Characters above U+00FF aren't available in Latin-1
+    thrown = false;
+    try
+    {
+        UnicodeConvAtl::Utf16ToLatin1(L"caff\xE8 \x5B66");
+    }
+    catch (const CAtlException& e)
+    {
+        thrown = (HRESULT(e) == HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION));
+    }
+    const bool unavailableMatches = thrown
+        && (UnicodeConvAtl::Utf16ToLatin1(L"caff\xE8 \x5B66\xD83D\xDE00",
+                                          UnicodeConvAtl::InvalidInputPolicy::Replace) == "caff\xE8 ??")
+        && (UnicodeConvAtl::Utf8ToLatin1("caff\xC3\xA8 \xE5\xAD\xA6",
+                                         UnicodeConvAtl::InvalidInputPolicy::Skip) == "caff\xE8 ");
+    ATLASSERT(unavailableMatches);
+    Check(unavailableMatches, "Latin-1 unavailable characters");
+
+    // WTF-8 preserves unpaired surrogates, and encodes pairs like UTF-8
+    const CStringW fileName = L"file\xD800 name\xDC00 \xD83D\xDE00";
+    const CStringA wtf8 = UnicodeConvAtl::Utf16ToWtf8(fileName);
+    const bool wtf8Matches =
+        (wtf8 == "file\xED\xA0\x80 name\xED\xB0\x80 \xF0\x9F\x98\x80")
+        && (UnicodeConvAtl::Wtf8ToUtf16(wtf8) == fileName)
+        && (UnicodeConvAtl::Utf16ToWtf8(utf16) == utf8);
+    ATLASSERT(wtf8Matches);
+    Check(wtf8Matches, "WTF-8 conversions");
+
+    // An encoded surrogate pair is invalid in WTF-8
+    thrown = false;
+    try
+    {
+        UnicodeConvAtl::Wtf8ToUtf16("\xED\xA0\xBD\xED\xB8\x80");
+    }
+    catch (const CAtlException& e)
+    {
+        thrown = (HRESULT(e) == HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION));
+    }
+    ATLASSERT(thrown);
+    Check(thrown, "Invalid WTF-8 conversion");
+
+    // CESU-8 encodes the supplementary characters as surrogate pairs,
+    // and rejects the 4-char UTF-8 sequences
+    const CStringW supplementary = L"caff\xE8 \xD83D\xDE00";
+    const CStringA cesu8 = UnicodeConvAtl::Utf16ToCesu8(supplementary);
+    const bool cesu8Matches = (cesu8 == "caff\xC3\xA8 \xED\xA0\xBD\xED\xB8\x80")
+        && (UnicodeConvAtl::Cesu8ToUtf16(cesu8) == supplementary)
+        && (UnicodeConvAtl::Cesu8ToUtf16("\xF0\x9F\x98\x80 \xED\xA0\xBD",
+                                         UnicodeConvAtl::InvalidInputPolicy::Replace)
+            == L"\xFFFD\xFFFD\xFFFD\xFFFD \xFFFD")
+        && (UnicodeConvAtl::Utf16ToCesu8(L"a\xDC00", UnicodeConvAtl::InvalidInputPolicy::Skip)
+            == "a");
+    ATLASSERT(cesu8Matches);
+    Check(cesu8Matches, "CESU-8 conversions");
+
+    // The buffer of the destination array is reused across conversions
+    const char32_t* const utf32Buffer = utf32.GetData();
+    UnicodeConvAtl::Utf16ToUtf32(L"short", utf32);
+    const bool utf32Reused = (utf32.GetCount() == 5) && (utf32.GetData() == utf32Buffer);
+    UnicodeConvAtl::ConvertEncoding<UnicodeConvAtl::Utf8Encoding, UnicodeConvAtl::Utf32Encoding>(
+        "", 0, utf32);
+    UnicodeConvAtl::Utf8ToUtf32(utf8, utf32);
+    const bool utf32ReusedAfterEmpty = (utf32.GetCount() == utf32FromUtf8.GetCount())
+        && (utf32.GetData() == utf32Buffer);
+    ATLASSERT(utf32Reused && utf32ReusedAfterEmpty);
+    Check(utf32Reused && utf32ReusedAfterEmpty, "UTF-32 array buffer reuse");
+
+    // Streams, fed one code unit at a time
+    UnicodeConvAtl::Wtf8ToUtf16Stream wtf8Stream;
+    CStringW streamedUtf16;
+    for (int i = 0; i < wtf8.GetLength(); ++i)
+    {
+        wtf8Stream.Convert(wtf8.GetString() + i, 1, streamedUtf16);
+    }
+    wtf8Stream.Finish(streamedUtf16);
+
+    UnicodeConvAtl::Utf8ToUtf32Stream utf8Stream;
+    CAtlArray<char32_t> streamedUtf32;
+    for (int i = 0; i < utf8.GetLength(); ++i)
+    {
+        utf8Stream.Convert(utf8.GetString() + i, 1, streamedUtf32);
+    }
+    utf8Stream.Finish(streamedUtf32);
+
+    const bool streamsMatch = (streamedUtf16 == fileName)
+        && (streamedUtf32.GetCount() == utf32.GetCount())
+        && (memcmp(streamedUtf32.GetData(), utf32.GetData(),
+                   utf32.GetCount() * sizeof(char32_t)) == 0);
+    ATLASSERT(streamsMatch);
+    Check(streamsMatch, "Streaming conversions of additional encodings");
+
+    UnicodeConvAtl::Cesu8ToUtf16Stream cesu8Stream;
+    CStringW streamedSupplementary;
+    for (int i = 0; i < cesu8.GetLength(); ++i)
+    {
+        cesu8Stream.Convert(cesu8.GetString() + i, 1, streamedSupplementary);
+    }
+    cesu8Stream.Finish(streamedSupplementary);
+    ATLASSERT(streamedSupplementary == supplementary);
+    Check(streamedSupplementary == supplementary, "Streaming CESU-8 conversion");
+}
+
+
+// Create a named pipe, with the server end opened for overlapped I/O,
+// and connect a client to it
+void CreateTestPipe(LPCWSTR name, DWORD pipeMode, CHandle& server, CHandle& client)
+{
+    server.Attach(::CreateNamedPipeW(name, PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,
+                                     pipeMode | PIPE_WAIT, 1, 4096, 4096, 0, nullptr));
+    ATLASSERT(server.m_h != INVALID_HANDLE_VALUE);
+
+    // The server end is connected as soon as the client opens the pipe
+    client.Attach(::CreateFileW(name, GENERIC_READ | GENERIC_WRITE, 0, nullptr,
+                                OPEN_EXISTING, 0, nullptr));
+    ATLASSERT(client.m_h != INVALID_HANDLE_VALUE);
+}
+
+
+void TestPipelineConversions()
+{
+    CStringW utf16;
+    while (utf16.GetLength() < 4 * 1024)
+    {
+        utf16 += L"caff\xE8 \x5B66 \xD83D\xDE00 ";
+    }
+    const CStringA utf8 = UnicodeConvAtl::ToUtf8(utf16);
+
+    wchar_t tempPath[MAX_PATH];
+    ATLVERIFY(::GetTempPathW(_countof(tempPath), tempPath) != 0);
+    const CStringW utf8Path = CStringW(tempPath) + L"TestUnicodeConvAtl-pipeline.txt";
+
+    // Convert the file with overlapped reads of a few bytes, so UTF-8
+    // sequences get split across reads
+    auto transcodeFile = [&](CStringW& result)
+    {
+        CHandle file(::CreateFileW(utf8Path, GENERIC_READ, FILE_SHARE_READ, nullptr,
+                                   OPEN_EXISTING, FILE_FLAG_OVERLAPPED, nullptr));
+        ATLASSERT(file.m_h != INVALID_HANDLE_VALUE);
+
+        UnicodeConvAtl::TranscodeUtf8ToUtf16(file, [&](CStringW const& chunk)
+        {
+            result += chunk;
+        }, 7, 3);
+    };
+
+    WriteTestFile(utf8Path, utf8.GetString(), utf8.GetLength());
+    CStringW utf16Result;
+    transcodeFile(utf16Result);
+    ATLASSERT(utf16Result == utf16);
+    Check(utf16Result == utf16, "Overlapped UTF-8 to UTF-16 pipeline");
+
+    // Invalid input, and a sequence truncated at the end of the input
+    const char* const invalidInputs[] = { "Invalid \xC0\xAF input", "Truncated \xE5\xAD" };
+    for (const char* invalidInput : invalidInputs)
+    {
+        WriteTestFile(utf8Path, invalidInput, static_cast<DWORD>(strlen(invalidInput)));
+        bool thrown = false;
+        try
+        {
+            CStringW ignored;
+            transcodeFile(ignored);
+        }
+        catch (const CAtlException& e)
+        {
+            thrown = (HRESULT(e) == HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION));
+        }
+        ATLASSERT(thrown);
+        Check(thrown, "Invalid input in the overlapped pipeline");
+    }
+
+    ::DeleteFileW(utf8Path);
+
+    // Message-mode pipe, with messages larger than the read buffers
+    {
+        CHandle server;
+        CHandle client;
+        CreateTestPipe(L"\\\\.\\pipe\\TestUnicodeConvAtl-messages",
+                       PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE, server, client);
+
+        CStringW messageResult;
+        UnicodeConvAtl::Utf8ToUtf16Pipeline pipeline(server, [&](CStringW const& chunk)
+        {
+            messageResult += chunk;
+        }, 7, 3);
+        pipeline.Start();
+
+        const int kMessageLength = 100;
+        for (int offset = 0; offset < utf8.GetLength(); offset += kMessageLength)
+        {
+            const int remaining = utf8.GetLength() - offset;
+            const DWORD messageLength = (remaining < kMessageLength) ? remaining : kMessageLength;
+            DWORD written = 0;
+            ATLVERIFY(::WriteFile(client, utf8.GetString() + offset, messageLength,
+                                  &written, nullptr));
+        }
+        client.Close();
+
+        pipeline.Wait();
+        ATLASSERT(messageResult == utf16);
+        Check(messageResult == utf16, "Pipeline on a message-mode pipe");
+    }
+
+    // An empty message between two others doesn't end the input
+    {
+        CHandle server;
+        CHandle client;
+        CreateTestPipe(L"\\\\.\\pipe\\TestUnicodeConvAtl-empty-message",
+                       PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE, server, client);
+
+        CStringW messageResult;
+        UnicodeConvAtl::Utf8ToUtf16Pipeline pipeline(server, [&](CStringW const& chunk)
+        {
+            messageResult += chunk;
+        });
+        pipeline.Start();
+
+        const char* const messages[] = { "caff\xC3\xA8 ", "", "\xE5\xAD\xA6" };
+        for (const char* message : messages)
+        {
+            DWORD written = 0;
+            ATLVERIFY(::WriteFile(client, message, static_cast<DWORD>(strlen(message)),
+                                  &written, nullptr));
+        }
+        client.Close();
+
+        pipeline.Wait();
+        ATLASSERT(messageResult == L"caff\xE8 \x5B66");
+        Check(messageResult == L"caff\xE8 \x5B66", "Pipeline on an empty message");
+    }
+
+    // Invalid input on a pipe whose writer stays open, without writing more:
+    // the pending read must be cancelled for the pipeline to complete
+    {
+        CHandle server;
+        CHandle client;
+        CreateTestPipe(L"\\\\.\\pipe\\TestUnicodeConvAtl-invalid",
+                       PIPE_TYPE_BYTE | PIPE_READMODE_BYTE, server, client);
+
+        UnicodeConvAtl::Utf8ToUtf16Pipeline pipeline(server, [](CStringW const&) {}, 7, 3);
+        pipeline.Start();
+
+        const char invalidInput[] = "Invalid \xC0\xAF input";
+        DWORD written = 0;
+        ATLVERIFY(::WriteFile(client, invalidInput, sizeof(invalidInput) - 1, &written, nullptr));
+
+        bool thrown = false;
+        try
+        {
+            pipeline.Wait();
+        }
+        catch (const CAtlException& e)
+        {
+            thrown = (HRESULT(e) == HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION));
+        }
+        ATLASSERT(thrown);
+        Check(thrown, "Invalid input on an idle pipe");
+    }
+
+    // Cancelling the pipeline cancels its read only, not the writes
+    // of the caller on the same duplex pipe
+    {
+        CHandle server;
+        CHandle client;
+        CreateTestPipe(L"\\\\.\\pipe\\TestUnicodeConvAtl-cancel",
+                       PIPE_TYPE_BYTE | PIPE_READMODE_BYTE, server, client);
+
+        UnicodeConvAtl::Utf8ToUtf16Pipeline pipeline(server, [](CStringW const&) {});
+        pipeline.Start();
+
+        // The write is larger than the pipe buffer, so it stays pending until
+        // the client reads it; the low bit of hEvent keeps its completion
+        // away from the thread pool I/O of the pipeline
+        CHandle writeCompleted(::CreateEventW(nullptr, TRUE, FALSE, nullptr));
+        OVERLAPPED writeOverlapped = {};
+        writeOverlapped.hEvent = reinterpret_cast<HANDLE>(
+            reinterpret_cast<ULONG_PTR>(writeCompleted.m_h) | 1);
+        const bool writeIssued = ::WriteFile(server, utf8.GetString(), utf8.GetLength(),
+                                             nullptr, &writeOverlapped)
+                                 || (::GetLastError() == ERROR_IO_PENDING);
+
+        pipeline.Cancel();
+        bool cancelled = false;
+        try
+        {
+            pipeline.Wait();
+        }
+        catch (const CAtlException& e)
+        {
+            cancelled = (HRESULT(e) == HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED));
+        }
+
+        // Reading the data on the client end completes the write
+        CStringA received;
+        char readBuffer[1024];
+        DWORD bytesRead = 0;
+        while ((received.GetLength() < utf8.GetLength())
+               && ::ReadFile(client, readBuffer, sizeof(readBuffer), &bytesRead, nullptr)
+               && (bytesRead > 0))
+        {
+            received.Append(readBuffer, bytesRead);
+        }
+
+        ::WaitForSingleObject(writeCompleted, INFINITE);
+        DWORD bytesWritten = 0;
+        const bool writeSucceeded = writeIssued
+            && ::GetOverlappedResult(server, &writeOverlapped, &bytesWritten, FALSE)
+            && (bytesWritten == static_cast<DWORD>(utf8.GetLength()));
+
+        ATLASSERT(cancelled && writeSucceeded && received == utf8);
+        Check(cancelled && writeSucceeded && received == utf8, "Pipeline cancellation on a duplex pipe");
+    }
+}
+
+
+void TestLazyConversions()
+{
+    CStringW utf16;
+    while (utf16.GetLength() < 1024)
+    {
+        utf16 += L"caff\xE8 \x5B66 \xD83D\xDE00 ";
+    }
+    const CStringA utf8 = UnicodeConvAtl::ToUtf8(utf16);
+
+    // Chunks of a few chars split the UTF-8 sequences
+    UnicodeConvAtl::Utf8ToUtf16ChunkReader reader(utf8, 7);
+    CStringW chunk;
+    CStringW readChunks;
+    int chunkCount = 0;
+    while (reader.Next(chunk))
+    {
+        readChunks += chunk;
+        ++chunkCount;
+    }
+    ATLASSERT(readChunks == utf16 && chunkCount > 1);
+    Check(readChunks == utf16 && chunkCount > 1, "Lazy UTF-16 chunks");
+
+    // The chunks before the invalid input are still returned
+    UnicodeConvAtl::Utf8ToUtf16ChunkReader invalidReader(CStringA("Valid te\xC0\xAF"), 4);
+    bool thrown = false;
+    CStringW validChunks;
+    try
+    {
+        while (invalidReader.Next(chunk))
+        {
+            validChunks += chunk;
+        }
+    }
+    catch (const CAtlException& e)
+    {
+        thrown = (HRESULT(e) == HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION));
+    }
+    ATLASSERT(thrown && validChunks == L"Valid te");
+    Check(thrown && validChunks == L"Valid te", "Invalid input in lazy UTF-16 chunks");
+
+#ifdef UNICODECONVATL_HAS_COROUTINES
+    CStringW generatedChunks;
+    for (CStringW const& generatedChunk : UnicodeConvAtl::Utf16Chunks(utf8, 7))
+    {
+        generatedChunks += generatedChunk;
+    }
+    ATLASSERT(generatedChunks == utf16);
+    Check(generatedChunks == utf16, "Generator of UTF-16 chunks");
+
+    thrown = false;
+    try
+    {
+        for (CStringW const& generatedChunk : UnicodeConvAtl::Utf16Chunks("Truncated \xE5\xAD"))
+        {
+            (void)generatedChunk;
+        }
+    }
+    catch (const CAtlException& e)
+    {
+        thrown = (HRESULT(e) == HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION));
+    }
+    ATLASSERT(thrown);
+    Check(thrown, "Invalid input in the generator of UTF-16 chunks");
+#endif // UNICODECONVATL_HAS_COROUTINES
+}
+
+
+void TestIncrementalConversions()
+{
+    using UnicodeConvAtl::InvalidInputPolicy;
+
+    CStringW document;
+    while (document.GetLength() < 2000)
+    {
+        document += L"caff\xE8 \x5B66 \xD83D\xDE00 ";
+    }
+
+    // Small chunks, so the edits span several of them; the random edits
+    // can split surrogate pairs, so replace the unpaired surrogates
+    UnicodeConvAtl::IncrementalUtf8Converter mirror(document, InvalidInputPolicy::Replace, 64);
+    ATLASSERT(mirror.GetChunkCount() > 1);
+
+    const CStringW insertions[] = { L"", L"x", L"\xE8", L"\x5B66 \x5B66", L"\xD83D",
+                                    L"\xDE00", L"\xD83D\xDE00", L"long inserted text " };
+    unsigned int random = 12345;
+    int inconsistentEdits = 0;
+    for (int edit = 0; edit < 1000; ++edit)
+    {
+        random = random * 1103515245 + 12345;
+        const int offset = static_cast<int>((random >> 8) % (document.GetLength() + 1));
+        random = random * 1103515245 + 12345;
+        int removed = static_cast<int>((random >> 8) % 100);
+        if (removed > document.GetLength() - offset)
+        {
+            removed = document.GetLength() - offset;
+        }
+        random = random * 1103515245 + 12345;
+        CStringW const& inserted = insertions[(random >> 8) % _countof(insertions)];
+
+        mirror.Replace(offset, removed, inserted);
+        document.Delete(offset, removed);
+        document.Insert(offset, inserted);
+
+        if ((mirror.GetUtf8() != UnicodeConvAtl::ToUtf8(document, InvalidInputPolicy::Replace))
+            || (mirror.GetUtf16() != document)
+            || (mirror.GetUtf8Length() != mirror.GetUtf8().GetLength()))
+        {
+            ++inconsistentEdits;
+        }
+    }
+    ATLASSERT(inconsistentEdits == 0);
+    Check(inconsistentEdits == 0, "Incremental UTF-8 conversion of edited document");
+
+    // Offsets that don't split surrogate pairs
+    int wrongOffsets = 0;
+    for (int offset = 0; offset <= document.GetLength(); ++offset)
+    {
+        if ((offset > 0) && (offset < document.GetLength())
+            && (document[offset - 1] >= 0xD800) && (document[offset - 1] <= 0xDBFF)
+            && (document[offset] >= 0xDC00) && (document[offset] <= 0xDFFF))
+        {
+            continue;
+        }
+        const CStringA prefix = UnicodeConvAtl::ToUtf8(document.Left(offset), InvalidInputPolicy::Replace);
+        if (mirror.Utf16ToUtf8Offset(offset) != prefix.GetLength())
+        {
+            ++wrongOffsets;
+        }
+    }
+    ATLASSERT(wrongOffsets == 0);
+    Check(wrongOffsets == 0, "Incremental UTF-16 to UTF-8 offsets");
+
+    // Invalid edits leave the document unchanged
+    UnicodeConvAtl::IncrementalUtf8Converter strictMirror(CStringW(L"caff\xE8"));
+    bool thrown = false;
+    try
+    {
+        strictMirror.Replace(2, 1, CStringW(L"\xD83D"));
+    }
+    catch (const CAtlException& e)
+    {
+        thrown = (HRESULT(e) == HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION));
+    }
+    const bool unchanged = (strictMirror.GetUtf8() == UnicodeConvAtl::ToUtf8(L"caff\xE8"));
+    ATLASSERT(thrown && unchanged);
+    Check(thrown && unchanged, "Invalid incremental edit");
+}
+
+
+void TestOffsetIndex()
+{
+    CStringW utf16;
+    while (utf16.GetLength() < 1000)
+    {
+        utf16 += L"caff\xE8 \x5B66 \xD83D\xDE00 ";
+    }
+
+    // Small intervals move many checkpoints past surrogate pairs
+    const int intervals[] = { 2, 3, 7, 64 };
+    int wrongOffsets = 0;
+    for (int interval : intervals)
+    {
+        UnicodeConvAtl::Utf8OffsetIndex index;
+        const CStringA utf8 = UnicodeConvAtl::ToUtf8(utf16, index, interval);
+        ATLASSERT(utf8 == UnicodeConvAtl::ToUtf8(utf16));
+
+        int utf8Offset = 0;
+        for (int utf16Offset = 0; utf16Offset <= utf16.GetLength(); ++utf16Offset)
+        {
+            // An offset in the middle of a pair maps to the beginning of the pair
+            const bool insidePair = (utf16Offset > 0)
+                && (utf16[utf16Offset - 1] >= 0xD800) && (utf16[utf16Offset - 1] <= 0xDBFF);
+            if (!insidePair)
+            {
+                utf8Offset = UnicodeConvAtl::Utf8LengthOf(utf16.Left(utf16Offset));
+            }
+            if (index.Utf16ToUtf8Offset(utf16Offset) != utf8Offset)
+            {
+                ++wrongOffsets;
+            }
+        }
+
+        int utf16Offset = 0;
+        for (int offset = 0; offset <= utf8.GetLength(); ++offset)
+        {
+            // An offset in the middle of a sequence maps to its beginning
+            const bool insideSequence = (offset < utf8.GetLength())
+                && ((static_cast<unsigned char>(utf8[offset]) & 0xC0) == 0x80);
+            if (!insideSequence)
+            {
+                utf16Offset = UnicodeConvAtl::Utf16LengthOf(utf8.Left(offset));
+            }
+            if (index.Utf8ToUtf16Offset(offset) != utf16Offset)
+            {
+                ++wrongOffsets;
+            }
+        }
+    }
+    ATLASSERT(wrongOffsets == 0);
+    Check(wrongOffsets == 0, "Offset index of a conversion");
+
+    UnicodeConvAtl::Utf8OffsetIndex emptyIndex;
+    const CStringW empty = UnicodeConvAtl::ToUtf16(CStringA(), emptyIndex);
+    const bool emptyMapped = empty.IsEmpty() && (emptyIndex.Utf16ToUtf8Offset(0) == 0)
+        && (emptyIndex.Utf8ToUtf16Offset(0) == 0);
+    ATLASSERT(emptyMapped);
+    Check(emptyMapped, "Offset index of an empty string");
+}
+
+
+void TestCompileTimeConversions()
+{
+#ifdef UNICODECONVATL_HAS_UTF8_LITERAL
+    using UnicodeConvAtl::Utf8Literal;
+
+    constexpr auto& literal = Utf8Literal<L"caff\xE8 \x5B66 \xD83D\xDE00">;
+    static_assert(literal.GetLength() == 15, "Compile-time UTF-8 length");
+    static_assert(literal.GetString()[4] == '\xC3' && literal.GetString()[5] == '\xA8',
+                  "Compile-time UTF-8 conversion");
+
+    const CStringA converted = literal;
+    ATLASSERT(converted == UnicodeConvAtl::ToUtf8(L"caff\xE8 \x5B66 \xD83D\xDE00"));
+    Check(converted == UnicodeConvAtl::ToUtf8(L"caff\xE8 \x5B66 \xD83D\xDE00"),
+          "Compile-time UTF-8 literal");
+
+    // Each literal is stored once
+    ATLASSERT(&Utf8Literal<L"x"> == &Utf8Literal<L"x">);
+    ATLASSERT(Utf8Literal<L"">.GetLength() == 0 && *Utf8Literal<L""> == '\0');
+#endif // UNICODECONVATL_HAS_UTF8_LITERAL
+}
+
+
+void TestLargePageConversions()
+{
+    using UnicodeConvAtl::CLargePageMemMgr;
+    using UnicodeConvAtl::CLargePageStringMgr;
+
+    CStringW utf16;
+    while (utf16.GetLength() < 300 * 1024)
+    {
+        utf16 += L"caff\xE8 \x5B66 \xD83D\xDE00 ";
+    }
+    const CStringA utf8 = UnicodeConvAtl::ToUtf8(utf16);
+
+    {
+        // Small threshold, so the strings go to virtual memory,
+        // and are converted in parallel
+        CLargePageStringMgr hugeStrings(NUMA_NO_PREFERRED_NODE, true, 64 * 1024);
+
+        const CStringA utf8Huge = UnicodeConvAtl::ToUtf8Parallel(utf16, &hugeStrings, 64 * 1024);
+        const CStringW utf16Huge = UnicodeConvAtl::ToUtf16Parallel(utf8, &hugeStrings, 64 * 1024);
+        const bool hugeMatches = (utf8Huge == utf8) && (utf16Huge == utf16)
+                                 && (utf8Huge.GetManager() == &hugeStrings)
+                                 && (utf16Huge.GetManager() == &hugeStrings);
+        ATLASSERT(hugeMatches);
+        Check(hugeMatches, "Parallel conversions with large-page string manager");
+    }
+
+    // Exercise the memory manager the way CString does; without the privilege
+    // to lock pages in memory, it falls back to regular pages
+    CLargePageMemMgr memMgr(NUMA_NO_PREFERRED_NODE, true, 4096);
+
+    char* small = static_cast<char*>(memMgr.Allocate(10));
+    memcpy(small, "123456789", 10);
+    char* moved = static_cast<char*>(memMgr.Reallocate(small, 10000));
+    const bool movedKeepsContent = (moved != nullptr) && (strcmp(moved, "123456789") == 0)
+                                   && (memMgr.GetSize(moved) == 10000);
+
+    char* grown = static_cast<char*>(memMgr.Reallocate(moved, 12000));
+    const bool grownInPlace = (grown == moved) && (memMgr.GetSize(grown) == 12000)
+                              && (strcmp(grown, "123456789") == 0);
+    memMgr.Free(grown);
+
+    const bool memMgrWorks = movedKeepsContent && grownInPlace
+                             && (memMgr.Allocate(static_cast<size_t>(INT_MAX) + 1) == nullptr);
+    ATLASSERT(memMgrWorks);
+    Check(memMgrWorks, "Large-page memory manager");
+}
+
+
+void TestFileConversions()
+{
+    // Build a text larger than a few file windows, so multi-char sequences
+    // and surrogate pairs get split across windows
+    CStringW utf16;
+    while (utf16.GetLength() < 200 * 1024)
+    {
+        utf16 += L"caff\xE8 \x5B66 \xD83D\xDE00 ";
+    }
+    const CStringA utf8 = UnicodeConvAtl::ToUtf8(utf16);
+
+    wchar_t tempPath[MAX_PATH];
+    ATLVERIFY(::GetTempPathW(_countof(tempPath), tempPath) != 0);
+    const CStringW utf8Path = CStringW(tempPath) + L"TestUnicodeConvAtl-utf8.txt";
+    const CStringW utf16Path = CStringW(tempPath) + L"TestUnicodeConvAtl-utf16.txt";
+    const CStringW roundTripPath = CStringW(tempPath) + L"TestUnicodeConvAtl-roundtrip.txt";
+
+    WriteTestFile(utf8Path, utf8.GetString(), utf8.GetLength());
+
+    // Use the smallest window size, to convert the files in several windows
+    UnicodeConvAtl::ConvertFileUtf8ToUtf16(utf8Path, utf16Path, 1);
+    const CStringA utf16Bytes = ReadTestFile(utf16Path);
+    const bool utf16Matches =
+        utf16Bytes.GetLength() == utf16.GetLength() * static_cast<int>(sizeof(wchar_t))
+        && memcmp(utf16Bytes.GetString(), utf16.GetString(), utf16Bytes.GetLength()) == 0;
+    ATLASSERT(utf16Matches);
+    Check(utf16Matches, "UTF-8 to UTF-16 file conversion");
+
+    UnicodeConvAtl::ConvertFileUtf16ToUtf8(utf16Path, roundTripPath, 1);
+    const CStringA roundTrip = ReadTestFile(roundTripPath);
+    ATLASSERT(roundTrip == utf8);
+    Check(roundTrip == utf8, "UTF-16 to UTF-8 file conversion");
+
+    // Invalid input: the output file is not left around
+    WriteTestFile(utf8Path, "Invalid \xC0\xAF", 10);
+    bool thrown = false;
+    try
+    {
+        UnicodeConvAtl::ConvertFileUtf8ToUtf16(utf8Path, utf16Path);
+    }
+    catch (const CAtlException& e)
+    {
+        thrown = (HRESULT(e) == HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION));
+    }
+    const bool outputDeleted = (::GetFileAttributesW(utf16Path) == INVALID_FILE_ATTRIBUTES);
+    ATLASSERT(thrown && outputDeleted);
+    Check(thrown && outputDeleted, "Invalid file conversion");
+
+    ::DeleteFileW(utf8Path);
+    ::DeleteFileW(roundTripPath);
+}
+
+
 void TestUnicodeConversions()
 {
     std::cout << "*** Test Unicode UTF-16/UTF-8 CString Conversion Functions *** \n"
@@ -86,6 +1853,33 @@ void TestUnicodeConversions()
     TestEmptyStrings();
     TestStringsWithJapaneseKanji();
     TestStringLengths();
+    TestSinglePassConversion();
+    TestAsciiFastPath();
+    TestNativeEngine();
+    TestOutputParameterConversions();
+    TestPointerAndLengthConversions();
+    TestFixedBufferConversions();
+    TestNonThrowingConversions();
+    TestStackBufferConversions();
+    TestStreamingConversions();
+    TestInvalidInputPolicies();
+    TestPolicyBasedConversions();
+    TestValidationAndLengthQueries();
+    TestBatchConversions();
+    TestParallelConversions();
+    TestParallelBatchConversions();
+    TestArenaConversions();
+    TestInstrumentation();
+    TestMovedInputConversions();
+    TestConversionCache();
+    TestAdditionalEncodings();
+    TestPipelineConversions();
+    TestLazyConversions();
+    TestIncrementalConversions();
+    TestOffsetIndex();
+    TestCompileTimeConversions();
+    TestLargePageConversions();
+    TestFileConversions();
 }
 
 
@@ -21,11 +21,125 @@
 //      * Convert from UTF-16 to UTF-8:
 //        CStringA ToUtf8(CStringW const& utf16)
 //
+//      * Convert from UTF-16 text that isn't stored in a CStringW:
+//        CStringA ToUtf8(const wchar_t* utf16, int utf16Length)
+//        CStringA ToUtf8(const wchar_t* utf16)       (NUL-terminated)
+//        CStringA ToUtf8(std::wstring_view utf16)    (C++17)
+//
+//      * Convert from UTF-16 to UTF-8, reusing the buffer of the destination
+//        string (the previous content is replaced):
+//        void ToUtf8(CStringW const& utf16, CStringA& utf8)
+//
+//      * Append the UTF-8 conversion of an UTF-16 string:
+//        void AppendUtf8(CStringW const& utf16, CStringA& utf8)
+//        void AppendUtf8(const wchar_t* utf16, int utf16Length, CStringA& utf8)
+//
+//      * Convert from UTF-16 to UTF-8, allocating the result with a custom
+//        string manager (e.g. a per-request arena, see UnicodeConvAtlArena.h):
+//        CStringA ToUtf8(CStringW const& utf16, IAtlStringMgr* stringMgr)
+//
+//      * Convert from an UTF-16 string that is no longer needed, releasing
+//        its memory as soon as it has been converted:
+//        CStringA ToUtf8(CStringW&& utf16)
+//
+//      * Convert from UTF-16 to UTF-8, with a single scan of the input string
+//        (trading some memory for speed):
+//        CStringA ToUtf8SinglePass(CStringW const& utf16, bool shrinkToFit)
+//
 //      * Convert from UTF-8 to UTF-16:
 //        CStringW ToUtf16(CStringA const& utf8)
 //
+//      * Convert from UTF-8 text that isn't stored in a CStringA:
+//        CStringW ToUtf16(const char* utf8, int utf8Length)
+//        CStringW ToUtf16(const char* utf8)          (NUL-terminated)
+//        CStringW ToUtf16(std::string_view utf8)     (C++17)
+//
+//      * Convert from UTF-8 to UTF-16, reusing the buffer of the destination
+//        string (the previous content is replaced):
+//        void ToUtf16(CStringA const& utf8, CStringW& utf16)
+//
+//      * Append the UTF-16 conversion of an UTF-8 string:
+//        void AppendUtf16(CStringA const& utf8, CStringW& utf16)
+//        void AppendUtf16(const char* utf8, int utf8Length, CStringW& utf16)
+//
+//      * Convert from UTF-8 to UTF-16, allocating the result with a custom
+//        string manager (e.g. a per-request arena, see UnicodeConvAtlArena.h):
+//        CStringW ToUtf16(CStringA const& utf8, IAtlStringMgr* stringMgr)
+//
+//      * Convert from an UTF-8 string that is no longer needed, releasing
+//        its memory as soon as it has been converted:
+//        CStringW ToUtf16(CStringA&& utf8)
+//
+//      * Convert from UTF-8 to UTF-16, with a single scan of the input string
+//        (trading some memory for speed):
+//        CStringW ToUtf16SinglePass(CStringA const& utf8, bool shrinkToFit)
+//
+//      * Convert between UTF-16 and UTF-8 using the native engine,
+//        which doesn't depend on the Win32 conversion APIs:
+//        CStringA ToUtf8Native(CStringW const& utf16)
+//        CStringW ToUtf16Native(CStringA const& utf8)
+//
+//      * Convert into caller-provided buffers, without heap allocations
+//        and without throwing exceptions (errors are reported
+//        in the returned ConversionResult):
+//        ConversionResult ConvertUtf16ToUtf8(const wchar_t* utf16, int utf16Length,
+//                                            char* utf8, int utf8Capacity)
+//        ConversionResult ConvertUtf8ToUtf16(const char* utf8, int utf8Length,
+//                                            wchar_t* utf16, int utf16Capacity)
+//
+//      * Convert without throwing exceptions on invalid input
+//        (return an HRESULT, and the offset of the first invalid code unit):
+//        HRESULT TryToUtf8(CStringW const& utf16, CStringA& utf8, int* invalidOffset)
+//        HRESULT TryToUtf16(CStringA const& utf8, CStringW& utf16, int* invalidOffset)
+//
+//      * Convert replacing invalid input with U+FFFD, or skipping it,
+//        instead of throwing:
+//        CStringA ToUtf8(CStringW const& utf16, InvalidInputPolicy policy)
+//        CStringW ToUtf16(CStringA const& utf8, InvalidInputPolicy policy)
+//
+//      * Convert with error handling, allocation and validation policies
+//        chosen at compile time (see "Conversion Policies"):
+//        ConvertToUtf8<ErrorPolicy, AllocPolicy, ValidationPolicy>(
+//            const wchar_t* utf16, int utf16Length, AllocPolicy::Utf8String& utf8)
+//        ConvertToUtf16<ErrorPolicy, AllocPolicy, ValidationPolicy>(
+//            const char* utf8, int utf8Length, AllocPolicy::Utf16String& utf16)
+//
+//      * Check whether a string is valid UTF-8 or UTF-16, without converting it:
+//        bool IsValidUtf8(CStringA const& utf8)
+//        bool IsValidUtf16(CStringW const& utf16)
+//
+//      * Get the length of the conversion of a string, without converting it:
+//        int Utf8LengthOf(CStringW const& utf16)
+//        int Utf16LengthOf(CStringA const& utf8)
+//
+//      * Convert many strings at once, into a single contiguous buffer
+//        of NUL-terminated strings, with a table of their offsets:
+//        void ToUtf8Batch(const CStringW* utf16Strings, size_t count,
+//                         CStringA& utf8, CAtlArray<int>& offsets)
+//        void ToUtf16Batch(const CStringA* utf8Strings, size_t count,
+//                          CStringW& utf16, CAtlArray<int>& offsets)
+//
+//      * Convert into an inline stack buffer (falling back to the heap only
+//        for long strings), to pass converted strings straight to APIs:
+//        class CW2Utf8EX<t_nBufferLength>  (typedef CW2Utf8)
+//        class CUtf82WEX<t_nBufferLength>  (typedef CUtf82W)
+//
+//      * Convert input that arrives in chunks, carrying over the sequences
+//        split across chunk boundaries:
+//        class Utf8ToUtf16Stream
+//        class Utf16ToUtf8Stream
+//
 // These functions live under the UnicodeConvAtl namespace.
 //
+// #define UNICODECONVATL_USE_NATIVE_ENGINE before including this header
+// to make ToUtf8 and ToUtf16 use the native engine as well.
+//
+// #define UNICODECONVATL_ENABLE_INSTRUMENTATION before including this header
+// to collect per-thread conversion statistics, and to trace the conversions
+// with ETW (see "Instrumentation"):
+//        ConversionStatistics GetConversionStatistics()
+//        ConversionStatistics GetThreadConversionStatistics()
+//
 // This code compiles cleanly at warning level 4 (/W4)
 // on both 32-bit and 64-bit builds.
 //
@@ -76,150 +190,5139 @@
 
 #include <atldef.h>     // ATLASSERT, AtlThrow, AtlThrowLastWin32
 #include <atlstr.h>     // CStringA/W
+#include <atlcoll.h>    // CAtlArray
+
+#include <limits.h>     // INT_MAX
+#include <stdlib.h>     // malloc, free
+#include <string.h>     // strlen, memcpy, memset
+#include <wchar.h>      // wcslen
+
+// std::basic_string_view overloads are available in C++17 mode
+#if (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L) || (__cplusplus >= 201703L)
+#define UNICODECONVATL_HAS_STRING_VIEW
+#include <string_view>  // std::string_view, std::wstring_view
+#endif
+
+// SSE2 is always available on x64, and it's enabled by default
+// also for 32-bit x86 builds since VS 2012 (/arch:SSE2)
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define UNICODECONVATL_HAS_SSE2
+#include <emmintrin.h>  // SSE2 intrinsics
+#endif
+
+// On x64, the ASCII helpers also have AVX2 versions, used when the processor
+// supports AVX2 (checked at run time, see HasAvx2); they're compiled
+// regardless of /arch, which clang needs a target attribute for
+#if defined(_M_X64)
+#define UNICODECONVATL_HAS_AVX2
+#include <immintrin.h>  // AVX2 intrinsics, _xgetbv
+#include <intrin.h>     // __cpuid, __cpuidex, _BitScanForward64
+#if defined(__clang__) || defined(__GNUC__)
+#define UNICODECONVATL_AVX2_FUNCTION __attribute__((target("avx2")))
+#else
+#define UNICODECONVATL_AVX2_FUNCTION
+#endif
+#endif
+
+// Optional conversion statistics and ETW tracing (see "Instrumentation")
+#ifdef UNICODECONVATL_ENABLE_INSTRUMENTATION
+#include <atomic>       // std::atomic
+#include <TraceLoggingProvider.h>   // TraceLogging ETW provider
+
+TRACELOGGING_DECLARE_PROVIDER(g_hUnicodeConvAtlTraceProvider);
+
+#ifdef UNICODECONVATL_DEFINE_TRACE_PROVIDER
+// Provider "UnicodeConvAtl", {862af243-5b84-5885-548b-82247989c199}
+// (the GUID is the ETW hash of the provider name)
+TRACELOGGING_DEFINE_PROVIDER(
+    g_hUnicodeConvAtlTraceProvider,
+    "UnicodeConvAtl",
+    (0x862af243, 0x5b84, 0x5885, 0x54, 0x8b, 0x82, 0x24, 0x79, 0x89, 0xc1, 0x99));
+#endif
+#endif
+
 
+namespace UnicodeConvAtl {
 
 //==============================================================================
-//                          Function Implementations
+//                              Types
 //==============================================================================
 
-namespace UnicodeConvAtl {
+//------------------------------------------------------------------------------
+// Outcome of a conversion into a caller-provided buffer
+//------------------------------------------------------------------------------
+enum class ConversionStatus
+{
+    // The whole input string has been converted
+    Success,
+
+    // An invalid sequence has been found in the input string;
+    // the valid part preceding it has been converted
+    InvalidInput,
+
+    // The destination buffer is too small: the conversion stopped
+    // at a code point boundary, and can be resumed with a larger
+    // (or another) buffer
+    InsufficientBuffer,
+
+    // Negative lengths, or null pointers with non-zero lengths
+    InvalidParameter
+};
+
 
 //------------------------------------------------------------------------------
-// Convert from UTF-16 CStringW to UTF-8 CStringA.
-// Signal errors using AtlThrow.
+// Result of a conversion into a caller-provided buffer
 //------------------------------------------------------------------------------
-inline CStringA ToUtf8(CStringW const& utf16)
+struct ConversionResult
 {
-    // Special case of empty input string
-    if (utf16.IsEmpty())
+    // Number of code units written to the destination buffer
+    int Written;
+
+    // Number of code units read from the input string.
+    // For InvalidInput, this is the offset of the first invalid code unit.
+    int Consumed;
+
+    ConversionStatus Status;
+};
+
+
+//------------------------------------------------------------------------------
+// How invalid input (unpaired surrogates in UTF-16, ill-formed sequences
+// in UTF-8) is handled by the conversion functions that accept a policy
+//------------------------------------------------------------------------------
+enum class InvalidInputPolicy
+{
+    // Signal an error using AtlThrow (like ToUtf8 and ToUtf16)
+    Throw,
+
+    // Replace each invalid code unit sequence with U+FFFD REPLACEMENT CHARACTER.
+    // Ill-formed UTF-8 is replaced one maximal subpart at a time,
+    // following the Unicode Standard recommended practice (and what
+    // MultiByteToWideChar does without MB_ERR_INVALID_CHARS).
+    Replace,
+
+    // Drop invalid code unit sequences from the output
+    Skip
+};
+
+
+//==============================================================================
+//                          Implementation Details
+//==============================================================================
+
+namespace Detail {
+
+//------------------------------------------------------------------------------
+// Convert a string length expressed as size_t to an int, as required
+// by CString and by the Win32 conversion APIs.
+// Signal lengths that don't fit into an int using AtlThrow.
+//------------------------------------------------------------------------------
+inline int ToIntLength(size_t length)
+{
+    if (length > static_cast<size_t>(INT_MAX))
     {
-        // Empty input --> return empty output string
-        return CStringA();
+        AtlThrow(E_INVALIDARG);
     }
 
-    // Safely fail if an invalid UTF-16 character sequence is encountered
-    constexpr DWORD kFlags = WC_ERR_INVALID_CHARS;
+    return static_cast<int>(length);
+}
 
-    const int utf16Length = utf16.GetLength();
 
-    // Get the length, in chars, of the resulting UTF-8 string
-    const int utf8Length = ::WideCharToMultiByte(
-        CP_UTF8,            // convert to UTF-8
-        kFlags,             // conversion flags
-        utf16,              // source UTF-16 string
-        utf16Length,        // length of source UTF-16 string, in wchar_ts
-        nullptr,            // unused - no conversion required in this step
-        0,                  // request size of destination buffer, in chars
-        nullptr, nullptr    // unused
-    );
-    if (utf8Length == 0)
+//------------------------------------------------------------------------------
+// RAII wrappers of SRW locks in shared and exclusive mode
+//------------------------------------------------------------------------------
+class SharedLockGuard
+{
+public:
+    explicit SharedLockGuard(SRWLOCK& lock) noexcept
+        : m_lock(lock)
     {
-        // Conversion error: capture error code and throw
-        AtlThrowLastWin32();
+        ::AcquireSRWLockShared(&m_lock);
     }
 
-    // Make room in the destination string for the converted bits
-    CStringA utf8;
-    char* utf8Buffer = utf8.GetBuffer(utf8Length);
-    ATLASSERT(utf8Buffer != nullptr);
+    ~SharedLockGuard() noexcept
+    {
+        ::ReleaseSRWLockShared(&m_lock);
+    }
+
+    // Ban copy
+    SharedLockGuard(const SharedLockGuard&) = delete;
+    SharedLockGuard& operator=(const SharedLockGuard&) = delete;
+
+private:
+    SRWLOCK& m_lock;
+};
+
 
-    // Do the actual conversion from UTF-16 to UTF-8
-    int result = ::WideCharToMultiByte(
-        CP_UTF8,            // convert to UTF-8
-        kFlags,             // conversion flags
-        utf16,              // source UTF-16 string
-        utf16Length,        // length of source UTF-16 string, in wchar_ts
-        utf8Buffer,         // pointer to destination buffer
-        utf8Length,         // size of destination buffer, in chars
-        nullptr, nullptr    // unused
-    );
-    if (result == 0)
+class ExclusiveLockGuard
+{
+public:
+    explicit ExclusiveLockGuard(SRWLOCK& lock) noexcept
+        : m_lock(lock)
     {
-        // Conversion error: capture error code and throw
-        AtlThrowLastWin32();
+        ::AcquireSRWLockExclusive(&m_lock);
     }
 
-    // Don't forget to call ReleaseBuffer on the CString object!
-    utf8.ReleaseBuffer(utf8Length);
+    ~ExclusiveLockGuard() noexcept
+    {
+        ::ReleaseSRWLockExclusive(&m_lock);
+    }
 
-    // It is good coding practice to clear the CString buffer pointer
-    // that was returned by CString::GetBuffer after a matching call
-    // to CString::ReleaseBuffer.
-    // However, in this case we just return the result string
-    // from the function, so we can skip that line:
-    //
-    // utf8Buffer = nullptr;
+    // Ban copy
+    ExclusiveLockGuard(const ExclusiveLockGuard&) = delete;
+    ExclusiveLockGuard& operator=(const ExclusiveLockGuard&) = delete;
 
-    return utf8;
+private:
+    SRWLOCK& m_lock;
+};
+
+
+#ifdef UNICODECONVATL_HAS_AVX2
+
+//------------------------------------------------------------------------------
+// Return true if the processor supports AVX2, and the OS saves
+// the YMM registers on context switches
+//------------------------------------------------------------------------------
+inline bool DetectAvx2() noexcept
+{
+    int info[4] = {};
+    __cpuid(info, 0);
+    if (info[0] < 7)
+    {
+        return false;
+    }
+
+    // OSXSAVE and AVX, then the XMM and YMM state enabled in XCR0
+    __cpuid(info, 1);
+    const int kOsxsaveAndAvx = (1 << 27) | (1 << 28);
+    if (((info[2] & kOsxsaveAndAvx) != kOsxsaveAndAvx) || ((_xgetbv(0) & 0x6) != 0x6))
+    {
+        return false;
+    }
+
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
 }
 
 
 //------------------------------------------------------------------------------
-// Convert from UTF-8 CStringA to UTF-16 CStringW.
-// Signal errors using AtlThrow.
+// Return true if the AVX2 versions of the ASCII helpers can be used.
+// The processor is checked only once.
 //------------------------------------------------------------------------------
-inline CStringW ToUtf16(CStringA const& utf8)
+inline bool HasAvx2() noexcept
 {
-    // Special case of empty input string
-    if (utf8.IsEmpty())
+    static const bool hasAvx2 = DetectAvx2();
+    return hasAvx2;
+}
+
+
+//------------------------------------------------------------------------------
+// AVX2 versions of the ASCII helpers below: they process the whole 32-byte
+// blocks of the initial ASCII run, and return the number of code units
+// processed; the rest of the run is left to the SSE2 and scalar code.
+// Only call them if HasAvx2 returns true.
+//------------------------------------------------------------------------------
+UNICODECONVATL_AVX2_FUNCTION
+inline int AsciiBlocksLengthAvx2(const wchar_t* utf16, int utf16Length) noexcept
+{
+    // Check 16 wchar_ts at a time: all of them must have bits 7-15 cleared
+    const __m256i kNonAsciiMask = _mm256_set1_epi16(static_cast<short>(0xFF80));
+    int i = 0;
+    for (; i + 16 <= utf16Length; i += 16)
     {
-        // Empty input --> return empty output string
-        return CStringW();
+        const __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(utf16 + i));
+        if (!_mm256_testz_si256(chunk, kNonAsciiMask))
+        {
+            break;
+        }
     }
+    return i;
+}
 
-    // Safely fail if an invalid UTF-8 character sequence is encountered
-    constexpr DWORD kFlags = MB_ERR_INVALID_CHARS;
 
-    const int utf8Length = utf8.GetLength();
+UNICODECONVATL_AVX2_FUNCTION
+inline int AsciiBlocksLengthAvx2(const char* utf8, int utf8Length) noexcept
+{
+    // Check 32 chars at a time: none of them must have the high bit set
+    int i = 0;
+    for (; i + 32 <= utf8Length; i += 32)
+    {
+        const __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(utf8 + i));
+        if (_mm256_movemask_epi8(chunk) != 0)
+        {
+            break;
+        }
+    }
+    return i;
+}
 
-    // Get the size of the destination UTF-16 string
-    const int utf16Length = ::MultiByteToWideChar(
-        CP_UTF8,       // source string is in UTF-8
-        kFlags,        // conversion flags
-        utf8,          // source UTF-8 string pointer
-        utf8Length,    // length of the source UTF-8 string, in chars
-        nullptr,       // unused - no conversion done in this step
-        0              // request size of destination buffer, in wchar_ts
-    );
-    if (utf16Length == 0)
+
+UNICODECONVATL_AVX2_FUNCTION
+inline int NarrowAsciiBlocksAvx2(const wchar_t* utf16, int utf16Length, char* utf8) noexcept
+{
+    // Process 32 wchar_ts at a time
+    const __m256i kNonAsciiMask = _mm256_set1_epi16(static_cast<short>(0xFF80));
+    int i = 0;
+    for (; i + 32 <= utf16Length; i += 32)
+    {
+        const __m256i low = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(utf16 + i));
+        const __m256i high = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(utf16 + i + 16));
+        if (!_mm256_testz_si256(_mm256_or_si256(low, high), kNonAsciiMask))
+        {
+            break;
+        }
+
+        // The pack instruction works within each 128-bit lane:
+        // reorder its 64-bit quarters to restore the order of the code units
+        const __m256i packed = _mm256_packus_epi16(low, high);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(utf8 + i),
+                            _mm256_permute4x64_epi64(packed, 0xD8));
+    }
+    return i;
+}
+
+
+UNICODECONVATL_AVX2_FUNCTION
+inline int WidenAsciiBlocksAvx2(const char* utf8, int utf8Length, wchar_t* utf16) noexcept
+{
+    // Process 32 chars at a time
+    int i = 0;
+    for (; i + 32 <= utf8Length; i += 32)
     {
-        // Conversion error: capture error code and throw
-        AtlThrowLastWin32();
+        const __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(utf8 + i));
+        if (_mm256_movemask_epi8(chunk) != 0)
+        {
+            break;
+        }
+
+        // Zero-extend each char to a wchar_t
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(utf16 + i),
+                            _mm256_cvtepu8_epi16(_mm256_castsi256_si128(chunk)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(utf16 + i + 16),
+                            _mm256_cvtepu8_epi16(_mm256_extracti128_si256(chunk, 1)));
     }
+    return i;
+}
 
-    // Make room in the destination string for the converted bits
-    CStringW utf16;
-    wchar_t* utf16Buffer = utf16.GetBuffer(utf16Length);
-    ATLASSERT(utf16Buffer != nullptr);
+#endif // UNICODECONVATL_HAS_AVX2
+
+
+//------------------------------------------------------------------------------
+// Return the length, in wchar_ts, of the initial run of ASCII code units
+// (U+0000 - U+007F) in the input UTF-16 string.
+//------------------------------------------------------------------------------
+inline int AsciiPrefixLength(const wchar_t* utf16, int utf16Length) noexcept
+{
+    int i = 0;
 
-    // Do the actual conversion from UTF-8 to UTF-16
-    int result = ::MultiByteToWideChar(
-        CP_UTF8,       // source string is in UTF-8
-        kFlags,        // conversion flags
-        utf8,          // source UTF-8 string pointer
-        utf8Length,    // length of source UTF-8 string, in chars
-        utf16Buffer,   // pointer to destination buffer
-        utf16Length    // size of destination buffer, in wchar_ts
-    );
-    if (result == 0)
+#ifdef UNICODECONVATL_HAS_AVX2
+    if (HasAvx2())
     {
-        // Conversion error: capture error code and throw
-        AtlThrowLastWin32();
+        i = AsciiBlocksLengthAvx2(utf16, utf16Length);
     }
+#endif
 
-    // Don't forget to call ReleaseBuffer on the CString object!
-    utf16.ReleaseBuffer(utf16Length);
+#ifdef UNICODECONVATL_HAS_SSE2
+    // Check 8 wchar_ts at a time: all of them must have bits 7-15 cleared
+    const __m128i kNonAsciiMask = _mm_set1_epi16(static_cast<short>(0xFF80));
+    const __m128i kZero = _mm_setzero_si128();
+    for (; i + 8 <= utf16Length; i += 8)
+    {
+        const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(utf16 + i));
+        const __m128i nonAscii = _mm_and_si128(chunk, kNonAsciiMask);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(nonAscii, kZero)) != 0xFFFF)
+        {
+            break;
+        }
+    }
+#endif
 
-    // It is good coding practice to clear the CString buffer pointer
-    // that was returned by CString::GetBuffer after a matching call
-    // to CString::ReleaseBuffer.
-    // However, in this case we just return the result string
-    // from the function, so we can skip that line:
-    //
-    // utf16Buffer = nullptr;
+    // Process the remaining code units one at a time
+    for (; i < utf16Length; ++i)
+    {
+        if (static_cast<unsigned int>(utf16[i]) > 0x7F)
+        {
+            break;
+        }
+    }
 
-    return utf16;
+    return i;
 }
 
-} // namespace UnicodeConvAtl
 
+//------------------------------------------------------------------------------
+// Return the length, in chars, of the initial run of ASCII chars
+// (0x00 - 0x7F) in the input UTF-8 string.
+//------------------------------------------------------------------------------
+inline int AsciiPrefixLength(const char* utf8, int utf8Length) noexcept
+{
+    int i = 0;
+
+#ifdef UNICODECONVATL_HAS_AVX2
+    if (HasAvx2())
+    {
+        i = AsciiBlocksLengthAvx2(utf8, utf8Length);
+    }
+#endif
+
+#ifdef UNICODECONVATL_HAS_SSE2
+    // Check 16 chars at a time: none of them must have the high bit set
+    for (; i + 16 <= utf8Length; i += 16)
+    {
+        const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(utf8 + i));
+        if (_mm_movemask_epi8(chunk) != 0)
+        {
+            break;
+        }
+    }
+#endif
+
+    // Process the remaining chars one at a time
+    for (; i < utf8Length; ++i)
+    {
+        if (static_cast<unsigned char>(utf8[i]) > 0x7F)
+        {
+            break;
+        }
+    }
+
+    return i;
+}
+
+
+//------------------------------------------------------------------------------
+// Copy the initial run of ASCII code units of the input UTF-16 string
+// to the destination UTF-8 buffer, narrowing each wchar_t to a char.
+// The destination buffer must have room for utf16Length chars.
+// Return the number of code units copied.
+//------------------------------------------------------------------------------
+inline int NarrowAsciiPrefix(const wchar_t* utf16, int utf16Length, char* utf8) noexcept
+{
+    int i = 0;
+
+#ifdef UNICODECONVATL_HAS_AVX2
+    if (HasAvx2())
+    {
+        i = NarrowAsciiBlocksAvx2(utf16, utf16Length, utf8);
+    }
+#endif
+
+#ifdef UNICODECONVATL_HAS_SSE2
+    // Process 16 wchar_ts at a time
+    const __m128i kNonAsciiMask = _mm_set1_epi16(static_cast<short>(0xFF80));
+    const __m128i kZero = _mm_setzero_si128();
+    for (; i + 16 <= utf16Length; i += 16)
+    {
+        const __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(utf16 + i));
+        const __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(utf16 + i + 8));
+        const __m128i nonAscii = _mm_and_si128(_mm_or_si128(low, high), kNonAsciiMask);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(nonAscii, kZero)) != 0xFFFF)
+        {
+            break;
+        }
+
+        // All the code units are ASCII, so the unsigned saturation
+        // of the pack instruction never kicks in
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(utf8 + i), _mm_packus_epi16(low, high));
+    }
+#endif
+
+    // Process the remaining code units one at a time
+    for (; i < utf16Length; ++i)
+    {
+        const unsigned int ch = static_cast<unsigned int>(utf16[i]);
+        if (ch > 0x7F)
+        {
+            break;
+        }
+        utf8[i] = static_cast<char>(ch);
+    }
+
+    return i;
+}
+
+
+//------------------------------------------------------------------------------
+// Copy the initial run of ASCII chars of the input UTF-8 string
+// to the destination UTF-16 buffer, widening each char to a wchar_t.
+// The destination buffer must have room for utf8Length wchar_ts.
+// Return the number of chars copied.
+//------------------------------------------------------------------------------
+inline int WidenAsciiPrefix(const char* utf8, int utf8Length, wchar_t* utf16) noexcept
+{
+    int i = 0;
+
+#ifdef UNICODECONVATL_HAS_AVX2
+    if (HasAvx2())
+    {
+        i = WidenAsciiBlocksAvx2(utf8, utf8Length, utf16);
+    }
+#endif
+
+#ifdef UNICODECONVATL_HAS_SSE2
+    // Process 16 chars at a time
+    const __m128i kZero = _mm_setzero_si128();
+    for (; i + 16 <= utf8Length; i += 16)
+    {
+        const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(utf8 + i));
+        if (_mm_movemask_epi8(chunk) != 0)
+        {
+            break;
+        }
+
+        // Zero-extend each char to a wchar_t
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(utf16 + i), _mm_unpacklo_epi8(chunk, kZero));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(utf16 + i + 8), _mm_unpackhi_epi8(chunk, kZero));
+    }
+#endif
+
+    // Process the remaining chars one at a time
+    for (; i < utf8Length; ++i)
+    {
+        const unsigned char ch = static_cast<unsigned char>(utf8[i]);
+        if (ch > 0x7F)
+        {
+            break;
+        }
+        utf16[i] = static_cast<wchar_t>(ch);
+    }
+
+    return i;
+}
+
+
+//------------------------------------------------------------------------------
+// UTF-16 surrogate helpers
+//------------------------------------------------------------------------------
+constexpr bool IsHighSurrogate(unsigned int ch) noexcept
+{
+    return (ch >= 0xD800) && (ch <= 0xDBFF);
+}
+
+constexpr bool IsLowSurrogate(unsigned int ch) noexcept
+{
+    return (ch >= 0xDC00) && (ch <= 0xDFFF);
+}
+
+constexpr bool IsSurrogate(unsigned int ch) noexcept
+{
+    return (ch >= 0xD800) && (ch <= 0xDFFF);
+}
+
+
+//------------------------------------------------------------------------------
+// Return true if the input byte is a UTF-8 continuation byte (10xxxxxx)
+//------------------------------------------------------------------------------
+constexpr bool IsUtf8Continuation(unsigned int ch) noexcept
+{
+    return (ch & 0xC0) == 0x80;
+}
+
+
+//------------------------------------------------------------------------------
+// Return the length, in chars, of the well-formed UTF-8 sequence starting
+// at the input pointer, or 0 if that sequence is ill-formed.
+// 'available' is the number of chars available in the input buffer (>= 1).
+//
+// The checks follow Table 3-7 "Well-Formed UTF-8 Byte Sequences"
+// of the Unicode Standard, so overlong encodings, encoded surrogates
+// and code points above U+10FFFF are all rejected, consistently with
+// MultiByteToWideChar and MB_ERR_INVALID_CHARS.
+//------------------------------------------------------------------------------
+inline int ValidUtf8SequenceLength(const unsigned char* utf8, int available) noexcept
+{
+    const unsigned int lead = utf8[0];
+
+    if (lead < 0x80)
+    {
+        // ASCII
+        return 1;
+    }
+
+    if (lead < 0xC2)
+    {
+        // Continuation byte, or overlong lead byte C0/C1
+        return 0;
+    }
+
+    if (lead < 0xE0)
+    {
+        // 2-char sequence
+        return (available >= 2 && IsUtf8Continuation(utf8[1])) ? 2 : 0;
+    }
+
+    if (lead < 0xF0)
+    {
+        // 3-char sequence:
+        // E0 must be followed by A0..BF (reject overlong encodings)
+        // ED must be followed by 80..9F (reject encoded surrogates)
+        if (available < 3)
+        {
+            return 0;
+        }
+        const unsigned int second = utf8[1];
+        const unsigned int minSecond = (lead == 0xE0) ? 0xA0 : 0x80;
+        const unsigned int maxSecond = (lead == 0xED) ? 0x9F : 0xBF;
+        return (second >= minSecond && second <= maxSecond
+                && IsUtf8Continuation(utf8[2])) ? 3 : 0;
+    }
+
+    if (lead < 0xF5)
+    {
+        // 4-char sequence:
+        // F0 must be followed by 90..BF (reject overlong encodings)
+        // F4 must be followed by 80..8F (reject code points above U+10FFFF)
+        if (available < 4)
+        {
+            return 0;
+        }
+        const unsigned int second = utf8[1];
+        const unsigned int minSecond = (lead == 0xF0) ? 0x90 : 0x80;
+        const unsigned int maxSecond = (lead == 0xF4) ? 0x8F : 0xBF;
+        return (second >= minSecond && second <= maxSecond
+                && IsUtf8Continuation(utf8[2])
+                && IsUtf8Continuation(utf8[3])) ? 4 : 0;
+    }
+
+    // F5..FF are never valid in UTF-8
+    return 0;
+}
+
+
+//------------------------------------------------------------------------------
+// Return true if the input chars (fewer than the length of the sequence
+// announced by the lead byte) are a valid beginning of a well-formed
+// UTF-8 sequence, i.e. the sequence is only truncated, and could be
+// completed by the following input.
+//------------------------------------------------------------------------------
+inline bool IsIncompleteUtf8Sequence(const unsigned char* utf8, int length) noexcept
+{
+    if (length <= 0)
+    {
+        return false;
+    }
+
+    const unsigned int lead = utf8[0];
+
+    // Same lead byte and second byte ranges of ValidUtf8SequenceLength
+    int sequenceLength = 0;
+    unsigned int minSecond = 0x80;
+    unsigned int maxSecond = 0xBF;
+    if (lead >= 0xC2 && lead <= 0xDF)
+    {
+        sequenceLength = 2;
+    }
+    else if (lead >= 0xE0 && lead <= 0xEF)
+    {
+        sequenceLength = 3;
+        minSecond = (lead == 0xE0) ? 0xA0 : 0x80;
+        maxSecond = (lead == 0xED) ? 0x9F : 0xBF;
+    }
+    else if (lead >= 0xF0 && lead <= 0xF4)
+    {
+        sequenceLength = 4;
+        minSecond = (lead == 0xF0) ? 0x90 : 0x80;
+        maxSecond = (lead == 0xF4) ? 0x8F : 0xBF;
+    }
+
+    if (length >= sequenceLength)
+    {
+        // Not a multi-char lead byte, or not truncated
+        return false;
+    }
+
+    if (length >= 2 && (utf8[1] < minSecond || utf8[1] > maxSecond))
+    {
+        return false;
+    }
+
+    for (int j = 2; j < length; ++j)
+    {
+        if (!IsUtf8Continuation(utf8[j]))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// Return the length of the incomplete UTF-8 sequence at the end of the
+// input string (see IsIncompleteUtf8Sequence), or 0 if the input string
+// doesn't end with a truncated sequence.
+//------------------------------------------------------------------------------
+inline int IncompleteUtf8TailLength(const char* utf8, int utf8Length) noexcept
+{
+    const unsigned char* const bytes = reinterpret_cast<const unsigned char*>(utf8);
+
+    // A truncated sequence is at most 3 chars long: look for its lead byte
+    for (int tailLength = 1; tailLength <= 3 && tailLength <= utf8Length; ++tailLength)
+    {
+        const unsigned char* const tail = bytes + utf8Length - tailLength;
+        if (!IsUtf8Continuation(*tail))
+        {
+            return IsIncompleteUtf8Sequence(tail, tailLength) ? tailLength : 0;
+        }
+    }
+
+    return 0;
+}
+
+
+//------------------------------------------------------------------------------
+// Encode the input code point (up to U+10FFFF) in UTF-8.
+// The destination buffer must have room for 4 chars.
+// Return the number of chars written.
+//------------------------------------------------------------------------------
+inline int EncodeUtf8(unsigned int codePoint, char* utf8) noexcept
+{
+    if (codePoint < 0x80)
+    {
+        utf8[0] = static_cast<char>(codePoint);
+        return 1;
+    }
+
+    if (codePoint < 0x800)
+    {
+        utf8[0] = static_cast<char>(0xC0 | (codePoint >> 6));
+        utf8[1] = static_cast<char>(0x80 | (codePoint & 0x3F));
+        return 2;
+    }
+
+    if (codePoint < 0x10000)
+    {
+        utf8[0] = static_cast<char>(0xE0 | (codePoint >> 12));
+        utf8[1] = static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F));
+        utf8[2] = static_cast<char>(0x80 | (codePoint & 0x3F));
+        return 3;
+    }
+
+    utf8[0] = static_cast<char>(0xF0 | (codePoint >> 18));
+    utf8[1] = static_cast<char>(0x80 | ((codePoint >> 12) & 0x3F));
+    utf8[2] = static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F));
+    utf8[3] = static_cast<char>(0x80 | (codePoint & 0x3F));
+    return 4;
+}
+
+
+//------------------------------------------------------------------------------
+// Decode the well-formed UTF-8 sequence of the given length (from 1 to 4,
+// see ValidUtf8SequenceLength) starting at the input pointer.
+// Return the decoded code point.
+//------------------------------------------------------------------------------
+inline unsigned int DecodeUtf8(const unsigned char* utf8, int sequenceLength) noexcept
+{
+    // The lead byte contributes 7, 5, 4 or 3 bits
+    constexpr unsigned char kLeadByteMasks[] = { 0x00, 0x7F, 0x1F, 0x0F, 0x07 };
+
+    unsigned int codePoint = utf8[0] & kLeadByteMasks[sequenceLength];
+    for (int j = 1; j < sequenceLength; ++j)
+    {
+        codePoint = (codePoint << 6) | (utf8[j] & 0x3F);
+    }
+
+    return codePoint;
+}
+
+
+//------------------------------------------------------------------------------
+// Return the code point corresponding to the input surrogate pair
+//------------------------------------------------------------------------------
+constexpr unsigned int CodePointFromSurrogates(unsigned int high, unsigned int low) noexcept
+{
+    return 0x10000 + ((high - 0xD800) << 10) + (low - 0xDC00);
+}
+
+
+#ifdef UNICODECONVATL_HAS_AVX2
+
+//------------------------------------------------------------------------------
+//                  AVX2 Kernels for Multilingual Text
+//
+// Validating and transcoding kernels for whole blocks of text that mix ASCII,
+// 2- and 3-char UTF-8 sequences and surrogate pairs (4-char sequences),
+// used by the native engine when HasAvx2 returns true.
+// Each kernel processes the blocks at the start of its input, as long as
+// they're valid, and returns the number of input code units processed.
+// It stops at the first block that is all ASCII (left to the ASCII helpers),
+// that contains invalid input, or that is too close to the end of the input:
+// the scalar code continues from there, so it still finds the exact offset
+// of the invalid input, and the kernels never read past the end of the input.
+//------------------------------------------------------------------------------
+
+// Minimum input lengths of the kernels, in code units: the callers leave
+// shorter inputs to the scalar code, without calling the kernels
+constexpr int kUtf8LengthBlocksMinLength = 16;
+constexpr int kUtf16ToUtf8BlocksMinLength = 8 + 16;
+constexpr int kUtf16LengthBlocksMinLength = 32;
+constexpr int kUtf8ToUtf16BlocksMinLength = 64 + 32;
+
+//------------------------------------------------------------------------------
+// Shuffles used by Utf16ToUtf8BlocksAvx2 to pack the UTF-8 chars of four
+// code units, each encoded in a 32-bit lane, into consecutive chars.
+// The index has two bits per lane: the number of chars of the lane, minus one.
+//------------------------------------------------------------------------------
+struct Utf8PackTable
+{
+    unsigned char shuffles[256][16];
+    unsigned char lengths[256];
+
+    Utf8PackTable() noexcept
+    {
+        for (int index = 0; index < 256; ++index)
+        {
+            int length = 0;
+            for (int lane = 0; lane < 4; ++lane)
+            {
+                const int laneLength = ((index >> (2 * lane)) & 0x3) + 1;
+                for (int j = 0; j < laneLength; ++j)
+                {
+                    shuffles[index][length++] = static_cast<unsigned char>(4 * lane + j);
+                }
+            }
+
+            lengths[index] = static_cast<unsigned char>(length);
+            for (int j = length; j < 16; ++j)
+            {
+                // Zero the unused chars
+                shuffles[index][j] = 0x80;
+            }
+        }
+    }
+};
+
+
+//------------------------------------------------------------------------------
+// Return the table of Utf16ToUtf8BlocksAvx2; it's built only once
+//------------------------------------------------------------------------------
+inline const Utf8PackTable& GetUtf8PackTable() noexcept
+{
+    static const Utf8PackTable table;
+    return table;
+}
+
+
+//------------------------------------------------------------------------------
+// How Utf8ToUtf16BlocksAvx2 decodes the sequences at the start of a window
+//------------------------------------------------------------------------------
+enum class Utf8DecodeKind : unsigned char
+{
+    // Not supported by the kernel: invalid input
+    None,
+
+    // Six 1- or 2-char sequences, in 16-bit lanes
+    UpTo2Chars,
+
+    // Four sequences of 1 to 3 chars, in 32-bit lanes
+    UpTo3Chars,
+
+    // One to three sequences of 1 to 4 chars, in 32-bit lanes
+    UpTo4Chars
+};
+
+
+//------------------------------------------------------------------------------
+// Decoding step of Utf8ToUtf16BlocksAvx2, for a given set of sequence ends
+//------------------------------------------------------------------------------
+struct Utf8DecodeStep
+{
+    Utf8DecodeKind kind;
+    unsigned char consumed;     // chars decoded
+    unsigned char count;        // sequences decoded
+    unsigned short shuffle;     // index of the shuffle in Utf8DecodeTables
+};
+
+
+//------------------------------------------------------------------------------
+// Tables used by Utf8ToUtf16BlocksAvx2, indexed by the 12-bit mask of the
+// chars that end a sequence (i.e. that aren't followed by a continuation
+// byte) in the first 12 chars of a window.
+// The shuffles move the chars of each sequence into their own lane,
+// from the last char (in the lowest byte of the lane) back to the lead byte.
+//------------------------------------------------------------------------------
+struct Utf8DecodeTables
+{
+    // Shuffles for UpTo2Chars (64), UpTo3Chars (81) and UpTo4Chars (192)
+    static constexpr int kUpTo3CharsShuffles = 64;
+    static constexpr int kUpTo4CharsShuffles = 64 + 81;
+    static constexpr int kShuffleCount = 64 + 81 + 192;
+
+    Utf8DecodeStep steps[4096];
+    unsigned char shuffles[kShuffleCount][16];
+
+    // Shuffles that drop the high halves of the 32-bit lanes of UpTo4Chars,
+    // indexed by the mask of the lanes that hold a surrogate pair
+    unsigned char pairShuffles[16][16];
+
+    Utf8DecodeTables() noexcept
+    {
+        memset(shuffles, 0x80, sizeof(shuffles));
+        memset(pairShuffles, 0x80, sizeof(pairShuffles));
+
+        for (int pairs = 0; pairs < 16; ++pairs)
+        {
+            int length = 0;
+            for (int lane = 0; lane < 4; ++lane)
+            {
+                const int laneBytes = ((pairs & (1 << lane)) != 0) ? 4 : 2;
+                for (int j = 0; j < laneBytes; ++j)
+                {
+                    pairShuffles[pairs][length++] = static_cast<unsigned char>(4 * lane + j);
+                }
+            }
+        }
+
+        for (int ends = 0; ends < 4096; ++ends)
+        {
+            // Lengths of the sequences that end in the first 12 chars
+            int lengths[12];
+            int count = 0;
+            int start = 0;
+            for (int j = 0; j < 12; ++j)
+            {
+                if ((ends & (1 << j)) != 0)
+                {
+                    lengths[count++] = j + 1 - start;
+                    start = j + 1;
+                }
+            }
+
+            Utf8DecodeStep& step = steps[ends];
+            if (AreSequencesShorterThan(lengths, count, 6, 3))
+            {
+                step.kind = Utf8DecodeKind::UpTo2Chars;
+                step.count = 6;
+                step.shuffle = static_cast<unsigned short>(ShuffleIndex(lengths, 6, 2));
+                step.consumed = static_cast<unsigned char>(
+                    FillShuffle(shuffles[step.shuffle], lengths, 6, 2));
+            }
+            else if (AreSequencesShorterThan(lengths, count, 4, 4))
+            {
+                step.kind = Utf8DecodeKind::UpTo3Chars;
+                step.count = 4;
+                step.shuffle = static_cast<unsigned short>(
+                    kUpTo3CharsShuffles + ShuffleIndex(lengths, 4, 3));
+                step.consumed = static_cast<unsigned char>(
+                    FillShuffle(shuffles[step.shuffle], lengths, 4, 4));
+            }
+            else
+            {
+                // As many sequences as possible (up to three) of at most 4 chars
+                int decoded = 0;
+                while (decoded < 3 && decoded < count && lengths[decoded] <= 4)
+                {
+                    ++decoded;
+                }
+
+                if (decoded == 0)
+                {
+                    step.kind = Utf8DecodeKind::None;
+                    step.count = 0;
+                    step.shuffle = 0;
+                    step.consumed = 0;
+                    continue;
+                }
+
+                step.kind = Utf8DecodeKind::UpTo4Chars;
+                step.count = static_cast<unsigned char>(decoded);
+                step.shuffle = static_cast<unsigned short>(kUpTo4CharsShuffles
+                    + (decoded - 1) * 64 + ShuffleIndex(lengths, decoded, 4));
+                step.consumed = static_cast<unsigned char>(
+                    FillShuffle(shuffles[step.shuffle], lengths, decoded, 4));
+            }
+        }
+    }
+
+private:
+
+    // Return true if there are at least 'count' sequences,
+    // and the first 'count' are shorter than 'limit' chars
+    static bool AreSequencesShorterThan(const int* lengths, int available,
+                                        int count, int limit) noexcept
+    {
+        if (available < count)
+        {
+            return false;
+        }
+
+        for (int k = 0; k < count; ++k)
+        {
+            if (lengths[k] >= limit)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Return the index of the shuffle for the given sequence lengths
+    // (from 1 to 'base'), among the shuffles of the same kind
+    static int ShuffleIndex(const int* lengths, int count, int base) noexcept
+    {
+        int index = 0;
+        for (int k = count - 1; k >= 0; --k)
+        {
+            index = index * base + (lengths[k] - 1);
+        }
+        return index;
+    }
+
+    // Fill the shuffle for the given sequences, with lanes of 'laneSize' bytes.
+    // Return the number of chars of the sequences.
+    static int FillShuffle(unsigned char* shuffle, const int* lengths, int count,
+                           int laneSize) noexcept
+    {
+        int start = 0;
+        for (int k = 0; k < count; ++k)
+        {
+            for (int j = 0; j < lengths[k]; ++j)
+            {
+                shuffle[laneSize * k + j] = static_cast<unsigned char>(start + lengths[k] - 1 - j);
+            }
+            start += lengths[k];
+        }
+        return start;
+    }
+};
+
+
+//------------------------------------------------------------------------------
+// Return the tables of Utf8ToUtf16BlocksAvx2; they're built only once
+//------------------------------------------------------------------------------
+inline const Utf8DecodeTables& GetUtf8DecodeTables() noexcept
+{
+    static const Utf8DecodeTables tables;
+    return tables;
+}
+
+
+//------------------------------------------------------------------------------
+// Validate whole blocks of 16 wchar_ts of the input UTF-16 string, adding
+// the length of their UTF-8 conversion to utf8Length.
+// Return the number of wchar_ts processed; they never end with a high
+// surrogate, which is checked by the scalar code with the following wchar_t.
+//------------------------------------------------------------------------------
+UNICODECONVATL_AVX2_FUNCTION
+inline int Utf8LengthBlocksAvx2(const wchar_t* utf16, int utf16Length,
+                                long long& utf8Length) noexcept
+{
+    const __m256i kNonAsciiMask = _mm256_set1_epi16(static_cast<short>(0xFF80));
+    const __m256i kNon2CharsMask = _mm256_set1_epi16(static_cast<short>(0xF800));
+    const __m256i kSurrogateMask = _mm256_set1_epi16(static_cast<short>(0xFC00));
+    const __m256i kHighSurrogate = _mm256_set1_epi16(static_cast<short>(0xD800));
+    const __m256i kLowSurrogate = _mm256_set1_epi16(static_cast<short>(0xDC00));
+    const __m256i kZero = _mm256_setzero_si256();
+
+    __m256i lengths = _mm256_setzero_si256();    // 8 partial sums
+    unsigned int carry = 0;                      // the previous block ended with a high surrogate
+
+    int i = 0;
+    for (; i + kUtf8LengthBlocksMinLength <= utf16Length; i += 16)
+    {
+        const __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(utf16 + i));
+        if (_mm256_testz_si256(chunk, kNonAsciiMask))
+        {
+            break;
+        }
+
+        // Each low surrogate must follow a high surrogate
+        // (two mask bits per wchar_t)
+        const __m256i kinds = _mm256_and_si256(chunk, kSurrogateMask);
+        const unsigned int highs = static_cast<unsigned int>(
+            _mm256_movemask_epi8(_mm256_cmpeq_epi16(kinds, kHighSurrogate)));
+        const unsigned int lows = static_cast<unsigned int>(
+            _mm256_movemask_epi8(_mm256_cmpeq_epi16(kinds, kLowSurrogate)));
+        if (lows != ((highs << 2) | carry))
+        {
+            break;
+        }
+        carry = highs >> 30;
+
+        // 1 char for ASCII, 2 up to U+07FF, 3 for the rest of the BMP,
+        // and 2 for each surrogate of a pair (the comparisons give -1)
+        const __m256i non2Chars = _mm256_and_si256(chunk, kNon2CharsMask);
+        __m256i chunkLengths = _mm256_set1_epi16(3);
+        chunkLengths = _mm256_add_epi16(chunkLengths,
+            _mm256_cmpeq_epi16(_mm256_and_si256(chunk, kNonAsciiMask), kZero));
+        chunkLengths = _mm256_add_epi16(chunkLengths, _mm256_cmpeq_epi16(non2Chars, kZero));
+        chunkLengths = _mm256_add_epi16(chunkLengths, _mm256_cmpeq_epi16(non2Chars, kHighSurrogate));
+        lengths = _mm256_add_epi32(lengths, _mm256_madd_epi16(chunkLengths, _mm256_set1_epi16(1)));
+    }
+
+    alignas(32) int partialLengths[8];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(partialLengths), lengths);
+    for (int lane = 0; lane < 8; ++lane)
+    {
+        utf8Length += partialLengths[lane];
+    }
+
+    if (carry != 0)
+    {
+        // Leave the last high surrogate to the scalar code
+        --i;
+        utf8Length -= 2;
+    }
+
+    return i;
+}
+
+
+//------------------------------------------------------------------------------
+// Convert whole blocks of 8 wchar_ts of the input UTF-16 string to UTF-8,
+// without validating them, advancing the utf8 pointer past the chars written.
+// Blocks with unpaired surrogates are left to the scalar code (see
+// NativeUtf16ToUtf8Unchecked).
+// Return the number of wchar_ts processed; they never end with a high
+// surrogate.
+//------------------------------------------------------------------------------
+UNICODECONVATL_AVX2_FUNCTION
+inline int Utf16ToUtf8BlocksAvx2(const wchar_t* utf16, int utf16Length, char*& utf8) noexcept
+{
+    const Utf8PackTable& table = GetUtf8PackTable();
+
+    // Spread the bits of a 4-bit lane mask to the 2-bit fields of a table index
+    constexpr unsigned char kSpreadBits[16] =
+    {
+        0x00, 0x01, 0x04, 0x05, 0x10, 0x11, 0x14, 0x15,
+        0x40, 0x41, 0x44, 0x45, 0x50, 0x51, 0x54, 0x55
+    };
+
+    // For blocks of 3-char sequences: the lead bytes of the 8 wchar_ts
+    // are followed by the continuation bytes of 4 of them
+    const __m128i kFirst3CharsShuffle = _mm_setr_epi8(
+        0, 8, 9, 1, 10, 11, 2, 12, 13, 3, 14, 15, -1, -1, -1, -1);
+    const __m128i kLast3CharsShuffle = _mm_setr_epi8(
+        4, 8, 9, 5, 10, 11, 6, 12, 13, 7, 14, 15, -1, -1, -1, -1);
+
+    // 0x10000 + ((high - 0xD800) << 10) + (low - 0xDC00) == (high << 10) + low - kSurrogateOffset
+    const __m256i kSurrogateOffset = _mm256_set1_epi32((0xD800 << 10) + 0xDC00 - 0x10000);
+    const __m256i kLow6Bits = _mm256_set1_epi32(0x3F);
+    const __m256i kContinuation = _mm256_set1_epi32(0x80);
+
+    // Work on a copy of the output pointer, which the stores could alias
+    char* output = utf8;
+
+    __m128i previousUnits = _mm_setzero_si128();
+    unsigned int carry = 0;     // the previous block ends with a high surrogate
+
+    int i = 0;
+
+    // The 16-byte stores may write past the output of a block: stay
+    // 16 wchar_ts from the end of the input, as their output takes
+    // at least 16 chars, written later
+    for (; i + kUtf16ToUtf8BlocksMinLength <= utf16Length; i += 8)
+    {
+        const __m128i units = _mm_loadu_si128(reinterpret_cast<const __m128i*>(utf16 + i));
+        if (_mm_testz_si128(units, _mm_set1_epi16(static_cast<short>(0xFF80))))
+        {
+            break;
+        }
+
+        // Each low surrogate must follow a high surrogate, also across blocks
+        const __m128i kinds = _mm_and_si128(units, _mm_set1_epi16(static_cast<short>(0xFC00)));
+        const unsigned int highs = static_cast<unsigned int>(_mm_movemask_epi8(_mm_packs_epi16(
+            _mm_cmpeq_epi16(kinds, _mm_set1_epi16(static_cast<short>(0xD800))), _mm_setzero_si128())));
+        const unsigned int lows = static_cast<unsigned int>(_mm_movemask_epi8(_mm_packs_epi16(
+            _mm_cmpeq_epi16(kinds, _mm_set1_epi16(static_cast<short>(0xDC00))), _mm_setzero_si128())));
+        if (lows != (((highs << 1) | carry) & 0xFF))
+        {
+            break;
+        }
+        carry = highs >> 7;
+
+        // Two mask bits for each wchar_t below U+0800
+        const unsigned int below800 = static_cast<unsigned int>(_mm_movemask_epi8(_mm_cmpeq_epi16(
+            _mm_and_si128(units, _mm_set1_epi16(static_cast<short>(0xF800))), _mm_setzero_si128())));
+        const bool hasSurrogates = ((highs | lows) != 0);
+
+        if ((below800 == 0xFFFF) && _mm_testz_si128(
+            _mm_cmpeq_epi16(_mm_and_si128(units, _mm_set1_epi16(static_cast<short>(0xFF80))), _mm_setzero_si128()),
+            _mm_set1_epi8(-1)))
+        {
+            // All 2-char sequences, e.g. Cyrillic, Greek, Hebrew or Arabic text
+            const __m128i leads = _mm_or_si128(_mm_srli_epi16(units, 6), _mm_set1_epi16(0xC0));
+            const __m128i lasts = _mm_or_si128(
+                _mm_and_si128(units, _mm_set1_epi16(0x3F)), _mm_set1_epi16(0x80));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(output), _mm_or_si128(leads, _mm_slli_epi16(lasts, 8)));
+            output += 16;
+            continue;
+        }
+
+        if ((highs == 0x55) && (lows == 0xAA))
+        {
+            // All surrogate pairs, e.g. emoji: one 4-char sequence
+            // for each 32-bit lane (high surrogate, then low surrogate)
+            const __m128i kPairLow6Bits = _mm_set1_epi32(0x3F);
+            const __m128i codePoints = _mm_add_epi32(_mm_add_epi32(
+                _mm_slli_epi32(_mm_and_si128(units, _mm_set1_epi32(0x3FF)), 10),
+                _mm_and_si128(_mm_srli_epi32(units, 16), _mm_set1_epi32(0x3FF))),
+                _mm_set1_epi32(0x10000));
+            const __m128i encoded = _mm_or_si128(_mm_or_si128(
+                _mm_or_si128(_mm_srli_epi32(codePoints, 18), _mm_set1_epi32(0x808080F0)),
+                _mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(codePoints, 12), kPairLow6Bits), 8)),
+                _mm_or_si128(
+                    _mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(codePoints, 6), kPairLow6Bits), 16),
+                    _mm_slli_epi32(_mm_and_si128(codePoints, kPairLow6Bits), 24)));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(output), encoded);
+            output += 16;
+            continue;
+        }
+
+        if (!hasSurrogates && (below800 == 0))
+        {
+            // All 3-char sequences, e.g. CJK text: no table lookups
+            const __m128i leads = _mm_or_si128(_mm_srli_epi16(units, 12), _mm_set1_epi16(0xE0));
+            const __m128i middles = _mm_or_si128(
+                _mm_and_si128(_mm_srli_epi16(units, 6), _mm_set1_epi16(0x3F)), _mm_set1_epi16(0x80));
+            const __m128i lasts = _mm_or_si128(
+                _mm_and_si128(units, _mm_set1_epi16(0x3F)), _mm_set1_epi16(0x80));
+            const __m128i packedLeads = _mm_packus_epi16(leads, leads);
+            const __m128i continuations = _mm_or_si128(middles, _mm_slli_epi16(lasts, 8));
+
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(output),
+                _mm_shuffle_epi8(_mm_unpacklo_epi64(packedLeads, continuations), kFirst3CharsShuffle));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(output + 12),
+                _mm_shuffle_epi8(_mm_unpackhi_epi64(packedLeads, continuations), kLast3CharsShuffle));
+            output += 24;
+            continue;
+        }
+
+        // Encode each wchar_t in a 32-bit lane, lead byte first
+        const __m256i current = _mm256_cvtepu16_epi32(units);
+        const __m256i is2Chars = _mm256_cmpgt_epi32(current, _mm256_set1_epi32(0x7F));
+        __m256i is3Chars = _mm256_cmpgt_epi32(current, _mm256_set1_epi32(0x7FF));
+
+        const __m256i last = _mm256_or_si256(_mm256_and_si256(current, kLow6Bits), kContinuation);
+        const __m256i middle = _mm256_or_si256(
+            _mm256_and_si256(_mm256_srli_epi32(current, 6), kLow6Bits), kContinuation);
+        const __m256i encoded2Chars = _mm256_or_si256(
+            _mm256_or_si256(_mm256_srli_epi32(current, 6), _mm256_set1_epi32(0xC0)),
+            _mm256_slli_epi32(last, 8));
+        const __m256i encoded3Chars = _mm256_or_si256(
+            _mm256_or_si256(_mm256_srli_epi32(current, 12), _mm256_set1_epi32(0xE0)),
+            _mm256_or_si256(_mm256_slli_epi32(middle, 8), _mm256_slli_epi32(last, 16)));
+
+        __m256i encoded = _mm256_blendv_epi8(current, encoded2Chars, is2Chars);
+        encoded = _mm256_blendv_epi8(encoded, encoded3Chars, is3Chars);
+
+        if (hasSurrogates)
+        {
+            // Each surrogate of a pair takes 2 chars: the high surrogate
+            // the first two chars of the code point, and the low surrogate
+            // the last two
+            const __m256i next = _mm256_cvtepu16_epi32(
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(utf16 + i + 1)));
+            const __m256i previous = _mm256_cvtepu16_epi32(_mm_alignr_epi8(units, previousUnits, 14));
+            const __m256i highCodePoints = _mm256_sub_epi32(
+                _mm256_add_epi32(_mm256_slli_epi32(current, 10), next), kSurrogateOffset);
+            const __m256i lowCodePoints = _mm256_sub_epi32(
+                _mm256_add_epi32(_mm256_slli_epi32(previous, 10), current), kSurrogateOffset);
+
+            const __m256i encodedHighs = _mm256_or_si256(
+                _mm256_or_si256(_mm256_srli_epi32(highCodePoints, 18), _mm256_set1_epi32(0xF0)),
+                _mm256_slli_epi32(_mm256_or_si256(_mm256_and_si256(
+                    _mm256_srli_epi32(highCodePoints, 12), kLow6Bits), kContinuation), 8));
+            const __m256i encodedLows = _mm256_or_si256(
+                _mm256_or_si256(_mm256_and_si256(
+                    _mm256_srli_epi32(lowCodePoints, 6), kLow6Bits), kContinuation),
+                _mm256_slli_epi32(_mm256_or_si256(
+                    _mm256_and_si256(lowCodePoints, kLow6Bits), kContinuation), 8));
+
+            const __m256i currentKinds = _mm256_and_si256(current, _mm256_set1_epi32(0xFC00));
+            const __m256i isHigh = _mm256_cmpeq_epi32(currentKinds, _mm256_set1_epi32(0xD800));
+            const __m256i isLow = _mm256_cmpeq_epi32(currentKinds, _mm256_set1_epi32(0xDC00));
+            encoded = _mm256_blendv_epi8(encoded, encodedHighs, isHigh);
+            encoded = _mm256_blendv_epi8(encoded, encodedLows, isLow);
+            is3Chars = _mm256_andnot_si256(_mm256_or_si256(isHigh, isLow), is3Chars);
+        }
+        previousUnits = units;
+
+        // Pack the chars of each half of the block
+        const unsigned int mask2Chars = static_cast<unsigned int>(
+            _mm256_movemask_ps(_mm256_castsi256_ps(is2Chars)));
+        const unsigned int mask3Chars = static_cast<unsigned int>(
+            _mm256_movemask_ps(_mm256_castsi256_ps(is3Chars)));
+        const int index0 = kSpreadBits[mask2Chars & 0xF] + kSpreadBits[mask3Chars & 0xF];
+        const int index1 = kSpreadBits[mask2Chars >> 4] + kSpreadBits[mask3Chars >> 4];
+
+        const __m256i shuffle = _mm256_inserti128_si256(_mm256_castsi128_si256(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(table.shuffles[index0]))),
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(table.shuffles[index1])), 1);
+        const __m256i packed = _mm256_shuffle_epi8(encoded, shuffle);
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(output), _mm256_castsi256_si128(packed));
+        output += table.lengths[index0];
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(output), _mm256_extracti128_si256(packed, 1));
+        output += table.lengths[index1];
+    }
+
+    if (carry != 0)
+    {
+        // Leave the last high surrogate, and its 2 chars, to the scalar code
+        --i;
+        output -= 2;
+    }
+
+    utf8 = output;
+    return i;
+}
+
+
+//------------------------------------------------------------------------------
+// Validate whole blocks of 32 chars of the input UTF-8 string, adding
+// the length of their UTF-16 conversion to utf16Length.
+// The checks are the ones of ValidUtf8SequenceLength, done on all the chars
+// at once with three nibble lookups (by John Keiser and Daniel Lemire).
+// Return the number of chars processed; they never end with an incomplete
+// sequence, which is checked by the scalar code with the following chars.
+//------------------------------------------------------------------------------
+UNICODECONVATL_AVX2_FUNCTION
+inline int Utf16LengthBlocksAvx2(const char* utf8, int utf8Length, int& utf16Length) noexcept
+{
+    // Errors detected by looking at pairs of consecutive chars
+    constexpr char kTooShort = 0x01;        // lead byte or ASCII, then a lead byte or ASCII
+    constexpr char kTooLong = 0x02;         // ASCII, then a continuation byte
+    constexpr char kOverlong3 = 0x04;       // E0, then 80..9F
+    constexpr char kTooLarge = 0x08;        // F4..FF, then 90..BF
+    constexpr char kSurrogate = 0x10;       // ED, then A0..BF
+    constexpr char kOverlong2 = 0x20;       // C0 or C1, then a continuation byte
+    constexpr char kTooLarge1000 = 0x40;    // F5..FF, then 80..8F
+    constexpr char kOverlong4 = 0x40;       // F0, then 80..8F
+    constexpr char kTwoContinuations = static_cast<char>(0x80);
+    constexpr char kCarry = kTooShort | kTooLong | kTwoContinuations;
+
+    // Indexed by the high nibble of the first char of the pair
+    const __m256i kFirstHighNibble = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+        kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, kTooLong,
+        kTwoContinuations, kTwoContinuations, kTwoContinuations, kTwoContinuations,
+        kTooShort | kOverlong2,
+        kTooShort,
+        kTooShort | kOverlong3 | kSurrogate,
+        kTooShort | kTooLarge | kTooLarge1000 | kOverlong4));
+
+    // Indexed by the low nibble of the first char of the pair
+    const __m256i kFirstLowNibble = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+        kCarry | kOverlong3 | kOverlong2 | kOverlong4,
+        kCarry | kOverlong2,
+        kCarry,
+        kCarry,
+        kCarry | kTooLarge,
+        kCarry | kTooLarge | kTooLarge1000,
+        kCarry | kTooLarge | kTooLarge1000,
+        kCarry | kTooLarge | kTooLarge1000,
+        kCarry | kTooLarge | kTooLarge1000,
+        kCarry | kTooLarge | kTooLarge1000,
+        kCarry | kTooLarge | kTooLarge1000,
+        kCarry | kTooLarge | kTooLarge1000,
+        kCarry | kTooLarge | kTooLarge1000,
+        kCarry | kTooLarge | kTooLarge1000 | kSurrogate,
+        kCarry | kTooLarge | kTooLarge1000,
+        kCarry | kTooLarge | kTooLarge1000));
+
+    // Indexed by the high nibble of the second char of the pair
+    const __m256i kSecondHighNibble = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+        kTooShort, kTooShort, kTooShort, kTooShort, kTooShort, kTooShort, kTooShort, kTooShort,
+        kTooLong | kOverlong2 | kTwoContinuations | kOverlong3 | kTooLarge1000 | kOverlong4,
+        kTooLong | kOverlong2 | kTwoContinuations | kOverlong3 | kTooLarge,
+        kTooLong | kOverlong2 | kTwoContinuations | kSurrogate | kTooLarge,
+        kTooLong | kOverlong2 | kTwoContinuations | kSurrogate | kTooLarge,
+        kTooShort, kTooShort, kTooShort, kTooShort));
+
+    const __m256i kLowNibbleMask = _mm256_set1_epi8(0x0F);
+    const __m256i kZero = _mm256_setzero_si256();
+
+    const unsigned char* const bytes = reinterpret_cast<const unsigned char*>(utf8);
+
+    __m256i previous = _mm256_setzero_si256();
+    __m256i lengths = _mm256_setzero_si256();    // 4 partial sums
+
+    int i = 0;
+    for (; i + kUtf16LengthBlocksMinLength <= utf8Length; i += 32)
+    {
+        const __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bytes + i));
+        if (_mm256_movemask_epi8(chunk) == 0)
+        {
+            break;
+        }
+
+        // The chunk shifted by 1, 2 and 3 chars, with the end of the previous one
+        const __m256i carried = _mm256_permute2x128_si256(previous, chunk, 0x21);
+        const __m256i previous1 = _mm256_alignr_epi8(chunk, carried, 15);
+        const __m256i previous2 = _mm256_alignr_epi8(chunk, carried, 14);
+        const __m256i previous3 = _mm256_alignr_epi8(chunk, carried, 13);
+
+        const __m256i pairErrors = _mm256_and_si256(_mm256_and_si256(
+            _mm256_shuffle_epi8(kFirstHighNibble,
+                _mm256_and_si256(_mm256_srli_epi16(previous1, 4), kLowNibbleMask)),
+            _mm256_shuffle_epi8(kFirstLowNibble, _mm256_and_si256(previous1, kLowNibbleMask))),
+            _mm256_shuffle_epi8(kSecondHighNibble,
+                _mm256_and_si256(_mm256_srli_epi16(chunk, 4), kLowNibbleMask)));
+
+        // The third and fourth chars of 3- and 4-char sequences are the only
+        // continuation bytes that follow another continuation byte
+        const __m256i must3Or4 = _mm256_and_si256(_mm256_or_si256(
+            _mm256_subs_epu8(previous2, _mm256_set1_epi8(static_cast<char>(0xE0 - 0x80))),
+            _mm256_subs_epu8(previous3, _mm256_set1_epi8(static_cast<char>(0xF0 - 0x80)))),
+            _mm256_set1_epi8(static_cast<char>(0x80)));
+        const __m256i errors = _mm256_xor_si256(must3Or4, pairErrors);
+        if (!_mm256_testz_si256(errors, errors))
+        {
+            break;
+        }
+
+        // Each sequence takes one wchar_t, except 4-char sequences (two):
+        // count the chars that aren't continuation bytes (signed chars
+        // greater than -65), and once more the lead bytes F0..F4
+        const __m256i kLead4Chars = _mm256_set1_epi8(static_cast<char>(0xF0));
+        const __m256i counts = _mm256_sub_epi8(kZero, _mm256_add_epi8(
+            _mm256_cmpgt_epi8(chunk, _mm256_set1_epi8(-65)),
+            _mm256_cmpeq_epi8(_mm256_and_si256(chunk, kLead4Chars), kLead4Chars)));
+        lengths = _mm256_add_epi64(lengths, _mm256_sad_epu8(counts, kZero));
+
+        previous = chunk;
+    }
+
+    alignas(32) long long partialLengths[4];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(partialLengths), lengths);
+    int length = static_cast<int>(partialLengths[0] + partialLengths[1]
+                                  + partialLengths[2] + partialLengths[3]);
+
+    // Leave the last sequence to the scalar code, if it isn't complete
+    for (int back = 1; back <= 3 && back <= i; ++back)
+    {
+        const unsigned int ch = bytes[i - back];
+        if (!IsUtf8Continuation(ch))
+        {
+            const int sequenceLength = (ch >= 0xF0) ? 4 : (ch >= 0xE0) ? 3 : (ch >= 0xC0) ? 2 : 1;
+            if (sequenceLength > back)
+            {
+                i -= back;
+                length -= (ch >= 0xF0) ? 2 : 1;
+            }
+            break;
+        }
+    }
+
+    utf16Length += length;
+    return i;
+}
+
+
+//------------------------------------------------------------------------------
+// Return the mask of the chars of the 32-char chunk that should be
+// continuation bytes, according to the lead bytes before them
+// (in the chunk, or at the end of the previous chunk)
+//------------------------------------------------------------------------------
+UNICODECONVATL_AVX2_FUNCTION
+inline unsigned int AnnouncedContinuationsAvx2(__m256i chunk, __m256i previous) noexcept
+{
+    // The chunk shifted by 1, 2 and 3 chars, with the end of the previous one
+    const __m256i carried = _mm256_permute2x128_si256(previous, chunk, 0x21);
+    const __m256i previous1 = _mm256_alignr_epi8(chunk, carried, 15);
+    const __m256i previous2 = _mm256_alignr_epi8(chunk, carried, 14);
+    const __m256i previous3 = _mm256_alignr_epi8(chunk, carried, 13);
+
+    // The lead bytes C0..FF announce one continuation byte, E0..FF two,
+    // and F0..FF three
+    return static_cast<unsigned int>(_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(
+        _mm256_subs_epu8(previous1, _mm256_set1_epi8(static_cast<char>(0xC0 - 0x80))),
+        _mm256_subs_epu8(previous2, _mm256_set1_epi8(static_cast<char>(0xE0 - 0x80)))),
+        _mm256_subs_epu8(previous3, _mm256_set1_epi8(static_cast<char>(0xF0 - 0x80))))));
+}
+
+
+//------------------------------------------------------------------------------
+// Convert the UTF-8 sequences at the start of the input string to UTF-16,
+// in blocks of 64 chars, without validating them, advancing the utf16
+// pointer past the wchar_ts written.
+// Runs of sequences of the same length are decoded without table lookups.
+// The result is the same of NativeUtf8ToUtf16Unchecked: the sequences
+// whose lead bytes don't announce their lengths, as in ill-formed input,
+// are left to the scalar code.
+// Return the number of chars processed.
+//------------------------------------------------------------------------------
+UNICODECONVATL_AVX2_FUNCTION
+inline int Utf8ToUtf16BlocksAvx2(const char* utf8, int utf8Length, wchar_t*& utf16) noexcept
+{
+    const Utf8DecodeTables& tables = GetUtf8DecodeTables();
+    const unsigned char* const bytes = reinterpret_cast<const unsigned char*>(utf8);
+
+    constexpr unsigned char kBitCounts[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+
+    // Masks of the bits of each char of a sequence, from the last one
+    const __m128i kLastBits = _mm_set1_epi32(0x7F);
+    const __m128i kSecondLastBits = _mm_set1_epi32(0xFC0);
+    const __m128i kThirdLastBits = _mm_set1_epi32(0x3F000);
+    const __m128i kFourthLastBits = _mm_set1_epi32(0x1C0000);
+
+    // Shuffles for blocks of 3-char sequences (four in each half),
+    // and of 4-char sequences, in 32-bit lanes like the ones of Utf8DecodeTables
+    const __m256i k3CharsShuffle = _mm256_setr_epi8(
+        2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1,
+        2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+    const __m128i k4CharsShuffle = _mm_setr_epi8(
+        3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+
+    // Continuation bytes (80..BF) are the signed chars less than -64
+    const __m256i kMinLeadByte = _mm256_set1_epi8(-64);
+
+    // Work on a copy of the output pointer, which the stores could alias
+    wchar_t* output = utf16;
+
+    int i = 0;
+
+    // The sequences of a block are read up to 80 chars from its start,
+    // and the stores may write up to seven wchar_ts past their output:
+    // stay 32 chars past the block from the end of the input, as their
+    // output takes at least eight wchar_ts, written later
+    while (i + kUtf8ToUtf16BlocksMinLength <= utf8Length)
+    {
+        // Continuation bytes, and the chars that should be continuation bytes,
+        // according to the lead bytes before them in the block (it starts
+        // at a sequence boundary)
+        const __m256i chunk0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bytes + i));
+        const __m256i chunk1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bytes + i + 32));
+        const unsigned long long continuations =
+            static_cast<unsigned int>(_mm256_movemask_epi8(_mm256_cmpgt_epi8(kMinLeadByte, chunk0)))
+            | (static_cast<unsigned long long>(static_cast<unsigned int>(
+                _mm256_movemask_epi8(_mm256_cmpgt_epi8(kMinLeadByte, chunk1)))) << 32);
+        const unsigned long long announced = AnnouncedContinuationsAvx2(chunk0, _mm256_setzero_si256())
+            | (static_cast<unsigned long long>(AnnouncedContinuationsAvx2(chunk1, chunk0)) << 32);
+
+        // The sequences are decoded as long as the lead bytes announce them,
+        // up to the first char that doesn't match
+        unsigned long consistentLength = 64;
+        _BitScanForward64(&consistentLength, continuations ^ announced);
+
+        // Chars not followed by a continuation byte end a sequence
+        const unsigned long long ends = ~((continuations >> 1)
+            | (static_cast<unsigned long long>(IsUtf8Continuation(bytes[i + 64])) << 63));
+
+        // Decode the sequences, checking the chars decoded at each step,
+        // and the one following them
+        int position = 0;
+        while (position < 64)
+        {
+            const unsigned long long pendingEnds = ends >> position;
+            const int checkedLength = static_cast<int>(consistentLength) - position;
+            const unsigned char* const sequences = bytes + i + position;
+
+            if (((pendingEnds & 0xFFFFFF) == 0x924924) && (24 < checkedLength))
+            {
+                // Eight 3-char sequences, e.g. CJK text
+                const __m256i lanes = _mm256_shuffle_epi8(_mm256_inserti128_si256(_mm256_castsi128_si256(
+                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(sequences))),
+                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(sequences + 12)), 1), k3CharsShuffle);
+                const __m256i codePoints = _mm256_or_si256(_mm256_or_si256(
+                    _mm256_and_si256(lanes, _mm256_set1_epi32(0x7F)),
+                    _mm256_and_si256(_mm256_srli_epi32(lanes, 2), _mm256_set1_epi32(0xFC0))),
+                    _mm256_and_si256(_mm256_srli_epi32(lanes, 4), _mm256_set1_epi32(0xF000)));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(output), _mm256_castsi256_si128(
+                    _mm256_permute4x64_epi64(_mm256_packus_epi32(codePoints, codePoints), 0x08)));
+                output += 8;
+                position += 24;
+                continue;
+            }
+
+            const __m128i window = _mm_loadu_si128(reinterpret_cast<const __m128i*>(sequences));
+
+            if (((pendingEnds & 0xFFFF) == 0xAAAA) && (16 < checkedLength))
+            {
+                // Eight 2-char sequences, e.g. Cyrillic, Greek, Hebrew or Arabic text
+                const __m128i codePoints = _mm_or_si128(
+                    _mm_slli_epi16(_mm_and_si128(window, _mm_set1_epi16(0x1F)), 6),
+                    _mm_and_si128(_mm_srli_epi16(window, 8), _mm_set1_epi16(0x3F)));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(output), codePoints);
+                output += 8;
+                position += 16;
+                continue;
+            }
+
+            if ((_mm_movemask_epi8(window) == 0) && (16 <= checkedLength))
+            {
+                // 16 ASCII chars
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(output), _mm256_cvtepu8_epi16(window));
+                output += 16;
+                position += 16;
+                continue;
+            }
+
+            Utf8DecodeKind kind = Utf8DecodeKind::UpTo4Chars;
+            int count = 4;
+            int consumed = 16;
+            __m128i lanes;
+            if ((pendingEnds & 0xFFFF) == 0x8888)
+            {
+                // Four 4-char sequences, e.g. emoji
+                lanes = _mm_shuffle_epi8(window, k4CharsShuffle);
+            }
+            else
+            {
+                const Utf8DecodeStep& step = tables.steps[pendingEnds & 0xFFF];
+                kind = step.kind;
+                count = step.count;
+                consumed = step.consumed;
+                lanes = _mm_shuffle_epi8(window,
+                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(tables.shuffles[step.shuffle])));
+            }
+
+            if ((kind == Utf8DecodeKind::None) || (consumed >= checkedLength))
+            {
+                break;
+            }
+
+            if (kind == Utf8DecodeKind::UpTo2Chars)
+            {
+                // Last char: 7 bits (ASCII) or 6 bits, lead byte: 5 bits
+                const __m128i codePoints = _mm_or_si128(
+                    _mm_and_si128(lanes, _mm_set1_epi16(0x7F)),
+                    _mm_and_si128(_mm_srli_epi16(lanes, 2), _mm_set1_epi16(0x7C0)));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(output), codePoints);
+                output += 6;
+            }
+            else if (kind == Utf8DecodeKind::UpTo3Chars)
+            {
+                // 6 bits from the continuation bytes, 5 or 4 bits from the lead byte
+                const __m128i codePoints = _mm_or_si128(_mm_or_si128(
+                    _mm_and_si128(lanes, kLastBits),
+                    _mm_and_si128(_mm_srli_epi32(lanes, 2), kSecondLastBits)),
+                    _mm_and_si128(_mm_srli_epi32(lanes, 4), _mm_set1_epi32(0xF000)));
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(output), _mm_packus_epi32(codePoints, codePoints));
+                output += 4;
+            }
+            else
+            {
+                // The third char from the end is the lead byte of 3-char sequences
+                // (1110xxxx), but a continuation byte for 4-char sequences:
+                // drop its 0x20 bit in the first case
+                const __m128i thirdChars = _mm_and_si128(_mm_srli_epi32(lanes, 16), _mm_set1_epi32(0xFF));
+                const __m128i lead3Chars = _mm_cmpgt_epi32(thirdChars, _mm_set1_epi32(0xDF));
+                __m128i codePoints = _mm_or_si128(_mm_or_si128(
+                    _mm_and_si128(lanes, kLastBits),
+                    _mm_and_si128(_mm_srli_epi32(lanes, 2), kSecondLastBits)),
+                    _mm_or_si128(
+                        _mm_and_si128(_mm_srli_epi32(lanes, 4), kThirdLastBits),
+                        _mm_and_si128(_mm_srli_epi32(lanes, 6), kFourthLastBits)));
+                codePoints = _mm_sub_epi32(codePoints, _mm_and_si128(lead3Chars, _mm_set1_epi32(0x20000)));
+
+                // Supplementary code points take a surrogate pair, in the same lane;
+                // then drop the unused high halves of the lanes
+                const __m128i isSupplementary = _mm_cmpgt_epi32(codePoints, _mm_set1_epi32(0xFFFF));
+                const __m128i highs = _mm_add_epi32(_mm_and_si128(_mm_srli_epi32(
+                    _mm_sub_epi32(codePoints, _mm_set1_epi32(0x10000)), 10), _mm_set1_epi32(0x3FF)),
+                    _mm_set1_epi32(0xD800));
+                const __m128i lows = _mm_add_epi32(_mm_and_si128(codePoints, _mm_set1_epi32(0x3FF)),
+                                                   _mm_set1_epi32(0xDC00));
+                const __m128i units = _mm_blendv_epi8(codePoints,
+                    _mm_or_si128(highs, _mm_slli_epi32(lows, 16)), isSupplementary);
+                const unsigned int supplementary = static_cast<unsigned int>(
+                    _mm_movemask_ps(_mm_castsi128_ps(isSupplementary)));
+
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(output), _mm_shuffle_epi8(units,
+                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(tables.pairShuffles[supplementary]))));
+                output += count + kBitCounts[supplementary];
+            }
+
+            position += consumed;
+        }
+
+        if (position == 0)
+        {
+            break;
+        }
+        i += position;
+    }
+
+    utf16 = output;
+    return i;
+}
+
+#endif // UNICODECONVATL_HAS_AVX2
+
+
+//------------------------------------------------------------------------------
+//                      Native UTF-16/UTF-8 Engine
+//
+// Validating and transcoding functions that don't depend on
+// WideCharToMultiByte/MultiByteToWideChar.
+// ASCII runs are processed in blocks with the AVX2/SSE2 helpers above,
+// and, when AVX2 is available, multilingual text with the AVX2 kernels above;
+// the rest of the input (e.g. the end of the strings, and invalid input)
+// is processed with scalar code.
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+// Validate the input UTF-16 string, and return the length, in chars,
+// of its UTF-8 conversion.
+// Return -1 if the input string contains unpaired surrogates; in this case,
+// if invalidOffset is not null, it receives the offset of the first one.
+//------------------------------------------------------------------------------
+inline long long NativeUtf8Length(const wchar_t* utf16, int utf16Length,
+                                  int* invalidOffset = nullptr) noexcept
+{
+    long long utf8Length = 0;
+
+#ifdef UNICODECONVATL_HAS_AVX2
+    const bool useAvx2 = HasAvx2();
+#endif
+
+    int i = 0;
+    while (i < utf16Length)
+    {
+        const unsigned int ch = static_cast<unsigned int>(utf16[i]);
+
+#ifdef UNICODECONVATL_HAS_AVX2
+        if (useAvx2 && (ch >= 0x80) && (utf16Length - i >= kUtf8LengthBlocksMinLength))
+        {
+            const int blockLength = Utf8LengthBlocksAvx2(utf16 + i, utf16Length - i, utf8Length);
+            if (blockLength > 0)
+            {
+                i += blockLength;
+                continue;
+            }
+        }
+#endif
+
+        if (ch < 0x80)
+        {
+            // Skip the whole ASCII run at once
+            const int asciiLength = AsciiPrefixLength(utf16 + i, utf16Length - i);
+            i += asciiLength;
+            utf8Length += asciiLength;
+        }
+        else if (ch < 0x800)
+        {
+            utf8Length += 2;
+            ++i;
+        }
+        else if (!IsSurrogate(ch))
+        {
+            utf8Length += 3;
+            ++i;
+        }
+        else if (IsHighSurrogate(ch) && (i + 1 < utf16Length)
+                 && IsLowSurrogate(static_cast<unsigned int>(utf16[i + 1])))
+        {
+            // Surrogate pair
+            utf8Length += 4;
+            i += 2;
+        }
+        else
+        {
+            // Unpaired surrogate
+            if (invalidOffset != nullptr)
+            {
+                *invalidOffset = i;
+            }
+            return -1;
+        }
+    }
+
+    return utf8Length;
+}
+
+
+//------------------------------------------------------------------------------
+// Convert the input UTF-16 string to UTF-8, without validating it.
+// The destination buffer must be large enough for the whole conversion
+// (see NativeUtf8Length).
+// Unpaired surrogates, if any, are encoded as 3-char sequences.
+// Return a pointer past the last char written.
+//------------------------------------------------------------------------------
+inline char* NativeUtf16ToUtf8Unchecked(const wchar_t* utf16, int utf16Length, char* utf8) noexcept
+{
+#ifdef UNICODECONVATL_HAS_AVX2
+    const bool useAvx2 = HasAvx2();
+#endif
+
+    int i = 0;
+    while (i < utf16Length)
+    {
+        const unsigned int ch = static_cast<unsigned int>(utf16[i]);
+
+#ifdef UNICODECONVATL_HAS_AVX2
+        if (useAvx2 && (ch >= 0x80) && (utf16Length - i >= kUtf16ToUtf8BlocksMinLength))
+        {
+            const int blockLength = Utf16ToUtf8BlocksAvx2(utf16 + i, utf16Length - i, utf8);
+            if (blockLength > 0)
+            {
+                i += blockLength;
+                continue;
+            }
+        }
+#endif
+
+        if (ch < 0x80)
+        {
+            // Copy the whole ASCII run at once
+            const int asciiLength = NarrowAsciiPrefix(utf16 + i, utf16Length - i, utf8);
+            i += asciiLength;
+            utf8 += asciiLength;
+        }
+        else if (IsHighSurrogate(ch) && (i + 1 < utf16Length)
+                 && IsLowSurrogate(static_cast<unsigned int>(utf16[i + 1])))
+        {
+            // Surrogate pair
+            const unsigned int low = static_cast<unsigned int>(utf16[i + 1]);
+            utf8 += EncodeUtf8(CodePointFromSurrogates(ch, low), utf8);
+            i += 2;
+        }
+        else
+        {
+            utf8 += EncodeUtf8(ch, utf8);
+            ++i;
+        }
+    }
+
+    return utf8;
+}
+
+
+//------------------------------------------------------------------------------
+// Convert the input UTF-16 string to UTF-8, validating it, and writing
+// at most utf8Capacity chars to the destination buffer.
+//------------------------------------------------------------------------------
+inline ConversionResult NativeUtf16ToUtf8(const wchar_t* utf16, int utf16Length,
+                                          char* utf8, int utf8Capacity) noexcept
+{
+    int i = 0;
+    int written = 0;
+    while (i < utf16Length)
+    {
+        const unsigned int ch = static_cast<unsigned int>(utf16[i]);
+        const int room = utf8Capacity - written;
+
+        if (ch < 0x80)
+        {
+            if (room == 0)
+            {
+                return { written, i, ConversionStatus::InsufficientBuffer };
+            }
+
+            // Copy the whole ASCII run at once, as far as the buffer allows
+            const int maxLength = (utf16Length - i < room) ? (utf16Length - i) : room;
+            const int asciiLength = NarrowAsciiPrefix(utf16 + i, maxLength, utf8 + written);
+            i += asciiLength;
+            written += asciiLength;
+            continue;
+        }
+
+        unsigned int codePoint = ch;
+        int utf16SequenceLength = 1;
+        if (IsSurrogate(ch))
+        {
+            if (!IsHighSurrogate(ch) || (i + 1 == utf16Length)
+                || !IsLowSurrogate(static_cast<unsigned int>(utf16[i + 1])))
+            {
+                // Unpaired surrogate
+                return { written, i, ConversionStatus::InvalidInput };
+            }
+
+            codePoint = CodePointFromSurrogates(ch, static_cast<unsigned int>(utf16[i + 1]));
+            utf16SequenceLength = 2;
+        }
+
+        const int utf8SequenceLength = (codePoint < 0x800) ? 2 : (codePoint < 0x10000) ? 3 : 4;
+        if (utf8SequenceLength > room)
+        {
+            return { written, i, ConversionStatus::InsufficientBuffer };
+        }
+
+        EncodeUtf8(codePoint, utf8 + written);
+        written += utf8SequenceLength;
+        i += utf16SequenceLength;
+    }
+
+    return { written, i, ConversionStatus::Success };
+}
+
+
+//------------------------------------------------------------------------------
+// Validate the input UTF-8 string, and return the length, in wchar_ts,
+// of its UTF-16 conversion.
+// Return -1 if the input string contains ill-formed UTF-8 sequences;
+// in this case, if invalidOffset is not null, it receives the offset
+// of the first one.
+//------------------------------------------------------------------------------
+inline int NativeUtf16Length(const char* utf8, int utf8Length,
+                             int* invalidOffset = nullptr) noexcept
+{
+    const unsigned char* const bytes = reinterpret_cast<const unsigned char*>(utf8);
+
+    int utf16Length = 0;
+
+#ifdef UNICODECONVATL_HAS_AVX2
+    const bool useAvx2 = HasAvx2();
+#endif
+
+    int i = 0;
+    while (i < utf8Length)
+    {
+        if (bytes[i] < 0x80)
+        {
+            // Skip the whole ASCII run at once
+            const int asciiLength = AsciiPrefixLength(utf8 + i, utf8Length - i);
+            i += asciiLength;
+            utf16Length += asciiLength;
+            continue;
+        }
+
+#ifdef UNICODECONVATL_HAS_AVX2
+        if (useAvx2 && (utf8Length - i >= kUtf16LengthBlocksMinLength))
+        {
+            const int blockLength = Utf16LengthBlocksAvx2(utf8 + i, utf8Length - i, utf16Length);
+            if (blockLength > 0)
+            {
+                i += blockLength;
+                continue;
+            }
+        }
+#endif
+
+        const int sequenceLength = ValidUtf8SequenceLength(bytes + i, utf8Length - i);
+        if (sequenceLength == 0)
+        {
+            // Ill-formed sequence
+            if (invalidOffset != nullptr)
+            {
+                *invalidOffset = i;
+            }
+            return -1;
+        }
+
+        // 4-char sequences are encoded as surrogate pairs in UTF-16
+        utf16Length += (sequenceLength == 4) ? 2 : 1;
+        i += sequenceLength;
+    }
+
+    return utf16Length;
+}
+
+
+//------------------------------------------------------------------------------
+// Convert the input UTF-8 string to UTF-16, without validating it.
+// The destination buffer must be large enough for the whole conversion
+// (see NativeUtf16Length); utf8Length wchar_ts are always enough.
+// Ill-formed input produces garbage, but never reads or writes
+// out of the buffer bounds.
+// Return a pointer past the last wchar_t written.
+//------------------------------------------------------------------------------
+inline wchar_t* NativeUtf8ToUtf16Unchecked(const char* utf8, int utf8Length, wchar_t* utf16) noexcept
+{
+    const unsigned char* const bytes = reinterpret_cast<const unsigned char*>(utf8);
+
+#ifdef UNICODECONVATL_HAS_AVX2
+    const bool useAvx2 = HasAvx2();
+#endif
+
+    int i = 0;
+    while (i < utf8Length)
+    {
+        const unsigned int lead = bytes[i];
+
+        if (lead < 0x80)
+        {
+            // Copy the whole ASCII run at once
+            const int asciiLength = WidenAsciiPrefix(utf8 + i, utf8Length - i, utf16);
+            i += asciiLength;
+            utf16 += asciiLength;
+            continue;
+        }
+
+#ifdef UNICODECONVATL_HAS_AVX2
+        if (useAvx2 && (utf8Length - i >= kUtf8ToUtf16BlocksMinLength))
+        {
+            const int blockLength = Utf8ToUtf16BlocksAvx2(utf8 + i, utf8Length - i, utf16);
+            if (blockLength > 0)
+            {
+                i += blockLength;
+                continue;
+            }
+        }
+#endif
+
+        // Get the sequence length from the lead byte,
+        // without ever going past the end of the input
+        const int leadSequenceLength = (lead >= 0xF0) ? 4 : (lead >= 0xE0) ? 3 : (lead >= 0xC0) ? 2 : 1;
+        const int sequenceLength = (leadSequenceLength <= utf8Length - i)
+                                    ? leadSequenceLength : (utf8Length - i);
+
+        unsigned int codePoint = lead & (0x7F >> leadSequenceLength);
+        for (int j = 1; j < sequenceLength; ++j)
+        {
+            codePoint = (codePoint << 6) | (bytes[i + j] & 0x3F);
+        }
+
+        if (codePoint >= 0x10000)
+        {
+            // Encode as a surrogate pair
+            codePoint -= 0x10000;
+            *utf16++ = static_cast<wchar_t>(0xD800 + ((codePoint >> 10) & 0x3FF));
+            *utf16++ = static_cast<wchar_t>(0xDC00 + (codePoint & 0x3FF));
+        }
+        else
+        {
+            *utf16++ = static_cast<wchar_t>(codePoint);
+        }
+
+        i += sequenceLength;
+    }
+
+    return utf16;
+}
+
+
+//------------------------------------------------------------------------------
+// Convert the input UTF-8 string to UTF-16, validating it, and writing
+// at most utf16Capacity wchar_ts to the destination buffer.
+//------------------------------------------------------------------------------
+inline ConversionResult NativeUtf8ToUtf16(const char* utf8, int utf8Length,
+                                          wchar_t* utf16, int utf16Capacity) noexcept
+{
+    const unsigned char* const bytes = reinterpret_cast<const unsigned char*>(utf8);
+
+    int i = 0;
+    int written = 0;
+    while (i < utf8Length)
+    {
+        const int room = utf16Capacity - written;
+
+        if (bytes[i] < 0x80)
+        {
+            if (room == 0)
+            {
+                return { written, i, ConversionStatus::InsufficientBuffer };
+            }
+
+            // Copy the whole ASCII run at once, as far as the buffer allows
+            const int maxLength = (utf8Length - i < room) ? (utf8Length - i) : room;
+            const int asciiLength = WidenAsciiPrefix(utf8 + i, maxLength, utf16 + written);
+            i += asciiLength;
+            written += asciiLength;
+            continue;
+        }
+
+        const int sequenceLength = ValidUtf8SequenceLength(bytes + i, utf8Length - i);
+        if (sequenceLength == 0)
+        {
+            // Ill-formed sequence
+            return { written, i, ConversionStatus::InvalidInput };
+        }
+
+        // 4-char sequences are encoded as surrogate pairs in UTF-16
+        const int utf16SequenceLength = (sequenceLength == 4) ? 2 : 1;
+        if (utf16SequenceLength > room)
+        {
+            return { written, i, ConversionStatus::InsufficientBuffer };
+        }
+
+        const unsigned int codePoint = DecodeUtf8(bytes + i, sequenceLength);
+        if (utf16SequenceLength == 2)
+        {
+            utf16[written] = static_cast<wchar_t>(0xD800 + ((codePoint - 0x10000) >> 10));
+            utf16[written + 1] = static_cast<wchar_t>(0xDC00 + ((codePoint - 0x10000) & 0x3FF));
+        }
+        else
+        {
+            utf16[written] = static_cast<wchar_t>(codePoint);
+        }
+
+        written += utf16SequenceLength;
+        i += sequenceLength;
+    }
+
+    return { written, i, ConversionStatus::Success };
+}
+
+
+//------------------------------------------------------------------------------
+// U+FFFD REPLACEMENT CHARACTER, used for InvalidInputPolicy::Replace
+//------------------------------------------------------------------------------
+constexpr unsigned int kReplacementCharacter = 0xFFFD;
+
+
+//------------------------------------------------------------------------------
+// Return the length of the maximal subpart of the ill-formed UTF-8 sequence
+// starting at the input pointer, i.e. the longest prefix of it that is
+// the beginning of a well-formed sequence, or 1 if there is none.
+// 'available' is the number of chars available in the input buffer (>= 1).
+//------------------------------------------------------------------------------
+inline int MaximalSubpartLength(const unsigned char* utf8, int available) noexcept
+{
+    int length = 1;
+    while (length < available && IsIncompleteUtf8Sequence(utf8, length + 1))
+    {
+        ++length;
+    }
+
+    return length;
+}
+
+
+//------------------------------------------------------------------------------
+// Return the length, in chars, of the UTF-8 conversion of the input UTF-16
+// string, where unpaired surrogates are handled according to the given
+// policy (Replace or Skip).
+//------------------------------------------------------------------------------
+inline long long NativeUtf8LengthWithPolicy(const wchar_t* utf16, int utf16Length,
+                                            InvalidInputPolicy policy) noexcept
+{
+    ATLASSERT(policy != InvalidInputPolicy::Throw);
+
+    // U+FFFD takes 3 chars in UTF-8
+    const int invalidLength = (policy == InvalidInputPolicy::Replace) ? 3 : 0;
+
+    long long utf8Length = 0;
+
+    int i = 0;
+    while (i < utf16Length)
+    {
+        const unsigned int ch = static_cast<unsigned int>(utf16[i]);
+
+        if (ch < 0x80)
+        {
+            // Skip the whole ASCII run at once
+            const int asciiLength = AsciiPrefixLength(utf16 + i, utf16Length - i);
+            i += asciiLength;
+            utf8Length += asciiLength;
+        }
+        else if (ch < 0x800)
+        {
+            utf8Length += 2;
+            ++i;
+        }
+        else if (!IsSurrogate(ch))
+        {
+            utf8Length += 3;
+            ++i;
+        }
+        else if (IsHighSurrogate(ch) && (i + 1 < utf16Length)
+                 && IsLowSurrogate(static_cast<unsigned int>(utf16[i + 1])))
+        {
+            // Surrogate pair
+            utf8Length += 4;
+            i += 2;
+        }
+        else
+        {
+            // Unpaired surrogate
+            utf8Length += invalidLength;
+            ++i;
+        }
+    }
+
+    return utf8Length;
+}
+
+
+//------------------------------------------------------------------------------
+// Convert the input UTF-16 string to UTF-8, handling unpaired surrogates
+// according to the given policy (Replace or Skip).
+// The destination buffer must be large enough for the whole conversion
+// (see NativeUtf8LengthWithPolicy).
+// Return a pointer past the last char written.
+//------------------------------------------------------------------------------
+inline char* NativeUtf16ToUtf8WithPolicy(const wchar_t* utf16, int utf16Length, char* utf8,
+                                         InvalidInputPolicy policy) noexcept
+{
+    ATLASSERT(policy != InvalidInputPolicy::Throw);
+
+    int i = 0;
+    while (i < utf16Length)
+    {
+        const unsigned int ch = static_cast<unsigned int>(utf16[i]);
+
+        if (ch < 0x80)
+        {
+            // Copy the whole ASCII run at once
+            const int asciiLength = NarrowAsciiPrefix(utf16 + i, utf16Length - i, utf8);
+            i += asciiLength;
+            utf8 += asciiLength;
+        }
+        else if (!IsSurrogate(ch))
+        {
+            utf8 += EncodeUtf8(ch, utf8);
+            ++i;
+        }
+        else if (IsHighSurrogate(ch) && (i + 1 < utf16Length)
+                 && IsLowSurrogate(static_cast<unsigned int>(utf16[i + 1])))
+        {
+            // Surrogate pair
+            const unsigned int low = static_cast<unsigned int>(utf16[i + 1]);
+            utf8 += EncodeUtf8(CodePointFromSurrogates(ch, low), utf8);
+            i += 2;
+        }
+        else
+        {
+            // Unpaired surrogate
+            if (policy == InvalidInputPolicy::Replace)
+            {
+                utf8 += EncodeUtf8(kReplacementCharacter, utf8);
+            }
+            ++i;
+        }
+    }
+
+    return utf8;
+}
+
+
+//------------------------------------------------------------------------------
+// Return the length, in wchar_ts, of the UTF-16 conversion of the input UTF-8
+// string, where ill-formed sequences are handled according to the given
+// policy (Replace or Skip).
+// The result is never greater than utf8Length.
+//------------------------------------------------------------------------------
+inline int NativeUtf16LengthWithPolicy(const char* utf8, int utf8Length,
+                                       InvalidInputPolicy policy) noexcept
+{
+    ATLASSERT(policy != InvalidInputPolicy::Throw);
+
+    // U+FFFD takes 1 wchar_t in UTF-16
+    const int invalidLength = (policy == InvalidInputPolicy::Replace) ? 1 : 0;
+
+    const unsigned char* const bytes = reinterpret_cast<const unsigned char*>(utf8);
+
+    int utf16Length = 0;
+
+    int i = 0;
+    while (i < utf8Length)
+    {
+        if (bytes[i] < 0x80)
+        {
+            // Skip the whole ASCII run at once
+            const int asciiLength = AsciiPrefixLength(utf8 + i, utf8Length - i);
+            i += asciiLength;
+            utf16Length += asciiLength;
+            continue;
+        }
+
+        const int sequenceLength = ValidUtf8SequenceLength(bytes + i, utf8Length - i);
+        if (sequenceLength == 0)
+        {
+            // Ill-formed sequence: replace or skip its maximal subpart
+            utf16Length += invalidLength;
+            i += MaximalSubpartLength(bytes + i, utf8Length - i);
+            continue;
+        }
+
+        // 4-char sequences are encoded as surrogate pairs in UTF-16
+        utf16Length += (sequenceLength == 4) ? 2 : 1;
+        i += sequenceLength;
+    }
+
+    return utf16Length;
+}
+
+
+//------------------------------------------------------------------------------
+// Convert the input UTF-8 string to UTF-16, handling ill-formed sequences
+// according to the given policy (Replace or Skip).
+// The destination buffer must be large enough for the whole conversion
+// (see NativeUtf16LengthWithPolicy); utf8Length wchar_ts are always enough.
+// Return a pointer past the last wchar_t written.
+//------------------------------------------------------------------------------
+inline wchar_t* NativeUtf8ToUtf16WithPolicy(const char* utf8, int utf8Length, wchar_t* utf16,
+                                            InvalidInputPolicy policy) noexcept
+{
+    ATLASSERT(policy != InvalidInputPolicy::Throw);
+
+    const unsigned char* const bytes = reinterpret_cast<const unsigned char*>(utf8);
+
+    int i = 0;
+    while (i < utf8Length)
+    {
+        if (bytes[i] < 0x80)
+        {
+            // Copy the whole ASCII run at once
+            const int asciiLength = WidenAsciiPrefix(utf8 + i, utf8Length - i, utf16);
+            i += asciiLength;
+            utf16 += asciiLength;
+            continue;
+        }
+
+        const int sequenceLength = ValidUtf8SequenceLength(bytes + i, utf8Length - i);
+        if (sequenceLength == 0)
+        {
+            // Ill-formed sequence: replace or skip its maximal subpart
+            if (policy == InvalidInputPolicy::Replace)
+            {
+                *utf16++ = static_cast<wchar_t>(kReplacementCharacter);
+            }
+            i += MaximalSubpartLength(bytes + i, utf8Length - i);
+            continue;
+        }
+
+        const unsigned int codePoint = DecodeUtf8(bytes + i, sequenceLength);
+        if (sequenceLength == 4)
+        {
+            // Encode as a surrogate pair
+            *utf16++ = static_cast<wchar_t>(0xD800 + ((codePoint - 0x10000) >> 10));
+            *utf16++ = static_cast<wchar_t>(0xDC00 + ((codePoint - 0x10000) & 0x3FF));
+        }
+        else
+        {
+            *utf16++ = static_cast<wchar_t>(codePoint);
+        }
+
+        i += sequenceLength;
+    }
+
+    return utf16;
+}
+
+
+//------------------------------------------------------------------------------
+// Return the length, in wchar_ts, of the output of NativeUtf8ToUtf16Unchecked
+// for the input UTF-8 string, without validating it.
+// For well-formed input, this is the same as NativeUtf16Length.
+//------------------------------------------------------------------------------
+inline int NativeUtf16LengthUnchecked(const char* utf8, int utf8Length) noexcept
+{
+    const unsigned char* const bytes = reinterpret_cast<const unsigned char*>(utf8);
+
+    int utf16Length = 0;
+
+    int i = 0;
+    while (i < utf8Length)
+    {
+        const unsigned int lead = bytes[i];
+
+        if (lead < 0x80)
+        {
+            // Skip the whole ASCII run at once
+            const int asciiLength = AsciiPrefixLength(utf8 + i, utf8Length - i);
+            i += asciiLength;
+            utf16Length += asciiLength;
+            continue;
+        }
+
+        // Step through the input exactly like NativeUtf8ToUtf16Unchecked
+        const int leadSequenceLength = (lead >= 0xF0) ? 4 : (lead >= 0xE0) ? 3 : (lead >= 0xC0) ? 2 : 1;
+        const int sequenceLength = (leadSequenceLength <= utf8Length - i)
+                                    ? leadSequenceLength : (utf8Length - i);
+
+        // Only complete 4-char sequences can encode supplementary code points,
+        // which take a surrogate pair in UTF-16
+        int utf16SequenceLength = 1;
+        if (sequenceLength == 4)
+        {
+            const unsigned int codePoint = ((lead & 0x07) << 18) | ((bytes[i + 1] & 0x3F) << 12)
+                                           | ((bytes[i + 2] & 0x3F) << 6) | (bytes[i + 3] & 0x3F);
+            if (codePoint >= 0x10000)
+            {
+                utf16SequenceLength = 2;
+            }
+        }
+
+        utf16Length += utf16SequenceLength;
+        i += sequenceLength;
+    }
+
+    return utf16Length;
+}
+
+} // namespace Detail
+
+
+//==============================================================================
+//                          Conversion Policies
+//
+// The policy-based conversion functions (ConvertToUtf8 and ConvertToUtf16)
+// take three policy classes as template arguments, so that every choice
+// is made at compile time:
+//
+//  - ErrorPolicy: how errors are reported (ThrowOnError, ReturnHResult),
+//    or how invalid input is handled (ReplaceInvalidInput, SkipInvalidInput)
+//  - AllocPolicy: how the destination buffer is allocated (CStringAllocPolicy)
+//  - ValidationPolicy: whether the input is validated (ValidateInput),
+//    or trusted to be well-formed (TrustInput)
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Error policy: signal errors using AtlThrow (like ToUtf8 and ToUtf16)
+//------------------------------------------------------------------------------
+struct ThrowOnError
+{
+    using ResultType = void;
+
+    // Invalid input is an error
+    static constexpr InvalidInputPolicy kInvalidInputPolicy = InvalidInputPolicy::Throw;
+
+    static void Success() noexcept
+    {
+    }
+
+    static void Failure(HRESULT hr)
+    {
+        AtlThrow(hr);
+    }
+};
+
+
+//------------------------------------------------------------------------------
+// Error policy: return S_OK, or an error HRESULT, without throwing
+//------------------------------------------------------------------------------
+struct ReturnHResult
+{
+    using ResultType = HRESULT;
+
+    // Invalid input is an error, returned as
+    // HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION)
+    static constexpr InvalidInputPolicy kInvalidInputPolicy = InvalidInputPolicy::Throw;
+
+    static HRESULT Success() noexcept
+    {
+        return S_OK;
+    }
+
+    static HRESULT Failure(HRESULT hr) noexcept
+    {
+        return hr;
+    }
+};
+
+
+//------------------------------------------------------------------------------
+// Error policy: replace invalid input with U+FFFD (see InvalidInputPolicy);
+// signal the other errors using AtlThrow
+//------------------------------------------------------------------------------
+struct ReplaceInvalidInput
+{
+    using ResultType = void;
+
+    static constexpr InvalidInputPolicy kInvalidInputPolicy = InvalidInputPolicy::Replace;
+
+    static void Success() noexcept
+    {
+    }
+
+    static void Failure(HRESULT hr)
+    {
+        AtlThrow(hr);
+    }
+};
+
+
+//------------------------------------------------------------------------------
+// Error policy: drop invalid input from the output (see InvalidInputPolicy);
+// signal the other errors using AtlThrow
+//------------------------------------------------------------------------------
+struct SkipInvalidInput
+{
+    using ResultType = void;
+
+    static constexpr InvalidInputPolicy kInvalidInputPolicy = InvalidInputPolicy::Skip;
+
+    static void Success() noexcept
+    {
+    }
+
+    static void Failure(HRESULT hr)
+    {
+        AtlThrow(hr);
+    }
+};
+
+
+//------------------------------------------------------------------------------
+// Allocation policy: the destination is a CStringA/W.
+// Memory comes from the string manager of the destination string,
+// so a CString constructed with a custom IAtlStringMgr (for example,
+// backed by an arena) allocates from it.
+// GetBuffer returns nullptr if the allocation fails.
+//------------------------------------------------------------------------------
+struct CStringAllocPolicy
+{
+    using Utf8String = CStringA;
+    using Utf16String = CStringW;
+
+    template <typename StringType>
+    static int GetLength(StringType const& s) noexcept
+    {
+        return s.GetLength();
+    }
+
+    template <typename StringType>
+    static void Truncate(StringType& s, int length) noexcept
+    {
+        s.Truncate(length);
+    }
+
+    template <typename StringType>
+    static auto GetBuffer(StringType& s, int length) noexcept -> decltype(s.GetBuffer(length))
+    {
+        try
+        {
+            return s.GetBuffer(length);
+        }
+        catch (const CAtlException&)
+        {
+            return nullptr;
+        }
+    }
+
+    template <typename StringType>
+    static void ReleaseBuffer(StringType& s, int length) noexcept
+    {
+        s.ReleaseBuffer(length);
+    }
+};
+
+
+//------------------------------------------------------------------------------
+// Validation policy: validate the input string while measuring it,
+// with the same rules of ToUtf8 and ToUtf16.
+// Invalid input is handled according to the InvalidInputPolicy
+// of the error policy.
+//------------------------------------------------------------------------------
+struct ValidateInput
+{
+    // Return the length of the UTF-8 conversion, or -1 for invalid input
+    static long long Utf8Length(const wchar_t* utf16, int utf16Length,
+                                InvalidInputPolicy policy) noexcept
+    {
+        return (policy == InvalidInputPolicy::Throw)
+            ? Detail::NativeUtf8Length(utf16, utf16Length)
+            : Detail::NativeUtf8LengthWithPolicy(utf16, utf16Length, policy);
+    }
+
+    static void ToUtf8(const wchar_t* utf16, int utf16Length, char* utf8,
+                       InvalidInputPolicy policy) noexcept
+    {
+        if (policy == InvalidInputPolicy::Throw)
+        {
+            // The input has already been validated by Utf8Length
+            Detail::NativeUtf16ToUtf8Unchecked(utf16, utf16Length, utf8);
+        }
+        else
+        {
+            Detail::NativeUtf16ToUtf8WithPolicy(utf16, utf16Length, utf8, policy);
+        }
+    }
+
+    // Return the length of the UTF-16 conversion, or -1 for invalid input
+    static int Utf16Length(const char* utf8, int utf8Length,
+                           InvalidInputPolicy policy) noexcept
+    {
+        return (policy == InvalidInputPolicy::Throw)
+            ? Detail::NativeUtf16Length(utf8, utf8Length)
+            : Detail::NativeUtf16LengthWithPolicy(utf8, utf8Length, policy);
+    }
+
+    static void ToUtf16(const char* utf8, int utf8Length, wchar_t* utf16,
+                        InvalidInputPolicy policy) noexcept
+    {
+        if (policy == InvalidInputPolicy::Throw)
+        {
+            // The input has already been validated by Utf16Length
+            Detail::NativeUtf8ToUtf16Unchecked(utf8, utf8Length, utf16);
+        }
+        else
+        {
+            Detail::NativeUtf8ToUtf16WithPolicy(utf8, utf8Length, utf16, policy);
+        }
+    }
+};
+
+
+//------------------------------------------------------------------------------
+// Validation policy: trust the input string to be well-formed,
+// skipping all the validation checks.
+// Ill-formed input produces garbage, but never reads or writes
+// out of the buffer bounds.
+//------------------------------------------------------------------------------
+struct TrustInput
+{
+    static long long Utf8Length(const wchar_t* utf16, int utf16Length,
+                                InvalidInputPolicy) noexcept
+    {
+        // The unchecked conversion encodes unpaired surrogates as 3-char
+        // sequences, so their length is the same of U+FFFD
+        return Detail::NativeUtf8LengthWithPolicy(utf16, utf16Length,
+                                                  InvalidInputPolicy::Replace);
+    }
+
+    static void ToUtf8(const wchar_t* utf16, int utf16Length, char* utf8,
+                       InvalidInputPolicy) noexcept
+    {
+        Detail::NativeUtf16ToUtf8Unchecked(utf16, utf16Length, utf8);
+    }
+
+    static int Utf16Length(const char* utf8, int utf8Length,
+                           InvalidInputPolicy) noexcept
+    {
+        return Detail::NativeUtf16LengthUnchecked(utf8, utf8Length);
+    }
+
+    static void ToUtf16(const char* utf8, int utf8Length, wchar_t* utf16,
+                        InvalidInputPolicy) noexcept
+    {
+        Detail::NativeUtf8ToUtf16Unchecked(utf8, utf8Length, utf16);
+    }
+};
+
+
+//==============================================================================
+//                              Instrumentation
+//
+// #define UNICODECONVATL_ENABLE_INSTRUMENTATION before including this header
+// to collect statistics on the conversions done by ToUtf8/ToUtf16
+// (and by the other functions built on AppendUtf8/AppendUtf16),
+// and by TryToUtf8/TryToUtf16:
+//
+//  - number of calls, bytes in and out, number of errors
+//  - fallback-path hits: conversions whose input isn't all ASCII,
+//    and that go past the ASCII fast path into the Win32 conversion APIs
+//
+// The counters are kept per thread, in cache-line-sized blocks, so the
+// threads don't contend on them; GetConversionStatistics sums the counters
+// of all the threads (including the ones that have already exited).
+//
+// Each conversion is also traced as an ETW span (a pair of "Conversion"
+// start/stop events, with the same activity ID) by the TraceLogging provider
+// "UnicodeConvAtl" {862af243-5b84-5885-548b-82247989c199}, when a trace
+// session enables it. The provider must be defined in one translation unit,
+// #defining UNICODECONVATL_DEFINE_TRACE_PROVIDER before including this header,
+// and registered by the application with:
+//
+//      TraceLoggingRegister(g_hUnicodeConvAtlTraceProvider);
+//      ...
+//      TraceLoggingUnregister(g_hUnicodeConvAtlTraceProvider);
+//
+// When UNICODECONVATL_ENABLE_INSTRUMENTATION isn't defined, the hooks in the
+// conversion functions are empty inline functions, that compile to nothing.
+//==============================================================================
+
+namespace Detail {
+
+//------------------------------------------------------------------------------
+// Direction of an instrumented conversion
+//------------------------------------------------------------------------------
+enum class ConversionDirection
+{
+    ToUtf8,
+    ToUtf16
+};
+
+} // namespace Detail
+
+
+#ifdef UNICODECONVATL_ENABLE_INSTRUMENTATION
+
+//------------------------------------------------------------------------------
+// Statistics of the conversions in one direction
+//------------------------------------------------------------------------------
+struct ConversionCounters
+{
+    ULONGLONG calls;        // number of conversions
+    ULONGLONG inputBytes;   // bytes of the input strings
+    ULONGLONG outputBytes;  // bytes of the converted strings
+    ULONGLONG errors;       // conversions that failed
+    ULONGLONG fallbacks;    // conversions that went past the ASCII fast path
+};
+
+
+//------------------------------------------------------------------------------
+// Statistics of the conversions in both directions
+//------------------------------------------------------------------------------
+struct ConversionStatistics
+{
+    ConversionCounters toUtf8;
+    ConversionCounters toUtf16;
+};
+
+
+namespace Detail {
+
+// The counter blocks are padded to the cache line size on purpose
+#ifdef _MSC_VER
+#pragma warning(push)
+#pragma warning(disable: 4324) // structure was padded due to alignment specifier
+#endif
+
+//------------------------------------------------------------------------------
+// Counters of the conversions in one direction, done by one thread.
+// Each block takes a whole cache line, so the counters updated by a thread
+// never share a cache line with data used by other threads.
+// The counters are written only by their own thread: they are atomic
+// just to be read safely by GetConversionStatistics, and they are updated
+// with relaxed loads and stores, which compile to plain moves.
+//------------------------------------------------------------------------------
+struct alignas(64) ConversionCounterBlock
+{
+    std::atomic<ULONGLONG> calls;
+    std::atomic<ULONGLONG> inputBytes;
+    std::atomic<ULONGLONG> outputBytes;
+    std::atomic<ULONGLONG> errors;
+    std::atomic<ULONGLONG> fallbacks;
+
+    ConversionCounterBlock() noexcept
+        : calls(0), inputBytes(0), outputBytes(0), errors(0), fallbacks(0)
+    {
+    }
+};
+
+
+//------------------------------------------------------------------------------
+// Add a value to a counter only written by the current thread
+//------------------------------------------------------------------------------
+inline void AddToCounter(std::atomic<ULONGLONG>& counter, ULONGLONG value) noexcept
+{
+    counter.store(counter.load(std::memory_order_relaxed) + value,
+                  std::memory_order_relaxed);
+}
+
+
+//------------------------------------------------------------------------------
+// Add the counters of a block to the given statistics
+//------------------------------------------------------------------------------
+inline void AccumulateCounters(ConversionCounters& total,
+                               ConversionCounterBlock const& block) noexcept
+{
+    total.calls += block.calls.load(std::memory_order_relaxed);
+    total.inputBytes += block.inputBytes.load(std::memory_order_relaxed);
+    total.outputBytes += block.outputBytes.load(std::memory_order_relaxed);
+    total.errors += block.errors.load(std::memory_order_relaxed);
+    total.fallbacks += block.fallbacks.load(std::memory_order_relaxed);
+}
+
+
+struct ThreadConversionCounters;
+
+
+//------------------------------------------------------------------------------
+// Registry of the counters of all the threads, so they can be summed up.
+// The lock is taken only when a thread does its first conversion,
+// when it exits, and when the statistics are read.
+//------------------------------------------------------------------------------
+class ConversionCounterRegistry
+{
+public:
+    ConversionCounterRegistry() noexcept
+        : m_pThreads(nullptr)
+        , m_exitedThreads()
+    {
+        ::InitializeSRWLock(&m_lock);
+    }
+
+    // Ban copy
+    ConversionCounterRegistry(const ConversionCounterRegistry&) = delete;
+    ConversionCounterRegistry& operator=(const ConversionCounterRegistry&) = delete;
+
+    void Register(ThreadConversionCounters* pThread) noexcept;
+    void Unregister(ThreadConversionCounters* pThread) noexcept;
+    ConversionStatistics GetStatistics() noexcept;
+
+private:
+    SRWLOCK                     m_lock;
+    ThreadConversionCounters*   m_pThreads;         // counters of the running threads
+    ConversionStatistics        m_exitedThreads;    // totals of the exited threads
+};
+
+
+inline ConversionCounterRegistry& GetConversionCounterRegistry() noexcept
+{
+    static ConversionCounterRegistry registry;
+    return registry;
+}
+
+
+//------------------------------------------------------------------------------
+// Conversion counters of one thread, registered while the thread runs
+//------------------------------------------------------------------------------
+struct ThreadConversionCounters
+{
+    ConversionCounterBlock      toUtf8;
+    ConversionCounterBlock      toUtf16;
+    ThreadConversionCounters*   pPrevious;
+    ThreadConversionCounters*   pNext;
+
+    ThreadConversionCounters() noexcept
+        : pPrevious(nullptr)
+        , pNext(nullptr)
+    {
+        GetConversionCounterRegistry().Register(this);
+    }
+
+    ~ThreadConversionCounters() noexcept
+    {
+        GetConversionCounterRegistry().Unregister(this);
+    }
+
+    // Ban copy
+    ThreadConversionCounters(const ThreadConversionCounters&) = delete;
+    ThreadConversionCounters& operator=(const ThreadConversionCounters&) = delete;
+
+    ConversionCounterBlock& Get(ConversionDirection direction) noexcept
+    {
+        return (direction == ConversionDirection::ToUtf8) ? toUtf8 : toUtf16;
+    }
+};
+
+
+#ifdef _MSC_VER
+#pragma warning(pop)
+#endif
+
+
+inline void ConversionCounterRegistry::Register(ThreadConversionCounters* pThread) noexcept
+{
+    ::AcquireSRWLockExclusive(&m_lock);
+
+    pThread->pNext = m_pThreads;
+    if (m_pThreads != nullptr)
+    {
+        m_pThreads->pPrevious = pThread;
+    }
+    m_pThreads = pThread;
+
+    ::ReleaseSRWLockExclusive(&m_lock);
+}
+
+
+inline void ConversionCounterRegistry::Unregister(ThreadConversionCounters* pThread) noexcept
+{
+    ::AcquireSRWLockExclusive(&m_lock);
+
+    // Keep the counts of the exiting thread
+    AccumulateCounters(m_exitedThreads.toUtf8, pThread->toUtf8);
+    AccumulateCounters(m_exitedThreads.toUtf16, pThread->toUtf16);
+
+    if (pThread->pPrevious != nullptr)
+    {
+        pThread->pPrevious->pNext = pThread->pNext;
+    }
+    else
+    {
+        m_pThreads = pThread->pNext;
+    }
+    if (pThread->pNext != nullptr)
+    {
+        pThread->pNext->pPrevious = pThread->pPrevious;
+    }
+
+    ::ReleaseSRWLockExclusive(&m_lock);
+}
+
+
+inline ConversionStatistics ConversionCounterRegistry::GetStatistics() noexcept
+{
+    ::AcquireSRWLockShared(&m_lock);
+
+    ConversionStatistics statistics = m_exitedThreads;
+    for (ThreadConversionCounters* p = m_pThreads; p != nullptr; p = p->pNext)
+    {
+        AccumulateCounters(statistics.toUtf8, p->toUtf8);
+        AccumulateCounters(statistics.toUtf16, p->toUtf16);
+    }
+
+    ::ReleaseSRWLockShared(&m_lock);
+    return statistics;
+}
+
+
+//------------------------------------------------------------------------------
+// Return the conversion counters of the calling thread
+//------------------------------------------------------------------------------
+inline ThreadConversionCounters& GetThreadConversionCounters() noexcept
+{
+    thread_local ThreadConversionCounters counters;
+    return counters;
+}
+
+
+//------------------------------------------------------------------------------
+// Instrumentation of a single conversion: counts the call and its input
+// when constructed, its output (or the error) when destroyed,
+// and traces the conversion span
+//------------------------------------------------------------------------------
+class ConversionScope
+{
+public:
+    ConversionScope(ConversionDirection direction, int inputLength, int outputLength) noexcept
+        : m_counters(GetThreadConversionCounters().Get(direction))
+        , m_direction(direction)
+        , m_inputLength(inputLength)
+        , m_initialOutputLength(outputLength)
+        , m_outputLength(-1)
+        , m_isTraced(false)
+    {
+        AddToCounter(m_counters.calls, 1);
+        AddToCounter(m_counters.inputBytes, static_cast<ULONGLONG>(inputLength) * InputUnitSize());
+
+        if (TraceLoggingProviderEnabled(g_hUnicodeConvAtlTraceProvider, WINEVENT_LEVEL_VERBOSE, 0))
+        {
+            m_isTraced = true;
+            ::EventActivityIdControl(EVENT_ACTIVITY_CTRL_CREATE_ID, &m_activityId);
+            TraceLoggingWriteActivity(
+                g_hUnicodeConvAtlTraceProvider,
+                "Conversion",
+                &m_activityId,
+                nullptr,
+                TraceLoggingOpcode(WINEVENT_OPCODE_START),
+                TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+                TraceLoggingString(DirectionName(), "Direction"),
+                TraceLoggingInt32(inputLength, "InputLength")
+            );
+        }
+    }
+
+    ~ConversionScope() noexcept
+    {
+        const bool succeeded = (m_outputLength >= 0);
+        if (succeeded)
+        {
+            AddToCounter(m_counters.outputBytes,
+                static_cast<ULONGLONG>(m_outputLength - m_initialOutputLength) * OutputUnitSize());
+        }
+        else
+        {
+            AddToCounter(m_counters.errors, 1);
+        }
+
+        if (m_isTraced)
+        {
+            TraceLoggingWriteActivity(
+                g_hUnicodeConvAtlTraceProvider,
+                "Conversion",
+                &m_activityId,
+                nullptr,
+                TraceLoggingOpcode(WINEVENT_OPCODE_STOP),
+                TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+                TraceLoggingString(DirectionName(), "Direction"),
+                TraceLoggingInt32(m_inputLength, "InputLength"),
+                TraceLoggingInt32(succeeded ? (m_outputLength - m_initialOutputLength) : 0,
+                                  "OutputLength"),
+                TraceLoggingBool(succeeded, "Succeeded")
+            );
+        }
+    }
+
+    // Ban copy
+    ConversionScope(const ConversionScope&) = delete;
+    ConversionScope& operator=(const ConversionScope&) = delete;
+
+    // Record the successful completion of the conversion, with the final
+    // length of the destination string; otherwise, the conversion is
+    // counted as an error
+    void Succeeded(int outputLength) noexcept
+    {
+        m_outputLength = outputLength;
+    }
+
+private:
+    ConversionCounterBlock&     m_counters;
+    ConversionDirection         m_direction;
+    int                         m_inputLength;
+    int                         m_initialOutputLength;
+    int                         m_outputLength;
+    bool                        m_isTraced;
+    GUID                        m_activityId;
+
+    ULONGLONG InputUnitSize() const noexcept
+    {
+        return (m_direction == ConversionDirection::ToUtf8) ? sizeof(wchar_t) : sizeof(char);
+    }
+
+    ULONGLONG OutputUnitSize() const noexcept
+    {
+        return (m_direction == ConversionDirection::ToUtf8) ? sizeof(char) : sizeof(wchar_t);
+    }
+
+    const char* DirectionName() const noexcept
+    {
+        return (m_direction == ConversionDirection::ToUtf8) ? "ToUtf8" : "ToUtf16";
+    }
+};
+
+
+//------------------------------------------------------------------------------
+// Count a conversion that goes past the ASCII fast path
+//------------------------------------------------------------------------------
+inline void CountFallback(ConversionDirection direction) noexcept
+{
+    AddToCounter(GetThreadConversionCounters().Get(direction).fallbacks, 1);
+}
+
+} // namespace Detail
+
+
+//------------------------------------------------------------------------------
+// Return the statistics of the conversions done by all the threads
+//------------------------------------------------------------------------------
+inline ConversionStatistics GetConversionStatistics() noexcept
+{
+    return Detail::GetConversionCounterRegistry().GetStatistics();
+}
+
+
+//------------------------------------------------------------------------------
+// Return the statistics of the conversions done by the calling thread
+//------------------------------------------------------------------------------
+inline ConversionStatistics GetThreadConversionStatistics() noexcept
+{
+    Detail::ThreadConversionCounters& counters = Detail::GetThreadConversionCounters();
+
+    ConversionStatistics statistics = {};
+    Detail::AccumulateCounters(statistics.toUtf8, counters.toUtf8);
+    Detail::AccumulateCounters(statistics.toUtf16, counters.toUtf16);
+    return statistics;
+}
+
+#else // !UNICODECONVATL_ENABLE_INSTRUMENTATION
+
+namespace Detail {
+
+//------------------------------------------------------------------------------
+// Instrumentation disabled: the hooks do nothing
+//------------------------------------------------------------------------------
+class ConversionScope
+{
+public:
+    ConversionScope(ConversionDirection, int, int) noexcept
+    {
+    }
+
+    void Succeeded(int) noexcept
+    {
+    }
+};
+
+
+inline void CountFallback(ConversionDirection) noexcept
+{
+}
+
+} // namespace Detail
+
+#endif // UNICODECONVATL_ENABLE_INSTRUMENTATION
+
+
+namespace Detail {
+
+//------------------------------------------------------------------------------
+//                      Conversion Cores
+//
+// The public conversion functions are thin wrappers around these
+// functions, that append the converted text to a destination CString,
+// growing its buffer only when it's too small.
+// On error, the destination string is left unchanged.
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+// Append the UTF-8 conversion of the input UTF-16 string to the first
+// keepLength chars of the destination CStringA (the rest of its content
+// is replaced), using WideCharToMultiByte.
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+inline void AppendUtf8Win32(const wchar_t* utf16, int utf16Length, CStringA& utf8,
+                            int keepLength)
+{
+    ATLASSERT(keepLength >= 0 && keepLength <= utf8.GetLength());
+
+    // Special case of empty input string: nothing to append
+    if (utf16Length == 0)
+    {
+        utf8.Truncate(keepLength);
+        return;
+    }
+
+    // Safely fail if an invalid UTF-16 character sequence is encountered
+    constexpr DWORD kFlags = WC_ERR_INVALID_CHARS;
+
+    // ASCII characters are encoded in the same way in UTF-16 and UTF-8,
+    // so the initial ASCII run doesn't need to go through the Win32 API
+    const int asciiLength = AsciiPrefixLength(utf16, utf16Length);
+
+    // Only the part following the ASCII prefix needs a real conversion
+    const wchar_t* const utf16Rest = utf16 + asciiLength;
+    const int utf16RestLength = utf16Length - asciiLength;
+
+    int utf8RestLength = 0;
+    if (utf16RestLength > 0)
+    {
+        CountFallback(ConversionDirection::ToUtf8);
+
+        // Get the length, in chars, of the UTF-8 conversion of that part
+        utf8RestLength = ::WideCharToMultiByte(
+            CP_UTF8,            // convert to UTF-8
+            kFlags,             // conversion flags
+            utf16Rest,          // source UTF-16 string
+            utf16RestLength,    // length of source UTF-16 string, in wchar_ts
+            nullptr,            // unused - no conversion required in this step
+            0,                  // request size of destination buffer, in chars
+            nullptr, nullptr    // unused
+        );
+        if (utf8RestLength == 0)
+        {
+            // Conversion error: capture error code and throw
+            AtlThrowLastWin32();
+        }
+    }
+
+    // The ASCII prefix takes one char per wchar_t in UTF-8
+    if (utf8RestLength > INT_MAX - asciiLength - keepLength)
+    {
+        AtlThrow(HRESULT_FROM_WIN32(ERROR_ARITHMETIC_OVERFLOW));
+    }
+    const int utf8Length = keepLength + asciiLength + utf8RestLength;
+
+    // Make room in the destination string for the converted bits
+    // (the kept content is preserved)
+    const int oldLength = utf8.GetLength();
+    char* utf8Buffer = utf8.GetBuffer(utf8Length);
+    ATLASSERT(utf8Buffer != nullptr);
+
+    // Copy the ASCII prefix as is
+    char* const dest = utf8Buffer + keepLength;
+    NarrowAsciiPrefix(utf16, asciiLength, dest);
+
+    if (utf16RestLength > 0)
+    {
+        // Do the actual conversion from UTF-16 to UTF-8 of the remaining part
+        int result = ::WideCharToMultiByte(
+            CP_UTF8,                // convert to UTF-8
+            kFlags,                 // conversion flags
+            utf16Rest,              // source UTF-16 string
+            utf16RestLength,        // length of source UTF-16 string, in wchar_ts
+            dest + asciiLength,     // pointer to destination buffer
+            utf8RestLength,         // size of destination buffer, in chars
+            nullptr, nullptr        // unused
+        );
+        if (result == 0)
+        {
+            // Conversion error: capture error code, restore the original
+            // length of the destination string, and throw
+            const DWORD error = ::GetLastError();
+            utf8.ReleaseBuffer(oldLength);
+            AtlThrow(HRESULT_FROM_WIN32(error));
+        }
+    }
+
+    // Don't forget to call ReleaseBuffer on the CString object!
+    utf8.ReleaseBuffer(utf8Length);
+}
+
+
+//------------------------------------------------------------------------------
+// Append the UTF-16 conversion of the input UTF-8 string to the first
+// keepLength wchar_ts of the destination CStringW (the rest of its content
+// is replaced), using MultiByteToWideChar.
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+inline void AppendUtf16Win32(const char* utf8, int utf8Length, CStringW& utf16,
+                             int keepLength)
+{
+    ATLASSERT(keepLength >= 0 && keepLength <= utf16.GetLength());
+
+    // Special case of empty input string: nothing to append
+    if (utf8Length == 0)
+    {
+        utf16.Truncate(keepLength);
+        return;
+    }
+
+    // Safely fail if an invalid UTF-8 character sequence is encountered
+    constexpr DWORD kFlags = MB_ERR_INVALID_CHARS;
+
+    // ASCII characters are encoded in the same way in UTF-8 and UTF-16,
+    // so the initial ASCII run doesn't need to go through the Win32 API
+    const int asciiLength = AsciiPrefixLength(utf8, utf8Length);
+
+    // Only the part following the ASCII prefix needs a real conversion
+    const char* const utf8Rest = utf8 + asciiLength;
+    const int utf8RestLength = utf8Length - asciiLength;
+
+    int utf16RestLength = 0;
+    if (utf8RestLength > 0)
+    {
+        CountFallback(ConversionDirection::ToUtf16);
+
+        // Get the size of the UTF-16 conversion of that part
+        utf16RestLength = ::MultiByteToWideChar(
+            CP_UTF8,        // source string is in UTF-8
+            kFlags,         // conversion flags
+            utf8Rest,       // source UTF-8 string pointer
+            utf8RestLength, // length of the source UTF-8 string, in chars
+            nullptr,        // unused - no conversion done in this step
+            0               // request size of destination buffer, in wchar_ts
+        );
+        if (utf16RestLength == 0)
+        {
+            // Conversion error: capture error code and throw
+            AtlThrowLastWin32();
+        }
+    }
+
+    // The ASCII prefix takes one wchar_t per char in UTF-16
+    if (utf16RestLength > INT_MAX - asciiLength - keepLength)
+    {
+        AtlThrow(HRESULT_FROM_WIN32(ERROR_ARITHMETIC_OVERFLOW));
+    }
+    const int utf16Length = keepLength + asciiLength + utf16RestLength;
+
+    // Make room in the destination string for the converted bits
+    // (the kept content is preserved)
+    const int oldLength = utf16.GetLength();
+    wchar_t* utf16Buffer = utf16.GetBuffer(utf16Length);
+    ATLASSERT(utf16Buffer != nullptr);
+
+    // Copy the ASCII prefix as is
+    wchar_t* const dest = utf16Buffer + keepLength;
+    WidenAsciiPrefix(utf8, asciiLength, dest);
+
+    if (utf8RestLength > 0)
+    {
+        // Do the actual conversion from UTF-8 to UTF-16 of the remaining part
+        int result = ::MultiByteToWideChar(
+            CP_UTF8,                // source string is in UTF-8
+            kFlags,                 // conversion flags
+            utf8Rest,               // source UTF-8 string pointer
+            utf8RestLength,         // length of source UTF-8 string, in chars
+            dest + asciiLength,     // pointer to destination buffer
+            utf16RestLength         // size of destination buffer, in wchar_ts
+        );
+        if (result == 0)
+        {
+            // Conversion error: capture error code, restore the original
+            // length of the destination string, and throw
+            const DWORD error = ::GetLastError();
+            utf16.ReleaseBuffer(oldLength);
+            AtlThrow(HRESULT_FROM_WIN32(error));
+        }
+    }
+
+    // Don't forget to call ReleaseBuffer on the CString object!
+    utf16.ReleaseBuffer(utf16Length);
+}
+
+
+//------------------------------------------------------------------------------
+// Append the UTF-8 conversion of the input UTF-16 string to the first
+// keepLength code units of the destination string (the rest of its content
+// is replaced), using the native engine with the given policies
+// (see "Conversion Policies").
+// On error, the destination string is left unchanged.
+//------------------------------------------------------------------------------
+template <class ErrorPolicy, class AllocPolicy, class ValidationPolicy>
+typename ErrorPolicy::ResultType AppendUtf8Basic(const wchar_t* utf16, int utf16Length,
+                                                 typename AllocPolicy::Utf8String& utf8,
+                                                 int keepLength)
+{
+    ATLASSERT(keepLength >= 0 && keepLength <= AllocPolicy::GetLength(utf8));
+
+    // Special case of empty input string: nothing to append
+    if (utf16Length == 0)
+    {
+        AllocPolicy::Truncate(utf8, keepLength);
+        return ErrorPolicy::Success();
+    }
+
+    // Get the length of the UTF-8 conversion (validating the input,
+    // depending on the validation policy)
+    const long long appendLength = ValidationPolicy::Utf8Length(
+        utf16, utf16Length, ErrorPolicy::kInvalidInputPolicy);
+    if (appendLength < 0)
+    {
+        // Same error signaled by WideCharToMultiByte with WC_ERR_INVALID_CHARS
+        return ErrorPolicy::Failure(HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION));
+    }
+
+    if (appendLength > INT_MAX - keepLength)
+    {
+        return ErrorPolicy::Failure(HRESULT_FROM_WIN32(ERROR_ARITHMETIC_OVERFLOW));
+    }
+    const int utf8Length = keepLength + static_cast<int>(appendLength);
+
+    // Make room in the destination string for the converted bits
+    char* utf8Buffer = AllocPolicy::GetBuffer(utf8, utf8Length);
+    if (utf8Buffer == nullptr)
+    {
+        return ErrorPolicy::Failure(E_OUTOFMEMORY);
+    }
+
+    ValidationPolicy::ToUtf8(utf16, utf16Length, utf8Buffer + keepLength,
+                             ErrorPolicy::kInvalidInputPolicy);
+
+    AllocPolicy::ReleaseBuffer(utf8, utf8Length);
+    return ErrorPolicy::Success();
+}
+
+
+//------------------------------------------------------------------------------
+// Append the UTF-16 conversion of the input UTF-8 string to the first
+// keepLength code units of the destination string (the rest of its content
+// is replaced), using the native engine with the given policies
+// (see "Conversion Policies").
+// On error, the destination string is left unchanged.
+//------------------------------------------------------------------------------
+template <class ErrorPolicy, class AllocPolicy, class ValidationPolicy>
+typename ErrorPolicy::ResultType AppendUtf16Basic(const char* utf8, int utf8Length,
+                                                  typename AllocPolicy::Utf16String& utf16,
+                                                  int keepLength)
+{
+    ATLASSERT(keepLength >= 0 && keepLength <= AllocPolicy::GetLength(utf16));
+
+    // Special case of empty input string: nothing to append
+    if (utf8Length == 0)
+    {
+        AllocPolicy::Truncate(utf16, keepLength);
+        return ErrorPolicy::Success();
+    }
+
+    // Get the length of the UTF-16 conversion (validating the input,
+    // depending on the validation policy)
+    const int appendLength = ValidationPolicy::Utf16Length(
+        utf8, utf8Length, ErrorPolicy::kInvalidInputPolicy);
+    if (appendLength < 0)
+    {
+        // Same error signaled by MultiByteToWideChar with MB_ERR_INVALID_CHARS
+        return ErrorPolicy::Failure(HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION));
+    }
+
+    if (appendLength > INT_MAX - keepLength)
+    {
+        return ErrorPolicy::Failure(HRESULT_FROM_WIN32(ERROR_ARITHMETIC_OVERFLOW));
+    }
+    const int utf16Length = keepLength + appendLength;
+
+    // Make room in the destination string for the converted bits
+    wchar_t* utf16Buffer = AllocPolicy::GetBuffer(utf16, utf16Length);
+    if (utf16Buffer == nullptr)
+    {
+        return ErrorPolicy::Failure(E_OUTOFMEMORY);
+    }
+
+    ValidationPolicy::ToUtf16(utf8, utf8Length, utf16Buffer + keepLength,
+                              ErrorPolicy::kInvalidInputPolicy);
+
+    AllocPolicy::ReleaseBuffer(utf16, utf16Length);
+    return ErrorPolicy::Success();
+}
+
+
+//------------------------------------------------------------------------------
+// Append the UTF-8 conversion of the input UTF-16 string to the first
+// keepLength chars of the destination CStringA, using the native engine.
+// Signal errors using AtlThrow, with the same error codes of the Win32 path.
+//------------------------------------------------------------------------------
+inline void AppendUtf8Native(const wchar_t* utf16, int utf16Length, CStringA& utf8,
+                             int keepLength)
+{
+    AppendUtf8Basic<ThrowOnError, CStringAllocPolicy, ValidateInput>(
+        utf16, utf16Length, utf8, keepLength);
+}
+
+
+//------------------------------------------------------------------------------
+// Append the UTF-16 conversion of the input UTF-8 string to the first
+// keepLength wchar_ts of the destination CStringW, using the native engine.
+// Signal errors using AtlThrow, with the same error codes of the Win32 path.
+//------------------------------------------------------------------------------
+inline void AppendUtf16Native(const char* utf8, int utf8Length, CStringW& utf16,
+                              int keepLength)
+{
+    AppendUtf16Basic<ThrowOnError, CStringAllocPolicy, ValidateInput>(
+        utf8, utf8Length, utf16, keepLength);
+}
+
+
+//------------------------------------------------------------------------------
+// Append the UTF-8 conversion of the input UTF-16 string to the first
+// keepLength chars of the destination CStringA (the rest of its content
+// is replaced), using the conversion engine selected at compile time.
+// On error, the destination string is left unchanged.
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+inline void AppendUtf8After(const wchar_t* utf16, int utf16Length, CStringA& utf8,
+                            int keepLength)
+{
+    ATLASSERT(utf16 != nullptr || utf16Length == 0);
+    if (utf16Length < 0)
+    {
+        AtlThrow(E_INVALIDARG);
+    }
+
+    ConversionScope scope(ConversionDirection::ToUtf8, utf16Length, keepLength);
+
+#ifdef UNICODECONVATL_USE_NATIVE_ENGINE
+    AppendUtf8Native(utf16, utf16Length, utf8, keepLength);
+#else
+    AppendUtf8Win32(utf16, utf16Length, utf8, keepLength);
+#endif
+
+    scope.Succeeded(utf8.GetLength());
+}
+
+
+//------------------------------------------------------------------------------
+// Append the UTF-16 conversion of the input UTF-8 string to the first
+// keepLength wchar_ts of the destination CStringW (the rest of its content
+// is replaced), using the conversion engine selected at compile time.
+// On error, the destination string is left unchanged.
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+inline void AppendUtf16After(const char* utf8, int utf8Length, CStringW& utf16,
+                             int keepLength)
+{
+    ATLASSERT(utf8 != nullptr || utf8Length == 0);
+    if (utf8Length < 0)
+    {
+        AtlThrow(E_INVALIDARG);
+    }
+
+    ConversionScope scope(ConversionDirection::ToUtf16, utf8Length, keepLength);
+
+#ifdef UNICODECONVATL_USE_NATIVE_ENGINE
+    AppendUtf16Native(utf8, utf8Length, utf16, keepLength);
+#else
+    AppendUtf16Win32(utf8, utf8Length, utf16, keepLength);
+#endif
+
+    scope.Succeeded(utf16.GetLength());
+}
+
+
+//------------------------------------------------------------------------------
+// Append the UTF-8 conversion of the input UTF-16 string to the destination
+// CStringA, using the native engine, and handling unpaired surrogates
+// according to the given policy (Replace or Skip).
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+inline void AppendUtf8WithPolicy(const wchar_t* utf16, int utf16Length, CStringA& utf8,
+                                 InvalidInputPolicy policy)
+{
+    ATLASSERT(policy != InvalidInputPolicy::Throw);
+
+    if (policy == InvalidInputPolicy::Replace)
+    {
+        AppendUtf8Basic<ReplaceInvalidInput, CStringAllocPolicy, ValidateInput>(
+            utf16, utf16Length, utf8, utf8.GetLength());
+    }
+    else
+    {
+        AppendUtf8Basic<SkipInvalidInput, CStringAllocPolicy, ValidateInput>(
+            utf16, utf16Length, utf8, utf8.GetLength());
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Append the UTF-16 conversion of the input UTF-8 string to the destination
+// CStringW, using the native engine, and handling ill-formed sequences
+// according to the given policy (Replace or Skip).
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+inline void AppendUtf16WithPolicy(const char* utf8, int utf8Length, CStringW& utf16,
+                                  InvalidInputPolicy policy)
+{
+    ATLASSERT(policy != InvalidInputPolicy::Throw);
+
+    if (policy == InvalidInputPolicy::Replace)
+    {
+        AppendUtf16Basic<ReplaceInvalidInput, CStringAllocPolicy, ValidateInput>(
+            utf8, utf8Length, utf16, utf16.GetLength());
+    }
+    else
+    {
+        AppendUtf16Basic<SkipInvalidInput, CStringAllocPolicy, ValidateInput>(
+            utf8, utf8Length, utf16, utf16.GetLength());
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Access the code units of the strings that can be passed to the batch
+// conversion functions
+//------------------------------------------------------------------------------
+inline const wchar_t* StringData(CStringW const& s) noexcept
+{
+    return s.GetString();
+}
+
+inline const char* StringData(CStringA const& s) noexcept
+{
+    return s.GetString();
+}
+
+inline int StringLength(CStringW const& s) noexcept
+{
+    return s.GetLength();
+}
+
+inline int StringLength(CStringA const& s) noexcept
+{
+    return s.GetLength();
+}
+
+#ifdef UNICODECONVATL_HAS_STRING_VIEW
+inline const wchar_t* StringData(std::wstring_view s) noexcept
+{
+    return s.data();
+}
+
+inline const char* StringData(std::string_view s) noexcept
+{
+    return s.data();
+}
+
+inline int StringLength(std::wstring_view s)
+{
+    return ToIntLength(s.length());
+}
+
+inline int StringLength(std::string_view s)
+{
+    return ToIntLength(s.length());
+}
+#endif // UNICODECONVATL_HAS_STRING_VIEW
+
+
+//------------------------------------------------------------------------------
+// Convert an array of UTF-16 strings to UTF-8, storing all the results
+// in the destination CStringA, each one followed by a NUL terminator.
+// offsets receives count + 1 entries: the offset of each converted string
+// in the destination, followed by the total length.
+// Signal errors using AtlThrow; on error, the destination string is left
+// unchanged, while the content of offsets is unspecified.
+//------------------------------------------------------------------------------
+template <typename Utf16String>
+void ToUtf8BatchNative(const Utf16String* utf16Strings, size_t count,
+                       CStringA& utf8, CAtlArray<int>& offsets)
+{
+    ATLASSERT(utf16Strings != nullptr || count == 0);
+
+    if (!offsets.SetCount(count + 1))
+    {
+        AtlThrow(E_OUTOFMEMORY);
+    }
+
+    // First pass: validate all the input strings, and compute the offsets
+    // of their conversions (each one followed by its NUL terminator)
+    long long totalLength = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        offsets[i] = static_cast<int>(totalLength);
+
+        const long long utf8Length = NativeUtf8Length(StringData(utf16Strings[i]),
+                                                      StringLength(utf16Strings[i]));
+        if (utf8Length < 0)
+        {
+            AtlThrow(HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION));
+        }
+
+        totalLength += utf8Length + 1;
+        if (totalLength > INT_MAX)
+        {
+            AtlThrow(HRESULT_FROM_WIN32(ERROR_ARITHMETIC_OVERFLOW));
+        }
+    }
+    offsets[count] = static_cast<int>(totalLength);
+
+    // Second pass: convert all the strings into a single buffer
+    char* utf8Buffer = utf8.GetBuffer(static_cast<int>(totalLength));
+    ATLASSERT(utf8Buffer != nullptr);
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        // The input strings have already been validated
+        char* end = NativeUtf16ToUtf8Unchecked(StringData(utf16Strings[i]),
+                                               StringLength(utf16Strings[i]),
+                                               utf8Buffer + offsets[i]);
+        *end = '\0';
+    }
+
+    utf8.ReleaseBuffer(static_cast<int>(totalLength));
+}
+
+
+//------------------------------------------------------------------------------
+// Convert an array of UTF-8 strings to UTF-16, storing all the results
+// in the destination CStringW, each one followed by a NUL terminator.
+// offsets receives count + 1 entries: the offset of each converted string
+// in the destination, followed by the total length.
+// Signal errors using AtlThrow; on error, the destination string is left
+// unchanged, while the content of offsets is unspecified.
+//------------------------------------------------------------------------------
+template <typename Utf8String>
+void ToUtf16BatchNative(const Utf8String* utf8Strings, size_t count,
+                        CStringW& utf16, CAtlArray<int>& offsets)
+{
+    ATLASSERT(utf8Strings != nullptr || count == 0);
+
+    if (!offsets.SetCount(count + 1))
+    {
+        AtlThrow(E_OUTOFMEMORY);
+    }
+
+    // First pass: validate all the input strings, and compute the offsets
+    // of their conversions (each one followed by its NUL terminator)
+    long long totalLength = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        offsets[i] = static_cast<int>(totalLength);
+
+        const int utf16Length = NativeUtf16Length(StringData(utf8Strings[i]),
+                                                  StringLength(utf8Strings[i]));
+        if (utf16Length < 0)
+        {
+            AtlThrow(HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION));
+        }
+
+        totalLength += utf16Length + 1LL;
+        if (totalLength > INT_MAX)
+        {
+            AtlThrow(HRESULT_FROM_WIN32(ERROR_ARITHMETIC_OVERFLOW));
+        }
+    }
+    offsets[count] = static_cast<int>(totalLength);
+
+    // Second pass: convert all the strings into a single buffer
+    wchar_t* utf16Buffer = utf16.GetBuffer(static_cast<int>(totalLength));
+    ATLASSERT(utf16Buffer != nullptr);
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        // The input strings have already been validated
+        wchar_t* end = NativeUtf8ToUtf16Unchecked(StringData(utf8Strings[i]),
+                                                  StringLength(utf8Strings[i]),
+                                                  utf16Buffer + offsets[i]);
+        *end = L'\0';
+    }
+
+    utf16.ReleaseBuffer(static_cast<int>(totalLength));
+}
+
+} // namespace Detail
+
+
+//==============================================================================
+//                          Function Implementations
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Append the UTF-8 conversion of the input UTF-16 string, specified by
+// pointer and length (in wchar_ts), to the destination CStringA.
+// The input string doesn't need to be NUL-terminated.
+// The buffer of the destination string is reused, and it's grown
+// only if it's too small: keep a scratch string around to get
+// allocation-free conversions in steady state.
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+inline void AppendUtf8(const wchar_t* utf16, int utf16Length, CStringA& utf8)
+{
+    Detail::AppendUtf8After(utf16, utf16Length, utf8, utf8.GetLength());
+}
+
+
+//------------------------------------------------------------------------------
+// Append the UTF-8 conversion of the input UTF-16 CStringW to the destination
+// CStringA, reusing the buffer of the destination string.
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+inline void AppendUtf8(CStringW const& utf16, CStringA& utf8)
+{
+    AppendUtf8(utf16.GetString(), utf16.GetLength(), utf8);
+}
+
+
+//------------------------------------------------------------------------------
+// Append the UTF-16 conversion of the input UTF-8 string, specified by
+// pointer and length (in chars), to the destination CStringW.
+// The input string doesn't need to be NUL-terminated.
+// The buffer of the destination string is reused, and it's grown
+// only if it's too small.
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+inline void AppendUtf16(const char* utf8, int utf8Length, CStringW& utf16)
+{
+    Detail::AppendUtf16After(utf8, utf8Length, utf16, utf16.GetLength());
+}
+
+
+//------------------------------------------------------------------------------
+// Append the UTF-16 conversion of the input UTF-8 CStringA to the destination
+// CStringW, reusing the buffer of the destination string.
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+inline void AppendUtf16(CStringA const& utf8, CStringW& utf16)
+{
+    AppendUtf16(utf8.GetString(), utf8.GetLength(), utf16);
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-16 CStringW to UTF-8 CStringA.
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+inline CStringA ToUtf8(CStringW const& utf16)
+{
+    CStringA utf8;
+    AppendUtf8(utf16, utf8);
+    return utf8;
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-16 to UTF-8 CStringA.
+// The input UTF-16 string is specified by pointer and length (in wchar_ts),
+// so it can be converted without copying it into a CStringW first.
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+inline CStringA ToUtf8(const wchar_t* utf16, int utf16Length)
+{
+    CStringA utf8;
+    AppendUtf8(utf16, utf16Length, utf8);
+    return utf8;
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from a NUL-terminated UTF-16 string to UTF-8 CStringA.
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+inline CStringA ToUtf8(const wchar_t* utf16)
+{
+    if (utf16 == nullptr)
+    {
+        // Consistently with CString, treat a null pointer as an empty string
+        return CStringA();
+    }
+
+    return ToUtf8(utf16, Detail::ToIntLength(wcslen(utf16)));
+}
+
+
+#ifdef UNICODECONVATL_HAS_STRING_VIEW
+//------------------------------------------------------------------------------
+// Convert from UTF-16 std::wstring_view to UTF-8 CStringA.
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+inline CStringA ToUtf8(std::wstring_view utf16)
+{
+    return ToUtf8(utf16.data(), Detail::ToIntLength(utf16.size()));
+}
+#endif // UNICODECONVATL_HAS_STRING_VIEW
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-16 CStringW to UTF-8, storing the result in the
+// destination CStringA. The previous content of the destination string
+// is replaced, but its buffer is reused if it's large enough.
+// On error, the destination string is left unchanged.
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+inline void ToUtf8(CStringW const& utf16, CStringA& utf8)
+{
+    // The previous content is replaced only after the input has been validated
+    Detail::AppendUtf8After(utf16.GetString(), utf16.GetLength(), utf8, 0);
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-16 to UTF-8 CStringA, allocating the memory of the
+// returned string with the given string manager (for example, a per-request
+// CArenaStringMgr defined in UnicodeConvAtlArena.h), instead of the default one.
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+inline CStringA ToUtf8(const wchar_t* utf16, int utf16Length, IAtlStringMgr* stringMgr)
+{
+    ATLASSERT(stringMgr != nullptr);
+
+    CStringA utf8(stringMgr);
+    AppendUtf8(utf16, utf16Length, utf8);
+    return utf8;
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-16 CStringW to UTF-8 CStringA, allocating the memory of the
+// returned string with the given string manager.
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+inline CStringA ToUtf8(CStringW const& utf16, IAtlStringMgr* stringMgr)
+{
+    return ToUtf8(utf16.GetString(), utf16.GetLength(), stringMgr);
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from an UTF-16 CStringW that the caller no longer needs
+// to UTF-8 CStringA, releasing the memory of the input string
+// as soon as it has been converted (the input string is left empty).
+//
+// Note that ATL CStrings of different character types can't share or adopt
+// each other's buffers, so the UTF-8 string is still a separate allocation:
+// the input buffer can't become the output buffer. What this overload saves
+// is keeping both alive: when the input is a large document moved in with
+// std::move, its memory goes back to the heap before ToUtf8 returns, instead
+// of when the caller's variable goes out of scope.
+// The input buffer is released only if it's not shared with other CStrings.
+// Signal errors using AtlThrow; on error, the input string is left unchanged.
+//------------------------------------------------------------------------------
+inline CStringA ToUtf8(CStringW&& utf16)
+{
+    CStringA utf8 = ToUtf8(static_cast<CStringW const&>(utf16));
+
+    // Release the memory of the converted input string
+    utf16.Empty();
+
+    return utf8;
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-8 CStringA to UTF-16 CStringW.
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+inline CStringW ToUtf16(CStringA const& utf8)
+{
+    CStringW utf16;
+    AppendUtf16(utf8, utf16);
+    return utf16;
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-8 to UTF-16 CStringW.
+// The input UTF-8 string is specified by pointer and length (in chars),
+// so it can be converted without copying it into a CStringA first.
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+inline CStringW ToUtf16(const char* utf8, int utf8Length)
+{
+    CStringW utf16;
+    AppendUtf16(utf8, utf8Length, utf16);
+    return utf16;
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from a NUL-terminated UTF-8 string to UTF-16 CStringW.
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+inline CStringW ToUtf16(const char* utf8)
+{
+    if (utf8 == nullptr)
+    {
+        // Consistently with CString, treat a null pointer as an empty string
+        return CStringW();
+    }
+
+    return ToUtf16(utf8, Detail::ToIntLength(strlen(utf8)));
+}
+
+
+#ifdef UNICODECONVATL_HAS_STRING_VIEW
+//------------------------------------------------------------------------------
+// Convert from UTF-8 std::string_view to UTF-16 CStringW.
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+inline CStringW ToUtf16(std::string_view utf8)
+{
+    return ToUtf16(utf8.data(), Detail::ToIntLength(utf8.size()));
+}
+#endif // UNICODECONVATL_HAS_STRING_VIEW
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-8 CStringA to UTF-16, storing the result in the
+// destination CStringW. The previous content of the destination string
+// is replaced, but its buffer is reused if it's large enough.
+// On error, the destination string is left unchanged.
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+inline void ToUtf16(CStringA const& utf8, CStringW& utf16)
+{
+    // The previous content is replaced only after the input has been validated
+    Detail::AppendUtf16After(utf8.GetString(), utf8.GetLength(), utf16, 0);
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-8 to UTF-16 CStringW, allocating the memory of the
+// returned string with the given string manager (for example, a per-request
+// CArenaStringMgr defined in UnicodeConvAtlArena.h), instead of the default one.
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+inline CStringW ToUtf16(const char* utf8, int utf8Length, IAtlStringMgr* stringMgr)
+{
+    ATLASSERT(stringMgr != nullptr);
+
+    CStringW utf16(stringMgr);
+    AppendUtf16(utf8, utf8Length, utf16);
+    return utf16;
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-8 CStringA to UTF-16 CStringW, allocating the memory of the
+// returned string with the given string manager.
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+inline CStringW ToUtf16(CStringA const& utf8, IAtlStringMgr* stringMgr)
+{
+    return ToUtf16(utf8.GetString(), utf8.GetLength(), stringMgr);
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from an UTF-8 CStringA that the caller no longer needs
+// to UTF-16 CStringW, releasing the memory of the input string
+// as soon as it has been converted (the input string is left empty).
+// See the ToUtf8 overload taking a CStringW&& for details.
+// Signal errors using AtlThrow; on error, the input string is left unchanged.
+//------------------------------------------------------------------------------
+inline CStringW ToUtf16(CStringA&& utf8)
+{
+    CStringW utf16 = ToUtf16(static_cast<CStringA const&>(utf8));
+
+    // Release the memory of the converted input string
+    utf8.Empty();
+
+    return utf16;
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-16 CStringW to UTF-8 CStringA, using the native engine
+// instead of WideCharToMultiByte.
+// Signal errors using AtlThrow, with the same error codes of ToUtf8.
+//------------------------------------------------------------------------------
+inline CStringA ToUtf8Native(CStringW const& utf16)
+{
+    CStringA utf8;
+    Detail::AppendUtf8Native(utf16, utf16.GetLength(), utf8, 0);
+    return utf8;
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-8 CStringA to UTF-16 CStringW, using the native engine
+// instead of MultiByteToWideChar.
+// Signal errors using AtlThrow, with the same error codes of ToUtf16.
+//------------------------------------------------------------------------------
+inline CStringW ToUtf16Native(CStringA const& utf8)
+{
+    CStringW utf16;
+    Detail::AppendUtf16Native(utf8, utf8.GetLength(), utf16, 0);
+    return utf16;
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-16 to UTF-8 into a caller-provided buffer,
+// without any heap allocation, and without throwing exceptions.
+//
+// At most utf8Capacity chars are written to the destination buffer
+// (which can live on the stack, or in an arena); no NUL terminator is added.
+// Errors are reported in the returned ConversionResult:
+// when the destination buffer is too small, the conversion stops at
+// a code point boundary, and can be resumed from the 'Consumed' offset.
+//
+// Uses the native engine, with the same validation rules of ToUtf8.
+//------------------------------------------------------------------------------
+inline ConversionResult ConvertUtf16ToUtf8(const wchar_t* utf16, int utf16Length,
+                                           char* utf8, int utf8Capacity) noexcept
+{
+    if (utf16Length < 0 || utf8Capacity < 0
+        || (utf16 == nullptr && utf16Length != 0)
+        || (utf8 == nullptr && utf8Capacity != 0))
+    {
+        return { 0, 0, ConversionStatus::InvalidParameter };
+    }
+
+    return Detail::NativeUtf16ToUtf8(utf16, utf16Length, utf8, utf8Capacity);
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-8 to UTF-16 into a caller-provided buffer,
+// without any heap allocation, and without throwing exceptions.
+//
+// At most utf16Capacity wchar_ts are written to the destination buffer;
+// no NUL terminator is added. A buffer of utf8Length wchar_ts is always
+// large enough.
+// Errors are reported in the returned ConversionResult, as for
+// ConvertUtf16ToUtf8.
+//
+// Uses the native engine, with the same validation rules of ToUtf16.
+//------------------------------------------------------------------------------
+inline ConversionResult ConvertUtf8ToUtf16(const char* utf8, int utf8Length,
+                                           wchar_t* utf16, int utf16Capacity) noexcept
+{
+    if (utf8Length < 0 || utf16Capacity < 0
+        || (utf8 == nullptr && utf8Length != 0)
+        || (utf16 == nullptr && utf16Capacity != 0))
+    {
+        return { 0, 0, ConversionStatus::InvalidParameter };
+    }
+
+    return Detail::NativeUtf8ToUtf16(utf8, utf8Length, utf16, utf16Capacity);
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-16 to UTF-8, storing the result in the destination
+// CStringA, without throwing exceptions on invalid input.
+//
+// Return S_OK on success, or HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION)
+// if the input string contains unpaired surrogates: in this case,
+// if invalidOffset is not null, it receives the offset (in wchar_ts)
+// of the first invalid code unit, so the record can be skipped or repaired.
+// On failure, the destination string is left unchanged.
+//
+// Uses the native engine, with the same validation rules of ToUtf8.
+//------------------------------------------------------------------------------
+inline HRESULT TryToUtf8(const wchar_t* utf16, int utf16Length, CStringA& utf8,
+                         int* invalidOffset = nullptr) noexcept
+{
+    if (invalidOffset != nullptr)
+    {
+        *invalidOffset = -1;
+    }
+
+    if (utf16Length < 0 || (utf16 == nullptr && utf16Length != 0))
+    {
+        return E_INVALIDARG;
+    }
+
+    // The previous content of the destination string is replaced
+    Detail::ConversionScope scope(Detail::ConversionDirection::ToUtf8, utf16Length, 0);
+
+    // Validate the input string, and get the length of the resulting UTF-8 string
+    const long long utf8Length = Detail::NativeUtf8Length(utf16, utf16Length, invalidOffset);
+    if (utf8Length < 0)
+    {
+        return HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION);
+    }
+    if (utf8Length > INT_MAX)
+    {
+        return HRESULT_FROM_WIN32(ERROR_ARITHMETIC_OVERFLOW);
+    }
+
+    try
+    {
+        // CString signals memory allocation failures using AtlThrow
+        char* utf8Buffer = utf8.GetBuffer(static_cast<int>(utf8Length));
+        ATLASSERT(utf8Buffer != nullptr);
+
+        // The input has already been validated
+        Detail::NativeUtf16ToUtf8Unchecked(utf16, utf16Length, utf8Buffer);
+
+        utf8.ReleaseBuffer(static_cast<int>(utf8Length));
+    }
+    catch (const CAtlException& e)
+    {
+        return e;
+    }
+
+    scope.Succeeded(static_cast<int>(utf8Length));
+    return S_OK;
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-16 CStringW to UTF-8, storing the result in the destination
+// CStringA, without throwing exceptions on invalid input.
+// See the pointer+length overload for details.
+//------------------------------------------------------------------------------
+inline HRESULT TryToUtf8(CStringW const& utf16, CStringA& utf8,
+                         int* invalidOffset = nullptr) noexcept
+{
+    return TryToUtf8(utf16.GetString(), utf16.GetLength(), utf8, invalidOffset);
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-8 to UTF-16, storing the result in the destination
+// CStringW, without throwing exceptions on invalid input.
+//
+// Return S_OK on success, or HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION)
+// if the input string contains ill-formed UTF-8 sequences: in this case,
+// if invalidOffset is not null, it receives the offset (in chars)
+// of the first invalid sequence.
+// On failure, the destination string is left unchanged.
+//
+// Uses the native engine, with the same validation rules of ToUtf16.
+//------------------------------------------------------------------------------
+inline HRESULT TryToUtf16(const char* utf8, int utf8Length, CStringW& utf16,
+                          int* invalidOffset = nullptr) noexcept
+{
+    if (invalidOffset != nullptr)
+    {
+        *invalidOffset = -1;
+    }
+
+    if (utf8Length < 0 || (utf8 == nullptr && utf8Length != 0))
+    {
+        return E_INVALIDARG;
+    }
+
+    // The previous content of the destination string is replaced
+    Detail::ConversionScope scope(Detail::ConversionDirection::ToUtf16, utf8Length, 0);
+
+    // Validate the input string, and get the length of the resulting UTF-16 string
+    const int utf16Length = Detail::NativeUtf16Length(utf8, utf8Length, invalidOffset);
+    if (utf16Length < 0)
+    {
+        return HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION);
+    }
+
+    try
+    {
+        // CString signals memory allocation failures using AtlThrow
+        wchar_t* utf16Buffer = utf16.GetBuffer(utf16Length);
+        ATLASSERT(utf16Buffer != nullptr);
+
+        // The input has already been validated
+        Detail::NativeUtf8ToUtf16Unchecked(utf8, utf8Length, utf16Buffer);
+
+        utf16.ReleaseBuffer(utf16Length);
+    }
+    catch (const CAtlException& e)
+    {
+        return e;
+    }
+
+    scope.Succeeded(utf16Length);
+    return S_OK;
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-8 CStringA to UTF-16, storing the result in the destination
+// CStringW, without throwing exceptions on invalid input.
+// See the pointer+length overload for details.
+//------------------------------------------------------------------------------
+inline HRESULT TryToUtf16(CStringA const& utf8, CStringW& utf16,
+                          int* invalidOffset = nullptr) noexcept
+{
+    return TryToUtf16(utf8.GetString(), utf8.GetLength(), utf16, invalidOffset);
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-16 CStringW to UTF-8 CStringA, scanning the input only once.
+//
+// Instead of querying the exact length of the resulting UTF-8 string with
+// a preliminary WideCharToMultiByte call, reserve a buffer large enough
+// for the worst case, and do the conversion with a single API call.
+// Each UTF-16 code unit expands to at most 3 UTF-8 chars (a surrogate pair,
+// i.e. two UTF-16 code units, expands to 4 UTF-8 chars).
+//
+// The price to pay is some wasted memory in the returned string:
+// pass shrinkToFit = true to release the unused part of the buffer.
+//
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+inline CStringA ToUtf8SinglePass(CStringW const& utf16, bool shrinkToFit = false)
+{
+    // Special case of empty input string
+    if (utf16.IsEmpty())
+    {
+        // Empty input --> return empty output string
+        return CStringA();
+    }
+
+    // Worst case: each UTF-16 code unit takes 3 chars in UTF-8
+    constexpr int kMaxUtf8CharsPerUtf16Unit = 3;
+
+    const int utf16Length = utf16.GetLength();
+
+    // The worst-case buffer size would overflow an int:
+    // fall back to the two-pass conversion, which computes the exact size
+    if (utf16Length > INT_MAX / kMaxUtf8CharsPerUtf16Unit)
+    {
+        return ToUtf8(utf16);
+    }
+
+    // Safely fail if an invalid UTF-16 character sequence is encountered
+    constexpr DWORD kFlags = WC_ERR_INVALID_CHARS;
+
+    const int maxUtf8Length = utf16Length * kMaxUtf8CharsPerUtf16Unit;
+
+    // Make room in the destination string for the worst case
+    CStringA utf8;
+    char* utf8Buffer = utf8.GetBuffer(maxUtf8Length);
+    ATLASSERT(utf8Buffer != nullptr);
+
+    // Copy the initial ASCII run as is, while scanning it
+    const int asciiLength = Detail::NarrowAsciiPrefix(utf16, utf16Length, utf8Buffer);
+    int utf8Length = asciiLength;
+
+    if (asciiLength < utf16Length)
+    {
+        // Do the actual conversion from UTF-16 to UTF-8 of the remaining part
+        // in a single call
+        const int utf8RestLength = ::WideCharToMultiByte(
+            CP_UTF8,                        // convert to UTF-8
+            kFlags,                         // conversion flags
+            utf16.GetString() + asciiLength,// source UTF-16 string
+            utf16Length - asciiLength,      // length of source UTF-16 string, in wchar_ts
+            utf8Buffer + asciiLength,       // pointer to destination buffer
+            maxUtf8Length - asciiLength,    // size of destination buffer, in chars
+            nullptr, nullptr                // unused
+        );
+        if (utf8RestLength == 0)
+        {
+            // Conversion error: capture error code and throw
+            AtlThrowLastWin32();
+        }
+
+        utf8Length += utf8RestLength;
+    }
+
+    // Set the actual length of the converted string
+    utf8.ReleaseBuffer(utf8Length);
+
+    if (shrinkToFit)
+    {
+        // Release the unused part of the worst-case buffer
+        utf8.FreeExtra();
+    }
+
+    return utf8;
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-8 CStringA to UTF-16 CStringW, scanning the input only once.
+//
+// A UTF-8 string never needs more UTF-16 code units than the number of
+// its chars (bytes): each UTF-8 sequence of 1, 2 or 3 chars maps to
+// a single UTF-16 code unit, and 4-char sequences map to surrogate pairs.
+// So the length of the input UTF-8 string is always a safe size for the
+// destination buffer, and the conversion can be done with a single
+// MultiByteToWideChar call, skipping the preliminary sizing call.
+//
+// For non-ASCII text the returned string can contain some unused memory:
+// pass shrinkToFit = true to release it.
+//
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+inline CStringW ToUtf16SinglePass(CStringA const& utf8, bool shrinkToFit = false)
+{
+    // Special case of empty input string
+    if (utf8.IsEmpty())
+    {
+        // Empty input --> return empty output string
+        return CStringW();
+    }
+
+    // Safely fail if an invalid UTF-8 character sequence is encountered
+    constexpr DWORD kFlags = MB_ERR_INVALID_CHARS;
+
+    const int utf8Length = utf8.GetLength();
+
+    // The UTF-8 length is an upper bound for the UTF-16 length
+    const int maxUtf16Length = utf8Length;
+
+    // Make room in the destination string for the converted bits
+    CStringW utf16;
+    wchar_t* utf16Buffer = utf16.GetBuffer(maxUtf16Length);
+    ATLASSERT(utf16Buffer != nullptr);
+
+    // Copy the initial ASCII run as is, while scanning it
+    const int asciiLength = Detail::WidenAsciiPrefix(utf8, utf8Length, utf16Buffer);
+    int utf16Length = asciiLength;
+
+    if (asciiLength < utf8Length)
+    {
+        // Do the actual conversion from UTF-8 to UTF-16 of the remaining part
+        // in a single call
+        const int utf16RestLength = ::MultiByteToWideChar(
+            CP_UTF8,                        // source string is in UTF-8
+            kFlags,                         // conversion flags
+            utf8.GetString() + asciiLength, // source UTF-8 string pointer
+            utf8Length - asciiLength,       // length of source UTF-8 string, in chars
+            utf16Buffer + asciiLength,      // pointer to destination buffer
+            maxUtf16Length - asciiLength    // size of destination buffer, in wchar_ts
+        );
+        if (utf16RestLength == 0)
+        {
+            // Conversion error: capture error code and throw
+            AtlThrowLastWin32();
+        }
+
+        utf16Length += utf16RestLength;
+    }
+
+    // Set the actual length of the converted string
+    utf16.ReleaseBuffer(utf16Length);
+
+    if (shrinkToFit)
+    {
+        // Release the unused part of the buffer
+        utf16.FreeExtra();
+    }
+
+    return utf16;
+}
+
+
+//==============================================================================
+//                      Conversions with Invalid Input Policies
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Convert from UTF-16 to UTF-8, handling unpaired surrogates in the input
+// string according to the given policy.
+// With InvalidInputPolicy::Throw this is the same as ToUtf8; Replace and Skip
+// are applied while converting, with the native engine, so invalid input
+// costs neither an exception nor another conversion.
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+inline CStringA ToUtf8(const wchar_t* utf16, int utf16Length, InvalidInputPolicy policy)
+{
+    if (policy == InvalidInputPolicy::Throw)
+    {
+        return ToUtf8(utf16, utf16Length);
+    }
+
+    ATLASSERT(utf16 != nullptr || utf16Length == 0);
+    if (utf16Length < 0)
+    {
+        AtlThrow(E_INVALIDARG);
+    }
+
+    CStringA utf8;
+    Detail::AppendUtf8WithPolicy(utf16, utf16Length, utf8, policy);
+    return utf8;
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-16 CStringW to UTF-8 CStringA, handling unpaired
+// surrogates according to the given policy (see above)
+//------------------------------------------------------------------------------
+inline CStringA ToUtf8(CStringW const& utf16, InvalidInputPolicy policy)
+{
+    return ToUtf8(utf16.GetString(), utf16.GetLength(), policy);
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-8 to UTF-16, handling ill-formed sequences in the input
+// string according to the given policy.
+// With InvalidInputPolicy::Throw this is the same as ToUtf16; Replace and Skip
+// are applied while converting, with the native engine, so invalid input
+// costs neither an exception nor another conversion.
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+inline CStringW ToUtf16(const char* utf8, int utf8Length, InvalidInputPolicy policy)
+{
+    if (policy == InvalidInputPolicy::Throw)
+    {
+        return ToUtf16(utf8, utf8Length);
+    }
+
+    ATLASSERT(utf8 != nullptr || utf8Length == 0);
+    if (utf8Length < 0)
+    {
+        AtlThrow(E_INVALIDARG);
+    }
+
+    CStringW utf16;
+    Detail::AppendUtf16WithPolicy(utf8, utf8Length, utf16, policy);
+    return utf16;
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-8 CStringA to UTF-16 CStringW, handling ill-formed
+// sequences according to the given policy (see above)
+//------------------------------------------------------------------------------
+inline CStringW ToUtf16(CStringA const& utf8, InvalidInputPolicy policy)
+{
+    return ToUtf16(utf8.GetString(), utf8.GetLength(), policy);
+}
+
+
+//==============================================================================
+//                          Policy-Based Conversions
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Convert from UTF-16 to UTF-8, storing the result in the destination string
+// (its previous content is replaced, and it's left empty on error),
+// with error handling, allocation and validation chosen at compile time
+// by the policy template arguments (see "Conversion Policies"). For example:
+//
+//      // Input known to be valid: no validation at all
+//      ConvertToUtf8<ThrowOnError, CStringAllocPolicy, TrustInput>(...);
+//
+//      // No exceptions: check the returned HRESULT
+//      HRESULT hr = ConvertToUtf8<ReturnHResult>(...);
+//
+// The return type is the ResultType of the error policy (void or HRESULT).
+// With the default policies, this does the same as ToUtf8 with the native
+// engine (which, with UNICODECONVATL_USE_NATIVE_ENGINE defined, is built
+// on this very instantiation).
+//------------------------------------------------------------------------------
+template <class ErrorPolicy = ThrowOnError,
+          class AllocPolicy = CStringAllocPolicy,
+          class ValidationPolicy = ValidateInput>
+typename ErrorPolicy::ResultType ConvertToUtf8(const wchar_t* utf16, int utf16Length,
+                                               typename AllocPolicy::Utf8String& utf8)
+{
+    ATLASSERT(utf16 != nullptr || utf16Length == 0);
+    if (utf16Length < 0)
+    {
+        return ErrorPolicy::Failure(E_INVALIDARG);
+    }
+
+    AllocPolicy::Truncate(utf8, 0);
+    return Detail::AppendUtf8Basic<ErrorPolicy, AllocPolicy, ValidationPolicy>(
+        utf16, utf16Length, utf8, AllocPolicy::GetLength(utf8));
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-8 to UTF-16, storing the result in the destination string
+// (its previous content is replaced, and it's left empty on error),
+// with error handling, allocation and validation chosen at compile time
+// by the policy template arguments (see ConvertToUtf8).
+//------------------------------------------------------------------------------
+template <class ErrorPolicy = ThrowOnError,
+          class AllocPolicy = CStringAllocPolicy,
+          class ValidationPolicy = ValidateInput>
+typename ErrorPolicy::ResultType ConvertToUtf16(const char* utf8, int utf8Length,
+                                                typename AllocPolicy::Utf16String& utf16)
+{
+    ATLASSERT(utf8 != nullptr || utf8Length == 0);
+    if (utf8Length < 0)
+    {
+        return ErrorPolicy::Failure(E_INVALIDARG);
+    }
+
+    AllocPolicy::Truncate(utf16, 0);
+    return Detail::AppendUtf16Basic<ErrorPolicy, AllocPolicy, ValidationPolicy>(
+        utf8, utf8Length, utf16, AllocPolicy::GetLength(utf16));
+}
+
+
+//==============================================================================
+//                      Validation and Length Queries
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Check whether the input string is valid UTF-8, without converting it,
+// and without any heap allocation.
+// If the string is invalid and invalidOffset is not null, it receives
+// the offset of the first ill-formed sequence.
+//
+// The validation rules are the same of ToUtf16; ASCII runs are skipped
+// with SIMD instructions where available.
+//------------------------------------------------------------------------------
+inline bool IsValidUtf8(const char* utf8, int utf8Length, int* invalidOffset = nullptr) noexcept
+{
+    ATLASSERT(utf8 != nullptr || utf8Length == 0);
+    if (utf8Length < 0)
+    {
+        return false;
+    }
+
+    return Detail::NativeUtf16Length(utf8, utf8Length, invalidOffset) >= 0;
+}
+
+
+//------------------------------------------------------------------------------
+// Check whether the input CStringA is valid UTF-8 (see above)
+//------------------------------------------------------------------------------
+inline bool IsValidUtf8(CStringA const& utf8, int* invalidOffset = nullptr) noexcept
+{
+    return IsValidUtf8(utf8.GetString(), utf8.GetLength(), invalidOffset);
+}
+
+
+//------------------------------------------------------------------------------
+// Check whether the input string is valid UTF-16 (i.e. it contains no unpaired
+// surrogates), without converting it, and without any heap allocation.
+// If the string is invalid and invalidOffset is not null, it receives
+// the offset of the first unpaired surrogate.
+//
+// The validation rules are the same of ToUtf8; ASCII runs are skipped
+// with SIMD instructions where available.
+//------------------------------------------------------------------------------
+inline bool IsValidUtf16(const wchar_t* utf16, int utf16Length, int* invalidOffset = nullptr) noexcept
+{
+    ATLASSERT(utf16 != nullptr || utf16Length == 0);
+    if (utf16Length < 0)
+    {
+        return false;
+    }
+
+    return Detail::NativeUtf8Length(utf16, utf16Length, invalidOffset) >= 0;
+}
+
+
+//------------------------------------------------------------------------------
+// Check whether the input CStringW is valid UTF-16 (see above)
+//------------------------------------------------------------------------------
+inline bool IsValidUtf16(CStringW const& utf16, int* invalidOffset = nullptr) noexcept
+{
+    return IsValidUtf16(utf16.GetString(), utf16.GetLength(), invalidOffset);
+}
+
+
+//------------------------------------------------------------------------------
+// Return the length, in chars, of the UTF-8 conversion of the input
+// UTF-16 string, without converting it, and without any heap allocation.
+// This is the same length of the CStringA returned by ToUtf8.
+// Signal errors (like invalid UTF-16 input) using AtlThrow.
+//------------------------------------------------------------------------------
+inline int Utf8LengthOf(const wchar_t* utf16, int utf16Length)
+{
+    ATLASSERT(utf16 != nullptr || utf16Length == 0);
+    if (utf16Length < 0)
+    {
+        AtlThrow(E_INVALIDARG);
+    }
+
+    const long long utf8Length = Detail::NativeUtf8Length(utf16, utf16Length);
+    if (utf8Length < 0)
+    {
+        AtlThrow(HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION));
+    }
+    if (utf8Length > INT_MAX)
+    {
+        AtlThrow(HRESULT_FROM_WIN32(ERROR_ARITHMETIC_OVERFLOW));
+    }
+
+    return static_cast<int>(utf8Length);
+}
+
+
+//------------------------------------------------------------------------------
+// Return the length, in chars, of the UTF-8 conversion of the input
+// CStringW (see above)
+//------------------------------------------------------------------------------
+inline int Utf8LengthOf(CStringW const& utf16)
+{
+    return Utf8LengthOf(utf16.GetString(), utf16.GetLength());
+}
+
+
+//------------------------------------------------------------------------------
+// Return the length, in wchar_ts, of the UTF-16 conversion of the input
+// UTF-8 string, without converting it, and without any heap allocation.
+// This is the same length of the CStringW returned by ToUtf16.
+// Signal errors (like invalid UTF-8 input) using AtlThrow.
+//------------------------------------------------------------------------------
+inline int Utf16LengthOf(const char* utf8, int utf8Length)
+{
+    ATLASSERT(utf8 != nullptr || utf8Length == 0);
+    if (utf8Length < 0)
+    {
+        AtlThrow(E_INVALIDARG);
+    }
+
+    const int utf16Length = Detail::NativeUtf16Length(utf8, utf8Length);
+    if (utf16Length < 0)
+    {
+        AtlThrow(HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION));
+    }
+
+    return utf16Length;
+}
+
+
+//------------------------------------------------------------------------------
+// Return the length, in wchar_ts, of the UTF-16 conversion of the input
+// CStringA (see above)
+//------------------------------------------------------------------------------
+inline int Utf16LengthOf(CStringA const& utf8)
+{
+    return Utf16LengthOf(utf8.GetString(), utf8.GetLength());
+}
+
+
+//==============================================================================
+//                          Batch Conversions
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Convert an array of UTF-16 strings to UTF-8, with a single allocation
+// for the whole batch.
+//
+// All the converted strings are stored one after the other in the destination
+// CStringA, each one followed by a NUL terminator; its previous content
+// is replaced. offsets receives count + 1 entries: offsets[i] is the offset
+// of the i-th converted string, so:
+//
+//      const char* s = utf8.GetString() + offsets[i];  // NUL-terminated
+//      int length = offsets[i + 1] - offsets[i] - 1;
+//
+// The total length of the batch is computed in a single scan of the input
+// strings, before converting them; uses the native engine, with the same
+// validation rules of ToUtf8.
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+inline void ToUtf8Batch(const CStringW* utf16Strings, size_t count,
+                        CStringA& utf8, CAtlArray<int>& offsets)
+{
+    Detail::ToUtf8BatchNative(utf16Strings, count, utf8, offsets);
+}
+
+
+//------------------------------------------------------------------------------
+// Convert an array of UTF-16 strings to UTF-8, with a single allocation
+// for the whole batch (see above)
+//------------------------------------------------------------------------------
+inline void ToUtf8Batch(CAtlArray<CStringW> const& utf16Strings,
+                        CStringA& utf8, CAtlArray<int>& offsets)
+{
+    Detail::ToUtf8BatchNative(utf16Strings.GetData(), utf16Strings.GetCount(), utf8, offsets);
+}
+
+
+#ifdef UNICODECONVATL_HAS_STRING_VIEW
+//------------------------------------------------------------------------------
+// Convert an array of UTF-16 string views to UTF-8, with a single allocation
+// for the whole batch (see above)
+//------------------------------------------------------------------------------
+inline void ToUtf8Batch(const std::wstring_view* utf16Strings, size_t count,
+                        CStringA& utf8, CAtlArray<int>& offsets)
+{
+    Detail::ToUtf8BatchNative(utf16Strings, count, utf8, offsets);
+}
+#endif // UNICODECONVATL_HAS_STRING_VIEW
+
+
+//------------------------------------------------------------------------------
+// Convert an array of UTF-8 strings to UTF-16, with a single allocation
+// for the whole batch.
+//
+// All the converted strings are stored one after the other in the destination
+// CStringW, each one followed by a NUL terminator, and offsets receives
+// count + 1 entries, as for ToUtf8Batch.
+//
+// Uses the native engine, with the same validation rules of ToUtf16.
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+inline void ToUtf16Batch(const CStringA* utf8Strings, size_t count,
+                         CStringW& utf16, CAtlArray<int>& offsets)
+{
+    Detail::ToUtf16BatchNative(utf8Strings, count, utf16, offsets);
+}
+
+
+//------------------------------------------------------------------------------
+// Convert an array of UTF-8 strings to UTF-16, with a single allocation
+// for the whole batch (see above)
+//------------------------------------------------------------------------------
+inline void ToUtf16Batch(CAtlArray<CStringA> const& utf8Strings,
+                         CStringW& utf16, CAtlArray<int>& offsets)
+{
+    Detail::ToUtf16BatchNative(utf8Strings.GetData(), utf8Strings.GetCount(), utf16, offsets);
+}
+
+
+#ifdef UNICODECONVATL_HAS_STRING_VIEW
+//------------------------------------------------------------------------------
+// Convert an array of UTF-8 string views to UTF-16, with a single allocation
+// for the whole batch (see above)
+//------------------------------------------------------------------------------
+inline void ToUtf16Batch(const std::string_view* utf8Strings, size_t count,
+                         CStringW& utf16, CAtlArray<int>& offsets)
+{
+    Detail::ToUtf16BatchNative(utf8Strings, count, utf16, offsets);
+}
+#endif // UNICODECONVATL_HAS_STRING_VIEW
+
+
+//==============================================================================
+//                          Stack Buffer Conversions
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Convert from UTF-16 to UTF-8 into an inline buffer of t_nBufferLength chars
+// (including the NUL terminator), falling back to the heap only for
+// longer strings. Like ATL's CW2AEX, it's meant to pass a converted string
+// straight to an API, without keeping it:
+//
+//      sqlite3_open(CW2Utf8(path), &db);
+//
+// Unlike CW2AEX, the input is strictly validated, with the same rules
+// of ToUtf8; errors are signaled using AtlThrow.
+// A null input pointer produces a null output pointer, as with CW2AEX.
+//------------------------------------------------------------------------------
+template <int t_nBufferLength = 128>
+class CW2Utf8EX
+{
+    static_assert(t_nBufferLength > 0, "The inline buffer must have room for the NUL terminator");
+
+public:
+    // Convert a NUL-terminated UTF-16 string
+    explicit CW2Utf8EX(const wchar_t* utf16)
+        : m_psz(m_szBuffer)
+    {
+        if (utf16 == nullptr)
+        {
+            m_psz = nullptr;
+            return;
+        }
+        Init(utf16, Detail::ToIntLength(wcslen(utf16)));
+    }
+
+    // Convert a UTF-16 string of the given length
+    CW2Utf8EX(const wchar_t* utf16, int utf16Length)
+        : m_psz(m_szBuffer)
+    {
+        Init(utf16, utf16Length);
+    }
+
+    explicit CW2Utf8EX(CStringW const& utf16)
+        : m_psz(m_szBuffer)
+    {
+        Init(utf16.GetString(), utf16.GetLength());
+    }
+
+    ~CW2Utf8EX()
+    {
+        if (m_psz != m_szBuffer)
+        {
+            ::free(m_psz);
+        }
+    }
+
+    // The converted NUL-terminated UTF-8 string
+    operator const char*() const noexcept
+    {
+        return m_psz;
+    }
+
+    const char* GetString() const noexcept
+    {
+        return m_psz;
+    }
+
+    // Length of the converted string, in chars (excluding the NUL terminator)
+    int GetLength() const noexcept
+    {
+        return m_length;
+    }
+
+    // Ban copy
+    CW2Utf8EX(const CW2Utf8EX&) = delete;
+    CW2Utf8EX& operator=(const CW2Utf8EX&) = delete;
+
+private:
+    char* m_psz;
+    int m_length = 0;
+    char m_szBuffer[t_nBufferLength];
+
+    void Init(const wchar_t* utf16, int utf16Length)
+    {
+        // Try converting into the inline buffer first
+        const ConversionResult result = ConvertUtf16ToUtf8(
+            utf16, utf16Length, m_szBuffer, t_nBufferLength - 1);
+
+        if (result.Status == ConversionStatus::InvalidParameter)
+        {
+            AtlThrow(E_INVALIDARG);
+        }
+        if (result.Status == ConversionStatus::InvalidInput)
+        {
+            AtlThrow(HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION));
+        }
+
+        if (result.Status == ConversionStatus::InsufficientBuffer)
+        {
+            // The string doesn't fit in the inline buffer: measure the rest
+            // of the input, and move to a heap buffer, keeping the part
+            // already converted
+            const wchar_t* const rest = utf16 + result.Consumed;
+            const int restLength = utf16Length - result.Consumed;
+
+            const long long restUtf8Length = Detail::NativeUtf8Length(rest, restLength);
+            if (restUtf8Length < 0)
+            {
+                AtlThrow(HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION));
+            }
+            if (restUtf8Length > INT_MAX - 1 - result.Written)
+            {
+                AtlThrow(HRESULT_FROM_WIN32(ERROR_ARITHMETIC_OVERFLOW));
+            }
+            const int utf8Length = result.Written + static_cast<int>(restUtf8Length);
+
+            char* const heapBuffer = static_cast<char*>(::malloc(utf8Length + 1));
+            if (heapBuffer == nullptr)
+            {
+                AtlThrow(E_OUTOFMEMORY);
+            }
+            ::memcpy(heapBuffer, m_szBuffer, result.Written);
+
+            // The rest of the input has already been validated
+            Detail::NativeUtf16ToUtf8Unchecked(rest, restLength, heapBuffer + result.Written);
+
+            m_psz = heapBuffer;
+            m_length = utf8Length;
+        }
+        else
+        {
+            m_length = result.Written;
+        }
+
+        m_psz[m_length] = '\0';
+    }
+};
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-8 to UTF-16 into an inline buffer of t_nBufferLength
+// wchar_ts (including the NUL terminator), falling back to the heap only
+// for longer strings. Like ATL's CA2WEX, it's meant to pass a converted
+// string straight to an API, without keeping it:
+//
+//      ::SetWindowTextW(hWnd, CUtf82W(utf8Text));
+//
+// Unlike CA2WEX, the input is strictly validated, with the same rules
+// of ToUtf16; errors are signaled using AtlThrow.
+// A null input pointer produces a null output pointer, as with CA2WEX.
+//------------------------------------------------------------------------------
+template <int t_nBufferLength = 128>
+class CUtf82WEX
+{
+    static_assert(t_nBufferLength > 0, "The inline buffer must have room for the NUL terminator");
+
+public:
+    // Convert a NUL-terminated UTF-8 string
+    explicit CUtf82WEX(const char* utf8)
+        : m_psz(m_szBuffer)
+    {
+        if (utf8 == nullptr)
+        {
+            m_psz = nullptr;
+            return;
+        }
+        Init(utf8, Detail::ToIntLength(strlen(utf8)));
+    }
+
+    // Convert a UTF-8 string of the given length
+    CUtf82WEX(const char* utf8, int utf8Length)
+        : m_psz(m_szBuffer)
+    {
+        Init(utf8, utf8Length);
+    }
+
+    explicit CUtf82WEX(CStringA const& utf8)
+        : m_psz(m_szBuffer)
+    {
+        Init(utf8.GetString(), utf8.GetLength());
+    }
+
+    ~CUtf82WEX()
+    {
+        if (m_psz != m_szBuffer)
+        {
+            ::free(m_psz);
+        }
+    }
+
+    // The converted NUL-terminated UTF-16 string
+    operator const wchar_t*() const noexcept
+    {
+        return m_psz;
+    }
+
+    const wchar_t* GetString() const noexcept
+    {
+        return m_psz;
+    }
+
+    // Length of the converted string, in wchar_ts (excluding the NUL terminator)
+    int GetLength() const noexcept
+    {
+        return m_length;
+    }
+
+    // Ban copy
+    CUtf82WEX(const CUtf82WEX&) = delete;
+    CUtf82WEX& operator=(const CUtf82WEX&) = delete;
+
+private:
+    wchar_t* m_psz;
+    int m_length = 0;
+    wchar_t m_szBuffer[t_nBufferLength];
+
+    void Init(const char* utf8, int utf8Length)
+    {
+        // Try converting into the inline buffer first
+        const ConversionResult result = ConvertUtf8ToUtf16(
+            utf8, utf8Length, m_szBuffer, t_nBufferLength - 1);
+
+        if (result.Status == ConversionStatus::InvalidParameter)
+        {
+            AtlThrow(E_INVALIDARG);
+        }
+        if (result.Status == ConversionStatus::InvalidInput)
+        {
+            AtlThrow(HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION));
+        }
+
+        if (result.Status == ConversionStatus::InsufficientBuffer)
+        {
+            // The string doesn't fit in the inline buffer: measure the rest
+            // of the input, and move to a heap buffer, keeping the part
+            // already converted
+            const char* const rest = utf8 + result.Consumed;
+            const int restLength = utf8Length - result.Consumed;
+
+            const int restUtf16Length = Detail::NativeUtf16Length(rest, restLength);
+            if (restUtf16Length < 0)
+            {
+                AtlThrow(HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION));
+            }
+            if (restUtf16Length > INT_MAX - 1 - result.Written)
+            {
+                AtlThrow(HRESULT_FROM_WIN32(ERROR_ARITHMETIC_OVERFLOW));
+            }
+            const int utf16Length = result.Written + restUtf16Length;
+
+            wchar_t* const heapBuffer = static_cast<wchar_t*>(
+                ::malloc((static_cast<size_t>(utf16Length) + 1) * sizeof(wchar_t)));
+            if (heapBuffer == nullptr)
+            {
+                AtlThrow(E_OUTOFMEMORY);
+            }
+            ::memcpy(heapBuffer, m_szBuffer, result.Written * sizeof(wchar_t));
+
+            // The rest of the input has already been validated
+            Detail::NativeUtf8ToUtf16Unchecked(rest, restLength, heapBuffer + result.Written);
+
+            m_psz = heapBuffer;
+            m_length = utf16Length;
+        }
+        else
+        {
+            m_length = result.Written;
+        }
+
+        m_psz[m_length] = L'\0';
+    }
+};
+
+
+//------------------------------------------------------------------------------
+// Stack buffer conversions with the default inline buffer size
+//------------------------------------------------------------------------------
+typedef CW2Utf8EX<> CW2Utf8;
+typedef CUtf82WEX<> CUtf82W;
+
+
+//==============================================================================
+//                          Streaming Conversions
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Stateful UTF-8 to UTF-16 converter, for input that arrives in chunks
+// (for example, read from a file or a socket).
+//
+// A UTF-8 sequence split across two chunks is carried over from one
+// Convert call to the next one, so each chunk can be cut at any byte.
+// Each call converts only the chunk it receives, so memory usage
+// is bounded by the chunk size.
+//
+// The validation rules are the same of ToUtf16; errors are signaled
+// using AtlThrow. After an error, call Reset before reusing the object.
+//------------------------------------------------------------------------------
+class Utf8ToUtf16Stream
+{
+public:
+    Utf8ToUtf16Stream() noexcept = default;
+
+    // Convert the next chunk of UTF-8 input, appending the result
+    // to the destination CStringW
+    void Convert(const char* utf8, int utf8Length, CStringW& utf16)
+    {
+        ATLASSERT(utf8 != nullptr || utf8Length == 0);
+        if (utf8Length < 0)
+        {
+            AtlThrow(E_INVALIDARG);
+        }
+
+        if (m_pendingLength > 0)
+        {
+            const int consumed = CompletePendingSequence(utf8, utf8Length, utf16);
+            utf8 += consumed;
+            utf8Length -= consumed;
+        }
+
+        // Keep a truncated sequence at the end of the chunk for the next call
+        const int tailLength = Detail::IncompleteUtf8TailLength(utf8, utf8Length);
+        AppendUtf16(utf8, utf8Length - tailLength, utf16);
+
+        memcpy(m_pending, utf8 + utf8Length - tailLength, tailLength);
+        m_pendingLength += tailLength;
+    }
+
+    void Convert(CStringA const& utf8, CStringW& utf16)
+    {
+        Convert(utf8.GetString(), utf8.GetLength(), utf16);
+    }
+
+    // Signal the end of the input.
+    // A sequence still pending at this point is truncated, so it's invalid.
+    void Finish()
+    {
+        if (m_pendingLength > 0)
+        {
+            Reset();
+            AtlThrow(HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION));
+        }
+    }
+
+    // Discard any pending input, to start converting a new stream
+    void Reset() noexcept
+    {
+        m_pendingLength = 0;
+    }
+
+    // Is there an incomplete sequence waiting for the next chunk?
+    bool HasPendingInput() const noexcept
+    {
+        return m_pendingLength > 0;
+    }
+
+private:
+    // Incomplete UTF-8 sequence carried over from the previous chunk
+    char m_pending[4] = {};
+    int m_pendingLength = 0;
+
+    // Try completing the pending sequence with the first chars of the
+    // input chunk. Return the number of chars consumed from the chunk.
+    int CompletePendingSequence(const char* utf8, int utf8Length, CStringW& utf16)
+    {
+        ATLASSERT(m_pendingLength > 0 && m_pendingLength < 4);
+
+        // Pending chars, followed by enough chunk chars to complete them
+        char sequence[4];
+        memcpy(sequence, m_pending, m_pendingLength);
+        int available = 4 - m_pendingLength;
+        if (available > utf8Length)
+        {
+            available = utf8Length;
+        }
+        memcpy(sequence + m_pendingLength, utf8, available);
+        const int sequenceAvailable = m_pendingLength + available;
+
+        const unsigned char* const bytes = reinterpret_cast<const unsigned char*>(sequence);
+        const int sequenceLength = Detail::ValidUtf8SequenceLength(bytes, sequenceAvailable);
+        if (sequenceLength == 0)
+        {
+            if (Detail::IsIncompleteUtf8Sequence(bytes, sequenceAvailable))
+            {
+                // Still truncated: the whole chunk goes into the pending sequence
+                memcpy(m_pending, sequence, sequenceAvailable);
+                m_pendingLength = sequenceAvailable;
+                return utf8Length;
+            }
+
+            // Ill-formed sequence: signal it like ToUtf16 does
+            AtlThrow(HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION));
+        }
+
+        AppendUtf16(sequence, sequenceLength, utf16);
+
+        const int consumed = sequenceLength - m_pendingLength;
+        m_pendingLength = 0;
+        return consumed;
+    }
+};
+
+
+//------------------------------------------------------------------------------
+// Stateful UTF-16 to UTF-8 converter, for input that arrives in chunks.
+//
+// A surrogate pair split across two chunks is carried over from one
+// Convert call to the next one, so each chunk can be cut at any wchar_t.
+//
+// The validation rules are the same of ToUtf8; errors are signaled
+// using AtlThrow. After an error, call Reset before reusing the object.
+//------------------------------------------------------------------------------
+class Utf16ToUtf8Stream
+{
+public:
+    Utf16ToUtf8Stream() noexcept = default;
+
+    // Convert the next chunk of UTF-16 input, appending the result
+    // to the destination CStringA
+    void Convert(const wchar_t* utf16, int utf16Length, CStringA& utf8)
+    {
+        ATLASSERT(utf16 != nullptr || utf16Length == 0);
+        if (utf16Length < 0)
+        {
+            AtlThrow(E_INVALIDARG);
+        }
+
+        if (utf16Length == 0)
+        {
+            return;
+        }
+
+        if (m_hasPendingHighSurrogate)
+        {
+            // Convert the pending high surrogate together with the first
+            // code unit of the chunk: if that is not a low surrogate,
+            // the conversion fails like ToUtf8 does for unpaired surrogates
+            const wchar_t pair[2] = { m_pendingHighSurrogate, utf16[0] };
+            AppendUtf8(pair, 2, utf8);
+            m_hasPendingHighSurrogate = false;
+            ++utf16;
+            --utf16Length;
+        }
+
+        // Keep a high surrogate at the end of the chunk for the next call
+        if (utf16Length > 0
+            && Detail::IsHighSurrogate(static_cast<unsigned int>(utf16[utf16Length - 1])))
+        {
+            AppendUtf8(utf16, utf16Length - 1, utf8);
+            m_pendingHighSurrogate = utf16[utf16Length - 1];
+            m_hasPendingHighSurrogate = true;
+        }
+        else
+        {
+            AppendUtf8(utf16, utf16Length, utf8);
+        }
+    }
+
+    void Convert(CStringW const& utf16, CStringA& utf8)
+    {
+        Convert(utf16.GetString(), utf16.GetLength(), utf8);
+    }
+
+    // Signal the end of the input.
+    // A high surrogate still pending at this point is unpaired, so it's invalid.
+    void Finish()
+    {
+        if (m_hasPendingHighSurrogate)
+        {
+            Reset();
+            AtlThrow(HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION));
+        }
+    }
+
+    // Discard any pending input, to start converting a new stream
+    void Reset() noexcept
+    {
+        m_hasPendingHighSurrogate = false;
+    }
+
+    // Is there a high surrogate waiting for the next chunk?
+    bool HasPendingInput() const noexcept
+    {
+        return m_hasPendingHighSurrogate;
+    }
+
+private:
+    // High surrogate carried over from the previous chunk
+    wchar_t m_pendingHighSurrogate = 0;
+    bool m_hasPendingHighSurrogate = false;
+};
+
+} // namespace UnicodeConvAtl
@@ -0,0 +1,374 @@
+#pragma once
+
+////////////////////////////////////////////////////////////////////////////////
+// Arena (bump) memory manager for the CStrings returned by UnicodeConvAtl
+//
+//                  Copyright (C) by Giovanni Dicanio
+//                    <giovanni.dicanio AT gmail.com>
+//
+////////////////////////////////////////////////////////////////////////////////
+
+
+//------------------------------------------------------------------------------
+// This header extends UnicodeConvAtl.h with an arena memory manager,
+// that can be plugged into ATL CStrings through their string manager:
+//
+//      * Arena memory manager (IAtlMemMgr implementation):
+//        class CArenaMemMgr
+//
+//      * ATL string manager that allocates from its own arena:
+//        class CArenaStringMgr
+//
+// Pass a CArenaStringMgr to the ToUtf8/ToUtf16 overloads taking an
+// IAtlStringMgr*, and the converted strings are carved out of large blocks
+// owned by the arena, instead of being allocated one by one from the process
+// heap. All the strings of the arena are released at once by Reset
+// (or by the arena destructor), at a cost that depends on the number
+// of blocks, not on the number of strings:
+//
+//      CArenaStringMgr requestStrings;
+//
+//      CStringA name = ToUtf8(nameUtf16, &requestStrings);
+//      CStringA path = ToUtf8(pathUtf16, &requestStrings);
+//      ...
+//
+// Notes:
+//
+//      * The arena is not thread-safe: use one arena per thread (or per request
+//        processed by a single thread). Since the arenas don't share any state,
+//        the threads don't contend on the process heap lock.
+//
+//      * The strings bound to an arena must be destroyed (or emptied) before
+//        calling Reset, or before the arena itself is destroyed, as CString
+//        updates its reference count in the arena memory when it's released.
+//
+//      * Memory released by a string is reclaimed only if it's the most recent
+//        allocation of the arena; otherwise, it's reclaimed by Reset.
+//
+// These classes live under the UnicodeConvAtl namespace.
+//
+// This code is released under the MIT License (see UnicodeConvAtl.h).
+//------------------------------------------------------------------------------
+
+
+//==============================================================================
+//                              Includes
+//==============================================================================
+
+#include "UnicodeConvAtl.h"     // Unicode UTF-16/UTF-8 conversions
+
+
+//==============================================================================
+//                          Implementation Details
+//==============================================================================
+
+namespace UnicodeConvAtl {
+namespace Detail {
+
+//------------------------------------------------------------------------------
+// Default size of the memory blocks allocated by the arena, in bytes
+//------------------------------------------------------------------------------
+constexpr size_t kDefaultArenaBlockSize = 64 * 1024;
+
+
+//------------------------------------------------------------------------------
+// Minimum size of the memory blocks allocated by the arena, in bytes
+//------------------------------------------------------------------------------
+constexpr size_t kMinArenaBlockSize = 1024;
+
+
+//------------------------------------------------------------------------------
+// Alignment of the memory returned by the arena, matching the alignment
+// guaranteed by the Windows heap
+//------------------------------------------------------------------------------
+constexpr size_t kArenaAlignment = MEMORY_ALLOCATION_ALIGNMENT;
+
+
+//------------------------------------------------------------------------------
+// Round the input size up to a multiple of the arena alignment.
+// The caller must make sure that the result doesn't overflow.
+//------------------------------------------------------------------------------
+constexpr size_t AlignArenaSize(size_t size) noexcept
+{
+    return (size + kArenaAlignment - 1) & ~(kArenaAlignment - 1);
+}
+
+} // namespace Detail
+
+
+//==============================================================================
+//                          Arena Memory Manager
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Memory manager that carves the requested allocations out of large blocks,
+// bumping a pointer, and releases all of them at once in Reset.
+// Each allocation is preceded by a small header that stores its size.
+//------------------------------------------------------------------------------
+class CArenaMemMgr : public IAtlMemMgr
+{
+public:
+
+    explicit CArenaMemMgr(size_t blockSize = Detail::kDefaultArenaBlockSize) noexcept
+        : m_pBlocks(nullptr)
+        , m_pLastAllocation(nullptr)
+        , m_blockSize(blockSize < Detail::kMinArenaBlockSize
+                        ? Detail::kMinArenaBlockSize : Detail::AlignArenaSize(blockSize))
+    {
+    }
+
+    ~CArenaMemMgr() noexcept
+    {
+        ReleaseBlocks(nullptr);
+    }
+
+    // Ban copy
+    CArenaMemMgr(const CArenaMemMgr&) = delete;
+    CArenaMemMgr& operator=(const CArenaMemMgr&) = delete;
+
+
+    //--------------------------------------------------------------------------
+    // Allocate the requested number of bytes from the current block,
+    // or from a new block if the current one is full.
+    // Return nullptr on failure.
+    //--------------------------------------------------------------------------
+    void* Allocate(size_t nBytes) noexcept override
+    {
+        // CStrings never need more than INT_MAX bytes: this check also
+        // guards against overflow in the size computations below
+        if (nBytes > static_cast<size_t>(INT_MAX))
+        {
+            return nullptr;
+        }
+
+        const size_t allocationSize = kHeaderSize + Detail::AlignArenaSize(nBytes);
+
+        if ((m_pBlocks == nullptr) || (m_pBlocks->capacity - m_pBlocks->used < allocationSize))
+        {
+            if (!AddBlock(allocationSize))
+            {
+                return nullptr;
+            }
+        }
+
+        // Bump the pointer of the current block
+        BYTE* pHeader = BlockData(m_pBlocks) + m_pBlocks->used;
+        m_pBlocks->used += allocationSize;
+
+        *reinterpret_cast<size_t*>(pHeader) = nBytes;
+
+        m_pLastAllocation = pHeader + kHeaderSize;
+        return m_pLastAllocation;
+    }
+
+
+    //--------------------------------------------------------------------------
+    // Release an allocation.
+    // Only the most recent allocation is given back to its block: the memory
+    // of the other allocations is reclaimed by Reset.
+    //--------------------------------------------------------------------------
+    void Free(void* p) noexcept override
+    {
+        if ((p != nullptr) && (p == m_pLastAllocation))
+        {
+            m_pBlocks->used -= kHeaderSize + Detail::AlignArenaSize(GetSize(p));
+            m_pLastAllocation = nullptr;
+        }
+    }
+
+
+    //--------------------------------------------------------------------------
+    // Resize an allocation.
+    // The most recent allocation is grown in place when the current block
+    // has enough room (as happens when a CString grows repeatedly);
+    // otherwise, a new allocation is made, and the content is copied there.
+    // Return nullptr on failure (the original allocation is left intact).
+    //--------------------------------------------------------------------------
+    void* Reallocate(void* p, size_t nBytes) noexcept override
+    {
+        if (p == nullptr)
+        {
+            return Allocate(nBytes);
+        }
+
+        const size_t currentSize = GetSize(p);
+
+        if (p == m_pLastAllocation)
+        {
+            const size_t offset = static_cast<BYTE*>(p) - BlockData(m_pBlocks);
+            if ((nBytes <= static_cast<size_t>(INT_MAX))
+                && (Detail::AlignArenaSize(nBytes) <= m_pBlocks->capacity - offset))
+            {
+                m_pBlocks->used = offset + Detail::AlignArenaSize(nBytes);
+                SetSize(p, nBytes);
+                return p;
+            }
+        }
+        else if (nBytes <= currentSize)
+        {
+            // The allocation already has enough room
+            return p;
+        }
+
+        void* pNew = Allocate(nBytes);
+        if (pNew != nullptr)
+        {
+            memcpy(pNew, p, (currentSize < nBytes) ? currentSize : nBytes);
+        }
+        return pNew;
+    }
+
+
+    //--------------------------------------------------------------------------
+    // Return the size of an allocation, in bytes
+    //--------------------------------------------------------------------------
+    size_t GetSize(void* p) noexcept override
+    {
+        ATLASSERT(p != nullptr);
+        return *reinterpret_cast<const size_t*>(static_cast<BYTE*>(p) - kHeaderSize);
+    }
+
+
+    //--------------------------------------------------------------------------
+    // Release all the allocations at once.
+    // The first block is kept, and reused by the following allocations,
+    // so an arena reused across requests usually doesn't touch the heap at all.
+    //--------------------------------------------------------------------------
+    void Reset() noexcept
+    {
+        if (m_pBlocks == nullptr)
+        {
+            return;
+        }
+
+        // The first block is the last one in the list
+        Block* pFirstBlock = m_pBlocks;
+        while (pFirstBlock->pNext != nullptr)
+        {
+            pFirstBlock = pFirstBlock->pNext;
+        }
+
+        ReleaseBlocks(pFirstBlock);
+
+        pFirstBlock->used = 0;
+        m_pBlocks = pFirstBlock;
+        m_pLastAllocation = nullptr;
+    }
+
+
+private:
+
+    // Header of each memory block: the block data follows it
+    struct Block
+    {
+        Block*  pNext;      // previously allocated block
+        size_t  capacity;   // size of the block data, in bytes
+        size_t  used;       // bytes of the block data already allocated
+    };
+
+    // Size of the header that precedes each allocation, in bytes
+    static constexpr size_t kHeaderSize = Detail::AlignArenaSize(sizeof(size_t));
+
+    // Size of the block header, in bytes, keeping the block data aligned
+    static constexpr size_t kBlockHeaderSize = Detail::AlignArenaSize(sizeof(Block));
+
+    Block*  m_pBlocks;          // current block, linked to the previous ones
+    void*   m_pLastAllocation;  // most recent allocation (may be grown in place)
+    size_t  m_blockSize;        // size of the blocks allocated by the arena
+
+
+    static BYTE* BlockData(Block* pBlock) noexcept
+    {
+        return reinterpret_cast<BYTE*>(pBlock) + kBlockHeaderSize;
+    }
+
+
+    static void SetSize(void* p, size_t nBytes) noexcept
+    {
+        *reinterpret_cast<size_t*>(static_cast<BYTE*>(p) - kHeaderSize) = nBytes;
+    }
+
+
+    //--------------------------------------------------------------------------
+    // Allocate a new block from the heap, large enough for the given
+    // allocation, and make it the current block.
+    // Return false on failure.
+    //--------------------------------------------------------------------------
+    bool AddBlock(size_t allocationSize) noexcept
+    {
+        // Requests larger than the block size get a block of their own
+        const size_t capacity = (allocationSize > m_blockSize) ? allocationSize : m_blockSize;
+
+        Block* pBlock = static_cast<Block*>(malloc(kBlockHeaderSize + capacity));
+        if (pBlock == nullptr)
+        {
+            return false;
+        }
+
+        pBlock->pNext = m_pBlocks;
+        pBlock->capacity = capacity;
+        pBlock->used = 0;
+
+        m_pBlocks = pBlock;
+        m_pLastAllocation = nullptr;
+        return true;
+    }
+
+
+    //--------------------------------------------------------------------------
+    // Free the blocks from the current one, up to (but excluding) the given one
+    //--------------------------------------------------------------------------
+    void ReleaseBlocks(Block* pLastToKeep) noexcept
+    {
+        while (m_pBlocks != pLastToKeep)
+        {
+            Block* pNext = m_pBlocks->pNext;
+            free(m_pBlocks);
+            m_pBlocks = pNext;
+        }
+    }
+};
+
+
+//==============================================================================
+//                          Arena String Manager
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// ATL string manager that allocates the strings from its own arena.
+// Pass it to the ToUtf8/ToUtf16 overloads taking an IAtlStringMgr*,
+// or to the CString constructors.
+//------------------------------------------------------------------------------
+class CArenaStringMgr : public CAtlStringMgr
+{
+public:
+
+    explicit CArenaStringMgr(size_t blockSize = Detail::kDefaultArenaBlockSize) noexcept
+        : m_arena(blockSize)
+    {
+        SetMemoryManager(&m_arena);
+    }
+
+    // Ban copy
+    CArenaStringMgr(const CArenaStringMgr&) = delete;
+    CArenaStringMgr& operator=(const CArenaStringMgr&) = delete;
+
+    //--------------------------------------------------------------------------
+    // Release all the strings allocated from this string manager at once.
+    // All those strings must have already been destroyed (or emptied).
+    //--------------------------------------------------------------------------
+    void Reset() noexcept
+    {
+        m_arena.Reset();
+    }
+
+    CArenaMemMgr& GetArena() noexcept
+    {
+        return m_arena;
+    }
+
+private:
+    CArenaMemMgr m_arena;
+};
+
+} // namespace UnicodeConvAtl
@@ -0,0 +1,442 @@
+#pragma once
+
+////////////////////////////////////////////////////////////////////////////////
+// Thread-safe cache of UTF-16/UTF-8 conversion results for repeated strings
+//
+//                  Copyright (C) by Giovanni Dicanio
+//                    <giovanni.dicanio AT gmail.com>
+//
+////////////////////////////////////////////////////////////////////////////////
+
+
+//------------------------------------------------------------------------------
+// This header extends UnicodeConvAtl.h with caches of conversion results,
+// for code that converts the same strings over and over again
+// (e.g. metric names, tag keys, column names):
+//
+//      * Cache of UTF-16 to UTF-8 conversions:
+//        class Utf16ToUtf8Cache
+//        CStringA Utf16ToUtf8Cache::Convert(CStringW const& utf16)
+//
+//      * Cache of UTF-8 to UTF-16 conversions:
+//        class Utf8ToUtf16Cache
+//        CStringW Utf8ToUtf16Cache::Convert(CStringA const& utf8)
+//
+// A cache can be shared by any number of threads. It's split into shards,
+// each one protected by its own SRW lock, taken in shared mode for lookups,
+// so threads converting different strings rarely contend, and cache hits
+// never block each other.
+//
+// The cache holds a bounded number of strings: when it's full, the strings
+// that haven't been requested recently are evicted, using the CLOCK
+// algorithm (an approximation of LRU that doesn't need to reorder entries
+// on each hit, and so works under a shared lock).
+//
+// Cache hits return a copy of the cached CString, which shares the buffer
+// of the cached string (CString buffers are reference counted, and copied
+// on write), so a hit costs a lookup and an interlocked increment.
+//
+// Strings longer than the maximum cached length are converted without
+// being cached. Invalid input is never cached: the conversion errors
+// are signaled using AtlThrow, as for ToUtf8/ToUtf16.
+//
+// These classes live under the UnicodeConvAtl namespace.
+//
+// This code is released under the MIT License (see UnicodeConvAtl.h).
+//------------------------------------------------------------------------------
+
+
+//==============================================================================
+//                              Includes
+//==============================================================================
+
+#include "UnicodeConvAtl.h"     // Unicode UTF-16/UTF-8 conversions
+
+#include <atomic>               // std::atomic
+#include <memory>               // std::unique_ptr
+
+
+//==============================================================================
+//                          Implementation Details
+//==============================================================================
+
+namespace UnicodeConvAtl {
+namespace Detail {
+
+//------------------------------------------------------------------------------
+// Default number of strings held by a conversion cache
+//------------------------------------------------------------------------------
+constexpr int kDefaultCacheCapacity = 4096;
+
+
+//------------------------------------------------------------------------------
+// Default maximum length, in code units, of the strings stored in the cache
+//------------------------------------------------------------------------------
+constexpr int kDefaultMaxCachedLength = 256;
+
+
+//------------------------------------------------------------------------------
+// Maximum number of shards of a conversion cache (must be a power of 2)
+//------------------------------------------------------------------------------
+constexpr int kMaxCacheShards = 16;
+
+
+//------------------------------------------------------------------------------
+// Hash the code units of a string (32-bit FNV-1a)
+//------------------------------------------------------------------------------
+template <typename CharType>
+ULONG HashCodeUnits(const CharType* text, int length) noexcept
+{
+    ULONG hash = 2166136261U;
+    for (int i = 0; i < length; ++i)
+    {
+        hash ^= static_cast<ULONG>(text[i]);
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+
+//------------------------------------------------------------------------------
+// Compare all the code units of the given strings, including embedded NULs
+// (the CStringT comparison operators stop at the first NUL)
+//------------------------------------------------------------------------------
+template <class StringType>
+bool SameCodeUnits(StringType const& a, StringType const& b) noexcept
+{
+    const int length = a.GetLength();
+    return (length == b.GetLength())
+        && (memcmp(a.GetString(), b.GetString(), length * sizeof(a.GetString()[0])) == 0);
+}
+
+
+//------------------------------------------------------------------------------
+// Conversion functions used by the caches
+//------------------------------------------------------------------------------
+inline CStringA ConvertForCache(CStringW const& utf16)
+{
+    return ToUtf8(utf16);
+}
+
+
+inline CStringW ConvertForCache(CStringA const& utf8)
+{
+    return ToUtf16(utf8);
+}
+
+} // namespace Detail
+
+
+//==============================================================================
+//                          Conversion Cache
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Thread-safe cache of the conversions of SourceString to ResultString.
+// Use the Utf16ToUtf8Cache and Utf8ToUtf16Cache typedefs below.
+//------------------------------------------------------------------------------
+template <class SourceString, class ResultString>
+class ConversionCache
+{
+public:
+
+    //--------------------------------------------------------------------------
+    // Create a cache holding up to capacity strings; strings longer than
+    // maxCachedLength code units are converted without being cached
+    //--------------------------------------------------------------------------
+    explicit ConversionCache(int capacity = Detail::kDefaultCacheCapacity,
+                             int maxCachedLength = Detail::kDefaultMaxCachedLength)
+        : m_shardCount(1)
+        , m_maxCachedLength(maxCachedLength)
+    {
+        ATLASSERT(capacity > 0);
+        if (capacity <= 0)
+        {
+            AtlThrow(E_INVALIDARG);
+        }
+
+        // Don't split small caches in shards of just a few strings
+        while ((m_shardCount < Detail::kMaxCacheShards) && (capacity / (m_shardCount * 2) >= 64))
+        {
+            m_shardCount *= 2;
+        }
+
+        const int shardCapacity = (capacity + m_shardCount - 1) / m_shardCount;
+
+        m_shards.reset(new Shard[m_shardCount]);
+        for (int i = 0; i < m_shardCount; ++i)
+        {
+            m_shards[i].Initialize(shardCapacity);
+        }
+    }
+
+    // Ban copy
+    ConversionCache(const ConversionCache&) = delete;
+    ConversionCache& operator=(const ConversionCache&) = delete;
+
+
+    //--------------------------------------------------------------------------
+    // Return the conversion of the input string, from the cache if possible.
+    // Signal errors using AtlThrow.
+    //--------------------------------------------------------------------------
+    ResultString Convert(SourceString const& source)
+    {
+        const int length = source.GetLength();
+        if (length > m_maxCachedLength)
+        {
+            return Detail::ConvertForCache(source);
+        }
+
+        const ULONG hash = Detail::HashCodeUnits(source.GetString(), length);
+
+        // The high bits of the hash select the shard,
+        // the low bits select the bucket in the shard
+        Shard& shard = m_shards[(hash >> 24) & static_cast<ULONG>(m_shardCount - 1)];
+
+        ResultString result;
+        if (shard.Find(source, hash, result))
+        {
+            return result;
+        }
+
+        // Convert without holding the lock; on error, nothing is cached
+        result = Detail::ConvertForCache(source);
+
+        shard.Insert(source, hash, result);
+        return result;
+    }
+
+
+    //--------------------------------------------------------------------------
+    // Remove all the strings from the cache
+    //--------------------------------------------------------------------------
+    void Clear() noexcept
+    {
+        for (int i = 0; i < m_shardCount; ++i)
+        {
+            m_shards[i].Clear();
+        }
+    }
+
+
+    //--------------------------------------------------------------------------
+    // Return the number of strings currently held by the cache
+    //--------------------------------------------------------------------------
+    int GetCount() const noexcept
+    {
+        int count = 0;
+        for (int i = 0; i < m_shardCount; ++i)
+        {
+            count += m_shards[i].GetCount();
+        }
+        return count;
+    }
+
+
+private:
+
+    // A cached conversion
+    struct Entry
+    {
+        SourceString        source;
+        ResultString        result;
+        ULONG               hash;
+        int                 next;       // next entry in the same bucket, or -1
+        std::atomic<bool>   referenced; // CLOCK reference bit, set by the hits
+
+        Entry() noexcept
+            : hash(0)
+            , next(-1)
+            , referenced(false)
+        {
+        }
+    };
+
+
+    // A shard of the cache: a fixed array of entries, indexed by a hash table
+    // of buckets chained through the entries
+    class Shard
+    {
+    public:
+        Shard() noexcept
+            : m_capacity(0)
+            , m_count(0)
+            , m_clockHand(0)
+            , m_bucketMask(0)
+        {
+            ::InitializeSRWLock(&m_lock);
+        }
+
+        void Initialize(int capacity)
+        {
+            // About two buckets per entry, keeping the chains short
+            int bucketCount = 1;
+            while (bucketCount < capacity * 2)
+            {
+                bucketCount *= 2;
+            }
+
+            m_entries.reset(new Entry[capacity]);
+            m_buckets.reset(new int[bucketCount]);
+            m_capacity = capacity;
+            m_bucketMask = static_cast<ULONG>(bucketCount - 1);
+
+            ClearBuckets();
+        }
+
+        bool Find(SourceString const& source, ULONG hash, ResultString& result) const
+        {
+            Detail::SharedLockGuard lock(m_lock);
+
+            const int index = FindEntry(source, hash);
+            if (index < 0)
+            {
+                return false;
+            }
+
+            // Hits run concurrently under the shared lock: the reference bit
+            // is the only state they update
+            Entry& entry = m_entries[index];
+            entry.referenced.store(true, std::memory_order_relaxed);
+            result = entry.result;
+            return true;
+        }
+
+        void Insert(SourceString const& source, ULONG hash, ResultString const& result)
+        {
+            Detail::ExclusiveLockGuard lock(m_lock);
+
+            // Another thread may have inserted the same string in the meantime
+            if (FindEntry(source, hash) >= 0)
+            {
+                return;
+            }
+
+            int index;
+            if (m_count < m_capacity)
+            {
+                index = m_count++;
+            }
+            else
+            {
+                index = EvictEntry();
+            }
+
+            Entry& entry = m_entries[index];
+            entry.source = source;
+            entry.result = result;
+            entry.hash = hash;
+
+            // New entries must be hit again to survive the next sweep
+            entry.referenced.store(false, std::memory_order_relaxed);
+
+            int& bucket = m_buckets[hash & m_bucketMask];
+            entry.next = bucket;
+            bucket = index;
+        }
+
+        void Clear() noexcept
+        {
+            Detail::ExclusiveLockGuard lock(m_lock);
+
+            for (int i = 0; i < m_count; ++i)
+            {
+                m_entries[i].source.Empty();
+                m_entries[i].result.Empty();
+            }
+            m_count = 0;
+            m_clockHand = 0;
+
+            ClearBuckets();
+        }
+
+        int GetCount() const noexcept
+        {
+            Detail::SharedLockGuard lock(m_lock);
+            return m_count;
+        }
+
+    private:
+        mutable SRWLOCK             m_lock;
+        std::unique_ptr<Entry[]>    m_entries;
+        std::unique_ptr<int[]>      m_buckets;  // first entry of each bucket, or -1
+        int                         m_capacity;
+        int                         m_count;
+        int                         m_clockHand;
+        ULONG                       m_bucketMask;
+
+        // Keep the locks of adjacent shards on different cache lines
+        BYTE                        m_padding[64];
+
+        void ClearBuckets() noexcept
+        {
+            for (ULONG i = 0; i <= m_bucketMask; ++i)
+            {
+                m_buckets[i] = -1;
+            }
+        }
+
+        // Return the index of the entry of the given string, or -1
+        int FindEntry(SourceString const& source, ULONG hash) const noexcept
+        {
+            for (int i = m_buckets[hash & m_bucketMask]; i >= 0; i = m_entries[i].next)
+            {
+                const Entry& entry = m_entries[i];
+                if ((entry.hash == hash) && Detail::SameCodeUnits(entry.source, source))
+                {
+                    return i;
+                }
+            }
+            return -1;
+        }
+
+        // Select an entry to evict with the CLOCK algorithm: sweep the entries,
+        // clearing the reference bits, until an entry that hasn't been hit
+        // since the last sweep is found; then unlink it from its bucket.
+        // Called with the exclusive lock held, on a full shard.
+        int EvictEntry() noexcept
+        {
+            int victim;
+            for (;;)
+            {
+                Entry& entry = m_entries[m_clockHand];
+                victim = m_clockHand;
+                m_clockHand = (m_clockHand + 1) % m_capacity;
+
+                if (!entry.referenced.load(std::memory_order_relaxed))
+                {
+                    break;
+                }
+                entry.referenced.store(false, std::memory_order_relaxed);
+            }
+
+            int* pLink = &m_buckets[m_entries[victim].hash & m_bucketMask];
+            while (*pLink != victim)
+            {
+                pLink = &m_entries[*pLink].next;
+            }
+            *pLink = m_entries[victim].next;
+
+            return victim;
+        }
+    };
+
+
+    std::unique_ptr<Shard[]>    m_shards;
+    int                         m_shardCount;
+    int                         m_maxCachedLength;
+};
+
+
+//------------------------------------------------------------------------------
+// Cache of UTF-16 to UTF-8 conversions
+//------------------------------------------------------------------------------
+typedef ConversionCache<CStringW, CStringA> Utf16ToUtf8Cache;
+
+
+//------------------------------------------------------------------------------
+// Cache of UTF-8 to UTF-16 conversions
+//------------------------------------------------------------------------------
+typedef ConversionCache<CStringA, CStringW> Utf8ToUtf16Cache;
+
+} // namespace UnicodeConvAtl
@@ -0,0 +1,1533 @@
+#pragma once
+
+////////////////////////////////////////////////////////////////////////////////
+// Conversions between Unicode UTF-16/UTF-8 and UTF-32, Latin-1, WTF-8 and CESU-8
+//
+//                  Copyright (C) by Giovanni Dicanio
+//                    <giovanni.dicanio AT gmail.com>
+//
+////////////////////////////////////////////////////////////////////////////////
+
+
+//------------------------------------------------------------------------------
+// This header extends UnicodeConvAtl.h with conversions between more
+// encodings, built on a single transcoding engine that goes straight
+// from the source encoding to the destination one, without intermediate
+// CStringW copies:
+//
+//      * Convert between UTF-32 (stored in a CAtlArray<char32_t>,
+//        or in a char32_t buffer) and UTF-16 or UTF-8:
+//        void Utf16ToUtf32(CStringW const& utf16, CAtlArray<char32_t>& utf32,
+//                          InvalidInputPolicy policy = InvalidInputPolicy::Throw)
+//        void Utf8ToUtf32(CStringA const& utf8, CAtlArray<char32_t>& utf32,
+//                         InvalidInputPolicy policy = InvalidInputPolicy::Throw)
+//        CStringW Utf32ToUtf16(const char32_t* utf32, int utf32Length,
+//                              InvalidInputPolicy policy = InvalidInputPolicy::Throw)
+//        CStringA Utf32ToUtf8(const char32_t* utf32, int utf32Length,
+//                             InvalidInputPolicy policy = InvalidInputPolicy::Throw)
+//
+//      * Convert between ISO-8859-1 (Latin-1, stored in a CStringA)
+//        and UTF-16 or UTF-8:
+//        CStringW Latin1ToUtf16(CStringA const& latin1)
+//        CStringA Latin1ToUtf8(CStringA const& latin1)
+//        CStringA Utf16ToLatin1(CStringW const& utf16,
+//                               InvalidInputPolicy policy = InvalidInputPolicy::Throw)
+//        CStringA Utf8ToLatin1(CStringA const& utf8,
+//                              InvalidInputPolicy policy = InvalidInputPolicy::Throw)
+//
+//      * Convert between potentially ill-formed UTF-16 (e.g. Windows file names,
+//        which can contain unpaired surrogates) and WTF-8, preserving
+//        the unpaired surrogates across the round trip:
+//        CStringA Utf16ToWtf8(CStringW const& utf16)
+//        CStringW Wtf8ToUtf16(CStringA const& wtf8,
+//                             InvalidInputPolicy policy = InvalidInputPolicy::Throw)
+//
+//      * Convert between UTF-16 and CESU-8 (UTF-8 with supplementary
+//        characters encoded as surrogate pairs, as used by Oracle and Java):
+//        CStringA Utf16ToCesu8(CStringW const& utf16,
+//                              InvalidInputPolicy policy = InvalidInputPolicy::Throw)
+//        CStringW Cesu8ToUtf16(CStringA const& cesu8,
+//                              InvalidInputPolicy policy = InvalidInputPolicy::Throw)
+//
+//      * Convert between any two of the encodings above, with the error
+//        policies of ConvertToUtf8/ConvertToUtf16 (ThrowOnError, ReturnHResult,
+//        ReplaceInvalidInput, SkipInvalidInput):
+//        AppendEncoded<SourceEncoding, TargetEncoding, ErrorPolicy>(...)
+//        ConvertEncoding<SourceEncoding, TargetEncoding, ErrorPolicy>(...)
+//
+//      * Convert input in any of the encodings above that arrives in chunks:
+//        class EncodingStream<SourceEncoding, TargetEncoding>
+//
+// Each function also has overloads taking a pointer and a length,
+// and overloads storing the result in a destination string passed by
+// reference, whose buffer is reused across calls.
+//
+// The encodings are identified by the classes Utf8Encoding, Utf16Encoding,
+// Utf32Encoding, Latin1Encoding, Wtf8Encoding, Cesu8Encoding and Wtf16Encoding
+// (potentially ill-formed UTF-16, as in the WTF-8 specification).
+//
+// Invalid input (including code points that can't be encoded in the
+// destination encoding, like non-Latin-1 characters converted to Latin-1)
+// is handled according to the InvalidInputPolicy, or to the ErrorPolicy;
+// errors are signaled using AtlThrow (or HRESULTs, with ReturnHResult),
+// with the same error codes of ToUtf8 and ToUtf16.
+// Invalid input is replaced with U+FFFD, or with '?' in Latin-1.
+//
+// Runs of ASCII code units are converted in blocks, using SSE2 when available,
+// as are whole Latin-1 strings converted to UTF-16.
+//
+// These functions live under the UnicodeConvAtl namespace.
+//
+// This code is released under the MIT License (see UnicodeConvAtl.h).
+//------------------------------------------------------------------------------
+
+
+//==============================================================================
+//                              Includes
+//==============================================================================
+
+#include "UnicodeConvAtl.h"     // Unicode UTF-16/UTF-8 conversions
+
+
+namespace UnicodeConvAtl {
+
+//==============================================================================
+//                          Allocation Policies
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Allocation policy: the destination is a CAtlArray (used for UTF-32).
+// Same interface of CStringAllocPolicy; GetBuffer returns nullptr
+// if the allocation fails.
+//------------------------------------------------------------------------------
+struct AtlArrayAllocPolicy
+{
+    template <typename ArrayType>
+    static int GetLength(ArrayType const& a) noexcept
+    {
+        return static_cast<int>(a.GetCount());
+    }
+
+    template <typename ArrayType>
+    static void Truncate(ArrayType& a, int length) noexcept
+    {
+        // SetCount(0) frees the buffer of a CAtlArray: remove the trailing
+        // elements instead, which keeps the buffer for the following calls
+        const size_t count = a.GetCount();
+        if (static_cast<size_t>(length) < count)
+        {
+            a.RemoveAt(static_cast<size_t>(length), count - static_cast<size_t>(length));
+        }
+    }
+
+    template <typename ArrayType>
+    static auto GetBuffer(ArrayType& a, int length) noexcept -> decltype(a.GetData())
+    {
+        try
+        {
+            if (!a.SetCount(static_cast<size_t>(length)))
+            {
+                return nullptr;
+            }
+            return a.GetData();
+        }
+        catch (const CAtlException&)
+        {
+            return nullptr;
+        }
+    }
+
+    template <typename ArrayType>
+    static void ReleaseBuffer(ArrayType& a, int length) noexcept
+    {
+        // GetBuffer has already set the count to the buffer length
+        Truncate(a, length);
+    }
+};
+
+
+//==============================================================================
+//                              Encodings
+//
+// Each encoding class describes how code points are decoded from,
+// and encoded to, its code units:
+//
+//  - CodeUnit: the type of the code units
+//  - StringType, AllocPolicy: the destination strings, and how they're allocated
+//  - kReplacementCodePoint: the code point that replaces invalid input
+//  - kMaxPendingLength: the maximum length of the code unit sequences that
+//    must be carried over between the chunks of a stream (see EncodingStream)
+//  - AsciiPrefixLength: the length of the initial run of ASCII code units
+//  - Decode: decode the code point at the beginning of the input, returning
+//    the number of code units it takes, or 0 if the input is invalid
+//    (in this case, invalidLength receives the number of code units to skip)
+//  - CanEncode, EncodedLength, Encode: encode a code point
+//  - IncompleteTailLength: the length of the code unit sequence at the end
+//    of the input that may be completed by the following input
+//==============================================================================
+
+namespace Detail {
+
+//------------------------------------------------------------------------------
+// Return the length, in char32_ts, of the initial run of ASCII code points
+// in the input UTF-32 string.
+//------------------------------------------------------------------------------
+inline int AsciiPrefixLength(const char32_t* utf32, int utf32Length) noexcept
+{
+    int i = 0;
+
+#ifdef UNICODECONVATL_HAS_SSE2
+    // Check 4 char32_ts at a time: all of them must have bits 7-31 cleared
+    const __m128i kNonAsciiMask = _mm_set1_epi32(static_cast<int>(0xFFFFFF80));
+    const __m128i kZero = _mm_setzero_si128();
+    for (; i + 4 <= utf32Length; i += 4)
+    {
+        const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(utf32 + i));
+        const __m128i nonAscii = _mm_and_si128(chunk, kNonAsciiMask);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(nonAscii, kZero)) != 0xFFFF)
+        {
+            break;
+        }
+    }
+#endif
+
+    // Process the remaining code units one at a time
+    for (; i < utf32Length; ++i)
+    {
+        if (static_cast<unsigned int>(utf32[i]) > 0x7F)
+        {
+            break;
+        }
+    }
+
+    return i;
+}
+
+
+//------------------------------------------------------------------------------
+// Copy the initial run of ASCII code units of the input string to the
+// destination buffer, which must have room for sourceLength code units.
+// Return the number of code units copied.
+// The UTF-16/UTF-8 pairs use the SSE2 helpers of UnicodeConvAtl.h.
+//------------------------------------------------------------------------------
+inline int CopyAsciiPrefix(const wchar_t* source, int sourceLength, char* target) noexcept
+{
+    return NarrowAsciiPrefix(source, sourceLength, target);
+}
+
+
+inline int CopyAsciiPrefix(const char* source, int sourceLength, wchar_t* target) noexcept
+{
+    return WidenAsciiPrefix(source, sourceLength, target);
+}
+
+
+template <typename SourceCodeUnit, typename TargetCodeUnit>
+int CopyAsciiPrefix(const SourceCodeUnit* source, int sourceLength, TargetCodeUnit* target) noexcept
+{
+    const int asciiLength = AsciiPrefixLength(source, sourceLength);
+    for (int i = 0; i < asciiLength; ++i)
+    {
+        target[i] = static_cast<TargetCodeUnit>(source[i]);
+    }
+
+    return asciiLength;
+}
+
+
+//------------------------------------------------------------------------------
+// Encoded surrogate helpers for WTF-8: surrogates are encoded like the
+// other BMP code points, as ED A0..BF 80..BF
+//------------------------------------------------------------------------------
+inline bool IsEncodedSurrogate(const unsigned char* wtf8, int available) noexcept
+{
+    return (available >= 3) && (wtf8[0] == 0xED) && (wtf8[1] >= 0xA0) && (wtf8[1] <= 0xBF)
+           && IsUtf8Continuation(wtf8[2]);
+}
+
+inline bool IsEncodedHighSurrogate(const unsigned char* wtf8, int available) noexcept
+{
+    return IsEncodedSurrogate(wtf8, available) && (wtf8[1] <= 0xAF);
+}
+
+inline bool IsEncodedLowSurrogate(const unsigned char* wtf8, int available) noexcept
+{
+    return IsEncodedSurrogate(wtf8, available) && (wtf8[1] >= 0xB0);
+}
+
+} // namespace Detail
+
+
+//------------------------------------------------------------------------------
+// UTF-8, with the same validation rules of ToUtf16
+//------------------------------------------------------------------------------
+struct Utf8Encoding
+{
+    using CodeUnit = char;
+    using StringType = CStringA;
+    using AllocPolicy = CStringAllocPolicy;
+
+    static constexpr unsigned int kReplacementCodePoint = Detail::kReplacementCharacter;
+    static constexpr int kMaxPendingLength = 3;
+
+    static int AsciiPrefixLength(const char* utf8, int utf8Length) noexcept
+    {
+        return Detail::AsciiPrefixLength(utf8, utf8Length);
+    }
+
+    static int Decode(const char* utf8, int available,
+                      unsigned int& codePoint, int& invalidLength) noexcept
+    {
+        const unsigned char* const bytes = reinterpret_cast<const unsigned char*>(utf8);
+
+        const int sequenceLength = Detail::ValidUtf8SequenceLength(bytes, available);
+        if (sequenceLength == 0)
+        {
+            invalidLength = Detail::MaximalSubpartLength(bytes, available);
+            return 0;
+        }
+
+        codePoint = Detail::DecodeUtf8(bytes, sequenceLength);
+        return sequenceLength;
+    }
+
+    static constexpr bool CanEncode(unsigned int codePoint) noexcept
+    {
+        return !Detail::IsSurrogate(codePoint);
+    }
+
+    static constexpr int EncodedLength(unsigned int codePoint) noexcept
+    {
+        return (codePoint < 0x80) ? 1 : (codePoint < 0x800) ? 2 : (codePoint < 0x10000) ? 3 : 4;
+    }
+
+    static int Encode(unsigned int codePoint, char* utf8) noexcept
+    {
+        return Detail::EncodeUtf8(codePoint, utf8);
+    }
+
+    static int IncompleteTailLength(const char* utf8, int utf8Length) noexcept
+    {
+        return Detail::IncompleteUtf8TailLength(utf8, utf8Length);
+    }
+};
+
+
+//------------------------------------------------------------------------------
+// WTF-8: UTF-8 extended with the encoding of unpaired surrogates
+// (see https://simonsapin.github.io/wtf-8/).
+// A surrogate pair must be encoded as a single 4-char sequence:
+// an encoded high surrogate followed by an encoded low surrogate is invalid.
+//------------------------------------------------------------------------------
+struct Wtf8Encoding
+{
+    using CodeUnit = char;
+    using StringType = CStringA;
+    using AllocPolicy = CStringAllocPolicy;
+
+    static constexpr unsigned int kReplacementCodePoint = Detail::kReplacementCharacter;
+
+    // An encoded high surrogate, followed by a truncated sequence
+    static constexpr int kMaxPendingLength = 5;
+
+    static int AsciiPrefixLength(const char* wtf8, int wtf8Length) noexcept
+    {
+        return Detail::AsciiPrefixLength(wtf8, wtf8Length);
+    }
+
+    static int Decode(const char* wtf8, int available,
+                      unsigned int& codePoint, int& invalidLength) noexcept
+    {
+        const unsigned char* const bytes = reinterpret_cast<const unsigned char*>(wtf8);
+
+        const int sequenceLength = Detail::ValidUtf8SequenceLength(bytes, available);
+        if (sequenceLength > 0)
+        {
+            codePoint = Detail::DecodeUtf8(bytes, sequenceLength);
+            return sequenceLength;
+        }
+
+        if (Detail::IsEncodedSurrogate(bytes, available)
+            && !(Detail::IsEncodedHighSurrogate(bytes, available)
+                 && Detail::IsEncodedLowSurrogate(bytes + 3, available - 3)))
+        {
+            codePoint = Detail::DecodeUtf8(bytes, 3);
+            return 3;
+        }
+
+        invalidLength = Detail::IsEncodedSurrogate(bytes, available)
+                        ? 3 : Detail::MaximalSubpartLength(bytes, available);
+        return 0;
+    }
+
+    static constexpr bool CanEncode(unsigned int) noexcept
+    {
+        return true;
+    }
+
+    static constexpr int EncodedLength(unsigned int codePoint) noexcept
+    {
+        return Utf8Encoding::EncodedLength(codePoint);
+    }
+
+    static int Encode(unsigned int codePoint, char* wtf8) noexcept
+    {
+        // Surrogates are encoded like the other BMP code points
+        return Detail::EncodeUtf8(codePoint, wtf8);
+    }
+
+    static int IncompleteTailLength(const char* wtf8, int wtf8Length) noexcept
+    {
+        const unsigned char* const bytes = reinterpret_cast<const unsigned char*>(wtf8);
+
+        // A truncated sequence, including a truncated encoded surrogate
+        int tailLength = Detail::IncompleteUtf8TailLength(wtf8, wtf8Length);
+        if (tailLength == 0 && wtf8Length >= 2)
+        {
+            const unsigned char* const truncated = bytes + wtf8Length - 2;
+            if ((truncated[0] == 0xED) && (truncated[1] >= 0xA0)
+                && Detail::IsUtf8Continuation(truncated[1]))
+            {
+                tailLength = 2;
+            }
+        }
+
+        // A complete encoded high surrogate must wait for the following
+        // sequence, as an encoded low surrogate would make it invalid
+        const int headLength = wtf8Length - tailLength;
+        const unsigned char* const tail = bytes + headLength;
+        if ((headLength >= 3) && Detail::IsEncodedHighSurrogate(tail - 3, 3)
+            && ((tailLength == 0) || ((tail[0] == 0xED) && (tailLength == 1 || tail[1] >= 0xB0))))
+        {
+            tailLength += 3;
+        }
+
+        return tailLength;
+    }
+};
+
+
+//------------------------------------------------------------------------------
+// CESU-8: UTF-8 where the supplementary code points are encoded as the two
+// 3-char encodings of their UTF-16 surrogates (6 chars), as used by Oracle
+// and by Java serialization. 4-char UTF-8 sequences and unpaired encoded
+// surrogates are invalid.
+//------------------------------------------------------------------------------
+struct Cesu8Encoding
+{
+    using CodeUnit = char;
+    using StringType = CStringA;
+    using AllocPolicy = CStringAllocPolicy;
+
+    static constexpr unsigned int kReplacementCodePoint = Detail::kReplacementCharacter;
+
+    // An encoded high surrogate, followed by a truncated encoded low surrogate
+    static constexpr int kMaxPendingLength = 5;
+
+    static int AsciiPrefixLength(const char* cesu8, int cesu8Length) noexcept
+    {
+        return Detail::AsciiPrefixLength(cesu8, cesu8Length);
+    }
+
+    static int Decode(const char* cesu8, int available,
+                      unsigned int& codePoint, int& invalidLength) noexcept
+    {
+        const unsigned char* const bytes = reinterpret_cast<const unsigned char*>(cesu8);
+
+        // The 4-char lead bytes are invalid
+        if (bytes[0] >= 0xF0)
+        {
+            invalidLength = 1;
+            return 0;
+        }
+
+        const int sequenceLength = Detail::ValidUtf8SequenceLength(bytes, available);
+        if (sequenceLength > 0)
+        {
+            codePoint = Detail::DecodeUtf8(bytes, sequenceLength);
+            return sequenceLength;
+        }
+
+        if (Detail::IsEncodedHighSurrogate(bytes, available)
+            && Detail::IsEncodedLowSurrogate(bytes + 3, available - 3))
+        {
+            codePoint = Detail::CodePointFromSurrogates(Detail::DecodeUtf8(bytes, 3),
+                                                        Detail::DecodeUtf8(bytes + 3, 3));
+            return 6;
+        }
+
+        invalidLength = Detail::IsEncodedSurrogate(bytes, available)
+                        ? 3 : Detail::MaximalSubpartLength(bytes, available);
+        return 0;
+    }
+
+    static constexpr bool CanEncode(unsigned int codePoint) noexcept
+    {
+        return !Detail::IsSurrogate(codePoint);
+    }
+
+    static constexpr int EncodedLength(unsigned int codePoint) noexcept
+    {
+        return (codePoint < 0x80) ? 1 : (codePoint < 0x800) ? 2 : (codePoint < 0x10000) ? 3 : 6;
+    }
+
+    static int Encode(unsigned int codePoint, char* cesu8) noexcept
+    {
+        if (codePoint < 0x10000)
+        {
+            return Detail::EncodeUtf8(codePoint, cesu8);
+        }
+
+        // Encode the surrogate pair, one surrogate at a time
+        Detail::EncodeUtf8(0xD800 + ((codePoint - 0x10000) >> 10), cesu8);
+        Detail::EncodeUtf8(0xDC00 + ((codePoint - 0x10000) & 0x3FF), cesu8 + 3);
+        return 6;
+    }
+
+    static int IncompleteTailLength(const char* cesu8, int cesu8Length) noexcept
+    {
+        // Same as WTF-8: a complete encoded high surrogate must wait for
+        // the following sequence, which may be the low surrogate of the pair
+        return Wtf8Encoding::IncompleteTailLength(cesu8, cesu8Length);
+    }
+};
+
+
+//------------------------------------------------------------------------------
+// UTF-16, with the same validation rules of ToUtf8
+//------------------------------------------------------------------------------
+struct Utf16Encoding
+{
+    using CodeUnit = wchar_t;
+    using StringType = CStringW;
+    using AllocPolicy = CStringAllocPolicy;
+
+    static constexpr unsigned int kReplacementCodePoint = Detail::kReplacementCharacter;
+    static constexpr int kMaxPendingLength = 1;
+
+    static int AsciiPrefixLength(const wchar_t* utf16, int utf16Length) noexcept
+    {
+        return Detail::AsciiPrefixLength(utf16, utf16Length);
+    }
+
+    static int Decode(const wchar_t* utf16, int available,
+                      unsigned int& codePoint, int& invalidLength) noexcept
+    {
+        const unsigned int ch = static_cast<unsigned int>(utf16[0]);
+
+        if (!Detail::IsSurrogate(ch))
+        {
+            codePoint = ch;
+            return 1;
+        }
+
+        if (Detail::IsHighSurrogate(ch) && (available >= 2)
+            && Detail::IsLowSurrogate(static_cast<unsigned int>(utf16[1])))
+        {
+            codePoint = Detail::CodePointFromSurrogates(ch, static_cast<unsigned int>(utf16[1]));
+            return 2;
+        }
+
+        // Unpaired surrogate
+        invalidLength = 1;
+        return 0;
+    }
+
+    static constexpr bool CanEncode(unsigned int codePoint) noexcept
+    {
+        return !Detail::IsSurrogate(codePoint);
+    }
+
+    static constexpr int EncodedLength(unsigned int codePoint) noexcept
+    {
+        return (codePoint < 0x10000) ? 1 : 2;
+    }
+
+    static int Encode(unsigned int codePoint, wchar_t* utf16) noexcept
+    {
+        if (codePoint < 0x10000)
+        {
+            utf16[0] = static_cast<wchar_t>(codePoint);
+            return 1;
+        }
+
+        // Encode as a surrogate pair
+        utf16[0] = static_cast<wchar_t>(0xD800 + ((codePoint - 0x10000) >> 10));
+        utf16[1] = static_cast<wchar_t>(0xDC00 + ((codePoint - 0x10000) & 0x3FF));
+        return 2;
+    }
+
+    static int IncompleteTailLength(const wchar_t* utf16, int utf16Length) noexcept
+    {
+        // A high surrogate may be paired with the first code unit of the following input
+        return ((utf16Length > 0)
+                && Detail::IsHighSurrogate(static_cast<unsigned int>(utf16[utf16Length - 1])))
+            ? 1 : 0;
+    }
+};
+
+
+//------------------------------------------------------------------------------
+// Potentially ill-formed UTF-16 (WTF-16): UTF-16 where unpaired surrogates
+// are allowed, and decoded as the corresponding surrogate code points.
+// This is how Windows treats file names, and the counterpart of WTF-8.
+//------------------------------------------------------------------------------
+struct Wtf16Encoding
+{
+    using CodeUnit = wchar_t;
+    using StringType = CStringW;
+    using AllocPolicy = CStringAllocPolicy;
+
+    static constexpr unsigned int kReplacementCodePoint = Detail::kReplacementCharacter;
+    static constexpr int kMaxPendingLength = 1;
+
+    static int AsciiPrefixLength(const wchar_t* utf16, int utf16Length) noexcept
+    {
+        return Detail::AsciiPrefixLength(utf16, utf16Length);
+    }
+
+    static int Decode(const wchar_t* utf16, int available,
+                      unsigned int& codePoint, int& invalidLength) noexcept
+    {
+        if (Utf16Encoding::Decode(utf16, available, codePoint, invalidLength) == 2)
+        {
+            return 2;
+        }
+
+        // Paired surrogates aside, each code unit is a code point
+        codePoint = static_cast<unsigned int>(utf16[0]);
+        return 1;
+    }
+
+    static constexpr bool CanEncode(unsigned int) noexcept
+    {
+        return true;
+    }
+
+    static constexpr int EncodedLength(unsigned int codePoint) noexcept
+    {
+        return Utf16Encoding::EncodedLength(codePoint);
+    }
+
+    static int Encode(unsigned int codePoint, wchar_t* utf16) noexcept
+    {
+        // Surrogates are single code units
+        return Utf16Encoding::Encode(codePoint, utf16);
+    }
+
+    static int IncompleteTailLength(const wchar_t* utf16, int utf16Length) noexcept
+    {
+        return Utf16Encoding::IncompleteTailLength(utf16, utf16Length);
+    }
+};
+
+
+//------------------------------------------------------------------------------
+// UTF-32: each code unit is a code point, up to U+10FFFF, excluding surrogates
+//------------------------------------------------------------------------------
+struct Utf32Encoding
+{
+    using CodeUnit = char32_t;
+    using StringType = CAtlArray<char32_t>;
+    using AllocPolicy = AtlArrayAllocPolicy;
+
+    static constexpr unsigned int kReplacementCodePoint = Detail::kReplacementCharacter;
+    static constexpr int kMaxPendingLength = 0;
+
+    static int AsciiPrefixLength(const char32_t* utf32, int utf32Length) noexcept
+    {
+        return Detail::AsciiPrefixLength(utf32, utf32Length);
+    }
+
+    static int Decode(const char32_t* utf32, int /* available */,
+                      unsigned int& codePoint, int& invalidLength) noexcept
+    {
+        const unsigned int ch = static_cast<unsigned int>(utf32[0]);
+        if ((ch > 0x10FFFF) || Detail::IsSurrogate(ch))
+        {
+            invalidLength = 1;
+            return 0;
+        }
+
+        codePoint = ch;
+        return 1;
+    }
+
+    static constexpr bool CanEncode(unsigned int codePoint) noexcept
+    {
+        return !Detail::IsSurrogate(codePoint);
+    }
+
+    static constexpr int EncodedLength(unsigned int) noexcept
+    {
+        return 1;
+    }
+
+    static int Encode(unsigned int codePoint, char32_t* utf32) noexcept
+    {
+        utf32[0] = static_cast<char32_t>(codePoint);
+        return 1;
+    }
+
+    static int IncompleteTailLength(const char32_t*, int) noexcept
+    {
+        return 0;
+    }
+};
+
+
+//------------------------------------------------------------------------------
+// ISO-8859-1 (Latin-1): each char is a code point, from U+0000 to U+00FF
+//------------------------------------------------------------------------------
+struct Latin1Encoding
+{
+    using CodeUnit = char;
+    using StringType = CStringA;
+    using AllocPolicy = CStringAllocPolicy;
+
+    // U+FFFD isn't available in Latin-1: use '?',
+    // like WideCharToMultiByte does by default
+    static constexpr unsigned int kReplacementCodePoint = '?';
+    static constexpr int kMaxPendingLength = 0;
+
+    static int AsciiPrefixLength(const char* latin1, int latin1Length) noexcept
+    {
+        return Detail::AsciiPrefixLength(latin1, latin1Length);
+    }
+
+    static int Decode(const char* latin1, int /* available */,
+                      unsigned int& codePoint, int& /* invalidLength */) noexcept
+    {
+        codePoint = static_cast<unsigned char>(latin1[0]);
+        return 1;
+    }
+
+    static constexpr bool CanEncode(unsigned int codePoint) noexcept
+    {
+        return codePoint <= 0xFF;
+    }
+
+    static constexpr int EncodedLength(unsigned int) noexcept
+    {
+        return 1;
+    }
+
+    static int Encode(unsigned int codePoint, char* latin1) noexcept
+    {
+        latin1[0] = static_cast<char>(codePoint);
+        return 1;
+    }
+
+    static int IncompleteTailLength(const char*, int) noexcept
+    {
+        return 0;
+    }
+};
+
+
+//==============================================================================
+//                          Transcoding Engine
+//==============================================================================
+
+namespace Detail {
+
+//------------------------------------------------------------------------------
+// Convert code points from SourceEncoding to TargetEncoding, in two passes:
+// Length measures (and validates) the input, Convert writes the output
+// into a buffer of the measured length.
+// Invalid input, and code points that can't be encoded in TargetEncoding,
+// are handled according to the given policy.
+//------------------------------------------------------------------------------
+template <class SourceEncoding, class TargetEncoding>
+struct Transcoder
+{
+    using SourceCodeUnit = typename SourceEncoding::CodeUnit;
+    using TargetCodeUnit = typename TargetEncoding::CodeUnit;
+
+    //--------------------------------------------------------------------------
+    // Return the length, in target code units, of the conversion of the input
+    // string, or -1 if the input is invalid and the policy is Throw
+    //--------------------------------------------------------------------------
+    static long long Length(const SourceCodeUnit* source, int sourceLength,
+                            InvalidInputPolicy policy) noexcept
+    {
+        const int invalidLength = (policy == InvalidInputPolicy::Replace)
+            ? TargetEncoding::EncodedLength(TargetEncoding::kReplacementCodePoint) : 0;
+
+        long long targetLength = 0;
+
+        int i = 0;
+        while (i < sourceLength)
+        {
+            if (static_cast<unsigned int>(source[i]) < 0x80)
+            {
+                // Skip the whole ASCII run at once
+                const int asciiLength = SourceEncoding::AsciiPrefixLength(
+                    source + i, sourceLength - i);
+                i += asciiLength;
+                targetLength += asciiLength;
+                continue;
+            }
+
+            unsigned int codePoint = 0;
+            int skipLength = 0;
+            const int sequenceLength = SourceEncoding::Decode(
+                source + i, sourceLength - i, codePoint, skipLength);
+
+            if ((sequenceLength > 0) && TargetEncoding::CanEncode(codePoint))
+            {
+                targetLength += TargetEncoding::EncodedLength(codePoint);
+                i += sequenceLength;
+                continue;
+            }
+
+            // Invalid input, or code point not available in the target encoding
+            if (policy == InvalidInputPolicy::Throw)
+            {
+                return -1;
+            }
+            targetLength += invalidLength;
+            i += (sequenceLength > 0) ? sequenceLength : skipLength;
+        }
+
+        return targetLength;
+    }
+
+    //--------------------------------------------------------------------------
+    // Convert the input string into the destination buffer, which must be
+    // large enough for the whole conversion (see Length).
+    // With the Throw policy, the input must have already been validated
+    // by Length.
+    // Return a pointer past the last code unit written.
+    //--------------------------------------------------------------------------
+    static TargetCodeUnit* Convert(const SourceCodeUnit* source, int sourceLength,
+                                   TargetCodeUnit* target, InvalidInputPolicy policy) noexcept
+    {
+        int i = 0;
+        while (i < sourceLength)
+        {
+            if (static_cast<unsigned int>(source[i]) < 0x80)
+            {
+                // Copy the whole ASCII run at once
+                const int asciiLength = CopyAsciiPrefix(source + i, sourceLength - i, target);
+                i += asciiLength;
+                target += asciiLength;
+                continue;
+            }
+
+            unsigned int codePoint = 0;
+            int skipLength = 0;
+            const int sequenceLength = SourceEncoding::Decode(
+                source + i, sourceLength - i, codePoint, skipLength);
+
+            if ((sequenceLength > 0) && TargetEncoding::CanEncode(codePoint))
+            {
+                target += TargetEncoding::Encode(codePoint, target);
+                i += sequenceLength;
+                continue;
+            }
+
+            // Invalid input, or code point not available in the target encoding
+            ATLASSERT(policy != InvalidInputPolicy::Throw);
+            if (policy == InvalidInputPolicy::Replace)
+            {
+                target += TargetEncoding::Encode(TargetEncoding::kReplacementCodePoint, target);
+            }
+            i += (sequenceLength > 0) ? sequenceLength : skipLength;
+        }
+
+        return target;
+    }
+};
+
+
+//------------------------------------------------------------------------------
+// Latin-1 to UTF-16: each char is zero-extended to a wchar_t,
+// 16 chars at a time with SSE2
+//------------------------------------------------------------------------------
+template <>
+struct Transcoder<Latin1Encoding, Utf16Encoding>
+{
+    static long long Length(const char*, int latin1Length, InvalidInputPolicy) noexcept
+    {
+        return latin1Length;
+    }
+
+    static wchar_t* Convert(const char* latin1, int latin1Length, wchar_t* utf16,
+                            InvalidInputPolicy) noexcept
+    {
+        int i = 0;
+
+#ifdef UNICODECONVATL_HAS_SSE2
+        const __m128i kZero = _mm_setzero_si128();
+        for (; i + 16 <= latin1Length; i += 16)
+        {
+            const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(latin1 + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(utf16 + i), _mm_unpacklo_epi8(chunk, kZero));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(utf16 + i + 8), _mm_unpackhi_epi8(chunk, kZero));
+        }
+#endif
+
+        // Process the remaining chars one at a time
+        for (; i < latin1Length; ++i)
+        {
+            utf16[i] = static_cast<wchar_t>(static_cast<unsigned char>(latin1[i]));
+        }
+
+        return utf16 + latin1Length;
+    }
+};
+
+} // namespace Detail
+
+
+//==============================================================================
+//                          Generic Conversions
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Append the conversion of the input string from SourceEncoding
+// to TargetEncoding to the destination string, with the given error policy
+// (ThrowOnError, ReturnHResult, ReplaceInvalidInput or SkipInvalidInput;
+// see "Conversion Policies" in UnicodeConvAtl.h). For example:
+//
+//      CAtlArray<char32_t> utf32;
+//      AppendEncoded<Utf8Encoding, Utf32Encoding>(utf8, utf8Length, utf32);
+//
+// The return type is the ResultType of the error policy (void or HRESULT).
+// On error, the destination string is left unchanged.
+//------------------------------------------------------------------------------
+template <class SourceEncoding, class TargetEncoding, class ErrorPolicy = ThrowOnError>
+typename ErrorPolicy::ResultType AppendEncoded(const typename SourceEncoding::CodeUnit* source,
+                                               int sourceLength,
+                                               typename TargetEncoding::StringType& target)
+{
+    using AllocPolicy = typename TargetEncoding::AllocPolicy;
+    using Transcoder = Detail::Transcoder<SourceEncoding, TargetEncoding>;
+
+    ATLASSERT(source != nullptr || sourceLength == 0);
+    if (sourceLength < 0)
+    {
+        return ErrorPolicy::Failure(E_INVALIDARG);
+    }
+
+    // Special case of empty input string: nothing to append
+    if (sourceLength == 0)
+    {
+        return ErrorPolicy::Success();
+    }
+
+    // Get the length of the conversion, validating the input
+    const long long appendLength = Transcoder::Length(
+        source, sourceLength, ErrorPolicy::kInvalidInputPolicy);
+    if (appendLength < 0)
+    {
+        // Same error signaled by the Win32 APIs with the strict flags
+        return ErrorPolicy::Failure(HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION));
+    }
+
+    // All the input may have been skipped; an empty CAtlArray has no buffer
+    if (appendLength == 0)
+    {
+        return ErrorPolicy::Success();
+    }
+
+    const int oldLength = AllocPolicy::GetLength(target);
+    if (appendLength > INT_MAX - oldLength)
+    {
+        return ErrorPolicy::Failure(HRESULT_FROM_WIN32(ERROR_ARITHMETIC_OVERFLOW));
+    }
+    const int targetLength = oldLength + static_cast<int>(appendLength);
+
+    // Make room in the destination string for the converted bits
+    auto targetBuffer = AllocPolicy::GetBuffer(target, targetLength);
+    if (targetBuffer == nullptr)
+    {
+        return ErrorPolicy::Failure(E_OUTOFMEMORY);
+    }
+
+    Transcoder::Convert(source, sourceLength, targetBuffer + oldLength,
+                        ErrorPolicy::kInvalidInputPolicy);
+
+    AllocPolicy::ReleaseBuffer(target, targetLength);
+    return ErrorPolicy::Success();
+}
+
+
+//------------------------------------------------------------------------------
+// Convert the input string from SourceEncoding to TargetEncoding, storing
+// the result in the destination string (its previous content is replaced,
+// and it's left empty on error), with the given error policy
+// (see AppendEncoded)
+//------------------------------------------------------------------------------
+template <class SourceEncoding, class TargetEncoding, class ErrorPolicy = ThrowOnError>
+typename ErrorPolicy::ResultType ConvertEncoding(const typename SourceEncoding::CodeUnit* source,
+                                                 int sourceLength,
+                                                 typename TargetEncoding::StringType& target)
+{
+    TargetEncoding::AllocPolicy::Truncate(target, 0);
+    return AppendEncoded<SourceEncoding, TargetEncoding, ErrorPolicy>(
+        source, sourceLength, target);
+}
+
+
+namespace Detail {
+
+//------------------------------------------------------------------------------
+// Append the conversion of the input string, with the error policy matching
+// the given InvalidInputPolicy. Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+template <class SourceEncoding, class TargetEncoding>
+void AppendEncodedWithPolicy(const typename SourceEncoding::CodeUnit* source,
+                             int sourceLength,
+                             typename TargetEncoding::StringType& target,
+                             InvalidInputPolicy policy)
+{
+    switch (policy)
+    {
+    case InvalidInputPolicy::Replace:
+        AppendEncoded<SourceEncoding, TargetEncoding, ReplaceInvalidInput>(
+            source, sourceLength, target);
+        break;
+
+    case InvalidInputPolicy::Skip:
+        AppendEncoded<SourceEncoding, TargetEncoding, SkipInvalidInput>(
+            source, sourceLength, target);
+        break;
+
+    default:
+        AppendEncoded<SourceEncoding, TargetEncoding, ThrowOnError>(
+            source, sourceLength, target);
+        break;
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Convert the input string, replacing the content of the destination string
+// (left empty on error), with the given InvalidInputPolicy.
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+template <class SourceEncoding, class TargetEncoding>
+void ConvertEncodingWithPolicy(const typename SourceEncoding::CodeUnit* source,
+                               int sourceLength,
+                               typename TargetEncoding::StringType& target,
+                               InvalidInputPolicy policy)
+{
+    TargetEncoding::AllocPolicy::Truncate(target, 0);
+    AppendEncodedWithPolicy<SourceEncoding, TargetEncoding>(source, sourceLength, target, policy);
+}
+
+} // namespace Detail
+
+
+//==============================================================================
+//                          UTF-32 Conversions
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Convert from UTF-16 to UTF-32, storing the result in the destination array
+// (its previous content is replaced, and its memory is reused).
+// Unpaired surrogates are handled according to the given policy.
+//------------------------------------------------------------------------------
+inline void Utf16ToUtf32(const wchar_t* utf16, int utf16Length, CAtlArray<char32_t>& utf32,
+                         InvalidInputPolicy policy = InvalidInputPolicy::Throw)
+{
+    Detail::ConvertEncodingWithPolicy<Utf16Encoding, Utf32Encoding>(
+        utf16, utf16Length, utf32, policy);
+}
+
+
+inline void Utf16ToUtf32(CStringW const& utf16, CAtlArray<char32_t>& utf32,
+                         InvalidInputPolicy policy = InvalidInputPolicy::Throw)
+{
+    Utf16ToUtf32(utf16.GetString(), utf16.GetLength(), utf32, policy);
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-8 to UTF-32, storing the result in the destination array
+// (its previous content is replaced, and its memory is reused).
+// Ill-formed sequences are handled according to the given policy.
+//------------------------------------------------------------------------------
+inline void Utf8ToUtf32(const char* utf8, int utf8Length, CAtlArray<char32_t>& utf32,
+                        InvalidInputPolicy policy = InvalidInputPolicy::Throw)
+{
+    Detail::ConvertEncodingWithPolicy<Utf8Encoding, Utf32Encoding>(
+        utf8, utf8Length, utf32, policy);
+}
+
+
+inline void Utf8ToUtf32(CStringA const& utf8, CAtlArray<char32_t>& utf32,
+                        InvalidInputPolicy policy = InvalidInputPolicy::Throw)
+{
+    Utf8ToUtf32(utf8.GetString(), utf8.GetLength(), utf32, policy);
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-32 to UTF-16, storing the result in the destination string
+// (its previous content is replaced, and its buffer is reused).
+// Surrogates and code points above U+10FFFF are handled according to
+// the given policy.
+//------------------------------------------------------------------------------
+inline void Utf32ToUtf16(const char32_t* utf32, int utf32Length, CStringW& utf16,
+                         InvalidInputPolicy policy = InvalidInputPolicy::Throw)
+{
+    Detail::ConvertEncodingWithPolicy<Utf32Encoding, Utf16Encoding>(
+        utf32, utf32Length, utf16, policy);
+}
+
+
+inline CStringW Utf32ToUtf16(const char32_t* utf32, int utf32Length,
+                             InvalidInputPolicy policy = InvalidInputPolicy::Throw)
+{
+    CStringW utf16;
+    Utf32ToUtf16(utf32, utf32Length, utf16, policy);
+    return utf16;
+}
+
+
+inline CStringW Utf32ToUtf16(CAtlArray<char32_t> const& utf32,
+                             InvalidInputPolicy policy = InvalidInputPolicy::Throw)
+{
+    return Utf32ToUtf16(utf32.GetData(), Detail::ToIntLength(utf32.GetCount()), policy);
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-32 to UTF-8, storing the result in the destination string
+// (its previous content is replaced, and its buffer is reused).
+// Surrogates and code points above U+10FFFF are handled according to
+// the given policy.
+//------------------------------------------------------------------------------
+inline void Utf32ToUtf8(const char32_t* utf32, int utf32Length, CStringA& utf8,
+                        InvalidInputPolicy policy = InvalidInputPolicy::Throw)
+{
+    Detail::ConvertEncodingWithPolicy<Utf32Encoding, Utf8Encoding>(
+        utf32, utf32Length, utf8, policy);
+}
+
+
+inline CStringA Utf32ToUtf8(const char32_t* utf32, int utf32Length,
+                            InvalidInputPolicy policy = InvalidInputPolicy::Throw)
+{
+    CStringA utf8;
+    Utf32ToUtf8(utf32, utf32Length, utf8, policy);
+    return utf8;
+}
+
+
+inline CStringA Utf32ToUtf8(CAtlArray<char32_t> const& utf32,
+                            InvalidInputPolicy policy = InvalidInputPolicy::Throw)
+{
+    return Utf32ToUtf8(utf32.GetData(), Detail::ToIntLength(utf32.GetCount()), policy);
+}
+
+
+//==============================================================================
+//                          Latin-1 Conversions
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Convert from Latin-1 to UTF-16, storing the result in the destination
+// string (its previous content is replaced, and its buffer is reused).
+// Every Latin-1 string is valid.
+//------------------------------------------------------------------------------
+inline void Latin1ToUtf16(const char* latin1, int latin1Length, CStringW& utf16)
+{
+    ConvertEncoding<Latin1Encoding, Utf16Encoding>(latin1, latin1Length, utf16);
+}
+
+
+inline void Latin1ToUtf16(CStringA const& latin1, CStringW& utf16)
+{
+    Latin1ToUtf16(latin1.GetString(), latin1.GetLength(), utf16);
+}
+
+
+inline CStringW Latin1ToUtf16(const char* latin1, int latin1Length)
+{
+    CStringW utf16;
+    Latin1ToUtf16(latin1, latin1Length, utf16);
+    return utf16;
+}
+
+
+inline CStringW Latin1ToUtf16(CStringA const& latin1)
+{
+    return Latin1ToUtf16(latin1.GetString(), latin1.GetLength());
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from Latin-1 to UTF-8, storing the result in the destination
+// string (its previous content is replaced, and its buffer is reused).
+// Every Latin-1 string is valid.
+//------------------------------------------------------------------------------
+inline void Latin1ToUtf8(const char* latin1, int latin1Length, CStringA& utf8)
+{
+    ConvertEncoding<Latin1Encoding, Utf8Encoding>(latin1, latin1Length, utf8);
+}
+
+
+inline void Latin1ToUtf8(CStringA const& latin1, CStringA& utf8)
+{
+    ATLASSERT(&latin1 != &utf8);
+    Latin1ToUtf8(latin1.GetString(), latin1.GetLength(), utf8);
+}
+
+
+inline CStringA Latin1ToUtf8(const char* latin1, int latin1Length)
+{
+    CStringA utf8;
+    Latin1ToUtf8(latin1, latin1Length, utf8);
+    return utf8;
+}
+
+
+inline CStringA Latin1ToUtf8(CStringA const& latin1)
+{
+    return Latin1ToUtf8(latin1.GetString(), latin1.GetLength());
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-16 to Latin-1, storing the result in the destination
+// string (its previous content is replaced, and its buffer is reused).
+// Unpaired surrogates, and characters not available in Latin-1
+// (above U+00FF), are handled according to the given policy.
+//------------------------------------------------------------------------------
+inline void Utf16ToLatin1(const wchar_t* utf16, int utf16Length, CStringA& latin1,
+                          InvalidInputPolicy policy = InvalidInputPolicy::Throw)
+{
+    Detail::ConvertEncodingWithPolicy<Utf16Encoding, Latin1Encoding>(
+        utf16, utf16Length, latin1, policy);
+}
+
+
+inline void Utf16ToLatin1(CStringW const& utf16, CStringA& latin1,
+                          InvalidInputPolicy policy = InvalidInputPolicy::Throw)
+{
+    Utf16ToLatin1(utf16.GetString(), utf16.GetLength(), latin1, policy);
+}
+
+
+inline CStringA Utf16ToLatin1(const wchar_t* utf16, int utf16Length,
+                              InvalidInputPolicy policy = InvalidInputPolicy::Throw)
+{
+    CStringA latin1;
+    Utf16ToLatin1(utf16, utf16Length, latin1, policy);
+    return latin1;
+}
+
+
+inline CStringA Utf16ToLatin1(CStringW const& utf16,
+                              InvalidInputPolicy policy = InvalidInputPolicy::Throw)
+{
+    return Utf16ToLatin1(utf16.GetString(), utf16.GetLength(), policy);
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-8 to Latin-1, storing the result in the destination
+// string (its previous content is replaced, and its buffer is reused).
+// Ill-formed sequences, and characters not available in Latin-1
+// (above U+00FF), are handled according to the given policy.
+//------------------------------------------------------------------------------
+inline void Utf8ToLatin1(const char* utf8, int utf8Length, CStringA& latin1,
+                         InvalidInputPolicy policy = InvalidInputPolicy::Throw)
+{
+    Detail::ConvertEncodingWithPolicy<Utf8Encoding, Latin1Encoding>(
+        utf8, utf8Length, latin1, policy);
+}
+
+
+inline void Utf8ToLatin1(CStringA const& utf8, CStringA& latin1,
+                         InvalidInputPolicy policy = InvalidInputPolicy::Throw)
+{
+    ATLASSERT(&utf8 != &latin1);
+    Utf8ToLatin1(utf8.GetString(), utf8.GetLength(), latin1, policy);
+}
+
+
+inline CStringA Utf8ToLatin1(const char* utf8, int utf8Length,
+                             InvalidInputPolicy policy = InvalidInputPolicy::Throw)
+{
+    CStringA latin1;
+    Utf8ToLatin1(utf8, utf8Length, latin1, policy);
+    return latin1;
+}
+
+
+inline CStringA Utf8ToLatin1(CStringA const& utf8,
+                             InvalidInputPolicy policy = InvalidInputPolicy::Throw)
+{
+    return Utf8ToLatin1(utf8.GetString(), utf8.GetLength(), policy);
+}
+
+
+//==============================================================================
+//                          WTF-8 Conversions
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Convert from potentially ill-formed UTF-16 to WTF-8, storing the result
+// in the destination string (its previous content is replaced, and its buffer
+// is reused). Unpaired surrogates are encoded, instead of being rejected
+// like ToUtf8 does, so every UTF-16 string is valid.
+// For well-formed UTF-16, the result is the same of ToUtf8.
+//------------------------------------------------------------------------------
+inline void Utf16ToWtf8(const wchar_t* utf16, int utf16Length, CStringA& wtf8)
+{
+    ConvertEncoding<Wtf16Encoding, Wtf8Encoding>(utf16, utf16Length, wtf8);
+}
+
+
+inline void Utf16ToWtf8(CStringW const& utf16, CStringA& wtf8)
+{
+    Utf16ToWtf8(utf16.GetString(), utf16.GetLength(), wtf8);
+}
+
+
+inline CStringA Utf16ToWtf8(const wchar_t* utf16, int utf16Length)
+{
+    CStringA wtf8;
+    Utf16ToWtf8(utf16, utf16Length, wtf8);
+    return wtf8;
+}
+
+
+inline CStringA Utf16ToWtf8(CStringW const& utf16)
+{
+    return Utf16ToWtf8(utf16.GetString(), utf16.GetLength());
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from WTF-8 to potentially ill-formed UTF-16, storing the result
+// in the destination string (its previous content is replaced, and its buffer
+// is reused). Encoded unpaired surrogates are decoded back to the same
+// code units; ill-formed sequences are handled according to the given policy.
+//------------------------------------------------------------------------------
+inline void Wtf8ToUtf16(const char* wtf8, int wtf8Length, CStringW& utf16,
+                        InvalidInputPolicy policy = InvalidInputPolicy::Throw)
+{
+    Detail::ConvertEncodingWithPolicy<Wtf8Encoding, Wtf16Encoding>(
+        wtf8, wtf8Length, utf16, policy);
+}
+
+
+inline void Wtf8ToUtf16(CStringA const& wtf8, CStringW& utf16,
+                        InvalidInputPolicy policy = InvalidInputPolicy::Throw)
+{
+    Wtf8ToUtf16(wtf8.GetString(), wtf8.GetLength(), utf16, policy);
+}
+
+
+inline CStringW Wtf8ToUtf16(const char* wtf8, int wtf8Length,
+                            InvalidInputPolicy policy = InvalidInputPolicy::Throw)
+{
+    CStringW utf16;
+    Wtf8ToUtf16(wtf8, wtf8Length, utf16, policy);
+    return utf16;
+}
+
+
+inline CStringW Wtf8ToUtf16(CStringA const& wtf8,
+                            InvalidInputPolicy policy = InvalidInputPolicy::Throw)
+{
+    return Wtf8ToUtf16(wtf8.GetString(), wtf8.GetLength(), policy);
+}
+
+
+//==============================================================================
+//                          CESU-8 Conversions
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Convert from UTF-16 to CESU-8, storing the result in the destination string
+// (its previous content is replaced, and its buffer is reused).
+// Unpaired surrogates are handled according to the given policy.
+//------------------------------------------------------------------------------
+inline void Utf16ToCesu8(const wchar_t* utf16, int utf16Length, CStringA& cesu8,
+                         InvalidInputPolicy policy = InvalidInputPolicy::Throw)
+{
+    Detail::ConvertEncodingWithPolicy<Utf16Encoding, Cesu8Encoding>(
+        utf16, utf16Length, cesu8, policy);
+}
+
+
+inline void Utf16ToCesu8(CStringW const& utf16, CStringA& cesu8,
+                         InvalidInputPolicy policy = InvalidInputPolicy::Throw)
+{
+    Utf16ToCesu8(utf16.GetString(), utf16.GetLength(), cesu8, policy);
+}
+
+
+inline CStringA Utf16ToCesu8(const wchar_t* utf16, int utf16Length,
+                             InvalidInputPolicy policy = InvalidInputPolicy::Throw)
+{
+    CStringA cesu8;
+    Utf16ToCesu8(utf16, utf16Length, cesu8, policy);
+    return cesu8;
+}
+
+
+inline CStringA Utf16ToCesu8(CStringW const& utf16,
+                             InvalidInputPolicy policy = InvalidInputPolicy::Throw)
+{
+    return Utf16ToCesu8(utf16.GetString(), utf16.GetLength(), policy);
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from CESU-8 to UTF-16, storing the result in the destination string
+// (its previous content is replaced, and its buffer is reused).
+// Ill-formed sequences, including 4-char UTF-8 sequences, are handled
+// according to the given policy.
+//------------------------------------------------------------------------------
+inline void Cesu8ToUtf16(const char* cesu8, int cesu8Length, CStringW& utf16,
+                         InvalidInputPolicy policy = InvalidInputPolicy::Throw)
+{
+    Detail::ConvertEncodingWithPolicy<Cesu8Encoding, Utf16Encoding>(
+        cesu8, cesu8Length, utf16, policy);
+}
+
+
+inline void Cesu8ToUtf16(CStringA const& cesu8, CStringW& utf16,
+                         InvalidInputPolicy policy = InvalidInputPolicy::Throw)
+{
+    Cesu8ToUtf16(cesu8.GetString(), cesu8.GetLength(), utf16, policy);
+}
+
+
+inline CStringW Cesu8ToUtf16(const char* cesu8, int cesu8Length,
+                             InvalidInputPolicy policy = InvalidInputPolicy::Throw)
+{
+    CStringW utf16;
+    Cesu8ToUtf16(cesu8, cesu8Length, utf16, policy);
+    return utf16;
+}
+
+
+inline CStringW Cesu8ToUtf16(CStringA const& cesu8,
+                             InvalidInputPolicy policy = InvalidInputPolicy::Throw)
+{
+    return Cesu8ToUtf16(cesu8.GetString(), cesu8.GetLength(), policy);
+}
+
+
+//==============================================================================
+//                          Streaming Conversions
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Stateful converter from SourceEncoding to TargetEncoding, for input
+// that arrives in chunks (see Utf8ToUtf16Stream in UnicodeConvAtl.h).
+//
+// A code unit sequence split across two chunks is carried over from one
+// Convert call to the next one, so each chunk can be cut at any code unit.
+// Invalid input is handled according to the policy passed to the constructor;
+// errors are signaled using AtlThrow. After an error, call Reset before
+// reusing the object.
+//------------------------------------------------------------------------------
+template <class SourceEncoding, class TargetEncoding>
+class EncodingStream
+{
+public:
+    using SourceCodeUnit = typename SourceEncoding::CodeUnit;
+    using TargetString = typename TargetEncoding::StringType;
+
+    explicit EncodingStream(InvalidInputPolicy policy = InvalidInputPolicy::Throw) noexcept
+        : m_policy(policy)
+    {
+    }
+
+    // Convert the next chunk of input, appending the result to the destination string
+    void Convert(const SourceCodeUnit* source, int sourceLength, TargetString& target)
+    {
+        ATLASSERT(source != nullptr || sourceLength == 0);
+        if (sourceLength < 0)
+        {
+            AtlThrow(E_INVALIDARG);
+        }
+
+        // Complete the pending sequence one code unit at a time:
+        // this only involves the first few code units of the chunk
+        while ((m_pendingLength > 0) && (sourceLength > 0))
+        {
+            m_pending[m_pendingLength++] = *source++;
+            --sourceLength;
+
+            const int tailLength = SourceEncoding::IncompleteTailLength(m_pending, m_pendingLength);
+            if (tailLength < m_pendingLength)
+            {
+                const int headLength = m_pendingLength - tailLength;
+                Detail::AppendEncodedWithPolicy<SourceEncoding, TargetEncoding>(
+                    m_pending, headLength, target, m_policy);
+
+                memmove(m_pending, m_pending + headLength, tailLength * sizeof(SourceCodeUnit));
+                m_pendingLength = tailLength;
+            }
+        }
+
+        // Keep an incomplete sequence at the end of the chunk for the next call
+        const int tailLength = SourceEncoding::IncompleteTailLength(source, sourceLength);
+        ATLASSERT(tailLength <= SourceEncoding::kMaxPendingLength);
+        Detail::AppendEncodedWithPolicy<SourceEncoding, TargetEncoding>(
+            source, sourceLength - tailLength, target, m_policy);
+
+        memcpy(m_pending + m_pendingLength, source + sourceLength - tailLength,
+               tailLength * sizeof(SourceCodeUnit));
+        m_pendingLength += tailLength;
+    }
+
+    // Signal the end of the input, converting any pending sequence.
+    // A truncated sequence is invalid, and handled according to the policy.
+    void Finish(TargetString& target)
+    {
+        if (m_pendingLength > 0)
+        {
+            const int pendingLength = m_pendingLength;
+            m_pendingLength = 0;
+            Detail::AppendEncodedWithPolicy<SourceEncoding, TargetEncoding>(
+                m_pending, pendingLength, target, m_policy);
+        }
+    }
+
+    // Discard any pending input, to start converting a new stream
+    void Reset() noexcept
+    {
+        m_pendingLength = 0;
+    }
+
+    // Is there an incomplete sequence waiting for the next chunk?
+    bool HasPendingInput() const noexcept
+    {
+        return m_pendingLength > 0;
+    }
+
+private:
+    // Incomplete sequence carried over from the previous chunk,
+    // plus room for the code unit being added to it
+    SourceCodeUnit m_pending[SourceEncoding::kMaxPendingLength + 1] = {};
+    int m_pendingLength = 0;
+
+    InvalidInputPolicy m_policy;
+};
+
+
+//------------------------------------------------------------------------------
+// Streaming converters between the most common encoding pairs
+//------------------------------------------------------------------------------
+typedef EncodingStream<Utf8Encoding, Utf32Encoding>     Utf8ToUtf32Stream;
+typedef EncodingStream<Utf32Encoding, Utf8Encoding>     Utf32ToUtf8Stream;
+typedef EncodingStream<Latin1Encoding, Utf8Encoding>    Latin1ToUtf8Stream;
+typedef EncodingStream<Utf8Encoding, Latin1Encoding>    Utf8ToLatin1Stream;
+typedef EncodingStream<Wtf8Encoding, Wtf16Encoding>     Wtf8ToUtf16Stream;
+typedef EncodingStream<Wtf16Encoding, Wtf8Encoding>     Utf16ToWtf8Stream;
+typedef EncodingStream<Cesu8Encoding, Utf16Encoding>    Cesu8ToUtf16Stream;
+typedef EncodingStream<Utf16Encoding, Cesu8Encoding>    Utf16ToCesu8Stream;
+
+} // namespace UnicodeConvAtl
@@ -0,0 +1,315 @@
+#pragma once
+
+////////////////////////////////////////////////////////////////////////////////
+// Unicode UTF-16/UTF-8 conversion of whole files, using memory-mapped I/O
+//
+//                  Copyright (C) by Giovanni Dicanio
+//                    <giovanni.dicanio AT gmail.com>
+//
+////////////////////////////////////////////////////////////////////////////////
+
+
+//------------------------------------------------------------------------------
+// This header extends UnicodeConvAtl.h with functions that convert
+// text files between UTF-8 and UTF-16 (little-endian):
+//
+//      * Convert a UTF-8 file to UTF-16:
+//        void ConvertFileUtf8ToUtf16(LPCWSTR inputPath, LPCWSTR outputPath)
+//
+//      * Convert a UTF-16 file to UTF-8:
+//        void ConvertFileUtf16ToUtf8(LPCWSTR inputPath, LPCWSTR outputPath)
+//
+// The input file is mapped in memory one window at a time, and each window
+// is converted with the streaming converters, so files of any size
+// can be converted with bounded memory usage, without reading them
+// into a CString first.
+//
+// The content is converted as is: a byte order mark at the beginning
+// of the input file is converted like any other character.
+//
+// These functions live under the UnicodeConvAtl namespace,
+// and signal errors using AtlThrow.
+//
+// This code is released under the MIT License (see UnicodeConvAtl.h).
+//------------------------------------------------------------------------------
+
+
+//==============================================================================
+//                              Includes
+//==============================================================================
+
+#include "UnicodeConvAtl.h"     // Unicode UTF-16/UTF-8 conversions
+
+#include <atlbase.h>            // CHandle
+
+
+//==============================================================================
+//                          Implementation Details
+//==============================================================================
+
+namespace UnicodeConvAtl {
+namespace Detail {
+
+//------------------------------------------------------------------------------
+// Default size of the input file windows mapped in memory, in bytes
+//------------------------------------------------------------------------------
+constexpr DWORD kDefaultFileWindowSize = 16 * 1024 * 1024;
+
+
+//------------------------------------------------------------------------------
+// Maximum size of the input file windows, in bytes.
+// The windows are converted using int lengths, so keep them well below INT_MAX.
+//------------------------------------------------------------------------------
+constexpr DWORD kMaxFileWindowSize = 1024 * 1024 * 1024;
+
+
+//------------------------------------------------------------------------------
+// RAII wrapper around a view of a file mapping
+//------------------------------------------------------------------------------
+class MappedFileView
+{
+public:
+    MappedFileView(HANDLE hMapping, ULONGLONG offset, SIZE_T size)
+    {
+        m_pView = ::MapViewOfFile(
+            hMapping,
+            FILE_MAP_READ,
+            static_cast<DWORD>(offset >> 32),
+            static_cast<DWORD>(offset & 0xFFFFFFFF),
+            size
+        );
+        if (m_pView == nullptr)
+        {
+            AtlThrowLastWin32();
+        }
+    }
+
+    ~MappedFileView()
+    {
+        ::UnmapViewOfFile(m_pView);
+    }
+
+    const void* GetData() const noexcept
+    {
+        return m_pView;
+    }
+
+    // Ban copy
+    MappedFileView(const MappedFileView&) = delete;
+    MappedFileView& operator=(const MappedFileView&) = delete;
+
+private:
+    void* m_pView;
+};
+
+
+//------------------------------------------------------------------------------
+// Open a file with CreateFileW.
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+inline HANDLE OpenFileHandle(LPCWSTR path, DWORD desiredAccess, DWORD shareMode,
+                             DWORD creationDisposition)
+{
+    HANDLE hFile = ::CreateFileW(
+        path,
+        desiredAccess,
+        shareMode,
+        nullptr,                    // default security
+        creationDisposition,
+        FILE_FLAG_SEQUENTIAL_SCAN,  // files are read and written sequentially
+        nullptr                     // no template file
+    );
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        AtlThrowLastWin32();
+    }
+
+    return hFile;
+}
+
+
+//------------------------------------------------------------------------------
+// Write the whole input buffer to the given file.
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+inline void WriteFileData(HANDLE hFile, const void* data, DWORD size)
+{
+    DWORD written = 0;
+    if (!::WriteFile(hFile, data, size, &written, nullptr))
+    {
+        AtlThrowLastWin32();
+    }
+    if (written != size)
+    {
+        AtlThrow(HRESULT_FROM_WIN32(ERROR_WRITE_FAULT));
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Round the requested window size to a multiple of the system allocation
+// granularity, as required for the offsets of the file views
+//------------------------------------------------------------------------------
+inline DWORD GetFileWindowSize(DWORD requestedSize) noexcept
+{
+    SYSTEM_INFO systemInfo;
+    ::GetSystemInfo(&systemInfo);
+    const DWORD granularity = systemInfo.dwAllocationGranularity;
+
+    if (requestedSize < granularity)
+    {
+        return granularity;
+    }
+
+    if (requestedSize > kMaxFileWindowSize)
+    {
+        requestedSize = kMaxFileWindowSize;
+    }
+
+    return requestedSize - (requestedSize % granularity);
+}
+
+
+//------------------------------------------------------------------------------
+// Map the input file one window at a time, and invoke the given function
+// on each window, passing the window data and size in bytes.
+// Then write the text produced by the function to the output file.
+// On error, the output file is deleted.
+//------------------------------------------------------------------------------
+template <typename ConvertWindowFunc, typename OutputString>
+void TranscodeFile(LPCWSTR inputPath, LPCWSTR outputPath, DWORD windowSize,
+                   OutputString& scratch, ConvertWindowFunc convertWindow)
+{
+    ATLASSERT(inputPath != nullptr);
+    ATLASSERT(outputPath != nullptr);
+
+    CHandle inputFile(OpenFileHandle(inputPath, GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING));
+
+    LARGE_INTEGER fileSize;
+    if (!::GetFileSizeEx(inputFile, &fileSize))
+    {
+        AtlThrowLastWin32();
+    }
+    const ULONGLONG inputSize = static_cast<ULONGLONG>(fileSize.QuadPart);
+
+    CHandle outputFile(OpenFileHandle(outputPath, GENERIC_WRITE, 0, CREATE_ALWAYS));
+
+    try
+    {
+        // Empty files can't be mapped: the output file is just empty as well
+        if (inputSize > 0)
+        {
+            CHandle mapping(::CreateFileMappingW(inputFile, nullptr, PAGE_READONLY, 0, 0, nullptr));
+            if (mapping.m_h == nullptr)
+            {
+                AtlThrowLastWin32();
+            }
+
+            windowSize = GetFileWindowSize(windowSize);
+
+            for (ULONGLONG offset = 0; offset < inputSize; offset += windowSize)
+            {
+                const ULONGLONG remaining = inputSize - offset;
+                const DWORD viewSize = (remaining < windowSize)
+                                        ? static_cast<DWORD>(remaining) : windowSize;
+                const bool isLastWindow = (offset + viewSize == inputSize);
+
+                // Convert the current window into the scratch string,
+                // whose buffer is reused across windows
+                scratch.Truncate(0);
+                {
+                    MappedFileView view(mapping, offset, viewSize);
+                    convertWindow(view.GetData(), viewSize, isLastWindow);
+                }
+
+                // A window's output is at most twice its size (UTF-8 to UTF-16),
+                // so it always fits in a DWORD given kMaxFileWindowSize
+                const size_t outputBytes = static_cast<size_t>(scratch.GetLength())
+                                           * sizeof(scratch[0]);
+                ATLASSERT(outputBytes <= MAXDWORD);
+                if (outputBytes > MAXDWORD)
+                {
+                    AtlThrow(HRESULT_FROM_WIN32(ERROR_ARITHMETIC_OVERFLOW));
+                }
+                const DWORD bytesToWrite = static_cast<DWORD>(outputBytes);
+                if (bytesToWrite > 0)
+                {
+                    WriteFileData(outputFile, scratch.GetString(), bytesToWrite);
+                }
+            }
+        }
+    }
+    catch (...)
+    {
+        // Don't leave a partially converted output file around
+        outputFile.Close();
+        ::DeleteFileW(outputPath);
+        throw;
+    }
+}
+
+} // namespace Detail
+
+
+//==============================================================================
+//                          Function Implementations
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Convert a UTF-8 text file to a UTF-16 (little-endian) text file.
+// The input file is mapped in memory in windows of windowSize bytes
+// (rounded to the system allocation granularity).
+// Signal errors using AtlThrow; on error, the output file is deleted.
+//------------------------------------------------------------------------------
+inline void ConvertFileUtf8ToUtf16(LPCWSTR inputPath, LPCWSTR outputPath,
+                                   DWORD windowSize = Detail::kDefaultFileWindowSize)
+{
+    Utf8ToUtf16Stream stream;
+    CStringW utf16;
+
+    Detail::TranscodeFile(inputPath, outputPath, windowSize, utf16,
+        [&](const void* data, DWORD size, bool isLastWindow)
+        {
+            stream.Convert(static_cast<const char*>(data), static_cast<int>(size), utf16);
+            if (isLastWindow)
+            {
+                stream.Finish();
+            }
+        }
+    );
+}
+
+
+//------------------------------------------------------------------------------
+// Convert a UTF-16 (little-endian) text file to a UTF-8 text file.
+// The input file is mapped in memory in windows of windowSize bytes
+// (rounded to the system allocation granularity).
+// Signal errors using AtlThrow; on error, the output file is deleted.
+//------------------------------------------------------------------------------
+inline void ConvertFileUtf16ToUtf8(LPCWSTR inputPath, LPCWSTR outputPath,
+                                   DWORD windowSize = Detail::kDefaultFileWindowSize)
+{
+    Utf16ToUtf8Stream stream;
+    CStringA utf8;
+
+    Detail::TranscodeFile(inputPath, outputPath, windowSize, utf8,
+        [&](const void* data, DWORD size, bool isLastWindow)
+        {
+            // The window offsets are even, so only the end of the file
+            // can split a UTF-16 code unit
+            if (size % sizeof(wchar_t) != 0)
+            {
+                AtlThrow(HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION));
+            }
+
+            stream.Convert(static_cast<const wchar_t*>(data),
+                           static_cast<int>(size / sizeof(wchar_t)), utf8);
+            if (isLastWindow)
+            {
+                stream.Finish();
+            }
+        }
+    );
+}
+
+} // namespace UnicodeConvAtl
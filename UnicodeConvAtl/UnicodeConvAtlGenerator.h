@@ -0,0 +1,373 @@
+#pragma once
+
+////////////////////////////////////////////////////////////////////////////////
+// Lazy UTF-8 to UTF-16 conversion, one chunk at a time, on demand
+//
+//                  Copyright (C) by Giovanni Dicanio
+//                    <giovanni.dicanio AT gmail.com>
+//
+////////////////////////////////////////////////////////////////////////////////
+
+
+//------------------------------------------------------------------------------
+// This header extends UnicodeConvAtl.h with lazy conversions, that convert
+// a UTF-8 string to UTF-16 in chunks, as the consumer pulls them, instead of
+// producing the whole CStringW up front like ToUtf16:
+//
+//      * Pull the UTF-16 chunks one by one (any C++ version):
+//        class Utf8ToUtf16ChunkReader
+//        bool Utf8ToUtf16ChunkReader::Next(CStringW& utf16Chunk)
+//
+//      * Generator of the UTF-16 chunks (C++20 coroutines):
+//        Generator<CStringW> Utf16Chunks(CStringA utf8, int chunkLength)
+//
+// The first chunk is available as soon as it's converted, and memory usage
+// is bounded by the chunk size, whatever the size of the input:
+//
+//      for (CStringW const& text : Utf16Chunks(payload))
+//      {
+//          tokenizer.Feed(text);
+//      }
+//
+// The chunk length is measured in UTF-8 input chars. A UTF-8 sequence
+// split at a chunk boundary is converted as part of the following chunk,
+// so a chunk never ends in the middle of a code point.
+//
+// Invalid UTF-8 is signaled using AtlThrow, like ToUtf16 does, when the chunk
+// holding it is converted (the chunks before it have already been consumed).
+//
+// Utf16Chunks is available when coroutines are enabled (/std:c++latest
+// with Visual Studio 2019 16.8 or later): check UNICODECONVATL_HAS_COROUTINES.
+//
+// These functions live under the UnicodeConvAtl namespace.
+//
+// This code is released under the MIT License (see UnicodeConvAtl.h).
+//------------------------------------------------------------------------------
+
+
+//==============================================================================
+//                              Includes
+//==============================================================================
+
+#include "UnicodeConvAtl.h"     // Unicode UTF-16/UTF-8 conversions
+
+// Coroutines are available in C++20 mode
+#if defined(__cpp_impl_coroutine) && (__cpp_impl_coroutine >= 201902L)
+#define UNICODECONVATL_HAS_COROUTINES
+#include <coroutine>            // std::coroutine_handle, std::suspend_always
+#include <exception>            // std::exception_ptr
+#include <iterator>             // std::default_sentinel_t
+#include <memory>               // std::addressof
+#endif
+
+
+//==============================================================================
+//                          Implementation Details
+//==============================================================================
+
+namespace UnicodeConvAtl {
+namespace Detail {
+
+//------------------------------------------------------------------------------
+// Default length of the chunks of lazy conversions, in UTF-8 chars
+//------------------------------------------------------------------------------
+constexpr int kDefaultLazyChunkLength = 16 * 1024;
+
+
+//------------------------------------------------------------------------------
+// Minimum length of the chunks of lazy conversions, in UTF-8 chars:
+// each chunk must be able to complete a UTF-8 sequence split
+// at its beginning, so it always produces some output
+//------------------------------------------------------------------------------
+constexpr int kMinLazyChunkLength = 4;
+
+} // namespace Detail
+
+
+//==============================================================================
+//                          Chunk Reader
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Convert a UTF-8 string to UTF-16 lazily, one chunk at a time,
+// each time Next is called
+//------------------------------------------------------------------------------
+class Utf8ToUtf16ChunkReader
+{
+public:
+
+    //--------------------------------------------------------------------------
+    // Read the given UTF-8 chars, which must stay valid while they're read
+    //--------------------------------------------------------------------------
+    Utf8ToUtf16ChunkReader(const char* utf8, int utf8Length,
+                           int chunkLength = Detail::kDefaultLazyChunkLength)
+        : m_utf8(utf8)
+        , m_utf8Length(utf8Length)
+        , m_chunkLength(chunkLength)
+    {
+        ATLASSERT(utf8 != nullptr || utf8Length == 0);
+        if ((utf8Length < 0) || (chunkLength < Detail::kMinLazyChunkLength))
+        {
+            AtlThrow(E_INVALIDARG);
+        }
+    }
+
+
+    //--------------------------------------------------------------------------
+    // Read the given UTF-8 string; the reader keeps a reference to its buffer
+    //--------------------------------------------------------------------------
+    explicit Utf8ToUtf16ChunkReader(CStringA const& utf8,
+                                    int chunkLength = Detail::kDefaultLazyChunkLength)
+        : Utf8ToUtf16ChunkReader(utf8.GetString(), utf8.GetLength(), chunkLength)
+    {
+        m_source = utf8;
+        m_utf8 = m_source.GetString();
+    }
+
+
+    //--------------------------------------------------------------------------
+    // Convert the next chunk of input, replacing the content of utf16Chunk
+    // (its buffer is reused, when it's not shared).
+    // Return false, leaving utf16Chunk empty, when the whole input
+    // has been converted.
+    // Signal errors using AtlThrow.
+    //--------------------------------------------------------------------------
+    bool Next(CStringW& utf16Chunk)
+    {
+        utf16Chunk.Truncate(0);
+
+        // Only the last chunk can hold just the beginning of a sequence,
+        // which the stream carries over, producing no output
+        while (utf16Chunk.IsEmpty())
+        {
+            if (m_position == m_utf8Length)
+            {
+                // A sequence truncated at the end of the input is invalid
+                m_stream.Finish();
+                return false;
+            }
+
+            int length = m_utf8Length - m_position;
+            if (length > m_chunkLength)
+            {
+                length = m_chunkLength;
+            }
+
+            m_stream.Convert(m_utf8 + m_position, length, utf16Chunk);
+            m_position += length;
+        }
+
+        return true;
+    }
+
+
+    //--------------------------------------------------------------------------
+    // Return the number of UTF-8 chars converted so far
+    //--------------------------------------------------------------------------
+    int GetPosition() const noexcept
+    {
+        return m_position;
+    }
+
+
+private:
+    const char*         m_utf8;
+    int                 m_utf8Length;
+    int                 m_chunkLength;
+    int                 m_position = 0;
+    CStringA            m_source;   // keeps the input alive, when it's a CStringA
+    Utf8ToUtf16Stream   m_stream;
+};
+
+
+#ifdef UNICODECONVATL_HAS_COROUTINES
+
+//==============================================================================
+//                          Coroutine Generator
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Minimal synchronous generator, for coroutines that co_yield values of type T.
+// It's an input range: iterate it once, with a range-based for loop.
+// Exceptions thrown by the coroutine propagate to the consumer,
+// when the iterator is advanced.
+//------------------------------------------------------------------------------
+template <typename T>
+class Generator
+{
+public:
+
+    struct promise_type
+    {
+        const T*            pValue = nullptr;
+        std::exception_ptr  exception;
+
+        Generator get_return_object() noexcept
+        {
+            return Generator(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() const noexcept
+        {
+            return {};
+        }
+
+        std::suspend_always final_suspend() const noexcept
+        {
+            return {};
+        }
+
+        // The yielded value lives in the coroutine frame until it's resumed
+        std::suspend_always yield_value(T const& value) noexcept
+        {
+            pValue = std::addressof(value);
+            return {};
+        }
+
+        void return_void() const noexcept
+        {
+        }
+
+        void unhandled_exception() noexcept
+        {
+            exception = std::current_exception();
+        }
+
+        // A generator can only co_yield
+        template <typename U>
+        std::suspend_never await_transform(U&&) = delete;
+    };
+
+
+    class Iterator
+    {
+    public:
+        using value_type = T;
+        using difference_type = ptrdiff_t;
+
+        Iterator() noexcept = default;
+
+        explicit Iterator(std::coroutine_handle<promise_type> coroutine) noexcept
+            : m_coroutine(coroutine)
+        {
+        }
+
+        T const& operator*() const noexcept
+        {
+            return *m_coroutine.promise().pValue;
+        }
+
+        Iterator& operator++()
+        {
+            Resume(m_coroutine);
+            return *this;
+        }
+
+        void operator++(int)
+        {
+            ++*this;
+        }
+
+        bool operator==(std::default_sentinel_t) const noexcept
+        {
+            return !m_coroutine || m_coroutine.done();
+        }
+
+    private:
+        std::coroutine_handle<promise_type> m_coroutine;
+    };
+
+
+    Generator(Generator&& other) noexcept
+        : m_coroutine(other.m_coroutine)
+    {
+        other.m_coroutine = nullptr;
+    }
+
+    Generator& operator=(Generator&& other) noexcept
+    {
+        if (this != &other)
+        {
+            if (m_coroutine)
+            {
+                m_coroutine.destroy();
+            }
+            m_coroutine = other.m_coroutine;
+            other.m_coroutine = nullptr;
+        }
+        return *this;
+    }
+
+    ~Generator()
+    {
+        if (m_coroutine)
+        {
+            m_coroutine.destroy();
+        }
+    }
+
+    // Ban copy
+    Generator(const Generator&) = delete;
+    Generator& operator=(const Generator&) = delete;
+
+
+    //--------------------------------------------------------------------------
+    // Run the coroutine up to its first value
+    //--------------------------------------------------------------------------
+    Iterator begin()
+    {
+        Resume(m_coroutine);
+        return Iterator(m_coroutine);
+    }
+
+    std::default_sentinel_t end() const noexcept
+    {
+        return {};
+    }
+
+
+private:
+    std::coroutine_handle<promise_type> m_coroutine;
+
+    explicit Generator(std::coroutine_handle<promise_type> coroutine) noexcept
+        : m_coroutine(coroutine)
+    {
+    }
+
+    // Run the coroutine up to its next value, rethrowing its exceptions
+    static void Resume(std::coroutine_handle<promise_type> coroutine)
+    {
+        ATLASSERT(coroutine && !coroutine.done());
+        coroutine.resume();
+
+        if (coroutine.done() && coroutine.promise().exception)
+        {
+            std::rethrow_exception(coroutine.promise().exception);
+        }
+    }
+};
+
+
+//------------------------------------------------------------------------------
+// Convert a UTF-8 string to UTF-16 lazily: each chunk is converted when
+// the consumer asks for it. The yielded chunks are valid until the generator
+// is advanced; copy them to keep them (the copy shares the chunk buffer).
+// Signal errors using AtlThrow, when the generator is advanced.
+//------------------------------------------------------------------------------
+inline Generator<CStringW> Utf16Chunks(CStringA utf8,
+                                       int chunkLength = Detail::kDefaultLazyChunkLength)
+{
+    // The input has been copied into the coroutine frame (sharing its buffer),
+    // so the caller may release its string while the chunks are converted
+    Utf8ToUtf16ChunkReader reader(utf8, chunkLength);
+
+    CStringW utf16Chunk;
+    while (reader.Next(utf16Chunk))
+    {
+        co_yield utf16Chunk;
+    }
+}
+
+#endif // UNICODECONVATL_HAS_COROUTINES
+
+} // namespace UnicodeConvAtl
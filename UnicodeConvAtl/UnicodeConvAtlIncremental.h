@@ -0,0 +1,467 @@
+#pragma once
+
+////////////////////////////////////////////////////////////////////////////////
+// Incremental UTF-8 mirror of an UTF-16 document that is edited in place
+//
+//                  Copyright (C) by Giovanni Dicanio
+//                    <giovanni.dicanio AT gmail.com>
+//
+////////////////////////////////////////////////////////////////////////////////
+
+
+//------------------------------------------------------------------------------
+// This header extends UnicodeConvAtl.h with an incremental converter,
+// that keeps the UTF-8 conversion of an UTF-16 document up to date
+// while the document is edited, re-converting only the edited text:
+//
+//      * UTF-8 mirror of an UTF-16 document:
+//        class IncrementalUtf8Converter
+//        void IncrementalUtf8Converter::Replace(int utf16Offset, int utf16RemovedLength,
+//                                               CStringW const& inserted)
+//        CStringA IncrementalUtf8Converter::GetUtf8() const
+//        int IncrementalUtf8Converter::Utf16ToUtf8Offset(int utf16Offset) const
+//
+// The document is split in chunks of a few thousand UTF-16 code units,
+// each one stored next to its UTF-8 conversion. An edit re-converts only
+// the chunks it touches, so its cost depends on the size of the edit,
+// not on the size of the document:
+//
+//      IncrementalUtf8Converter mirror(document);
+//      ...
+//      // The user typed some text at the cursor
+//      mirror.Replace(cursor, 0, typedText);
+//      SendToLanguageServer(mirror.GetUtf8());
+//
+// The chunk boundaries never split a surrogate pair, so the chunks convert
+// independently. Edits are validated like ToUtf8 does (or replace/skip the
+// unpaired surrogates, with the InvalidInputPolicy passed to the constructor);
+// if an edit can't be converted, AtlThrow is called, and the document is
+// left unchanged.
+//
+// The converter is not thread-safe: use it from the thread that edits
+// the document.
+//
+// These classes live under the UnicodeConvAtl namespace.
+//
+// This code is released under the MIT License (see UnicodeConvAtl.h).
+//------------------------------------------------------------------------------
+
+
+//==============================================================================
+//                              Includes
+//==============================================================================
+
+#include "UnicodeConvAtl.h"     // Unicode UTF-16/UTF-8 conversions
+
+#include <atlcoll.h>            // CAtlArray
+
+
+//==============================================================================
+//                          Implementation Details
+//==============================================================================
+
+namespace UnicodeConvAtl {
+namespace Detail {
+
+//------------------------------------------------------------------------------
+// Default maximum length of the chunks of an incremental converter,
+// in UTF-16 code units
+//------------------------------------------------------------------------------
+constexpr int kDefaultIncrementalChunkLength = 4096;
+
+
+//------------------------------------------------------------------------------
+// Minimum chunk length accepted by an incremental converter
+//------------------------------------------------------------------------------
+constexpr int kMinIncrementalChunkLength = 16;
+
+
+//------------------------------------------------------------------------------
+// Return the length of the UTF-8 conversion of the first utf16Length
+// code units of a chunk, converted with the given policy.
+// An offset in the middle of a surrogate pair is moved to the beginning
+// of the pair.
+//------------------------------------------------------------------------------
+inline int Utf8PrefixLength(const wchar_t* utf16, int chunkLength, int utf16Length,
+                            InvalidInputPolicy policy) noexcept
+{
+    int utf8Length = 0;
+    int i = 0;
+    while (i < utf16Length)
+    {
+        const unsigned int ch = static_cast<unsigned int>(utf16[i]);
+        if (ch < 0x80)
+        {
+            utf8Length += 1;
+        }
+        else if (ch < 0x800)
+        {
+            utf8Length += 2;
+        }
+        else if (!IsSurrogate(ch))
+        {
+            utf8Length += 3;
+        }
+        else if (IsHighSurrogate(ch) && (i + 1 < chunkLength)
+                 && IsLowSurrogate(static_cast<unsigned int>(utf16[i + 1])))
+        {
+            if (i + 1 == utf16Length)
+            {
+                break;
+            }
+            utf8Length += 4;
+            ++i;
+        }
+        else if (policy != InvalidInputPolicy::Skip)
+        {
+            // Unpaired surrogate, replaced with U+FFFD
+            utf8Length += 3;
+        }
+        ++i;
+    }
+    return utf8Length;
+}
+
+} // namespace Detail
+
+
+//==============================================================================
+//                          Incremental Converter
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// UTF-8 mirror of an UTF-16 document, updated incrementally on each edit
+//------------------------------------------------------------------------------
+class IncrementalUtf8Converter
+{
+public:
+
+    //--------------------------------------------------------------------------
+    // Convert the initial content of the document.
+    // Signal errors using AtlThrow.
+    //--------------------------------------------------------------------------
+    explicit IncrementalUtf8Converter(CStringW const& utf16,
+                                      InvalidInputPolicy policy = InvalidInputPolicy::Throw,
+                                      int chunkLength = Detail::kDefaultIncrementalChunkLength)
+        : m_policy(policy)
+        , m_chunkLength(chunkLength)
+    {
+        if (chunkLength < Detail::kMinIncrementalChunkLength)
+        {
+            AtlThrow(E_INVALIDARG);
+        }
+
+        SplitIntoChunks(utf16.GetString(), utf16.GetLength(), m_chunks);
+        for (size_t i = 0; i < m_chunks.GetCount(); ++i)
+        {
+            m_utf16Length += m_chunks[i].utf16.GetLength();
+            m_utf8Length += m_chunks[i].utf8.GetLength();
+        }
+    }
+
+    // Ban copy
+    IncrementalUtf8Converter(const IncrementalUtf8Converter&) = delete;
+    IncrementalUtf8Converter& operator=(const IncrementalUtf8Converter&) = delete;
+
+
+    //--------------------------------------------------------------------------
+    // Replace utf16RemovedLength code units of the document, starting at
+    // utf16Offset, with the inserted text (insert with utf16RemovedLength 0,
+    // delete with an empty inserted text), re-converting the edited chunks.
+    // Signal errors using AtlThrow; on error, the document is unchanged.
+    //--------------------------------------------------------------------------
+    void Replace(int utf16Offset, int utf16RemovedLength,
+                 const wchar_t* inserted, int insertedLength)
+    {
+        ATLASSERT(inserted != nullptr || insertedLength == 0);
+        if ((utf16Offset < 0) || (utf16RemovedLength < 0) || (insertedLength < 0)
+            || (utf16Offset > m_utf16Length)
+            || (utf16RemovedLength > m_utf16Length - utf16Offset))
+        {
+            AtlThrow(E_INVALIDARG);
+        }
+
+        const int chunkCount = static_cast<int>(m_chunks.GetCount());
+
+        // Find the chunks holding the beginning and the end of the edited range
+        int first = 0;
+        int firstStart = 0;
+        while ((first + 1 < chunkCount)
+               && (firstStart + m_chunks[first].utf16.GetLength() < utf16Offset))
+        {
+            firstStart += m_chunks[first].utf16.GetLength();
+            ++first;
+        }
+
+        const int removedEnd = utf16Offset + utf16RemovedLength;
+        int last = first;
+        int lastStart = firstStart;
+        while ((last + 1 < chunkCount)
+               && (lastStart + m_chunks[last].utf16.GetLength() < removedEnd))
+        {
+            lastStart += m_chunks[last].utf16.GetLength();
+            ++last;
+        }
+
+        // The new text of the edited chunks
+        CStringW text;
+        if (chunkCount > 0)
+        {
+            text.Append(m_chunks[first].utf16.GetString(), utf16Offset - firstStart);
+            text.Append(inserted, insertedLength);
+            text.Append(m_chunks[last].utf16.GetString() + (removedEnd - lastStart),
+                        m_chunks[last].utf16.GetLength() - (removedEnd - lastStart));
+        }
+        else
+        {
+            text.Append(inserted, insertedLength);
+            last = -1;
+        }
+
+        ExtendEditedChunks(text, first, last);
+
+        // Convert the new text before touching the document,
+        // so it's unchanged if the conversion fails
+        CAtlArray<Chunk> newChunks;
+        SplitIntoChunks(text.GetString(), text.GetLength(), newChunks);
+
+        int removedUtf8Length = 0;
+        for (int i = first; i <= last; ++i)
+        {
+            removedUtf8Length += m_chunks[i].utf8.GetLength();
+        }
+        int insertedUtf8Length = 0;
+        for (size_t i = 0; i < newChunks.GetCount(); ++i)
+        {
+            insertedUtf8Length += newChunks[i].utf8.GetLength();
+        }
+
+        // Insert before removing: only the insertion can fail
+        m_chunks.InsertArrayAt(first, &newChunks);
+        if (last >= first)
+        {
+            m_chunks.RemoveAt(first + newChunks.GetCount(), last - first + 1);
+        }
+
+        m_utf16Length += insertedLength - utf16RemovedLength;
+        m_utf8Length += insertedUtf8Length - removedUtf8Length;
+    }
+
+
+    //--------------------------------------------------------------------------
+    // Replace a range of the document with the given text (see above)
+    //--------------------------------------------------------------------------
+    void Replace(int utf16Offset, int utf16RemovedLength, CStringW const& inserted)
+    {
+        Replace(utf16Offset, utf16RemovedLength, inserted.GetString(), inserted.GetLength());
+    }
+
+
+    //--------------------------------------------------------------------------
+    // Return the UTF-8 conversion of the whole document.
+    // The chunks are concatenated, without converting anything.
+    //--------------------------------------------------------------------------
+    CStringA GetUtf8() const
+    {
+        CStringA utf8;
+        char* const dest = utf8.GetBuffer(m_utf8Length);
+        int position = 0;
+        for (size_t i = 0; i < m_chunks.GetCount(); ++i)
+        {
+            CStringA const& chunk = m_chunks[i].utf8;
+            ::memcpy(dest + position, chunk.GetString(), chunk.GetLength());
+            position += chunk.GetLength();
+        }
+        utf8.ReleaseBufferSetLength(m_utf8Length);
+        return utf8;
+    }
+
+
+    //--------------------------------------------------------------------------
+    // Return the whole UTF-16 document
+    //--------------------------------------------------------------------------
+    CStringW GetUtf16() const
+    {
+        CStringW utf16;
+        wchar_t* const dest = utf16.GetBuffer(m_utf16Length);
+        int position = 0;
+        for (size_t i = 0; i < m_chunks.GetCount(); ++i)
+        {
+            CStringW const& chunk = m_chunks[i].utf16;
+            ::memcpy(dest + position, chunk.GetString(), chunk.GetLength() * sizeof(wchar_t));
+            position += chunk.GetLength();
+        }
+        utf16.ReleaseBufferSetLength(m_utf16Length);
+        return utf16;
+    }
+
+
+    //--------------------------------------------------------------------------
+    // Return the length of the document, in UTF-16 code units
+    //--------------------------------------------------------------------------
+    int GetUtf16Length() const noexcept
+    {
+        return m_utf16Length;
+    }
+
+
+    //--------------------------------------------------------------------------
+    // Return the length of the UTF-8 conversion of the document, in chars
+    //--------------------------------------------------------------------------
+    int GetUtf8Length() const noexcept
+    {
+        return m_utf8Length;
+    }
+
+
+    //--------------------------------------------------------------------------
+    // Map an offset in the UTF-16 document to the matching offset in its
+    // UTF-8 conversion. An offset in the middle of a surrogate pair maps
+    // to the beginning of its UTF-8 sequence.
+    // Only the chunk holding the offset is scanned.
+    //--------------------------------------------------------------------------
+    int Utf16ToUtf8Offset(int utf16Offset) const
+    {
+        if ((utf16Offset < 0) || (utf16Offset > m_utf16Length))
+        {
+            AtlThrow(E_INVALIDARG);
+        }
+
+        int utf16Start = 0;
+        int utf8Start = 0;
+        for (size_t i = 0; i < m_chunks.GetCount(); ++i)
+        {
+            CStringW const& chunk = m_chunks[i].utf16;
+            if (utf16Offset - utf16Start <= chunk.GetLength())
+            {
+                return utf8Start + Detail::Utf8PrefixLength(chunk.GetString(), chunk.GetLength(),
+                                                            utf16Offset - utf16Start, m_policy);
+            }
+            utf16Start += chunk.GetLength();
+            utf8Start += m_chunks[i].utf8.GetLength();
+        }
+
+        ATLASSERT(utf16Offset == 0);
+        return 0;
+    }
+
+
+    //--------------------------------------------------------------------------
+    // Return the number of chunks the document is currently split into
+    //--------------------------------------------------------------------------
+    int GetChunkCount() const noexcept
+    {
+        return static_cast<int>(m_chunks.GetCount());
+    }
+
+
+private:
+
+    // A piece of the document, with its conversion
+    struct Chunk
+    {
+        CStringW    utf16;
+        CStringA    utf8;
+    };
+
+    CAtlArray<Chunk>    m_chunks;
+    InvalidInputPolicy  m_policy;
+    int                 m_chunkLength;
+    int                 m_utf16Length = 0;
+    int                 m_utf8Length = 0;
+
+
+    //--------------------------------------------------------------------------
+    // Split the text in chunks of at most m_chunkLength code units,
+    // not splitting surrogate pairs, and convert them
+    //--------------------------------------------------------------------------
+    void SplitIntoChunks(const wchar_t* utf16, int utf16Length, CAtlArray<Chunk>& chunks) const
+    {
+        int position = 0;
+        while (position < utf16Length)
+        {
+            int length = utf16Length - position;
+            if (length > m_chunkLength)
+            {
+                length = m_chunkLength;
+
+                // Keep the surrogate pair cut by the boundary in the next chunk
+                if (Detail::IsHighSurrogate(static_cast<unsigned int>(utf16[position + length - 1]))
+                    && Detail::IsLowSurrogate(static_cast<unsigned int>(utf16[position + length])))
+                {
+                    --length;
+                }
+            }
+
+            Chunk chunk;
+            chunk.utf16.SetString(utf16 + position, length);
+            chunk.utf8 = ToUtf8(utf16 + position, length, m_policy);
+            chunks.Add(chunk);
+
+            position += length;
+        }
+    }
+
+
+    //--------------------------------------------------------------------------
+    // Extend the edited chunks [first, last] (whose new text is passed in)
+    // with their neighbours, when the edit would leave a surrogate pair
+    // across a chunk boundary, or would leave behind a chunk much smaller
+    // than the others
+    //--------------------------------------------------------------------------
+    void ExtendEditedChunks(CStringW& text, int& first, int& last) const
+    {
+        const int chunkCount = static_cast<int>(m_chunks.GetCount());
+        for (;;)
+        {
+            bool extended = false;
+
+            // Merge small chunks with their neighbours, so that deletions
+            // don't fragment the document
+            if ((text.GetLength() < m_chunkLength / 2) && (last + 1 < chunkCount))
+            {
+                text += m_chunks[++last].utf16;
+                extended = true;
+            }
+            else if ((text.GetLength() < m_chunkLength / 2) && (first > 0))
+            {
+                text.Insert(0, m_chunks[--first].utf16);
+                extended = true;
+            }
+
+            if (text.IsEmpty())
+            {
+                break;
+            }
+
+            // Keep the surrogate pairs at the edges in a single chunk
+            if ((first > 0)
+                && Detail::IsLowSurrogate(static_cast<unsigned int>(text[0]))
+                && Detail::IsHighSurrogate(static_cast<unsigned int>(LastCodeUnit(m_chunks[first - 1].utf16))))
+            {
+                text.Insert(0, m_chunks[--first].utf16);
+                extended = true;
+            }
+            if ((last + 1 < chunkCount)
+                && Detail::IsHighSurrogate(static_cast<unsigned int>(text[text.GetLength() - 1]))
+                && Detail::IsLowSurrogate(static_cast<unsigned int>(m_chunks[last + 1].utf16[0])))
+            {
+                text += m_chunks[++last].utf16;
+                extended = true;
+            }
+
+            if (!extended)
+            {
+                break;
+            }
+        }
+    }
+
+
+    static wchar_t LastCodeUnit(CStringW const& text) noexcept
+    {
+        return text.IsEmpty() ? L'\0' : text[text.GetLength() - 1];
+    }
+};
+
+} // namespace UnicodeConvAtl
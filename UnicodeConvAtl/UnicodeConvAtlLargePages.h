@@ -0,0 +1,358 @@
+#pragma once
+
+////////////////////////////////////////////////////////////////////////////////
+// Large-page and NUMA-aware memory manager for huge converted strings
+//
+//                  Copyright (C) by Giovanni Dicanio
+//                    <giovanni.dicanio AT gmail.com>
+//
+////////////////////////////////////////////////////////////////////////////////
+
+
+//------------------------------------------------------------------------------
+// This header extends UnicodeConvAtl.h with a memory manager for the huge
+// strings (hundreds of MB) returned by the conversions, that allocates them
+// straight from virtual memory, on large pages when possible, and on
+// a preferred NUMA node, instead of going through the CRT heap:
+//
+//      * Virtual memory manager (IAtlMemMgr implementation):
+//        class CLargePageMemMgr
+//
+//      * ATL string manager that allocates from virtual memory:
+//        class CLargePageStringMgr
+//
+// Pass a CLargePageStringMgr to the ToUtf8/ToUtf16 overloads taking an
+// IAtlStringMgr* (or to ToUtf8Parallel/ToUtf16Parallel, see
+// UnicodeConvAtlParallel.h):
+//
+//      // Place the output on the NUMA node of the worker that will parse it
+//      CLargePageStringMgr hugeStrings(workerNumaNode);
+//
+//      CStringA utf8 = ToUtf8Parallel(document, &hugeStrings);
+//
+// Notes:
+//
+//      * Large pages need the "Lock pages in memory" privilege
+//        (SeLockMemoryPrivilege), enabled in the process token. Without it,
+//        or when no large pages are available, the memory manager falls back
+//        to regular pages.
+//
+//      * Large pages are committed, and backed by physical memory, when
+//        they're allocated, so they don't cause page faults; regular pages
+//        get their physical memory when they're first touched, still from
+//        the preferred NUMA node passed to VirtualAllocExNuma when possible.
+//
+//      * Allocations smaller than 1 MB (by default) still go to the CRT heap,
+//        as a virtual memory allocation takes at least 64 KB of address space.
+//
+//      * The memory manager is thread-safe: the strings can be released
+//        by any thread.
+//
+// These classes live under the UnicodeConvAtl namespace.
+//
+// This code is released under the MIT License (see UnicodeConvAtl.h).
+//------------------------------------------------------------------------------
+
+
+//==============================================================================
+//                              Includes
+//==============================================================================
+
+#include "UnicodeConvAtl.h"     // Unicode UTF-16/UTF-8 conversions
+
+#include <atomic>               // std::atomic
+
+
+//==============================================================================
+//                          Implementation Details
+//==============================================================================
+
+namespace UnicodeConvAtl {
+namespace Detail {
+
+//------------------------------------------------------------------------------
+// Default minimum size of the allocations made from virtual memory, in bytes;
+// smaller allocations go to the CRT heap
+//------------------------------------------------------------------------------
+constexpr size_t kDefaultMinVirtualAllocationSize = 1024 * 1024;
+
+
+//------------------------------------------------------------------------------
+// Round the input size up to a multiple of the given power of 2.
+// The caller must make sure that the result doesn't overflow.
+//------------------------------------------------------------------------------
+constexpr size_t RoundUpToPowerOf2Multiple(size_t size, size_t powerOf2) noexcept
+{
+    return (size + powerOf2 - 1) & ~(powerOf2 - 1);
+}
+
+} // namespace Detail
+
+
+//==============================================================================
+//                      Large-Page Memory Manager
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Memory manager that allocates large blocks from virtual memory,
+// on large pages when possible, preferring the given NUMA node.
+// Each allocation is preceded by a small header that stores its size.
+//------------------------------------------------------------------------------
+class CLargePageMemMgr : public IAtlMemMgr
+{
+public:
+
+    //--------------------------------------------------------------------------
+    // Allocate from the given NUMA node (NUMA_NO_PREFERRED_NODE to let
+    // the system choose); allocations smaller than minVirtualAllocationSize
+    // bytes go to the CRT heap
+    //--------------------------------------------------------------------------
+    explicit CLargePageMemMgr(DWORD numaNode = NUMA_NO_PREFERRED_NODE,
+                              bool useLargePages = true,
+                              size_t minVirtualAllocationSize
+                                  = Detail::kDefaultMinVirtualAllocationSize) noexcept
+        : m_numaNode(numaNode)
+        , m_largePageSize(useLargePages ? ::GetLargePageMinimum() : 0)
+        , m_minVirtualAllocationSize(minVirtualAllocationSize)
+        , m_largePagesFailed(false)
+    {
+    }
+
+    // Ban copy
+    CLargePageMemMgr(const CLargePageMemMgr&) = delete;
+    CLargePageMemMgr& operator=(const CLargePageMemMgr&) = delete;
+
+
+    //--------------------------------------------------------------------------
+    // Allocate the requested number of bytes.
+    // Return nullptr on failure.
+    //--------------------------------------------------------------------------
+    void* Allocate(size_t nBytes) noexcept override
+    {
+        // CStrings never need more than INT_MAX bytes: this check also
+        // guards against overflow in the size computations below
+        if (nBytes > static_cast<size_t>(INT_MAX))
+        {
+            return nullptr;
+        }
+
+        if (nBytes < m_minVirtualAllocationSize)
+        {
+            Header* pHeader = static_cast<Header*>(malloc(kHeaderSize + nBytes));
+            if (pHeader == nullptr)
+            {
+                return nullptr;
+            }
+            pHeader->size = nBytes;
+            pHeader->capacity = nBytes;
+            pHeader->isVirtual = false;
+            pHeader->isLargePage = false;
+            return AllocationData(pHeader);
+        }
+
+        return AllocateVirtual(nBytes);
+    }
+
+
+    //--------------------------------------------------------------------------
+    // Release an allocation
+    //--------------------------------------------------------------------------
+    void Free(void* p) noexcept override
+    {
+        if (p == nullptr)
+        {
+            return;
+        }
+
+        Header* pHeader = AllocationHeader(p);
+        if (pHeader->isVirtual)
+        {
+            ATLVERIFY(::VirtualFree(pHeader, 0, MEM_RELEASE));
+        }
+        else
+        {
+            free(pHeader);
+        }
+    }
+
+
+    //--------------------------------------------------------------------------
+    // Resize an allocation.
+    // A virtual memory allocation is resized in place, when the pages
+    // allocated for it are enough; otherwise, a new allocation is made,
+    // and the content is copied there.
+    // Return nullptr on failure (the original allocation is left intact).
+    //--------------------------------------------------------------------------
+    void* Reallocate(void* p, size_t nBytes) noexcept override
+    {
+        if (p == nullptr)
+        {
+            return Allocate(nBytes);
+        }
+
+        Header* pHeader = AllocationHeader(p);
+        if (pHeader->isVirtual && (nBytes <= pHeader->capacity))
+        {
+            pHeader->size = nBytes;
+            return p;
+        }
+
+        void* pNew = Allocate(nBytes);
+        if (pNew != nullptr)
+        {
+            memcpy(pNew, p, (pHeader->size < nBytes) ? pHeader->size : nBytes);
+            Free(p);
+        }
+        return pNew;
+    }
+
+
+    //--------------------------------------------------------------------------
+    // Return the size of an allocation, in bytes
+    //--------------------------------------------------------------------------
+    size_t GetSize(void* p) noexcept override
+    {
+        ATLASSERT(p != nullptr);
+        return AllocationHeader(p)->size;
+    }
+
+
+    //--------------------------------------------------------------------------
+    // Return true if the allocation is backed by large pages
+    //--------------------------------------------------------------------------
+    static bool IsOnLargePages(const void* p) noexcept
+    {
+        ATLASSERT(p != nullptr);
+        return AllocationHeader(const_cast<void*>(p))->isLargePage;
+    }
+
+
+private:
+
+    // Header of each allocation: the allocation data follows it
+    struct Header
+    {
+        size_t  size;           // requested size, in bytes
+        size_t  capacity;       // bytes available for the data
+        bool    isVirtual;      // allocated with VirtualAlloc (vs. malloc)
+        bool    isLargePage;    // allocated on large pages
+    };
+
+    // Size of the allocation header, in bytes, keeping the data aligned
+    // as the Windows heap does
+    static constexpr size_t kHeaderSize
+        = Detail::RoundUpToPowerOf2Multiple(sizeof(Header), MEMORY_ALLOCATION_ALIGNMENT);
+
+    DWORD               m_numaNode;
+    size_t              m_largePageSize;    // 0 when large pages are not used
+    size_t              m_minVirtualAllocationSize;
+
+    // Set after a large-page allocation fails for the missing privilege,
+    // to avoid retrying on each allocation
+    std::atomic<bool>   m_largePagesFailed;
+
+
+    static void* AllocationData(Header* pHeader) noexcept
+    {
+        return reinterpret_cast<BYTE*>(pHeader) + kHeaderSize;
+    }
+
+
+    static Header* AllocationHeader(void* p) noexcept
+    {
+        return reinterpret_cast<Header*>(static_cast<BYTE*>(p) - kHeaderSize);
+    }
+
+
+    //--------------------------------------------------------------------------
+    // Allocate from virtual memory, trying large pages first.
+    // Return nullptr on failure.
+    //--------------------------------------------------------------------------
+    void* AllocateVirtual(size_t nBytes) noexcept
+    {
+        const size_t requiredSize = kHeaderSize + nBytes;
+        const HANDLE hProcess = ::GetCurrentProcess();
+
+        Header* pHeader = nullptr;
+        size_t allocationSize = 0;
+        bool isLargePage = false;
+
+        if ((m_largePageSize != 0) && !m_largePagesFailed.load(std::memory_order_relaxed))
+        {
+            // Large-page allocations must be a multiple of the large page size
+            allocationSize = Detail::RoundUpToPowerOf2Multiple(requiredSize, m_largePageSize);
+            pHeader = static_cast<Header*>(::VirtualAllocExNuma(
+                hProcess, nullptr, allocationSize,
+                MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE, m_numaNode));
+
+            // Without the privilege no large-page allocation can succeed;
+            // other failures (e.g. fragmented physical memory) may be temporary
+            if ((pHeader == nullptr) && (::GetLastError() == ERROR_PRIVILEGE_NOT_HELD))
+            {
+                m_largePagesFailed.store(true, std::memory_order_relaxed);
+            }
+            isLargePage = (pHeader != nullptr);
+        }
+
+        if (pHeader == nullptr)
+        {
+            SYSTEM_INFO systemInfo;
+            ::GetSystemInfo(&systemInfo);
+
+            allocationSize = Detail::RoundUpToPowerOf2Multiple(requiredSize, systemInfo.dwPageSize);
+            pHeader = static_cast<Header*>(::VirtualAllocExNuma(
+                hProcess, nullptr, allocationSize,
+                MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, m_numaNode));
+            if (pHeader == nullptr)
+            {
+                return nullptr;
+            }
+        }
+
+        // Only the page holding the header is touched here: the other pages
+        // are touched by the threads that write the string
+        pHeader->size = nBytes;
+        pHeader->capacity = allocationSize - kHeaderSize;
+        pHeader->isVirtual = true;
+        pHeader->isLargePage = isLargePage;
+        return AllocationData(pHeader);
+    }
+};
+
+
+//==============================================================================
+//                      Large-Page String Manager
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// ATL string manager that allocates huge strings from virtual memory,
+// on large pages when possible, preferring the given NUMA node.
+// Pass it to the ToUtf8/ToUtf16 overloads taking an IAtlStringMgr*.
+//------------------------------------------------------------------------------
+class CLargePageStringMgr : public CAtlStringMgr
+{
+public:
+
+    explicit CLargePageStringMgr(DWORD numaNode = NUMA_NO_PREFERRED_NODE,
+                                 bool useLargePages = true,
+                                 size_t minVirtualAllocationSize
+                                     = Detail::kDefaultMinVirtualAllocationSize) noexcept
+        : m_memMgr(numaNode, useLargePages, minVirtualAllocationSize)
+    {
+        SetMemoryManager(&m_memMgr);
+    }
+
+    // Ban copy
+    CLargePageStringMgr(const CLargePageStringMgr&) = delete;
+    CLargePageStringMgr& operator=(const CLargePageStringMgr&) = delete;
+
+    CLargePageMemMgr& GetLargePageMemMgr() noexcept
+    {
+        return m_memMgr;
+    }
+
+private:
+    CLargePageMemMgr m_memMgr;
+};
+
+} // namespace UnicodeConvAtl
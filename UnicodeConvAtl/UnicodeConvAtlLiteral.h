@@ -0,0 +1,229 @@
+#pragma once
+
+////////////////////////////////////////////////////////////////////////////////
+// Compile-time conversion of UTF-16 string literals to UTF-8
+//
+//                  Copyright (C) by Giovanni Dicanio
+//                    <giovanni.dicanio AT gmail.com>
+//
+////////////////////////////////////////////////////////////////////////////////
+
+
+//------------------------------------------------------------------------------
+// This header extends UnicodeConvAtl.h with the conversion of UTF-16 string
+// literals to UTF-8 at compile time, for the UTF-8 constants that would
+// otherwise be converted with ToUtf8 at startup:
+//
+//      * UTF-8 conversion of an UTF-16 string literal, as a static char array:
+//        Utf8Literal<L"...">
+//
+// For example:
+//
+//      constexpr auto& kCafeTag = Utf8Literal<L"caff\xE8">;
+//
+//      SendTag(kCafeTag.GetString(), kCafeTag.GetLength());
+//      CStringA tag = kCafeTag;    // copied, without converting anything
+//
+// The literal is converted by a consteval function, so no conversion code
+// runs at run time: the UTF-8 chars are stored in a constant array,
+// NUL-terminated, and each distinct literal is stored once.
+// A literal that isn't valid UTF-16 (an unpaired surrogate) doesn't compile.
+//
+// Utf8Literal requires C++20 (/std:c++20 with Visual Studio 2022, as in the
+// UnicodeConvAtlCpp20 test project): check UNICODECONVATL_HAS_UTF8_LITERAL.
+//
+// These functions live under the UnicodeConvAtl namespace.
+//
+// This code is released under the MIT License (see UnicodeConvAtl.h).
+//------------------------------------------------------------------------------
+
+
+//==============================================================================
+//                              Includes
+//==============================================================================
+
+#include "UnicodeConvAtl.h"     // Unicode UTF-16/UTF-8 conversions
+
+// consteval functions, and literals as template arguments, are available
+// in C++20 mode (Visual Studio 2022 supports consteval in /std:c++20 even
+// in the versions that don't define __cpp_consteval)
+#if (defined(__cpp_consteval) || (defined(_MSC_VER) && (_MSC_VER >= 1930) \
+                                  && defined(_MSVC_LANG) && (_MSVC_LANG >= 202002L))) \
+    && defined(__cpp_nontype_template_args) && (__cpp_nontype_template_args >= 201911L)
+#define UNICODECONVATL_HAS_UTF8_LITERAL
+#endif
+
+
+#ifdef UNICODECONVATL_HAS_UTF8_LITERAL
+
+//==============================================================================
+//                          Implementation Details
+//==============================================================================
+
+namespace UnicodeConvAtl {
+namespace Detail {
+
+//------------------------------------------------------------------------------
+// UTF-16 string literal passed as a template argument.
+// Length counts the terminating NUL, like the size of the literal array.
+//------------------------------------------------------------------------------
+template <size_t Length>
+struct Utf16Literal
+{
+    wchar_t text[Length] = {};
+
+    consteval Utf16Literal(const wchar_t (&literal)[Length]) noexcept
+    {
+        for (size_t i = 0; i < Length; ++i)
+        {
+            text[i] = literal[i];
+        }
+    }
+};
+
+
+//------------------------------------------------------------------------------
+// Error raised at compile time by the conversion of an invalid literal
+//------------------------------------------------------------------------------
+inline void InvalidUtf16Literal()
+{
+    AtlThrow(HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION));
+}
+
+
+//------------------------------------------------------------------------------
+// Return the length of the UTF-8 conversion of an UTF-16 literal
+// (excluding the terminating NUL)
+//------------------------------------------------------------------------------
+template <size_t Length>
+consteval int Utf8LengthOfLiteral(Utf16Literal<Length> const& literal)
+{
+    int utf8Length = 0;
+    for (size_t i = 0; i + 1 < Length; ++i)
+    {
+        const unsigned int ch = static_cast<unsigned int>(literal.text[i]);
+        if (ch < 0x80)
+        {
+            utf8Length += 1;
+        }
+        else if (ch < 0x800)
+        {
+            utf8Length += 2;
+        }
+        else if (!IsSurrogate(ch))
+        {
+            utf8Length += 3;
+        }
+        else if (IsHighSurrogate(ch) && (i + 2 < Length)
+                 && IsLowSurrogate(static_cast<unsigned int>(literal.text[i + 1])))
+        {
+            utf8Length += 4;
+            ++i;
+        }
+        else
+        {
+            // Calling a non-constexpr function makes the literal fail to compile
+            InvalidUtf16Literal();
+        }
+    }
+    return utf8Length;
+}
+
+} // namespace Detail
+
+
+//==============================================================================
+//                          Compile-Time Conversions
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Constant UTF-8 string, converted from an UTF-16 literal at compile time
+//------------------------------------------------------------------------------
+template <int Length>
+class Utf8LiteralString
+{
+public:
+
+    //--------------------------------------------------------------------------
+    // Convert the UTF-16 literal, at compile time
+    //--------------------------------------------------------------------------
+    template <size_t Utf16Length>
+    consteval explicit Utf8LiteralString(Detail::Utf16Literal<Utf16Length> const& literal)
+    {
+        int position = 0;
+        for (size_t i = 0; i + 1 < Utf16Length; ++i)
+        {
+            unsigned int codePoint = static_cast<unsigned int>(literal.text[i]);
+            if (Detail::IsHighSurrogate(codePoint))
+            {
+                // The literal has been validated by Utf8LengthOfLiteral
+                codePoint = Detail::CodePointFromSurrogates(
+                    codePoint, static_cast<unsigned int>(literal.text[++i]));
+            }
+
+            if (codePoint < 0x80)
+            {
+                m_text[position++] = static_cast<char>(codePoint);
+            }
+            else if (codePoint < 0x800)
+            {
+                m_text[position++] = static_cast<char>(0xC0 | (codePoint >> 6));
+                m_text[position++] = static_cast<char>(0x80 | (codePoint & 0x3F));
+            }
+            else if (codePoint < 0x10000)
+            {
+                m_text[position++] = static_cast<char>(0xE0 | (codePoint >> 12));
+                m_text[position++] = static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F));
+                m_text[position++] = static_cast<char>(0x80 | (codePoint & 0x3F));
+            }
+            else
+            {
+                m_text[position++] = static_cast<char>(0xF0 | (codePoint >> 18));
+                m_text[position++] = static_cast<char>(0x80 | ((codePoint >> 12) & 0x3F));
+                m_text[position++] = static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F));
+                m_text[position++] = static_cast<char>(0x80 | (codePoint & 0x3F));
+            }
+        }
+        m_text[position] = '\0';
+    }
+
+
+    // NUL-terminated UTF-8 chars
+    constexpr const char* GetString() const noexcept
+    {
+        return m_text;
+    }
+
+    // Length in chars, excluding the terminating NUL
+    constexpr int GetLength() const noexcept
+    {
+        return Length;
+    }
+
+    constexpr operator const char*() const noexcept
+    {
+        return m_text;
+    }
+
+    // Copy into a CStringA (embedded NULs included)
+    operator CStringA() const
+    {
+        return CStringA(m_text, Length);
+    }
+
+
+private:
+    char m_text[Length + 1] = {};
+};
+
+
+//------------------------------------------------------------------------------
+// UTF-8 conversion of an UTF-16 string literal, computed at compile time:
+// Utf8Literal<L"..."> is a constant Utf8LiteralString
+//------------------------------------------------------------------------------
+template <Detail::Utf16Literal Literal>
+inline constexpr Utf8LiteralString<Detail::Utf8LengthOfLiteral(Literal)> Utf8Literal{ Literal };
+
+} // namespace UnicodeConvAtl
+
+#endif // UNICODECONVATL_HAS_UTF8_LITERAL
@@ -0,0 +1,357 @@
+#pragma once
+
+////////////////////////////////////////////////////////////////////////////////
+// Index mapping UTF-16 offsets to UTF-8 offsets (and back) of a conversion
+//
+//                  Copyright (C) by Giovanni Dicanio
+//                    <giovanni.dicanio AT gmail.com>
+//
+////////////////////////////////////////////////////////////////////////////////
+
+
+//------------------------------------------------------------------------------
+// This header extends UnicodeConvAtl.h with an offset index, that maps
+// the offsets of an UTF-16 string to the offsets of its UTF-8 conversion,
+// and back, without rescanning the strings from the beginning
+// (e.g. for LSP positions, or regex match spans):
+//
+//      * Offset index of a conversion:
+//        class Utf8OffsetIndex
+//        int Utf8OffsetIndex::Utf16ToUtf8Offset(int utf16Offset) const
+//        int Utf8OffsetIndex::Utf8ToUtf16Offset(int utf8Offset) const
+//
+//      * Convert, and build the offset index of the conversion:
+//        CStringA ToUtf8(CStringW const& utf16, Utf8OffsetIndex& index)
+//        CStringW ToUtf16(CStringA const& utf8, Utf8OffsetIndex& index)
+//
+// The index samples the strings: it stores a checkpoint (a pair of matching
+// UTF-16 and UTF-8 offsets) every 64 UTF-16 code units by default, and
+// a query scans the strings only from the nearest checkpoint.
+// The UTF-16 offsets of the checkpoints lie on a regular grid, so mapping
+// an UTF-16 offset finds its checkpoint in O(1); mapping an UTF-8 offset
+// finds it with a binary search, in O(log n).
+//
+// The checkpoints are stored as two parallel arrays of offsets (a structure
+// of arrays), so the binary search only touches the array it searches.
+// An index of a string of n UTF-16 code units takes about n/8 bytes.
+//
+// Offsets in the middle of a surrogate pair, or of an UTF-8 sequence,
+// are mapped to the beginning of the encoded code point.
+//
+// These functions live under the UnicodeConvAtl namespace.
+//
+// This code is released under the MIT License (see UnicodeConvAtl.h).
+//------------------------------------------------------------------------------
+
+
+//==============================================================================
+//                              Includes
+//==============================================================================
+
+#include "UnicodeConvAtl.h"     // Unicode UTF-16/UTF-8 conversions
+
+#include <atlcoll.h>            // CAtlArray
+
+
+//==============================================================================
+//                          Implementation Details
+//==============================================================================
+
+namespace UnicodeConvAtl {
+namespace Detail {
+
+//------------------------------------------------------------------------------
+// Default distance between the checkpoints of an offset index,
+// in UTF-16 code units
+//------------------------------------------------------------------------------
+constexpr int kDefaultOffsetIndexInterval = 64;
+
+
+//------------------------------------------------------------------------------
+// Minimum distance between the checkpoints of an offset index: a checkpoint
+// moved forward past a surrogate pair must not reach the next grid point
+//------------------------------------------------------------------------------
+constexpr int kMinOffsetIndexInterval = 2;
+
+
+//------------------------------------------------------------------------------
+// Return the length of the UTF-8 sequence starting with the given lead byte
+// of valid UTF-8
+//------------------------------------------------------------------------------
+constexpr int Utf8SequenceLengthFromLeadByte(unsigned int leadByte) noexcept
+{
+    return (leadByte < 0x80) ? 1 : (leadByte < 0xE0) ? 2 : (leadByte < 0xF0) ? 3 : 4;
+}
+
+} // namespace Detail
+
+
+//==============================================================================
+//                              Offset Index
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Sampled index of the matching offsets of an UTF-16 string and of its
+// UTF-8 conversion. The index keeps a reference to both strings
+// (sharing their reference-counted buffers).
+//------------------------------------------------------------------------------
+class Utf8OffsetIndex
+{
+public:
+    Utf8OffsetIndex() noexcept = default;
+
+    // Ban copy
+    Utf8OffsetIndex(const Utf8OffsetIndex&) = delete;
+    Utf8OffsetIndex& operator=(const Utf8OffsetIndex&) = delete;
+
+
+    //--------------------------------------------------------------------------
+    // Build the index of a valid UTF-16 string and of its UTF-8 conversion
+    // (as returned by ToUtf8), with a checkpoint every interval code units.
+    // Signal errors using AtlThrow.
+    //--------------------------------------------------------------------------
+    void Build(CStringW const& utf16, CStringA const& utf8,
+               int interval = Detail::kDefaultOffsetIndexInterval)
+    {
+        if (interval < Detail::kMinOffsetIndexInterval)
+        {
+            AtlThrow(E_INVALIDARG);
+        }
+
+        Clear();
+
+        const int utf16Length = utf16.GetLength();
+        const size_t checkpointCount = static_cast<size_t>(utf16Length / interval) + 1;
+        if (!m_utf16Offsets.SetCount(checkpointCount) || !m_utf8Offsets.SetCount(checkpointCount))
+        {
+            Clear();
+            AtlThrow(E_OUTOFMEMORY);
+        }
+
+        const wchar_t* const text = utf16.GetString();
+        int* const utf16Offsets = m_utf16Offsets.GetData();
+        int* const utf8Offsets = m_utf8Offsets.GetData();
+
+        // The checkpoint of each grid point is moved forward by one code unit,
+        // when the grid point splits a surrogate pair
+        size_t checkpoint = 0;
+        int nextGridPoint = 0;
+        int utf8Offset = 0;
+        int i = 0;
+        while (i < utf16Length)
+        {
+            if (i >= nextGridPoint)
+            {
+                utf16Offsets[checkpoint] = i;
+                utf8Offsets[checkpoint] = utf8Offset;
+                ++checkpoint;
+                nextGridPoint += interval;
+            }
+
+            const unsigned int ch = static_cast<unsigned int>(text[i]);
+            if (ch < 0x80)
+            {
+                utf8Offset += 1;
+            }
+            else if (ch < 0x800)
+            {
+                utf8Offset += 2;
+            }
+            else if (Detail::IsHighSurrogate(ch))
+            {
+                // Valid input: a low surrogate follows
+                utf8Offset += 4;
+                ++i;
+            }
+            else
+            {
+                utf8Offset += 3;
+            }
+            ++i;
+        }
+
+        // The last grid point may fall at (or inside a pair just before)
+        // the end of the string
+        if (checkpoint < checkpointCount)
+        {
+            utf16Offsets[checkpoint] = utf16Length;
+            utf8Offsets[checkpoint] = utf8Offset;
+            ++checkpoint;
+        }
+
+        ATLASSERT(checkpoint == checkpointCount);
+        ATLASSERT(utf8Offset == utf8.GetLength());
+
+        m_utf16 = utf16;
+        m_utf8 = utf8;
+        m_interval = interval;
+    }
+
+
+    //--------------------------------------------------------------------------
+    // Map an offset of the UTF-16 string to the matching offset
+    // of the UTF-8 string. Signal errors using AtlThrow.
+    //--------------------------------------------------------------------------
+    int Utf16ToUtf8Offset(int utf16Offset) const
+    {
+        if ((utf16Offset < 0) || (utf16Offset > m_utf16.GetLength()))
+        {
+            AtlThrow(E_INVALIDARG);
+        }
+        if (m_utf16Offsets.IsEmpty())
+        {
+            return 0;
+        }
+
+        // The checkpoint of the grid point at or before the offset
+        size_t checkpoint = static_cast<size_t>(utf16Offset / m_interval);
+        if (checkpoint >= m_utf16Offsets.GetCount())
+        {
+            checkpoint = m_utf16Offsets.GetCount() - 1;
+        }
+        if (m_utf16Offsets[checkpoint] > utf16Offset)
+        {
+            // The offset splits the pair that moved the checkpoint forward
+            --checkpoint;
+        }
+
+        const wchar_t* const text = m_utf16.GetString();
+        int utf8Offset = m_utf8Offsets[checkpoint];
+        int i = m_utf16Offsets[checkpoint];
+        while (i < utf16Offset)
+        {
+            const unsigned int ch = static_cast<unsigned int>(text[i]);
+            if (ch < 0x80)
+            {
+                utf8Offset += 1;
+            }
+            else if (ch < 0x800)
+            {
+                utf8Offset += 2;
+            }
+            else if (Detail::IsHighSurrogate(ch))
+            {
+                if (i + 1 == utf16Offset)
+                {
+                    break;
+                }
+                utf8Offset += 4;
+                ++i;
+            }
+            else
+            {
+                utf8Offset += 3;
+            }
+            ++i;
+        }
+        return utf8Offset;
+    }
+
+
+    //--------------------------------------------------------------------------
+    // Map an offset of the UTF-8 string to the matching offset
+    // of the UTF-16 string. Signal errors using AtlThrow.
+    //--------------------------------------------------------------------------
+    int Utf8ToUtf16Offset(int utf8Offset) const
+    {
+        if ((utf8Offset < 0) || (utf8Offset > m_utf8.GetLength()))
+        {
+            AtlThrow(E_INVALIDARG);
+        }
+        if (m_utf8Offsets.IsEmpty())
+        {
+            return 0;
+        }
+
+        // Binary search of the last checkpoint at or before the offset
+        const int* const utf8Offsets = m_utf8Offsets.GetData();
+        size_t low = 0;
+        size_t high = m_utf8Offsets.GetCount();
+        while (high - low > 1)
+        {
+            const size_t middle = low + (high - low) / 2;
+            if (utf8Offsets[middle] <= utf8Offset)
+            {
+                low = middle;
+            }
+            else
+            {
+                high = middle;
+            }
+        }
+
+        const unsigned char* const bytes = reinterpret_cast<const unsigned char*>(m_utf8.GetString());
+        int utf16Offset = m_utf16Offsets[low];
+        int i = utf8Offsets[low];
+        while (i < utf8Offset)
+        {
+            const int sequenceLength = Detail::Utf8SequenceLengthFromLeadByte(bytes[i]);
+            if (i + sequenceLength > utf8Offset)
+            {
+                break;
+            }
+            utf16Offset += (sequenceLength == 4) ? 2 : 1;
+            i += sequenceLength;
+        }
+        return utf16Offset;
+    }
+
+
+    //--------------------------------------------------------------------------
+    // Return the number of checkpoints stored in the index
+    //--------------------------------------------------------------------------
+    int GetCheckpointCount() const noexcept
+    {
+        return static_cast<int>(m_utf16Offsets.GetCount());
+    }
+
+
+    //--------------------------------------------------------------------------
+    // Remove the checkpoints, and release the strings
+    //--------------------------------------------------------------------------
+    void Clear() noexcept
+    {
+        m_utf16Offsets.RemoveAll();
+        m_utf8Offsets.RemoveAll();
+        m_utf16.Empty();
+        m_utf8.Empty();
+    }
+
+
+private:
+    CStringW        m_utf16;
+    CStringA        m_utf8;
+    int             m_interval = Detail::kDefaultOffsetIndexInterval;
+
+    // Checkpoints, as parallel arrays of matching offsets
+    CAtlArray<int>  m_utf16Offsets;
+    CAtlArray<int>  m_utf8Offsets;
+};
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-16 to UTF-8, building the offset index of the conversion.
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+inline CStringA ToUtf8(CStringW const& utf16, Utf8OffsetIndex& index,
+                       int interval = Detail::kDefaultOffsetIndexInterval)
+{
+    CStringA utf8 = ToUtf8(utf16);
+    index.Build(utf16, utf8, interval);
+    return utf8;
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-8 to UTF-16, building the offset index of the conversion.
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+inline CStringW ToUtf16(CStringA const& utf8, Utf8OffsetIndex& index,
+                        int interval = Detail::kDefaultOffsetIndexInterval)
+{
+    CStringW utf16 = ToUtf16(utf8);
+    index.Build(utf16, utf8, interval);
+    return utf16;
+}
+
+} // namespace UnicodeConvAtl
@@ -0,0 +1,738 @@
+#pragma once
+
+////////////////////////////////////////////////////////////////////////////////
+// Parallel Unicode UTF-16/UTF-8 conversion of very large strings
+//
+//                  Copyright (C) by Giovanni Dicanio
+//                    <giovanni.dicanio AT gmail.com>
+//
+////////////////////////////////////////////////////////////////////////////////
+
+
+//------------------------------------------------------------------------------
+// This header extends UnicodeConvAtl.h with functions that convert
+// very large strings using all the available processor cores:
+//
+//      * Convert from UTF-16 to UTF-8 in parallel:
+//        CStringA ToUtf8Parallel(CStringW const& utf16, int parallelThreshold)
+//        CStringA ToUtf8Parallel(const wchar_t* utf16, int utf16Length,
+//                                int parallelThreshold)
+//
+//      * Convert from UTF-8 to UTF-16 in parallel:
+//        CStringW ToUtf16Parallel(CStringA const& utf8, int parallelThreshold)
+//        CStringW ToUtf16Parallel(const char* utf8, int utf8Length,
+//                                 int parallelThreshold)
+//
+//      * Convert in parallel, allocating the result with a custom string
+//        manager (e.g. for huge strings, see UnicodeConvAtlLargePages.h):
+//        CStringA ToUtf8Parallel(CStringW const& utf16, IAtlStringMgr* stringMgr,
+//                                int parallelThreshold)
+//        CStringW ToUtf16Parallel(CStringA const& utf8, IAtlStringMgr* stringMgr,
+//                                 int parallelThreshold)
+//
+//      * Convert many strings at once, in parallel, into a single contiguous
+//        buffer (with the same layout of ToUtf8Batch and ToUtf16Batch):
+//        void ToUtf8BatchParallel(const CStringW* utf16Strings, size_t count,
+//                                 CStringA& utf8, CAtlArray<int>& offsets,
+//                                 int parallelThreshold)
+//        void ToUtf16BatchParallel(const CStringA* utf8Strings, size_t count,
+//                                  CStringW& utf16, CAtlArray<int>& offsets,
+//                                  int parallelThreshold)
+//
+// The input string is split in chunks at code point boundaries (never
+// inside a surrogate pair or a UTF-8 multi-char sequence). The chunks are
+// measured in parallel, the lengths of their conversions are summed to get
+// the offset of each chunk in the output string, and then, after a single
+// allocation, the chunks are converted in parallel, each one straight
+// into its own slot of the output string (so the pages of the output string
+// are first touched by the threads that write them).
+//
+// Inputs shorter than parallelThreshold code units are converted on the
+// calling thread, with ToUtf8 and ToUtf16, as the cost of dispatching work
+// to other threads would outweigh the gain.
+//
+// Batches of strings are split in ranges of consecutive strings of about
+// the same total length, many more ranges than processors, so that threads
+// that finish early steal the remaining ranges, even when the string lengths
+// are very uneven. The converted strings keep the order of the input ones.
+//
+// The chunks are scheduled with the Parallel Patterns Library (PPL),
+// and converted with the native engine: the validation rules are the same
+// of ToUtf8 and ToUtf16.
+//
+// These functions live under the UnicodeConvAtl namespace,
+// and signal errors using AtlThrow.
+//
+// This code is released under the MIT License (see UnicodeConvAtl.h).
+//------------------------------------------------------------------------------
+
+
+//==============================================================================
+//                              Includes
+//==============================================================================
+
+#include "UnicodeConvAtl.h"     // Unicode UTF-16/UTF-8 conversions
+
+#include <ppl.h>                // concurrency::parallel_for
+
+
+//==============================================================================
+//                          Implementation Details
+//==============================================================================
+
+namespace UnicodeConvAtl {
+namespace Detail {
+
+//------------------------------------------------------------------------------
+// Default minimum input length, in code units, that triggers
+// a parallel conversion
+//------------------------------------------------------------------------------
+constexpr int kDefaultParallelThreshold = 1024 * 1024;
+
+
+//------------------------------------------------------------------------------
+// Minimum length of the chunks converted in parallel, in code units
+//------------------------------------------------------------------------------
+constexpr int kMinParallelChunkLength = 64 * 1024;
+
+
+//------------------------------------------------------------------------------
+// Return the number of processors available to the parallel conversions
+//------------------------------------------------------------------------------
+inline int GetProcessorCount() noexcept
+{
+    SYSTEM_INFO systemInfo;
+    ::GetSystemInfo(&systemInfo);
+
+    return static_cast<int>(systemInfo.dwNumberOfProcessors);
+}
+
+
+//------------------------------------------------------------------------------
+// Return the number of chunks to split an input string of the given length.
+// A few chunks per processor are used, so the faster chunks (e.g. ASCII ones)
+// don't leave cores idle, but each chunk is at least kMinParallelChunkLength
+// code units long.
+//------------------------------------------------------------------------------
+inline int GetParallelChunkCount(int inputLength) noexcept
+{
+    int chunkCount = GetProcessorCount() * 4;
+
+    const int maxChunkCount = inputLength / kMinParallelChunkLength;
+    if (chunkCount > maxChunkCount)
+    {
+        chunkCount = maxChunkCount;
+    }
+
+    return (chunkCount < 1) ? 1 : chunkCount;
+}
+
+
+//------------------------------------------------------------------------------
+// Split the input UTF-16 string in chunks of about the same length.
+// boundaries receives chunkCount + 1 offsets: chunk i spans
+// [boundaries[i], boundaries[i + 1]).
+// Surrogate pairs are never split, so each chunk is valid if and only if
+// the corresponding part of the whole string is valid.
+//------------------------------------------------------------------------------
+inline void SplitUtf16Chunks(const wchar_t* utf16, int utf16Length, int chunkCount,
+                             CAtlArray<int>& boundaries)
+{
+    if (!boundaries.SetCount(chunkCount + 1))
+    {
+        AtlThrow(E_OUTOFMEMORY);
+    }
+
+    boundaries[0] = 0;
+    for (int i = 1; i < chunkCount; ++i)
+    {
+        int boundary = static_cast<int>(static_cast<long long>(utf16Length) * i / chunkCount);
+
+        // Don't end a chunk with the first half of a surrogate pair
+        if (IsHighSurrogate(static_cast<unsigned int>(utf16[boundary - 1])))
+        {
+            --boundary;
+        }
+
+        boundaries[i] = boundary;
+    }
+    boundaries[chunkCount] = utf16Length;
+}
+
+
+//------------------------------------------------------------------------------
+// Split the input UTF-8 string in chunks of about the same length.
+// boundaries receives chunkCount + 1 offsets: chunk i spans
+// [boundaries[i], boundaries[i + 1]).
+// Each chunk starts at a lead byte (multi-char sequences are never split),
+// so each chunk is valid if and only if the corresponding part
+// of the whole string is valid.
+//------------------------------------------------------------------------------
+inline void SplitUtf8Chunks(const char* utf8, int utf8Length, int chunkCount,
+                            CAtlArray<int>& boundaries)
+{
+    if (!boundaries.SetCount(chunkCount + 1))
+    {
+        AtlThrow(E_OUTOFMEMORY);
+    }
+
+    const unsigned char* const bytes = reinterpret_cast<const unsigned char*>(utf8);
+
+    boundaries[0] = 0;
+    for (int i = 1; i < chunkCount; ++i)
+    {
+        int boundary = static_cast<int>(static_cast<long long>(utf8Length) * i / chunkCount);
+
+        // Back up to the lead byte of the current sequence.
+        // Well-formed sequences have at most 3 continuation chars:
+        // if there are more, the input is invalid anyway, and the next chunk
+        // will detect it.
+        for (int k = 0; k < 3 && IsUtf8Continuation(bytes[boundary]); ++k)
+        {
+            --boundary;
+        }
+
+        boundaries[i] = boundary;
+    }
+    boundaries[chunkCount] = utf8Length;
+}
+
+
+//------------------------------------------------------------------------------
+// Convert the input chunks in parallel, into a single output string.
+//
+// measureChunk(chunk, chunkLength) validates a chunk, and returns the length
+// of its conversion, or a negative value if the chunk is invalid.
+// convertChunk(chunk, chunkLength, output) converts a validated chunk
+// into the output buffer.
+//
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+template <typename InputChar, typename OutputString, typename MeasureFunc, typename ConvertFunc>
+void ConvertChunksInParallel(const InputChar* input, CAtlArray<int> const& boundaries,
+                             OutputString& output,
+                             MeasureFunc measureChunk, ConvertFunc convertChunk)
+{
+    const size_t chunkCount = boundaries.GetCount() - 1;
+
+    CAtlArray<long long> chunkOffsets;
+    if (!chunkOffsets.SetCount(chunkCount))
+    {
+        AtlThrow(E_OUTOFMEMORY);
+    }
+
+    // First pass: validate the chunks, and compute the lengths
+    // of their conversions
+    concurrency::parallel_for(size_t(0), chunkCount, [&](size_t i)
+    {
+        chunkOffsets[i] = measureChunk(input + boundaries[i], boundaries[i + 1] - boundaries[i]);
+    });
+
+    // Prefix-sum the chunk lengths, to get the offset of each chunk
+    // in the output string
+    long long outputLength = 0;
+    for (size_t i = 0; i < chunkCount; ++i)
+    {
+        const long long chunkLength = chunkOffsets[i];
+        if (chunkLength < 0)
+        {
+            AtlThrow(HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION));
+        }
+
+        chunkOffsets[i] = outputLength;
+        outputLength += chunkLength;
+        if (outputLength > INT_MAX)
+        {
+            AtlThrow(HRESULT_FROM_WIN32(ERROR_ARITHMETIC_OVERFLOW));
+        }
+    }
+
+    // Second pass: convert each chunk into its own slot of the output string
+    auto* outputBuffer = output.GetBuffer(static_cast<int>(outputLength));
+    ATLASSERT(outputBuffer != nullptr);
+
+    concurrency::parallel_for(size_t(0), chunkCount, [&](size_t i)
+    {
+        convertChunk(input + boundaries[i], boundaries[i + 1] - boundaries[i],
+                     outputBuffer + chunkOffsets[i]);
+    });
+
+    output.ReleaseBuffer(static_cast<int>(outputLength));
+}
+
+
+//------------------------------------------------------------------------------
+// Split the input batch of strings in ranges of consecutive strings,
+// of about the same total length.
+// ranges receives the index of the first string of each range, followed
+// by count. If the whole batch is shorter than parallelThreshold code units,
+// or not long enough to be worth splitting, a single range is returned.
+//------------------------------------------------------------------------------
+template <typename InputString>
+void SplitBatchRanges(const InputString* strings, size_t count, int parallelThreshold,
+                      CAtlArray<size_t>& ranges)
+{
+    // Each string costs at least its NUL terminator, so that batches
+    // of empty strings are split as well
+    long long totalLength = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        totalLength += StringLength(strings[i]) + 1LL;
+    }
+
+    // Use many more ranges than processors, so the work is balanced
+    // by work stealing even if the string lengths are very uneven
+    long long rangeLength = totalLength / (GetProcessorCount() * 16LL);
+    if (rangeLength < kMinParallelChunkLength)
+    {
+        rangeLength = kMinParallelChunkLength;
+    }
+
+    ranges.RemoveAll();
+    ranges.Add(0);
+
+    if (totalLength >= parallelThreshold)
+    {
+        long long currentLength = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            currentLength += StringLength(strings[i]) + 1LL;
+            if (currentLength >= rangeLength && i + 1 < count)
+            {
+                ranges.Add(i + 1);
+                currentLength = 0;
+            }
+        }
+    }
+
+    ranges.Add(count);
+}
+
+
+//------------------------------------------------------------------------------
+// Convert the input batch of strings in parallel, one range at a time,
+// into a single output string, each converted string followed by
+// a NUL terminator. offsets receives count + 1 entries, as for ToUtf8Batch.
+//
+// measureString(string) validates a string, and returns the length
+// of its conversion, or a negative value if the string is invalid.
+// convertString(string, output) converts a validated string into the output
+// buffer, and returns a pointer past the last code unit written.
+//
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+template <typename InputString, typename OutputString, typename MeasureFunc, typename ConvertFunc>
+void ConvertBatchInParallel(const InputString* strings, size_t count,
+                            CAtlArray<size_t> const& ranges,
+                            OutputString& output, CAtlArray<int>& offsets,
+                            MeasureFunc measureString, ConvertFunc convertString)
+{
+    const size_t rangeCount = ranges.GetCount() - 1;
+
+    if (!offsets.SetCount(count + 1))
+    {
+        AtlThrow(E_OUTOFMEMORY);
+    }
+
+    // First pass: validate the strings, and store the lengths of their
+    // conversions in offsets (-1 for invalid strings, and INT_MAX for those
+    // that are too long)
+    concurrency::parallel_for(size_t(0), rangeCount, [&](size_t range)
+    {
+        for (size_t i = ranges[range]; i < ranges[range + 1]; ++i)
+        {
+            const long long length = measureString(strings[i]);
+            offsets[i] = (length > INT_MAX) ? INT_MAX : static_cast<int>(length);
+        }
+    });
+
+    // Prefix-sum the string lengths, to get the offset of each string
+    // in the output string
+    long long outputLength = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        const int length = offsets[i];
+        if (length < 0)
+        {
+            AtlThrow(HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION));
+        }
+
+        offsets[i] = static_cast<int>(outputLength);
+        outputLength += length + 1LL;
+        if (outputLength > INT_MAX)
+        {
+            AtlThrow(HRESULT_FROM_WIN32(ERROR_ARITHMETIC_OVERFLOW));
+        }
+    }
+    offsets[count] = static_cast<int>(outputLength);
+
+    // Second pass: convert each string into its own slot of the output string
+    auto* outputBuffer = output.GetBuffer(static_cast<int>(outputLength));
+    ATLASSERT(outputBuffer != nullptr);
+
+    concurrency::parallel_for(size_t(0), rangeCount, [&](size_t range)
+    {
+        for (size_t i = ranges[range]; i < ranges[range + 1]; ++i)
+        {
+            auto* end = convertString(strings[i], outputBuffer + offsets[i]);
+            *end = 0;
+        }
+    });
+
+    output.ReleaseBuffer(static_cast<int>(outputLength));
+}
+
+
+//------------------------------------------------------------------------------
+// Convert an array of UTF-16 strings to UTF-8 in parallel (see ToUtf8BatchParallel)
+//------------------------------------------------------------------------------
+template <typename Utf16String>
+void ToUtf8BatchParallelNative(const Utf16String* utf16Strings, size_t count,
+                               CStringA& utf8, CAtlArray<int>& offsets,
+                               int parallelThreshold)
+{
+    ATLASSERT(utf16Strings != nullptr || count == 0);
+    ATLASSERT(parallelThreshold >= 0);
+
+    CAtlArray<size_t> ranges;
+    SplitBatchRanges(utf16Strings, count, parallelThreshold, ranges);
+    if (ranges.GetCount() == 2)
+    {
+        // A single range: just convert it on the calling thread
+        ToUtf8BatchNative(utf16Strings, count, utf8, offsets);
+        return;
+    }
+
+    ConvertBatchInParallel(utf16Strings, count, ranges, utf8, offsets,
+        [](Utf16String const& utf16)
+        {
+            return NativeUtf8Length(StringData(utf16), StringLength(utf16));
+        },
+        [](Utf16String const& utf16, char* output)
+        {
+            return NativeUtf16ToUtf8Unchecked(StringData(utf16), StringLength(utf16), output);
+        }
+    );
+}
+
+
+//------------------------------------------------------------------------------
+// Convert an array of UTF-8 strings to UTF-16 in parallel (see ToUtf16BatchParallel)
+//------------------------------------------------------------------------------
+template <typename Utf8String>
+void ToUtf16BatchParallelNative(const Utf8String* utf8Strings, size_t count,
+                                CStringW& utf16, CAtlArray<int>& offsets,
+                                int parallelThreshold)
+{
+    ATLASSERT(utf8Strings != nullptr || count == 0);
+    ATLASSERT(parallelThreshold >= 0);
+
+    CAtlArray<size_t> ranges;
+    SplitBatchRanges(utf8Strings, count, parallelThreshold, ranges);
+    if (ranges.GetCount() == 2)
+    {
+        // A single range: just convert it on the calling thread
+        ToUtf16BatchNative(utf8Strings, count, utf16, offsets);
+        return;
+    }
+
+    ConvertBatchInParallel(utf8Strings, count, ranges, utf16, offsets,
+        [](Utf8String const& utf8)
+        {
+            return static_cast<long long>(NativeUtf16Length(StringData(utf8), StringLength(utf8)));
+        },
+        [](Utf8String const& utf8, wchar_t* output)
+        {
+            return NativeUtf8ToUtf16Unchecked(StringData(utf8), StringLength(utf8), output);
+        }
+    );
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-16 to UTF-8 in parallel, appending to the given empty
+// string (which may be bound to a custom string manager).
+// Each chunk is written by the thread that converts it, so the pages of
+// a huge output string are first touched by the threads that write them.
+//------------------------------------------------------------------------------
+inline void ConvertUtf16ToUtf8Parallel(const wchar_t* utf16, int utf16Length,
+                                       int parallelThreshold, CStringA& utf8)
+{
+    ATLASSERT(utf16 != nullptr || utf16Length == 0);
+    ATLASSERT(parallelThreshold >= 0);
+    if (utf16Length < 0)
+    {
+        AtlThrow(E_INVALIDARG);
+    }
+
+    // Short inputs are not worth the cost of dispatching work to other threads
+    const int chunkCount = (utf16Length < parallelThreshold)
+                           ? 1 : GetParallelChunkCount(utf16Length);
+    if (chunkCount == 1)
+    {
+        AppendUtf8(utf16, utf16Length, utf8);
+        return;
+    }
+
+    CAtlArray<int> boundaries;
+    SplitUtf16Chunks(utf16, utf16Length, chunkCount, boundaries);
+
+    ConvertChunksInParallel(utf16, boundaries, utf8,
+        [](const wchar_t* chunk, int chunkLength)
+        {
+            return NativeUtf8Length(chunk, chunkLength);
+        },
+        [](const wchar_t* chunk, int chunkLength, char* output)
+        {
+            NativeUtf16ToUtf8Unchecked(chunk, chunkLength, output);
+        }
+    );
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-8 to UTF-16 in parallel, appending to the given empty
+// string (which may be bound to a custom string manager)
+//------------------------------------------------------------------------------
+inline void ConvertUtf8ToUtf16Parallel(const char* utf8, int utf8Length,
+                                       int parallelThreshold, CStringW& utf16)
+{
+    ATLASSERT(utf8 != nullptr || utf8Length == 0);
+    ATLASSERT(parallelThreshold >= 0);
+    if (utf8Length < 0)
+    {
+        AtlThrow(E_INVALIDARG);
+    }
+
+    // Short inputs are not worth the cost of dispatching work to other threads
+    const int chunkCount = (utf8Length < parallelThreshold)
+                           ? 1 : GetParallelChunkCount(utf8Length);
+    if (chunkCount == 1)
+    {
+        AppendUtf16(utf8, utf8Length, utf16);
+        return;
+    }
+
+    CAtlArray<int> boundaries;
+    SplitUtf8Chunks(utf8, utf8Length, chunkCount, boundaries);
+
+    ConvertChunksInParallel(utf8, boundaries, utf16,
+        [](const char* chunk, int chunkLength)
+        {
+            return static_cast<long long>(NativeUtf16Length(chunk, chunkLength));
+        },
+        [](const char* chunk, int chunkLength, wchar_t* output)
+        {
+            NativeUtf8ToUtf16Unchecked(chunk, chunkLength, output);
+        }
+    );
+}
+
+} // namespace Detail
+
+
+//==============================================================================
+//                          Function Implementations
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Convert from UTF-16 to UTF-8, splitting the input string in chunks
+// that are converted in parallel.
+// Inputs shorter than parallelThreshold wchar_ts are converted with ToUtf8
+// on the calling thread.
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+inline CStringA ToUtf8Parallel(const wchar_t* utf16, int utf16Length,
+                               int parallelThreshold = Detail::kDefaultParallelThreshold)
+{
+    CStringA utf8;
+    Detail::ConvertUtf16ToUtf8Parallel(utf16, utf16Length, parallelThreshold, utf8);
+    return utf8;
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-16 to UTF-8 in parallel (see above), allocating the memory
+// of the returned string with the given string manager (for example,
+// a CLargePageStringMgr defined in UnicodeConvAtlLargePages.h, for huge strings).
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+inline CStringA ToUtf8Parallel(const wchar_t* utf16, int utf16Length, IAtlStringMgr* stringMgr,
+                               int parallelThreshold = Detail::kDefaultParallelThreshold)
+{
+    ATLASSERT(stringMgr != nullptr);
+
+    CStringA utf8(stringMgr);
+    Detail::ConvertUtf16ToUtf8Parallel(utf16, utf16Length, parallelThreshold, utf8);
+    return utf8;
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-16 CStringW to UTF-8 CStringA, splitting the input string
+// in chunks that are converted in parallel (see above)
+//------------------------------------------------------------------------------
+inline CStringA ToUtf8Parallel(CStringW const& utf16,
+                               int parallelThreshold = Detail::kDefaultParallelThreshold)
+{
+    return ToUtf8Parallel(utf16.GetString(), utf16.GetLength(), parallelThreshold);
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-16 CStringW to UTF-8 CStringA in parallel, allocating
+// the memory of the returned string with the given string manager
+//------------------------------------------------------------------------------
+inline CStringA ToUtf8Parallel(CStringW const& utf16, IAtlStringMgr* stringMgr,
+                               int parallelThreshold = Detail::kDefaultParallelThreshold)
+{
+    return ToUtf8Parallel(utf16.GetString(), utf16.GetLength(), stringMgr, parallelThreshold);
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-8 to UTF-16, splitting the input string in chunks
+// that are converted in parallel.
+// Inputs shorter than parallelThreshold chars are converted with ToUtf16
+// on the calling thread.
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+inline CStringW ToUtf16Parallel(const char* utf8, int utf8Length,
+                                int parallelThreshold = Detail::kDefaultParallelThreshold)
+{
+    CStringW utf16;
+    Detail::ConvertUtf8ToUtf16Parallel(utf8, utf8Length, parallelThreshold, utf16);
+    return utf16;
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-8 to UTF-16 in parallel (see above), allocating the memory
+// of the returned string with the given string manager.
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+inline CStringW ToUtf16Parallel(const char* utf8, int utf8Length, IAtlStringMgr* stringMgr,
+                                int parallelThreshold = Detail::kDefaultParallelThreshold)
+{
+    ATLASSERT(stringMgr != nullptr);
+
+    CStringW utf16(stringMgr);
+    Detail::ConvertUtf8ToUtf16Parallel(utf8, utf8Length, parallelThreshold, utf16);
+    return utf16;
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-8 CStringA to UTF-16 CStringW, splitting the input string
+// in chunks that are converted in parallel (see above)
+//------------------------------------------------------------------------------
+inline CStringW ToUtf16Parallel(CStringA const& utf8,
+                                int parallelThreshold = Detail::kDefaultParallelThreshold)
+{
+    return ToUtf16Parallel(utf8.GetString(), utf8.GetLength(), parallelThreshold);
+}
+
+
+//------------------------------------------------------------------------------
+// Convert from UTF-8 CStringA to UTF-16 CStringW in parallel, allocating
+// the memory of the returned string with the given string manager
+//------------------------------------------------------------------------------
+inline CStringW ToUtf16Parallel(CStringA const& utf8, IAtlStringMgr* stringMgr,
+                                int parallelThreshold = Detail::kDefaultParallelThreshold)
+{
+    return ToUtf16Parallel(utf8.GetString(), utf8.GetLength(), stringMgr, parallelThreshold);
+}
+
+
+//------------------------------------------------------------------------------
+// Convert an array of UTF-16 strings to UTF-8, spreading the strings
+// across the processor cores.
+//
+// The result has the same layout of ToUtf8Batch: all the converted strings
+// are stored in input order in the destination CStringA, each one followed
+// by a NUL terminator, and offsets receives count + 1 entries (the offset
+// of each converted string, followed by the total length).
+//
+// Batches shorter than parallelThreshold code units in total are converted
+// with ToUtf8Batch on the calling thread.
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+inline void ToUtf8BatchParallel(const CStringW* utf16Strings, size_t count,
+                                CStringA& utf8, CAtlArray<int>& offsets,
+                                int parallelThreshold = Detail::kDefaultParallelThreshold)
+{
+    Detail::ToUtf8BatchParallelNative(utf16Strings, count, utf8, offsets, parallelThreshold);
+}
+
+
+//------------------------------------------------------------------------------
+// Convert an array of UTF-16 strings to UTF-8, spreading the strings
+// across the processor cores (see above)
+//------------------------------------------------------------------------------
+inline void ToUtf8BatchParallel(CAtlArray<CStringW> const& utf16Strings,
+                                CStringA& utf8, CAtlArray<int>& offsets,
+                                int parallelThreshold = Detail::kDefaultParallelThreshold)
+{
+    Detail::ToUtf8BatchParallelNative(utf16Strings.GetData(), utf16Strings.GetCount(),
+                                      utf8, offsets, parallelThreshold);
+}
+
+
+#ifdef UNICODECONVATL_HAS_STRING_VIEW
+//------------------------------------------------------------------------------
+// Convert an array of UTF-16 string views to UTF-8, spreading the strings
+// across the processor cores (see above)
+//------------------------------------------------------------------------------
+inline void ToUtf8BatchParallel(const std::wstring_view* utf16Strings, size_t count,
+                                CStringA& utf8, CAtlArray<int>& offsets,
+                                int parallelThreshold = Detail::kDefaultParallelThreshold)
+{
+    Detail::ToUtf8BatchParallelNative(utf16Strings, count, utf8, offsets, parallelThreshold);
+}
+#endif // UNICODECONVATL_HAS_STRING_VIEW
+
+
+//------------------------------------------------------------------------------
+// Convert an array of UTF-8 strings to UTF-16, spreading the strings
+// across the processor cores.
+//
+// The result has the same layout of ToUtf16Batch (see ToUtf8BatchParallel).
+// Batches shorter than parallelThreshold code units in total are converted
+// with ToUtf16Batch on the calling thread.
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+inline void ToUtf16BatchParallel(const CStringA* utf8Strings, size_t count,
+                                 CStringW& utf16, CAtlArray<int>& offsets,
+                                 int parallelThreshold = Detail::kDefaultParallelThreshold)
+{
+    Detail::ToUtf16BatchParallelNative(utf8Strings, count, utf16, offsets, parallelThreshold);
+}
+
+
+//------------------------------------------------------------------------------
+// Convert an array of UTF-8 strings to UTF-16, spreading the strings
+// across the processor cores (see above)
+//------------------------------------------------------------------------------
+inline void ToUtf16BatchParallel(CAtlArray<CStringA> const& utf8Strings,
+                                 CStringW& utf16, CAtlArray<int>& offsets,
+                                 int parallelThreshold = Detail::kDefaultParallelThreshold)
+{
+    Detail::ToUtf16BatchParallelNative(utf8Strings.GetData(), utf8Strings.GetCount(),
+                                       utf16, offsets, parallelThreshold);
+}
+
+
+#ifdef UNICODECONVATL_HAS_STRING_VIEW
+//------------------------------------------------------------------------------
+// Convert an array of UTF-8 string views to UTF-16, spreading the strings
+// across the processor cores (see above)
+//------------------------------------------------------------------------------
+inline void ToUtf16BatchParallel(const std::string_view* utf8Strings, size_t count,
+                                 CStringW& utf16, CAtlArray<int>& offsets,
+                                 int parallelThreshold = Detail::kDefaultParallelThreshold)
+{
+    Detail::ToUtf16BatchParallelNative(utf8Strings, count, utf16, offsets, parallelThreshold);
+}
+#endif // UNICODECONVATL_HAS_STRING_VIEW
+
+} // namespace UnicodeConvAtl
@@ -0,0 +1,590 @@
+#pragma once
+
+////////////////////////////////////////////////////////////////////////////////
+// Overlapped UTF-8 to UTF-16 conversion pipeline for pipes, sockets and files
+//
+//                  Copyright (C) by Giovanni Dicanio
+//                    <giovanni.dicanio AT gmail.com>
+//
+////////////////////////////////////////////////////////////////////////////////
+
+
+//------------------------------------------------------------------------------
+// This header extends UnicodeConvAtl.h with a pipeline that reads UTF-8 text
+// from a handle opened for overlapped I/O (a named pipe, a socket, a file),
+// converts it to UTF-16 on the Windows thread pool, and passes the converted
+// text to a consumer callback, one chunk at a time:
+//
+//      * Pipeline object, to start the conversion and wait for it later:
+//        class Utf8ToUtf16Pipeline
+//
+//      * Run a pipeline until the end of the input:
+//        void TranscodeUtf8ToUtf16(HANDLE hInput,
+//                                  Utf8ToUtf16Pipeline::Consumer consumer)
+//
+// The reads are bound to the thread pool with CreateThreadpoolIo.
+// Several read buffers are used (three by default): as soon as a read
+// completes, the next read is started into a free buffer, while the data
+// just read is converted, so the I/O and the conversion overlap.
+//
+// The chunks are converted with a Utf8ToUtf16Stream, so UTF-8 sequences
+// split across reads are handled correctly; they're converted, and passed
+// to the consumer, in the same order they were read, by one thread pool
+// thread at a time (the consumer doesn't need to be thread-safe, but it
+// shouldn't block for long, as it holds back the conversion of the
+// following chunks).
+//
+// For example, for a named pipe created with FILE_FLAG_OVERLAPPED:
+//
+//      Utf8ToUtf16Pipeline pipeline(hPipe, [&](CStringW const& text)
+//      {
+//          ProcessMessageText(text);
+//      });
+//      pipeline.Start();
+//      ...
+//      pipeline.Wait();    // throws on I/O or conversion errors
+//
+// The input ends when a read reports end of file, or a broken pipe
+// (the writer closed its end); on handles other than pipes (like sockets),
+// also when a read completes without data. On message-mode pipes, empty
+// messages are skipped, and messages larger than a read buffer are read
+// in pieces, and converted as a single stream.
+// Errors are signaled by Wait using AtlThrow:
+// I/O errors, invalid UTF-8 (with the same error code of ToUtf16),
+// and CAtlExceptions thrown by the consumer (other exceptions thrown
+// by the consumer are reported as E_FAIL). On errors, only the pending read
+// of the pipeline is cancelled: other I/O on the same handle (like writes
+// on a duplex pipe) is not affected.
+//
+// These functions live under the UnicodeConvAtl namespace.
+//
+// This code is released under the MIT License (see UnicodeConvAtl.h).
+//------------------------------------------------------------------------------
+
+
+//==============================================================================
+//                              Includes
+//==============================================================================
+
+#include "UnicodeConvAtl.h"     // Unicode UTF-16/UTF-8 conversions
+
+#include <atlbase.h>            // CHandle
+
+#include <functional>           // std::function
+#include <memory>               // std::unique_ptr
+
+
+//==============================================================================
+//                          Implementation Details
+//==============================================================================
+
+namespace UnicodeConvAtl {
+namespace Detail {
+
+//------------------------------------------------------------------------------
+// Default size of each read buffer of the pipeline, in bytes
+//------------------------------------------------------------------------------
+constexpr DWORD kDefaultPipelineBufferSize = 64 * 1024;
+
+
+//------------------------------------------------------------------------------
+// Default number of read buffers of the pipeline (triple buffering: one read
+// in flight, one chunk being converted, one chunk waiting)
+//------------------------------------------------------------------------------
+constexpr int kDefaultPipelineBufferCount = 3;
+
+
+//------------------------------------------------------------------------------
+// Return true if the given read error marks the end of the input
+//------------------------------------------------------------------------------
+inline bool IsEndOfInput(DWORD error) noexcept
+{
+    return (error == ERROR_HANDLE_EOF) || (error == ERROR_BROKEN_PIPE);
+}
+
+
+//------------------------------------------------------------------------------
+// Return true if the given read result carries data: on message-mode pipes,
+// ERROR_MORE_DATA reports a message larger than the read buffer, whose
+// remaining bytes are returned by the following reads
+//------------------------------------------------------------------------------
+inline bool IsSuccessfulRead(DWORD error) noexcept
+{
+    return (error == NO_ERROR) || (error == ERROR_MORE_DATA);
+}
+
+} // namespace Detail
+
+
+//==============================================================================
+//                          Conversion Pipeline
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Pipeline that reads UTF-8 text from a handle opened for overlapped I/O,
+// and passes its UTF-16 conversion to a consumer callback.
+// The handle is owned by the caller, and must stay open until the pipeline
+// completes (or is destroyed).
+//------------------------------------------------------------------------------
+class Utf8ToUtf16Pipeline
+{
+public:
+
+    // Callback invoked with each converted chunk of text, in order
+    using Consumer = std::function<void(CStringW const& utf16)>;
+
+
+    //--------------------------------------------------------------------------
+    // Bind the pipeline to the input handle.
+    // Signal errors using AtlThrow.
+    //--------------------------------------------------------------------------
+    Utf8ToUtf16Pipeline(HANDLE hInput, Consumer consumer,
+                        DWORD bufferSize = Detail::kDefaultPipelineBufferSize,
+                        int bufferCount = Detail::kDefaultPipelineBufferCount)
+        : m_hInput(hInput)
+        , m_consumer(std::move(consumer))
+        , m_bufferSize(bufferSize)
+        , m_bufferCount(bufferCount)
+    {
+        ATLASSERT(hInput != nullptr && hInput != INVALID_HANDLE_VALUE);
+        ATLASSERT(m_consumer);
+        if ((bufferSize == 0) || (bufferSize > static_cast<DWORD>(INT_MAX)) || (bufferCount < 2))
+        {
+            AtlThrow(E_INVALIDARG);
+        }
+
+        ::InitializeSRWLock(&m_lock);
+
+        m_buffers.reset(new ReadBuffer[bufferCount]);
+        m_readyQueue.reset(new int[bufferCount]);
+        m_freeBuffers.reset(new int[bufferCount]);
+        for (int i = 0; i < bufferCount; ++i)
+        {
+            m_buffers[i].data.reset(new char[bufferSize]);
+            m_freeBuffers[i] = i;
+        }
+        m_freeCount = bufferCount;
+
+        // Manual-reset event, signaled when the pipeline completes
+        m_completed.Attach(::CreateEventW(nullptr, TRUE, FALSE, nullptr));
+        if (m_completed.m_h == nullptr)
+        {
+            AtlThrowLastWin32();
+        }
+
+        // On pipes, a successful read without data is an empty message
+        m_isPipe = (::GetNamedPipeInfo(hInput, nullptr, nullptr, nullptr, nullptr) != FALSE);
+
+        m_io = ::CreateThreadpoolIo(hInput, IoCompletionCallback, this, nullptr);
+        if (m_io == nullptr)
+        {
+            AtlThrowLastWin32();
+        }
+    }
+
+
+    //--------------------------------------------------------------------------
+    // Cancel the pending I/O, if the pipeline is still running,
+    // and wait for its thread pool callbacks to complete
+    //--------------------------------------------------------------------------
+    ~Utf8ToUtf16Pipeline()
+    {
+        if (m_started)
+        {
+            Cancel();
+            ::WaitForSingleObject(m_completed, INFINITE);
+        }
+
+        ::WaitForThreadpoolIoCallbacks(m_io, FALSE);
+        ::CloseThreadpoolIo(m_io);
+    }
+
+    // Ban copy
+    Utf8ToUtf16Pipeline(const Utf8ToUtf16Pipeline&) = delete;
+    Utf8ToUtf16Pipeline& operator=(const Utf8ToUtf16Pipeline&) = delete;
+
+
+    //--------------------------------------------------------------------------
+    // Start reading and converting the input.
+    // The pipeline runs on the thread pool, until the end of the input.
+    //--------------------------------------------------------------------------
+    void Start()
+    {
+        ATLASSERT(!m_started);
+        m_started = true;
+        ContinueReading();
+    }
+
+
+    //--------------------------------------------------------------------------
+    // Wait until the whole input has been read and converted, and passed
+    // to the consumer. Signal errors using AtlThrow.
+    //--------------------------------------------------------------------------
+    void Wait()
+    {
+        ATLASSERT(m_started);
+        ::WaitForSingleObject(m_completed, INFINITE);
+
+        if (FAILED(m_hr))
+        {
+            AtlThrow(m_hr);
+        }
+    }
+
+
+    //--------------------------------------------------------------------------
+    // Return true if the pipeline has completed (successfully or not).
+    // Wait doesn't block after this returns true.
+    //--------------------------------------------------------------------------
+    bool IsCompleted() const noexcept
+    {
+        return ::WaitForSingleObject(m_completed, 0) == WAIT_OBJECT_0;
+    }
+
+
+    //--------------------------------------------------------------------------
+    // Cancel the pending read: the pipeline completes with the error
+    // HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED).
+    // Other I/O issued by the caller on the same handle is not cancelled.
+    //--------------------------------------------------------------------------
+    void Cancel() noexcept
+    {
+        Detail::ExclusiveLockGuard lock(m_lock);
+        if (!m_finished)
+        {
+            SetErrorLocked(HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED));
+        }
+    }
+
+
+private:
+
+    // Read buffer; the OVERLAPPED structure comes first, so the buffer
+    // can be recovered from the OVERLAPPED pointer of the completion
+    struct ReadBuffer
+    {
+        OVERLAPPED                  overlapped;
+        std::unique_ptr<char[]>     data;
+        DWORD                       length;
+
+        ReadBuffer() noexcept
+            : overlapped()
+            , length(0)
+        {
+        }
+    };
+
+    HANDLE                          m_hInput;
+    Consumer                        m_consumer;
+    DWORD                           m_bufferSize;
+    int                             m_bufferCount;
+    bool                            m_isPipe = false;
+
+    PTP_IO                          m_io = nullptr;
+    CHandle                         m_completed;
+    bool                            m_started = false;
+
+    // State shared by the thread pool callbacks, protected by m_lock
+    SRWLOCK                         m_lock;
+    std::unique_ptr<ReadBuffer[]>   m_buffers;
+    std::unique_ptr<int[]>          m_freeBuffers;  // stack of free buffer indexes
+    int                             m_freeCount = 0;
+    std::unique_ptr<int[]>          m_readyQueue;   // FIFO of buffers read, to convert
+    int                             m_readyHead = 0;
+    int                             m_readyCount = 0;
+    ULONGLONG                       m_offset = 0;   // offset of the next read, for files
+    ReadBuffer*                     m_pendingRead = nullptr;    // buffer of the read in flight
+    bool                            m_readPending = false;
+    bool                            m_converting = false;
+    bool                            m_endOfInput = false;
+    bool                            m_finished = false;
+    HRESULT                         m_hr = S_OK;
+
+    // Used only by the thread that is converting
+    Utf8ToUtf16Stream               m_stream;
+    CStringW                        m_utf16;
+
+
+    //--------------------------------------------------------------------------
+    // Record the first error; the pipeline stops reading and converting.
+    // Called with the lock held.
+    //--------------------------------------------------------------------------
+    void SetErrorLocked(HRESULT hr) noexcept
+    {
+        if (SUCCEEDED(m_hr))
+        {
+            m_hr = hr;
+        }
+
+        // The pipeline completes once the read in flight does: don't wait
+        // for a writer that may keep the pipe open without writing
+        CancelPendingReadLocked();
+    }
+
+
+    //--------------------------------------------------------------------------
+    // Cancel the read in flight, if any, after an error.
+    // Only this read is cancelled, not the other I/O on the handle.
+    // Called with the lock held.
+    //--------------------------------------------------------------------------
+    void CancelPendingReadLocked() noexcept
+    {
+        if (m_readPending && FAILED(m_hr))
+        {
+            // Fails with ERROR_NOT_FOUND if the read hasn't been issued yet,
+            // or has already completed: ContinueReading checks again
+            // after issuing it
+            ::CancelIoEx(m_hInput, &m_pendingRead->overlapped);
+        }
+    }
+
+
+    //--------------------------------------------------------------------------
+    // Start the next read, if there's a free buffer and no read in flight.
+    // Reads are issued one at a time, so they complete in order.
+    //--------------------------------------------------------------------------
+    void ContinueReading() noexcept
+    {
+        ReadBuffer* pBuffer = nullptr;
+        {
+            Detail::ExclusiveLockGuard lock(m_lock);
+            if (m_readPending || m_endOfInput || FAILED(m_hr) || (m_freeCount == 0))
+            {
+                return;
+            }
+
+            pBuffer = &m_buffers[m_freeBuffers[--m_freeCount]];
+            m_pendingRead = pBuffer;
+            m_readPending = true;
+
+            pBuffer->overlapped = OVERLAPPED();
+            pBuffer->overlapped.Offset = static_cast<DWORD>(m_offset & 0xFFFFFFFF);
+            pBuffer->overlapped.OffsetHigh = static_cast<DWORD>(m_offset >> 32);
+        }
+
+        ::StartThreadpoolIo(m_io);
+        if (!::ReadFile(m_hInput, pBuffer->data.get(), m_bufferSize, nullptr,
+                        &pBuffer->overlapped))
+        {
+            // With ERROR_MORE_DATA, the completion is queued like for
+            // a successful read
+            const DWORD error = ::GetLastError();
+            if ((error != ERROR_IO_PENDING) && (error != ERROR_MORE_DATA))
+            {
+                // No completion will be queued for this read
+                ::CancelThreadpoolIo(m_io);
+                OnReadCompleted(pBuffer, error, 0);
+                return;
+            }
+        }
+
+        // An error may have been recorded while the read was being issued
+        Detail::ExclusiveLockGuard lock(m_lock);
+        CancelPendingReadLocked();
+    }
+
+
+    //--------------------------------------------------------------------------
+    // Thread pool callback, invoked when a read completes
+    //--------------------------------------------------------------------------
+    static void CALLBACK IoCompletionCallback(PTP_CALLBACK_INSTANCE /* instance */,
+                                              PVOID context, PVOID overlapped,
+                                              ULONG ioResult, ULONG_PTR bytesTransferred,
+                                              PTP_IO /* io */) noexcept
+    {
+        Utf8ToUtf16Pipeline* const pThis = static_cast<Utf8ToUtf16Pipeline*>(context);
+        pThis->OnReadCompleted(reinterpret_cast<ReadBuffer*>(overlapped), ioResult,
+                               static_cast<DWORD>(bytesTransferred));
+    }
+
+
+    //--------------------------------------------------------------------------
+    // Queue the data read for conversion, start the next read,
+    // and convert the queued data, unless another thread is already doing it
+    //--------------------------------------------------------------------------
+    void OnReadCompleted(ReadBuffer* pBuffer, DWORD error, DWORD bytesRead) noexcept
+    {
+        const int bufferIndex = static_cast<int>(pBuffer - m_buffers.get());
+        {
+            Detail::ExclusiveLockGuard lock(m_lock);
+            m_readPending = false;
+            m_pendingRead = nullptr;
+
+            if (Detail::IsSuccessfulRead(error) && (bytesRead > 0))
+            {
+                pBuffer->length = bytesRead;
+                m_offset += bytesRead;
+                m_readyQueue[(m_readyHead + m_readyCount) % m_bufferCount] = bufferIndex;
+                ++m_readyCount;
+            }
+            else
+            {
+                // On pipes, only a broken pipe ends the input: after an empty
+                // message, the next read is issued as usual
+                if (Detail::IsEndOfInput(error) || ((error == NO_ERROR) && !m_isPipe))
+                {
+                    m_endOfInput = true;
+                }
+                else if (!Detail::IsSuccessfulRead(error))
+                {
+                    SetErrorLocked(HRESULT_FROM_WIN32(error));
+                }
+                m_freeBuffers[m_freeCount++] = bufferIndex;
+            }
+        }
+
+        // Overlap the next read with the conversion of this chunk
+        ContinueReading();
+        ConvertReadyBuffers();
+    }
+
+
+    //--------------------------------------------------------------------------
+    // Convert the queued buffers in order, and pass them to the consumer.
+    // Only one thread at a time converts; the others just queue their buffers.
+    // When the input has ended, and all of it has been converted,
+    // complete the pipeline.
+    //--------------------------------------------------------------------------
+    void ConvertReadyBuffers() noexcept
+    {
+        for (;;)
+        {
+            ReadBuffer* pBuffer = nullptr;
+            int bufferIndex = -1;
+            {
+                Detail::ExclusiveLockGuard lock(m_lock);
+                if (m_converting)
+                {
+                    return;
+                }
+
+                if ((m_readyCount > 0) && SUCCEEDED(m_hr))
+                {
+                    bufferIndex = m_readyQueue[m_readyHead];
+                    m_readyHead = (m_readyHead + 1) % m_bufferCount;
+                    --m_readyCount;
+                    pBuffer = &m_buffers[bufferIndex];
+                    m_converting = true;
+                }
+                else
+                {
+                    // Nothing to convert (or an error occurred): complete the
+                    // pipeline, once there's no read in flight
+                    if (!m_readPending && !m_finished && (m_endOfInput || FAILED(m_hr)))
+                    {
+                        m_finished = true;
+                        m_converting = true;
+                    }
+                    else
+                    {
+                        return;
+                    }
+                }
+            }
+
+            if (pBuffer != nullptr)
+            {
+                ConvertBuffer(pBuffer);
+
+                {
+                    Detail::ExclusiveLockGuard lock(m_lock);
+                    m_freeBuffers[m_freeCount++] = bufferIndex;
+                    m_converting = false;
+                }
+
+                // A read may have been waiting for a free buffer
+                ContinueReading();
+            }
+            else
+            {
+                Complete();
+                return;
+            }
+        }
+    }
+
+
+    //--------------------------------------------------------------------------
+    // Convert a chunk, and pass it to the consumer
+    //--------------------------------------------------------------------------
+    void ConvertBuffer(ReadBuffer* pBuffer) noexcept
+    {
+        HRESULT hr = S_OK;
+        try
+        {
+            m_utf16.Truncate(0);
+            m_stream.Convert(pBuffer->data.get(), static_cast<int>(pBuffer->length), m_utf16);
+
+            // The chunk may hold just the beginning of a UTF-8 sequence
+            if (!m_utf16.IsEmpty())
+            {
+                m_consumer(m_utf16);
+            }
+        }
+        catch (const CAtlException& e)
+        {
+            hr = e;
+        }
+        catch (...)
+        {
+            hr = E_FAIL;
+        }
+
+        if (FAILED(hr))
+        {
+            Detail::ExclusiveLockGuard lock(m_lock);
+            SetErrorLocked(hr);
+        }
+    }
+
+
+    //--------------------------------------------------------------------------
+    // Check the end of the input, and signal the completion of the pipeline.
+    // Called by the converting thread, after all the chunks have been converted.
+    //--------------------------------------------------------------------------
+    void Complete() noexcept
+    {
+        HRESULT hr = S_OK;
+        {
+            Detail::SharedLockGuard lock(m_lock);
+            hr = m_hr;
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            try
+            {
+                // A UTF-8 sequence truncated at the end of the input is invalid
+                m_stream.Finish();
+            }
+            catch (const CAtlException& e)
+            {
+                Detail::ExclusiveLockGuard lock(m_lock);
+                SetErrorLocked(e);
+            }
+        }
+
+        // The pipeline object may be destroyed as soon as the event is signaled:
+        // this must be the last access to it
+        ::SetEvent(m_completed);
+    }
+};
+
+
+//------------------------------------------------------------------------------
+// Read UTF-8 text from the input handle (opened for overlapped I/O) until
+// the end of the input, passing its UTF-16 conversion to the consumer,
+// one chunk at a time, with the I/O overlapped with the conversion
+// (see Utf8ToUtf16Pipeline).
+// Signal errors using AtlThrow.
+//------------------------------------------------------------------------------
+inline void TranscodeUtf8ToUtf16(HANDLE hInput, Utf8ToUtf16Pipeline::Consumer consumer,
+                                 DWORD bufferSize = Detail::kDefaultPipelineBufferSize,
+                                 int bufferCount = Detail::kDefaultPipelineBufferCount)
+{
+    Utf8ToUtf16Pipeline pipeline(hInput, std::move(consumer), bufferSize, bufferCount);
+    pipeline.Start();
+    pipeline.Wait();
+}
+
+} // namespace UnicodeConvAtl
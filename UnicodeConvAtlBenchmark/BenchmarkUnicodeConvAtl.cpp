@@ -0,0 +1,411 @@
+////////////////////////////////////////////////////////////////////////////////
+// BenchmarkUnicodeConvAtl.cpp : Measure the performance of the Unicode
+// conversion functions, comparing the available conversion strategies
+// by Giovanni Dicanio <giovanni.dicanio AT gmail.com>
+////////////////////////////////////////////////////////////////////////////////
+
+
+//------------------------------------------------------------------------------
+// Usage:
+//
+//      BenchmarkUnicodeConvAtl [maxSizeInBytes] [--csv]
+//
+// For each corpus (ASCII, Latin-1, CJK, emoji-heavy, mixed) and each text size
+// (from 8 bytes up to maxSizeInBytes, 64 MB by default, 1 GB at most),
+// every conversion strategy is run repeatedly, and the following are reported:
+//
+//      * throughput, in MB/s and in strings/s
+//      * latency percentiles (p50, p90, p99) of a single conversion
+//
+// Sizes and throughput are measured in UTF-8 bytes for both conversion
+// directions, so the results of the two directions can be compared directly.
+//
+// Measuring up to 1 GB requires a 64-bit build, and several GB of memory.
+// Run the Release build, with no debugger attached.
+//------------------------------------------------------------------------------
+
+
+#include "UnicodeConvAtl.h"         // Module to benchmark
+#include "UnicodeConvAtlParallel.h" // Parallel conversions
+
+#include <atlconv.h>                // ATL CW2A, CA2W, for comparison
+
+#include <algorithm>                // std::sort
+#include <iomanip>                  // std::setw
+#include <iostream>                 // For console output
+#include <vector>                   // std::vector
+
+
+//
+// Benchmark Configuration
+//
+
+// Each latency sample times a batch of conversions of at least this many bytes,
+// so that very short conversions can be measured accurately with QPC
+constexpr size_t kMinBatchBytes = 64 * 1024;
+
+// Time spent measuring each strategy, in seconds
+constexpr double kTimeBudgetPerStrategy = 0.25;
+
+// Number of latency samples collected for each strategy
+constexpr size_t kMinSamples = 5;
+constexpr size_t kMaxSamples = 10000;
+
+// Text sizes, in UTF-8 bytes
+const size_t kTextSizes[] =
+{
+    8, 64, 1024, 16 * 1024, 256 * 1024,
+    4 * 1024 * 1024, 64 * 1024 * 1024, 1024 * 1024 * 1024
+};
+
+constexpr size_t kDefaultMaxTextSize = 64 * 1024 * 1024;
+
+
+//
+// Corpora: each corpus text is built repeating its sample
+//
+
+struct Corpus
+{
+    const char*     name;
+    const wchar_t*  sample;
+};
+
+const Corpus kCorpora[] =
+{
+    { "ASCII",      L"The quick brown fox jumps over the lazy dog. 0123456789\n" },
+    { "Latin-1",    L"Caff\xE8 cr\xE8me br\xFBl\xE9" L"e, na\xEFve se\xF1or, \xC5ngstr\xF6m, "
+                    L"\xE0 la carte, Stra\xDF" L"e\n" },
+    { "CJK",        L"\x65E5\x672C\x8A9E\x306E\x6587\x7AE0\x3002\x4E2D\x6587\x6587\x672C"
+                    L"\x3002\xD55C\xAD6D\xC5B4\x3001\x5B66\x5802\n" },
+    { "Emoji",      L"\xD83D\xDE00\xD83D\xDE80\xD83C\xDF89\xD83D\xDC4D \xD83E\xDD16"
+                    L"\xD83C\xDF0D\xD83D\xDCA1\xD83D\xDD25\n" },
+    { "Mixed",      L"Hello, \x4E16\x754C! Caff\xE8 \xD83D\xDE00 \x3053\x3093\x306B\x3061"
+                    L"\x306F, \x041F\x0440\x0438\x0432\x0435\x0442 \x0645\x0631\x062D\x0628"
+                    L"\x0627\n" },
+};
+
+
+//
+// Benchmark Support
+//
+
+// Results of the conversions are accumulated here,
+// so that the compiler can't optimize them away
+volatile unsigned int g_sink = 0;
+
+void Consume(int result)
+{
+    g_sink = g_sink + static_cast<unsigned int>(result);
+}
+
+
+// Performance measures of a conversion strategy
+struct Measurement
+{
+    double  megabytesPerSecond;
+    double  stringsPerSecond;
+    double  p50Microseconds;
+    double  p90Microseconds;
+    double  p99Microseconds;
+};
+
+
+// Return the current QPC time, in seconds
+double Now()
+{
+    static const double frequency = []()
+    {
+        LARGE_INTEGER f;
+        ::QueryPerformanceFrequency(&f);
+        return static_cast<double>(f.QuadPart);
+    }();
+
+    LARGE_INTEGER counter;
+    ::QueryPerformanceCounter(&counter);
+    return static_cast<double>(counter.QuadPart) / frequency;
+}
+
+
+// Return the requested percentile of the sorted samples
+double Percentile(const std::vector<double>& sortedSamples, double percentile)
+{
+    const size_t index = static_cast<size_t>(
+        percentile * static_cast<double>(sortedSamples.size() - 1) + 0.5);
+    return sortedSamples[index];
+}
+
+
+// Run the given conversion repeatedly on a text of textBytes UTF-8 bytes,
+// and measure its throughput and latency.
+// The conversion function returns the length of its result.
+template <typename ConvertFunc>
+Measurement Measure(size_t textBytes, ConvertFunc convert)
+{
+    const size_t batchSize = (textBytes < kMinBatchBytes) ? (kMinBatchBytes / textBytes) : 1;
+
+    // Warm up caches, and the buffers reused across conversions
+    Consume(convert());
+
+    std::vector<double> samples;
+    double totalSeconds = 0.0;
+
+    while ((samples.size() < kMinSamples || totalSeconds < kTimeBudgetPerStrategy)
+           && samples.size() < kMaxSamples)
+    {
+        const double start = Now();
+        for (size_t i = 0; i < batchSize; ++i)
+        {
+            Consume(convert());
+        }
+        const double elapsed = Now() - start;
+
+        totalSeconds += elapsed;
+        samples.push_back(elapsed / static_cast<double>(batchSize));
+    }
+
+    std::sort(samples.begin(), samples.end());
+
+    const double conversions = static_cast<double>(samples.size() * batchSize);
+
+    Measurement result;
+    result.megabytesPerSecond = conversions * static_cast<double>(textBytes) / (1024.0 * 1024.0) / totalSeconds;
+    result.stringsPerSecond = conversions / totalSeconds;
+    result.p50Microseconds = Percentile(samples, 0.50) * 1e6;
+    result.p90Microseconds = Percentile(samples, 0.90) * 1e6;
+    result.p99Microseconds = Percentile(samples, 0.99) * 1e6;
+    return result;
+}
+
+
+// Print the measures of a conversion strategy, as a table row or a CSV line
+void PrintMeasurement(const char* corpus, size_t textBytes, const char* strategy,
+                      const Measurement& m, bool csv)
+{
+    if (csv)
+    {
+        std::cout << corpus << ',' << textBytes << ',' << strategy << ','
+                  << m.megabytesPerSecond << ',' << m.stringsPerSecond << ','
+                  << m.p50Microseconds << ',' << m.p90Microseconds << ','
+                  << m.p99Microseconds << '\n';
+        return;
+    }
+
+    std::cout << "  " << std::left << std::setw(38) << strategy << std::right
+              << std::fixed << std::setprecision(1)
+              << std::setw(12) << m.megabytesPerSecond
+              << std::setw(15) << m.stringsPerSecond
+              << std::setprecision(3)
+              << std::setw(13) << m.p50Microseconds
+              << std::setw(13) << m.p90Microseconds
+              << std::setw(13) << m.p99Microseconds << '\n';
+}
+
+
+// Build a text of (about) textBytes UTF-8 bytes, repeating the given sample.
+// The text is cut at a code point boundary.
+CStringW BuildCorpusText(const wchar_t* sample, size_t textBytes)
+{
+    const CStringW sampleUtf16(sample);
+    const size_t sampleBytes = static_cast<size_t>(UnicodeConvAtl::Utf8LengthOf(sampleUtf16));
+
+    CStringW text;
+    text.Preallocate(static_cast<int>(textBytes / sampleBytes + 1) * sampleUtf16.GetLength());
+
+    size_t bytes = 0;
+    while (bytes + sampleBytes <= textBytes)
+    {
+        text += sampleUtf16;
+        bytes += sampleBytes;
+    }
+
+    // Complete the text with the beginning of the sample, one code point at a time
+    for (int i = 0; i < sampleUtf16.GetLength(); )
+    {
+        const int codePointLength = IS_HIGH_SURROGATE(sampleUtf16[i]) ? 2 : 1;
+        const size_t codePointBytes = static_cast<size_t>(
+            UnicodeConvAtl::Utf8LengthOf(sampleUtf16.GetString() + i, codePointLength));
+        if (bytes + codePointBytes > textBytes)
+        {
+            break;
+        }
+
+        text += sampleUtf16.Mid(i, codePointLength);
+        bytes += codePointBytes;
+        i += codePointLength;
+    }
+
+    return text;
+}
+
+
+//
+// Benchmarks
+//
+
+// Measure all the UTF-16 to UTF-8 conversion strategies
+void BenchmarkToUtf8(const char* corpus, size_t textBytes, CStringW const& utf16, bool csv)
+{
+    using namespace UnicodeConvAtl;
+
+    CStringA reused;
+
+    PrintMeasurement(corpus, textBytes, "UTF-16->8 ToUtf8 (two-pass)",
+        Measure(textBytes, [&]() { return ToUtf8(utf16).GetLength(); }), csv);
+
+    PrintMeasurement(corpus, textBytes, "UTF-16->8 ToUtf8 (reused buffer)",
+        Measure(textBytes, [&]() { ToUtf8(utf16, reused); return reused.GetLength(); }), csv);
+
+    PrintMeasurement(corpus, textBytes, "UTF-16->8 ToUtf8SinglePass",
+        Measure(textBytes, [&]() { return ToUtf8SinglePass(utf16).GetLength(); }), csv);
+
+    PrintMeasurement(corpus, textBytes, "UTF-16->8 ToUtf8Native",
+        Measure(textBytes, [&]() { return ToUtf8Native(utf16).GetLength(); }), csv);
+
+    PrintMeasurement(corpus, textBytes, "UTF-16->8 ConvertToUtf8<TrustInput>",
+        Measure(textBytes, [&]()
+        {
+            ConvertToUtf8<ThrowOnError, CStringAllocPolicy, TrustInput>(
+                utf16.GetString(), utf16.GetLength(), reused);
+            return reused.GetLength();
+        }), csv);
+
+    PrintMeasurement(corpus, textBytes, "UTF-16->8 CW2Utf8 (stack buffer)",
+        Measure(textBytes, [&]() { return CW2Utf8(utf16).GetLength(); }), csv);
+
+    if (textBytes >= static_cast<size_t>(Detail::kDefaultParallelThreshold))
+    {
+        PrintMeasurement(corpus, textBytes, "UTF-16->8 ToUtf8Parallel",
+            Measure(textBytes, [&]() { return ToUtf8Parallel(utf16).GetLength(); }), csv);
+    }
+
+    PrintMeasurement(corpus, textBytes, "UTF-16->8 ATL CW2A(CP_UTF8)",
+        Measure(textBytes, [&]()
+        {
+            CW2A utf8(utf16, CP_UTF8);
+            return static_cast<int>(static_cast<const char*>(utf8)[0]);
+        }), csv);
+}
+
+
+// Measure all the UTF-8 to UTF-16 conversion strategies
+void BenchmarkToUtf16(const char* corpus, size_t textBytes, CStringA const& utf8, bool csv)
+{
+    using namespace UnicodeConvAtl;
+
+    CStringW reused;
+
+    PrintMeasurement(corpus, textBytes, "UTF-8->16 ToUtf16 (two-pass)",
+        Measure(textBytes, [&]() { return ToUtf16(utf8).GetLength(); }), csv);
+
+    PrintMeasurement(corpus, textBytes, "UTF-8->16 ToUtf16 (reused buffer)",
+        Measure(textBytes, [&]() { ToUtf16(utf8, reused); return reused.GetLength(); }), csv);
+
+    PrintMeasurement(corpus, textBytes, "UTF-8->16 ToUtf16SinglePass",
+        Measure(textBytes, [&]() { return ToUtf16SinglePass(utf8).GetLength(); }), csv);
+
+    PrintMeasurement(corpus, textBytes, "UTF-8->16 ToUtf16Native",
+        Measure(textBytes, [&]() { return ToUtf16Native(utf8).GetLength(); }), csv);
+
+    PrintMeasurement(corpus, textBytes, "UTF-8->16 ConvertToUtf16<TrustInput>",
+        Measure(textBytes, [&]()
+        {
+            ConvertToUtf16<ThrowOnError, CStringAllocPolicy, TrustInput>(
+                utf8.GetString(), utf8.GetLength(), reused);
+            return reused.GetLength();
+        }), csv);
+
+    PrintMeasurement(corpus, textBytes, "UTF-8->16 CUtf82W (stack buffer)",
+        Measure(textBytes, [&]() { return CUtf82W(utf8).GetLength(); }), csv);
+
+    if (textBytes >= static_cast<size_t>(Detail::kDefaultParallelThreshold))
+    {
+        PrintMeasurement(corpus, textBytes, "UTF-8->16 ToUtf16Parallel",
+            Measure(textBytes, [&]() { return ToUtf16Parallel(utf8).GetLength(); }), csv);
+    }
+
+    PrintMeasurement(corpus, textBytes, "UTF-8->16 ATL CA2W(CP_UTF8)",
+        Measure(textBytes, [&]()
+        {
+            CA2W utf16(utf8, CP_UTF8);
+            return static_cast<int>(static_cast<const wchar_t*>(utf16)[0]);
+        }), csv);
+}
+
+
+void RunBenchmarks(size_t maxTextSize, bool csv)
+{
+    if (csv)
+    {
+        std::cout << "corpus,bytes,strategy,MB/s,strings/s,p50 us,p90 us,p99 us\n";
+    }
+    else
+    {
+        std::cout << "*** Benchmark Unicode UTF-16/UTF-8 CString Conversion Functions *** \n"
+                  << "    ============================================================ \n"
+                  << "    by Giovanni Dicanio \n\n";
+    }
+
+    for (const Corpus& corpus : kCorpora)
+    {
+        for (size_t textBytes : kTextSizes)
+        {
+            if (textBytes > maxTextSize)
+            {
+                break;
+            }
+
+            const CStringW utf16 = BuildCorpusText(corpus.sample, textBytes);
+            const CStringA utf8 = UnicodeConvAtl::ToUtf8(utf16);
+
+            if (!csv)
+            {
+                std::cout << corpus.name << ", " << utf8.GetLength() << " bytes:\n"
+                          << "  " << std::left << std::setw(38) << "Strategy" << std::right
+                          << std::setw(12) << "MB/s" << std::setw(15) << "strings/s"
+                          << std::setw(13) << "p50 us" << std::setw(13) << "p90 us"
+                          << std::setw(13) << "p99 us" << '\n';
+            }
+
+            BenchmarkToUtf8(corpus.name, textBytes, utf16, csv);
+            BenchmarkToUtf16(corpus.name, textBytes, utf8, csv);
+
+            if (!csv)
+            {
+                std::cout << '\n';
+            }
+        }
+    }
+}
+
+
+int wmain(int argc, wchar_t* argv[])
+{
+    size_t maxTextSize = kDefaultMaxTextSize;
+    bool csv = false;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (wcscmp(argv[i], L"--csv") == 0)
+        {
+            csv = true;
+        }
+        else
+        {
+            maxTextSize = static_cast<size_t>(wcstoull(argv[i], nullptr, 10));
+        }
+    }
+
+    try
+    {
+        RunBenchmarks(maxTextSize, csv);
+    }
+    catch (const CAtlException& e)
+    {
+        std::cerr << "Benchmark failed with HRESULT 0x" << std::hex
+                  << static_cast<unsigned long>(HRESULT(e)) << '\n';
+        return 1;
+    }
+
+    return 0;
+}
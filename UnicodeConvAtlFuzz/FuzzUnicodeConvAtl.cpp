@@ -0,0 +1,1131 @@
+////////////////////////////////////////////////////////////////////////////////
+// FuzzUnicodeConvAtl.cpp : Fuzz target and differential test driver, that
+// check every conversion engine against the Win32 reference conversions
+// (WideCharToMultiByte and MultiByteToWideChar), and measure their speedup
+// by Giovanni Dicanio <giovanni.dicanio AT gmail.com>
+////////////////////////////////////////////////////////////////////////////////
+
+
+//------------------------------------------------------------------------------
+// Usage:
+//
+//      FuzzUnicodeConvAtl [--iterations count] [--seed seed] [--size bytes]
+//      FuzzUnicodeConvAtl --replay file...
+//
+// Each input is converted by every engine (ToUtf8/ToUtf16, the native engine,
+// the single-pass conversions, the caller-provided buffers, the Try and policy
+// conversions, the streams, the parallel conversions, the stack buffers...),
+// and each output is compared, byte for byte, with the output of the Win32
+// reference conversions, called with WC_ERR_INVALID_CHARS and
+// MB_ERR_INVALID_CHARS (and without them, for InvalidInputPolicy::Replace).
+// Invalid input must be rejected by all the engines, and each reported offset
+// of the first invalid code unit is checked: the input before it must be valid,
+// and no valid sequence can start at it.
+// The first mismatch is printed, and the program aborts.
+//
+// The default (differential) mode generates random inputs for each input class
+// (ASCII, Latin-1, CJK, emoji-heavy, mixed), about a quarter of them
+// corrupted with invalid sequences, and then reports the throughput of every
+// engine on a text of each class (1 MB of UTF-8 by default), and its speedup
+// over the Win32 reference. Run the Release build, with no debugger attached.
+//
+// The --replay mode checks the given input files, like the fuzz target does:
+// use it to reproduce a crash found by a fuzzer, or to run the program
+// under AFL (WinAFL): afl-fuzz.exe ... -- FuzzUnicodeConvAtl.exe --replay @@
+//
+// To build a libFuzzer target, define UNICODECONVATL_LIBFUZZER and compile
+// with /fsanitize=fuzzer (libFuzzer provides main); /fsanitize=address
+// is recommended as well.
+// Each fuzzer input is checked both as UTF-8, and as UTF-16 (pairs of bytes).
+//------------------------------------------------------------------------------
+
+
+#include "UnicodeConvAtl.h"             // Module to test
+#include "UnicodeConvAtlEncodings.h"    // WTF-8 and CESU-8 conversions
+#include "UnicodeConvAtlParallel.h"     // Parallel conversions
+
+#include <atlbase.h>                    // CHandle
+
+#include <stdint.h>                     // uint8_t
+#include <stdlib.h>                     // abort
+
+#include <iomanip>                      // std::setw
+#include <iostream>                     // For console output
+#include <random>                       // std::mt19937
+#include <type_traits>                  // std::conditional
+#include <vector>                       // std::vector
+
+
+//
+// Differential Test Configuration
+//
+
+// Random inputs generated for each input class
+constexpr int kDefaultIterations = 20000;
+
+// Maximum length of the random inputs, in code points.
+// One input in kLongInputRatio is up to kMaxLongInputLength code points long.
+constexpr int kMaxInputLength = 64;
+constexpr int kMaxLongInputLength = 4096;
+constexpr int kLongInputRatio = 16;
+
+// One random input in kCorruptionRatio is corrupted with invalid sequences
+constexpr int kCorruptionRatio = 4;
+
+// Size of the throughput texts, in UTF-8 bytes
+constexpr size_t kDefaultTextSize = 1024 * 1024;
+
+// Time spent measuring the throughput of each engine, in seconds
+constexpr double kTimeBudgetPerEngine = 0.2;
+
+// Chunk lengths fed to the streaming converters, in turn, so that
+// the sequences are split at every possible position
+const int kStreamChunkLengths[] = { 1, 2, 3, 5, 8, 13, 64 };
+
+// Output capacity of each step of the resumed buffer conversions:
+// enough for a surrogate pair, or for the longest UTF-8 sequence
+constexpr int kResumedCapacity = 7;
+
+
+//
+// Input classes: the random inputs get their code points from the class range
+// (mixed with ASCII); the throughput texts are built repeating the class sample
+//
+
+struct InputClass
+{
+    const char*     name;
+    unsigned int    firstCodePoint;
+    unsigned int    lastCodePoint;
+    const wchar_t*  sample;
+};
+
+const InputClass kInputClasses[] =
+{
+    { "ASCII",      0x0000, 0x007F,
+                    L"The quick brown fox jumps over the lazy dog. 0123456789\n" },
+    { "Latin-1",    0x0080, 0x00FF,
+                    L"Caff\xE8 cr\xE8me br\xFBl\xE9" L"e, na\xEFve se\xF1or, \xC5ngstr\xF6m, "
+                    L"\xE0 la carte, Stra\xDF" L"e\n" },
+    { "CJK",        0x3000, 0x9FFF,
+                    L"\x65E5\x672C\x8A9E\x306E\x6587\x7AE0\x3002\x4E2D\x6587\x6587\x672C"
+                    L"\x3002\xD55C\xAD6D\xC5B4\x3001\x5B66\x5802\n" },
+    { "Emoji",      0x1F300, 0x1FAFF,
+                    L"\xD83D\xDE00\xD83D\xDE80\xD83C\xDF89\xD83D\xDC4D \xD83E\xDD16"
+                    L"\xD83C\xDF0D\xD83D\xDCA1\xD83D\xDD25\n" },
+    { "Mixed",      0x0000, 0x10FFFF,
+                    L"Hello, \x4E16\x754C! Caff\xE8 \xD83D\xDE00 \x3053\x3093\x306B\x3061"
+                    L"\x306F, \x041F\x0440\x0438\x0432\x0435\x0442 \x0645\x0631\x062D\x0628"
+                    L"\x0627\n" },
+};
+
+// Code points at the boundaries of the UTF-8 sequence lengths, and around
+// the surrogates, mixed into the random inputs of every class
+const unsigned int kBoundaryCodePoints[] =
+{
+    0x0000, 0x007F, 0x0080, 0x07FF, 0x0800, 0xD7FF, 0xE000, 0xFFFD, 0xFFFE, 0xFFFF,
+    0x10000, 0x10FFFF
+};
+
+// Ill-formed UTF-8 sequences inserted into the corrupted inputs
+const char* const kInvalidUtf8Sequences[] =
+{
+    "\x80",                 // continuation byte without a lead byte
+    "\xBF",
+    "\xC0\xAF",             // overlong encodings
+    "\xC1\xBF",
+    "\xE0\x80\xAF",
+    "\xF0\x80\x80\xAF",
+    "\xED\xA0\x80",         // encoded surrogates
+    "\xED\xBF\xBF",
+    "\xF4\x90\x80\x80",     // beyond U+10FFFF
+    "\xF5\x80\x80\x80",
+    "\xFE",                 // bytes never used in UTF-8
+    "\xFF",
+    "\xE5\xAD",             // truncated sequences
+    "\xF0\x9F\x98",
+};
+
+
+//
+// Failure Reporting
+//
+
+// Raw bytes of the input being checked, printed when a check fails
+const uint8_t* g_inputBytes = nullptr;
+size_t g_inputSize = 0;
+
+
+// Print the failed check and the input, and abort, so that fuzzers
+// record the input as a crash
+[[noreturn]] void Fail(const char* engine, const char* message)
+{
+    std::cerr << "\n*** MISMATCH: " << engine << ": " << message << '\n'
+              << "Input (" << g_inputSize << " bytes):";
+
+    for (size_t i = 0; i < g_inputSize; ++i)
+    {
+        std::cerr << ((i % 16 == 0) ? "\n    " : " ")
+                  << std::hex << std::setw(2) << std::setfill('0')
+                  << static_cast<unsigned int>(g_inputBytes[i]);
+    }
+    std::cerr << std::dec << std::setfill(' ') << std::endl;
+
+    abort();
+}
+
+
+//
+// Win32 Reference Conversions
+//
+
+// Convert with WideCharToMultiByte; return false if the input is rejected
+bool ReferenceConvert(const wchar_t* utf16, int utf16Length, DWORD flags, CStringA& utf8)
+{
+    utf8.Empty();
+    if (utf16Length == 0)
+    {
+        return true;
+    }
+
+    const int utf8Length = ::WideCharToMultiByte(CP_UTF8, flags, utf16, utf16Length,
+                                                 nullptr, 0, nullptr, nullptr);
+    if (utf8Length == 0)
+    {
+        if (::GetLastError() != ERROR_NO_UNICODE_TRANSLATION)
+        {
+            Fail("WideCharToMultiByte", "unexpected error");
+        }
+        return false;
+    }
+
+    char* utf8Buffer = utf8.GetBuffer(utf8Length);
+    if (::WideCharToMultiByte(CP_UTF8, flags, utf16, utf16Length,
+                              utf8Buffer, utf8Length, nullptr, nullptr) != utf8Length)
+    {
+        Fail("WideCharToMultiByte", "inconsistent length");
+    }
+    utf8.ReleaseBuffer(utf8Length);
+    return true;
+}
+
+
+// Convert with MultiByteToWideChar; return false if the input is rejected
+bool ReferenceConvert(const char* utf8, int utf8Length, DWORD flags, CStringW& utf16)
+{
+    utf16.Empty();
+    if (utf8Length == 0)
+    {
+        return true;
+    }
+
+    const int utf16Length = ::MultiByteToWideChar(CP_UTF8, flags, utf8, utf8Length,
+                                                  nullptr, 0);
+    if (utf16Length == 0)
+    {
+        if (::GetLastError() != ERROR_NO_UNICODE_TRANSLATION)
+        {
+            Fail("MultiByteToWideChar", "unexpected error");
+        }
+        return false;
+    }
+
+    wchar_t* utf16Buffer = utf16.GetBuffer(utf16Length);
+    if (::MultiByteToWideChar(CP_UTF8, flags, utf8, utf8Length,
+                              utf16Buffer, utf16Length) != utf16Length)
+    {
+        Fail("MultiByteToWideChar", "inconsistent length");
+    }
+    utf16.ReleaseBuffer(utf16Length);
+    return true;
+}
+
+
+// Return true if the reference conversion accepts the first length code units
+template <typename CharType>
+bool ReferenceIsValid(const CharType* text, int length)
+{
+    typename std::conditional<sizeof(CharType) == 1, CStringW, CStringA>::type output;
+    return ReferenceConvert(text, length, sizeof(CharType) == 1
+                            ? MB_ERR_INVALID_CHARS : WC_ERR_INVALID_CHARS, output);
+}
+
+
+//
+// Checks
+//
+
+const HRESULT kInvalidInputError = HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION);
+
+
+// Run a conversion, returning the HRESULT of the CAtlException it throws
+template <typename ConvertFunc>
+HRESULT Run(ConvertFunc convert)
+{
+    try
+    {
+        convert();
+    }
+    catch (const CAtlException& e)
+    {
+        return e;
+    }
+    return S_OK;
+}
+
+
+// Compare two strings, including their embedded NULs
+// (CString comparison operators stop at the first NUL)
+template <typename CharType>
+bool IsSameText(const CharType* text1, int length1, const CharType* text2, int length2)
+{
+    return (length1 == length2)
+        && (memcmp(text1, text2, static_cast<size_t>(length1) * sizeof(CharType)) == 0);
+}
+
+template <typename StringType>
+bool IsSameText(StringType const& text1, StringType const& text2)
+{
+    return IsSameText(text1.GetString(), text1.GetLength(), text2.GetString(), text2.GetLength());
+}
+
+
+// Check the outcome of a conversion against the reference conversion
+template <typename StringType>
+void CheckOutput(const char* engine, HRESULT hr, StringType const& output,
+                 bool referenceIsValid, StringType const& reference)
+{
+    if (referenceIsValid)
+    {
+        if (FAILED(hr))
+        {
+            Fail(engine, "valid input rejected");
+        }
+        if (!IsSameText(output, reference))
+        {
+            Fail(engine, "output differs from the reference");
+        }
+    }
+    else if (hr != kInvalidInputError)
+    {
+        Fail(engine, SUCCEEDED(hr) ? "invalid input accepted" : "unexpected error");
+    }
+}
+
+
+// Check the offset of the first invalid code unit reported by an engine:
+// the input before it must be valid, and no valid sequence can start there
+// (the longer prefixes, up to the longest sequence, must be invalid)
+template <typename CharType>
+void CheckInvalidOffset(const char* engine, const CharType* text, int length, int invalidOffset)
+{
+    if ((invalidOffset < 0) || (invalidOffset >= length))
+    {
+        Fail(engine, "invalid offset out of range");
+    }
+    if (!ReferenceIsValid(text, invalidOffset))
+    {
+        Fail(engine, "invalid input before the invalid offset");
+    }
+
+    const int maxSequenceLength = (sizeof(CharType) == 1) ? 4 : 2;
+    for (int i = 1; (i <= maxSequenceLength) && (invalidOffset + i <= length); ++i)
+    {
+        if (ReferenceIsValid(text, invalidOffset + i))
+        {
+            Fail(engine, "valid sequence at the invalid offset");
+        }
+    }
+}
+
+
+// Check a conversion into a caller-provided buffer: the result must match
+// the reference, or stop at the first invalid code unit
+template <typename InputCharType, typename OutputCharType>
+void CheckBufferOutput(const char* engine, const InputCharType* input, int inputLength,
+                       UnicodeConvAtl::ConversionResult const& result,
+                       const OutputCharType* output, bool referenceIsValid,
+                       const OutputCharType* reference, int referenceLength)
+{
+    using UnicodeConvAtl::ConversionStatus;
+
+    if (referenceIsValid)
+    {
+        if ((result.Status != ConversionStatus::Success) || (result.Consumed != inputLength))
+        {
+            Fail(engine, "valid input not converted");
+        }
+        if (!IsSameText(output, result.Written, reference, referenceLength))
+        {
+            Fail(engine, "output differs from the reference");
+        }
+        return;
+    }
+
+    if (result.Status != ConversionStatus::InvalidInput)
+    {
+        Fail(engine, "invalid input accepted");
+    }
+    CheckInvalidOffset(engine, input, inputLength, result.Consumed);
+
+    // The valid part before the invalid code unit has been converted
+    typename std::conditional<sizeof(OutputCharType) == 1, CStringA, CStringW>::type prefix;
+    ReferenceConvert(input, result.Consumed,
+                     sizeof(InputCharType) == 1 ? MB_ERR_INVALID_CHARS : WC_ERR_INVALID_CHARS,
+                     prefix);
+    if (!IsSameText(output, result.Written, prefix.GetString(), prefix.GetLength()))
+    {
+        Fail(engine, "output before the invalid offset differs from the reference");
+    }
+}
+
+
+// Convert into a caller-provided buffer, a few code units at a time,
+// resuming each conversion where the previous one stopped
+template <typename InputCharType, typename OutputCharType, typename ConvertFunc>
+UnicodeConvAtl::ConversionResult ConvertResumed(const char* engine,
+                                                const InputCharType* input, int inputLength,
+                                                OutputCharType* output, int outputCapacity,
+                                                ConvertFunc convert)
+{
+    using UnicodeConvAtl::ConversionStatus;
+
+    UnicodeConvAtl::ConversionResult total = { 0, 0, ConversionStatus::Success };
+    while (total.Consumed < inputLength)
+    {
+        int capacity = outputCapacity - total.Written;
+        if (capacity > kResumedCapacity)
+        {
+            capacity = kResumedCapacity;
+        }
+
+        const UnicodeConvAtl::ConversionResult step = convert(
+            input + total.Consumed, inputLength - total.Consumed,
+            output + total.Written, capacity);
+
+        total.Written += step.Written;
+        total.Consumed += step.Consumed;
+        total.Status = step.Status;
+
+        if (step.Status == ConversionStatus::InsufficientBuffer)
+        {
+            if (step.Consumed == 0)
+            {
+                Fail(engine, "no progress with a buffer large enough for a code point");
+            }
+        }
+        else if (step.Status != ConversionStatus::Success)
+        {
+            break;
+        }
+    }
+
+    if (total.Status == ConversionStatus::InsufficientBuffer)
+    {
+        Fail(engine, "whole input consumed, but buffer reported as insufficient");
+    }
+    return total;
+}
+
+
+// Check all the UTF-16 to UTF-8 engines on the given input
+void CheckUtf16Input(const wchar_t* utf16, int utf16Length)
+{
+    using namespace UnicodeConvAtl;
+
+    CStringA reference;
+    const bool valid = ReferenceConvert(utf16, utf16Length, WC_ERR_INVALID_CHARS, reference);
+
+    // Without WC_ERR_INVALID_CHARS, unpaired surrogates are replaced with U+FFFD
+    CStringA replaced;
+    if (!ReferenceConvert(utf16, utf16Length, 0, replaced))
+    {
+        Fail("WideCharToMultiByte", "conversion without WC_ERR_INVALID_CHARS failed");
+    }
+
+    const CStringW text(utf16, utf16Length);
+    CStringA utf8;
+    HRESULT hr;
+
+    hr = Run([&]() { utf8 = ToUtf8(utf16, utf16Length); });
+    CheckOutput("ToUtf8", hr, utf8, valid, reference);
+
+    hr = Run([&]() { utf8 = ToUtf8Native(text); });
+    CheckOutput("ToUtf8Native", hr, utf8, valid, reference);
+
+    hr = Run([&]() { utf8 = ToUtf8SinglePass(text); });
+    CheckOutput("ToUtf8SinglePass", hr, utf8, valid, reference);
+
+    hr = Run([&]() { utf8 = ToUtf8SinglePass(text, true); });
+    CheckOutput("ToUtf8SinglePass (shrink to fit)", hr, utf8, valid, reference);
+
+    hr = Run([&]() { utf8 = "Prefix"; AppendUtf8(utf16, utf16Length, utf8); });
+    CheckOutput("AppendUtf8", hr, utf8, valid, CStringA("Prefix") + reference);
+
+    hr = Run([&]() { CW2Utf8 converted(utf16, utf16Length);
+                     utf8.SetString(converted.GetString(), converted.GetLength()); });
+    CheckOutput("CW2Utf8", hr, utf8, valid, reference);
+
+    hr = Run([&]() { utf8 = ToUtf8Parallel(utf16, utf16Length, 0); });
+    CheckOutput("ToUtf8Parallel", hr, utf8, valid, reference);
+
+    hr = Run([&]()
+    {
+        utf8.Empty();
+        Utf16ToUtf8Stream stream;
+        for (int position = 0, chunk = 0; position < utf16Length; ++chunk)
+        {
+            int chunkLength = kStreamChunkLengths[chunk % _countof(kStreamChunkLengths)];
+            if (chunkLength > utf16Length - position)
+            {
+                chunkLength = utf16Length - position;
+            }
+            stream.Convert(utf16 + position, chunkLength, utf8);
+            position += chunkLength;
+        }
+        stream.Finish();
+    });
+    CheckOutput("Utf16ToUtf8Stream", hr, utf8, valid, reference);
+
+    if (valid)
+    {
+        hr = Run([&]() { ConvertToUtf8<ThrowOnError, CStringAllocPolicy, TrustInput>(
+                             utf16, utf16Length, utf8); });
+        CheckOutput("ConvertToUtf8<TrustInput>", hr, utf8, valid, reference);
+
+        hr = Run([&]() { utf8 = Utf16ToWtf8(text); });
+        CheckOutput("Utf16ToWtf8", hr, utf8, valid, reference);
+
+        int utf8Length = -1;
+        hr = Run([&]() { utf8Length = Utf8LengthOf(utf16, utf16Length); });
+        if (FAILED(hr) || (utf8Length != reference.GetLength()))
+        {
+            Fail("Utf8LengthOf", "length differs from the reference");
+        }
+    }
+
+    // WTF-8 preserves the unpaired surrogates across the round trip
+    CStringW roundTrip;
+    hr = Run([&]() { roundTrip = Wtf8ToUtf16(Utf16ToWtf8(text)); });
+    CheckOutput("Utf16ToWtf8/Wtf8ToUtf16 round trip", hr, roundTrip, true, text);
+
+    // CESU-8 rejects the same unpaired surrogates of UTF-8
+    hr = Run([&]() { roundTrip = Cesu8ToUtf16(Utf16ToCesu8(text)); });
+    CheckOutput("Utf16ToCesu8/Cesu8ToUtf16 round trip", hr, roundTrip, valid, text);
+
+    hr = Run([&]() { utf8 = ToUtf8(text, InvalidInputPolicy::Replace); });
+    CheckOutput("ToUtf8 (InvalidInputPolicy::Replace)", hr, utf8, true, replaced);
+
+    int invalidOffset = -1;
+    hr = TryToUtf8(utf16, utf16Length, utf8, &invalidOffset);
+    CheckOutput("TryToUtf8", hr, utf8, valid, reference);
+    if (!valid)
+    {
+        CheckInvalidOffset("TryToUtf8", utf16, utf16Length, invalidOffset);
+    }
+
+    if (IsValidUtf16(utf16, utf16Length, &invalidOffset) != valid)
+    {
+        Fail("IsValidUtf16", "validity differs from the reference");
+    }
+    if (!valid)
+    {
+        CheckInvalidOffset("IsValidUtf16", utf16, utf16Length, invalidOffset);
+    }
+
+    // Each UTF-16 code unit takes at most 3 UTF-8 bytes (a pair takes 4)
+    std::vector<char> buffer(static_cast<size_t>(utf16Length) * 3 + 1);
+    const int capacity = static_cast<int>(buffer.size());
+
+    ConversionResult result = ConvertUtf16ToUtf8(utf16, utf16Length, buffer.data(), capacity);
+    CheckBufferOutput("ConvertUtf16ToUtf8", utf16, utf16Length, result, buffer.data(),
+                      valid, reference.GetString(), reference.GetLength());
+
+    result = ConvertResumed("ConvertUtf16ToUtf8 (resumed)", utf16, utf16Length,
+                            buffer.data(), capacity,
+        [](const wchar_t* input, int inputLength, char* output, int outputCapacity)
+        {
+            return ConvertUtf16ToUtf8(input, inputLength, output, outputCapacity);
+        });
+    CheckBufferOutput("ConvertUtf16ToUtf8 (resumed)", utf16, utf16Length, result, buffer.data(),
+                      valid, reference.GetString(), reference.GetLength());
+}
+
+
+// Check all the UTF-8 to UTF-16 engines on the given input
+void CheckUtf8Input(const char* utf8, int utf8Length)
+{
+    using namespace UnicodeConvAtl;
+
+    CStringW reference;
+    const bool valid = ReferenceConvert(utf8, utf8Length, MB_ERR_INVALID_CHARS, reference);
+
+    // Without MB_ERR_INVALID_CHARS, each maximal subpart of an ill-formed
+    // sequence is replaced with U+FFFD
+    CStringW replaced;
+    if (!ReferenceConvert(utf8, utf8Length, 0, replaced))
+    {
+        Fail("MultiByteToWideChar", "conversion without MB_ERR_INVALID_CHARS failed");
+    }
+
+    const CStringA text(utf8, utf8Length);
+    CStringW utf16;
+    HRESULT hr;
+
+    hr = Run([&]() { utf16 = ToUtf16(utf8, utf8Length); });
+    CheckOutput("ToUtf16", hr, utf16, valid, reference);
+
+    hr = Run([&]() { utf16 = ToUtf16Native(text); });
+    CheckOutput("ToUtf16Native", hr, utf16, valid, reference);
+
+    hr = Run([&]() { utf16 = ToUtf16SinglePass(text); });
+    CheckOutput("ToUtf16SinglePass", hr, utf16, valid, reference);
+
+    hr = Run([&]() { utf16 = ToUtf16SinglePass(text, true); });
+    CheckOutput("ToUtf16SinglePass (shrink to fit)", hr, utf16, valid, reference);
+
+    hr = Run([&]() { utf16 = L"Prefix"; AppendUtf16(utf8, utf8Length, utf16); });
+    CheckOutput("AppendUtf16", hr, utf16, valid, CStringW(L"Prefix") + reference);
+
+    hr = Run([&]() { CUtf82W converted(utf8, utf8Length);
+                     utf16.SetString(converted, converted.GetLength()); });
+    CheckOutput("CUtf82W", hr, utf16, valid, reference);
+
+    hr = Run([&]() { utf16 = ToUtf16Parallel(utf8, utf8Length, 0); });
+    CheckOutput("ToUtf16Parallel", hr, utf16, valid, reference);
+
+    hr = Run([&]()
+    {
+        utf16.Empty();
+        Utf8ToUtf16Stream stream;
+        for (int position = 0, chunk = 0; position < utf8Length; ++chunk)
+        {
+            int chunkLength = kStreamChunkLengths[chunk % _countof(kStreamChunkLengths)];
+            if (chunkLength > utf8Length - position)
+            {
+                chunkLength = utf8Length - position;
+            }
+            stream.Convert(utf8 + position, chunkLength, utf16);
+            position += chunkLength;
+        }
+        stream.Finish();
+    });
+    CheckOutput("Utf8ToUtf16Stream", hr, utf16, valid, reference);
+
+    if (valid)
+    {
+        hr = Run([&]() { ConvertToUtf16<ThrowOnError, CStringAllocPolicy, TrustInput>(
+                             utf8, utf8Length, utf16); });
+        CheckOutput("ConvertToUtf16<TrustInput>", hr, utf16, valid, reference);
+
+        // Valid UTF-8 is valid WTF-8
+        hr = Run([&]() { utf16 = Wtf8ToUtf16(text); });
+        CheckOutput("Wtf8ToUtf16", hr, utf16, valid, reference);
+
+        int utf16Length = -1;
+        hr = Run([&]() { utf16Length = Utf16LengthOf(utf8, utf8Length); });
+        if (FAILED(hr) || (utf16Length != reference.GetLength()))
+        {
+            Fail("Utf16LengthOf", "length differs from the reference");
+        }
+    }
+
+    hr = Run([&]() { utf16 = ToUtf16(text, InvalidInputPolicy::Replace); });
+    CheckOutput("ToUtf16 (InvalidInputPolicy::Replace)", hr, utf16, true, replaced);
+
+    int invalidOffset = -1;
+    hr = TryToUtf16(utf8, utf8Length, utf16, &invalidOffset);
+    CheckOutput("TryToUtf16", hr, utf16, valid, reference);
+    if (!valid)
+    {
+        CheckInvalidOffset("TryToUtf16", utf8, utf8Length, invalidOffset);
+    }
+
+    if (IsValidUtf8(utf8, utf8Length, &invalidOffset) != valid)
+    {
+        Fail("IsValidUtf8", "validity differs from the reference");
+    }
+    if (!valid)
+    {
+        CheckInvalidOffset("IsValidUtf8", utf8, utf8Length, invalidOffset);
+    }
+
+    // Each UTF-8 byte produces at most one UTF-16 code unit
+    std::vector<wchar_t> buffer(static_cast<size_t>(utf8Length) + 1);
+    const int capacity = static_cast<int>(buffer.size());
+
+    ConversionResult result = ConvertUtf8ToUtf16(utf8, utf8Length, buffer.data(), capacity);
+    CheckBufferOutput("ConvertUtf8ToUtf16", utf8, utf8Length, result, buffer.data(),
+                      valid, reference.GetString(), reference.GetLength());
+
+    result = ConvertResumed("ConvertUtf8ToUtf16 (resumed)", utf8, utf8Length,
+                            buffer.data(), capacity,
+        [](const char* input, int inputLength, wchar_t* output, int outputCapacity)
+        {
+            return ConvertUtf8ToUtf16(input, inputLength, output, outputCapacity);
+        });
+    CheckBufferOutput("ConvertUtf8ToUtf16 (resumed)", utf8, utf8Length, result, buffer.data(),
+                      valid, reference.GetString(), reference.GetLength());
+}
+
+
+//
+// Fuzz Target
+//
+
+// Check an input both as UTF-8 and as UTF-16 (ignoring a trailing odd byte).
+// Any mismatch aborts the program.
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    if (size > static_cast<size_t>(INT_MAX))
+    {
+        return 0;
+    }
+
+    g_inputBytes = data;
+    g_inputSize = size;
+
+    CheckUtf8Input(reinterpret_cast<const char*>(data), static_cast<int>(size));
+
+    // Copy the UTF-16 code units, as the fuzzer data may not be aligned
+    std::vector<wchar_t> utf16(size / sizeof(wchar_t));
+    if (!utf16.empty())
+    {
+        memcpy(utf16.data(), data, utf16.size() * sizeof(wchar_t));
+    }
+    CheckUtf16Input(utf16.data(), static_cast<int>(utf16.size()));
+
+    g_inputBytes = nullptr;
+    g_inputSize = 0;
+    return 0;
+}
+
+
+#ifndef UNICODECONVATL_LIBFUZZER
+
+//
+// Differential Test
+//
+
+// Append the UTF-16 encoding of a code point
+void AppendCodePoint(unsigned int codePoint, CStringW& utf16)
+{
+    if (codePoint < 0x10000)
+    {
+        utf16 += static_cast<wchar_t>(codePoint);
+    }
+    else
+    {
+        utf16 += static_cast<wchar_t>(0xD800 + ((codePoint - 0x10000) >> 10));
+        utf16 += static_cast<wchar_t>(0xDC00 + ((codePoint - 0x10000) & 0x3FF));
+    }
+}
+
+
+// Build a random valid UTF-16 string of code points of the given class
+CStringW RandomText(InputClass const& inputClass, std::mt19937& random)
+{
+    const int maxLength = (random() % kLongInputRatio == 0) ? kMaxLongInputLength : kMaxInputLength;
+    const int length = static_cast<int>(random() % (maxLength + 1));
+
+    std::uniform_int_distribution<unsigned int> classCodePoints(
+        inputClass.firstCodePoint, inputClass.lastCodePoint);
+
+    CStringW text;
+    for (int i = 0; i < length; ++i)
+    {
+        unsigned int codePoint;
+        switch (random() % 8)
+        {
+        case 0:
+            codePoint = kBoundaryCodePoints[random() % _countof(kBoundaryCodePoints)];
+            break;
+
+        case 1:
+        case 2:
+            codePoint = random() % 0x80;
+            break;
+
+        default:
+            codePoint = classCodePoints(random);
+            break;
+        }
+
+        if (codePoint >= 0xD800 && codePoint <= 0xDFFF)
+        {
+            // Surrogates aren't code points of valid text
+            codePoint = 0xFFFD;
+        }
+        AppendCodePoint(codePoint, text);
+    }
+    return text;
+}
+
+
+// Corrupt an UTF-16 string, inserting an unpaired surrogate,
+// or cutting the string (possibly splitting a surrogate pair)
+void CorruptUtf16(CStringW& utf16, std::mt19937& random)
+{
+    const int position = static_cast<int>(random() % (utf16.GetLength() + 1));
+    if (random() % 2 == 0)
+    {
+        utf16.Insert(position, static_cast<wchar_t>(0xD800 + random() % 0x800));
+    }
+    else
+    {
+        utf16.Truncate(position);
+    }
+}
+
+
+// Corrupt an UTF-8 string, inserting an ill-formed sequence, replacing
+// or removing a random byte, or cutting the string
+void CorruptUtf8(CStringA& utf8, std::mt19937& random)
+{
+    const int position = static_cast<int>(random() % (utf8.GetLength() + 1));
+    switch (random() % 4)
+    {
+    case 0:
+        utf8.Insert(position, kInvalidUtf8Sequences[random() % _countof(kInvalidUtf8Sequences)]);
+        break;
+
+    case 1:
+        if (position < utf8.GetLength())
+        {
+            utf8.SetAt(position, static_cast<char>(random() % 0x100));
+        }
+        break;
+
+    case 2:
+        utf8.Delete(position);
+        break;
+
+    default:
+        utf8.Truncate(position);
+        break;
+    }
+}
+
+
+// Check a UTF-16 string, and a UTF-8 string, setting the input printed on failure
+void CheckInputs(CStringW const& utf16, CStringA const& utf8)
+{
+    g_inputBytes = reinterpret_cast<const uint8_t*>(utf16.GetString());
+    g_inputSize = static_cast<size_t>(utf16.GetLength()) * sizeof(wchar_t);
+    CheckUtf16Input(utf16.GetString(), utf16.GetLength());
+
+    g_inputBytes = reinterpret_cast<const uint8_t*>(utf8.GetString());
+    g_inputSize = static_cast<size_t>(utf8.GetLength());
+    CheckUtf8Input(utf8.GetString(), utf8.GetLength());
+
+    g_inputBytes = nullptr;
+    g_inputSize = 0;
+}
+
+
+// Check the engines on random inputs of each class
+void RunDifferentialTest(int iterations, unsigned int seed)
+{
+    std::cout << "Differential test, " << iterations << " inputs per class, seed "
+              << seed << ":\n"
+              << "  " << std::left << std::setw(12) << "Class" << std::right
+              << std::setw(12) << "Inputs" << std::setw(16) << "Invalid UTF-16"
+              << std::setw(16) << "Invalid UTF-8" << '\n';
+
+    std::mt19937 random(seed);
+
+    for (const InputClass& inputClass : kInputClasses)
+    {
+        int invalidUtf16Count = 0;
+        int invalidUtf8Count = 0;
+
+        for (int i = 0; i < iterations; ++i)
+        {
+            CStringW utf16 = RandomText(inputClass, random);
+            CStringA utf8 = UnicodeConvAtl::ToUtf8(utf16);
+
+            if (random() % kCorruptionRatio == 0)
+            {
+                CorruptUtf16(utf16, random);
+            }
+            if (random() % kCorruptionRatio == 0)
+            {
+                CorruptUtf8(utf8, random);
+            }
+
+            invalidUtf16Count += UnicodeConvAtl::IsValidUtf16(utf16) ? 0 : 1;
+            invalidUtf8Count += UnicodeConvAtl::IsValidUtf8(utf8) ? 0 : 1;
+
+            CheckInputs(utf16, utf8);
+        }
+
+        std::cout << "  " << std::left << std::setw(12) << inputClass.name << std::right
+                  << std::setw(12) << iterations << std::setw(16) << invalidUtf16Count
+                  << std::setw(16) << invalidUtf8Count << '\n';
+    }
+
+    std::cout << "All the engines match the Win32 reference.\n\n";
+}
+
+
+//
+// Throughput
+//
+
+// Results of the conversions are accumulated here,
+// so that the compiler can't optimize them away
+volatile unsigned int g_sink = 0;
+
+
+// Return the current QPC time, in seconds
+double Now()
+{
+    static const double frequency = []()
+    {
+        LARGE_INTEGER f;
+        ::QueryPerformanceFrequency(&f);
+        return static_cast<double>(f.QuadPart);
+    }();
+
+    LARGE_INTEGER counter;
+    ::QueryPerformanceCounter(&counter);
+    return static_cast<double>(counter.QuadPart) / frequency;
+}
+
+
+// Run the given conversion repeatedly, and return its throughput in MB/s
+// of UTF-8 text. The conversion function returns the length of its result.
+template <typename ConvertFunc>
+double MeasureThroughput(size_t textBytes, ConvertFunc convert)
+{
+    // Warm up caches, and the buffers reused across conversions
+    g_sink = g_sink + static_cast<unsigned int>(convert());
+
+    size_t conversions = 0;
+    const double start = Now();
+    double elapsed = 0.0;
+    do
+    {
+        g_sink = g_sink + static_cast<unsigned int>(convert());
+        ++conversions;
+        elapsed = Now() - start;
+    } while (elapsed < kTimeBudgetPerEngine);
+
+    return static_cast<double>(conversions) * static_cast<double>(textBytes)
+        / (1024.0 * 1024.0) / elapsed;
+}
+
+
+// Print the throughput of an engine, and its speedup over the reference
+void PrintThroughput(const char* engine, double megabytesPerSecond, double referenceMegabytesPerSecond)
+{
+    std::cout << "  " << std::left << std::setw(36) << engine << std::right
+              << std::fixed << std::setprecision(1)
+              << std::setw(12) << megabytesPerSecond
+              << std::setprecision(2)
+              << std::setw(10) << megabytesPerSecond / referenceMegabytesPerSecond << "x\n";
+}
+
+
+// Build a text of (about) textBytes UTF-8 bytes, repeating the given sample
+CStringW BuildText(const wchar_t* sample, size_t textBytes)
+{
+    const CStringW sampleUtf16(sample);
+    const size_t sampleBytes = static_cast<size_t>(UnicodeConvAtl::Utf8LengthOf(sampleUtf16));
+
+    CStringW text;
+    for (size_t bytes = 0; bytes + sampleBytes <= textBytes; bytes += sampleBytes)
+    {
+        text += sampleUtf16;
+    }
+    return text;
+}
+
+
+// Measure the throughput of the engines on a text of each class,
+// after checking them on it (so the parallel engines split it in chunks)
+void RunThroughputTest(size_t textBytes)
+{
+    using namespace UnicodeConvAtl;
+
+    std::cout << "Throughput, and speedup over the Win32 reference:\n";
+
+    for (const InputClass& inputClass : kInputClasses)
+    {
+        const CStringW utf16 = BuildText(inputClass.sample, textBytes);
+        const CStringA utf8 = ToUtf8(utf16);
+        const size_t bytes = static_cast<size_t>(utf8.GetLength());
+
+        CheckInputs(utf16, utf8);
+
+        std::cout << inputClass.name << ", " << bytes << " bytes:\n"
+                  << "  " << std::left << std::setw(36) << "Engine" << std::right
+                  << std::setw(12) << "MB/s" << std::setw(11) << "Speedup" << '\n';
+
+        CStringA reusedUtf8;
+        CStringW reusedUtf16;
+
+        const double referenceToUtf8 = MeasureThroughput(bytes, [&]()
+        {
+            ReferenceConvert(utf16.GetString(), utf16.GetLength(), WC_ERR_INVALID_CHARS, reusedUtf8);
+            return reusedUtf8.GetLength();
+        });
+        PrintThroughput("UTF-16->8 WideCharToMultiByte", referenceToUtf8, referenceToUtf8);
+
+        PrintThroughput("UTF-16->8 ToUtf8", MeasureThroughput(bytes, [&]()
+            { ToUtf8(utf16, reusedUtf8); return reusedUtf8.GetLength(); }), referenceToUtf8);
+
+        PrintThroughput("UTF-16->8 ToUtf8Native", MeasureThroughput(bytes, [&]()
+            { return ToUtf8Native(utf16).GetLength(); }), referenceToUtf8);
+
+        PrintThroughput("UTF-16->8 ToUtf8SinglePass", MeasureThroughput(bytes, [&]()
+            { return ToUtf8SinglePass(utf16).GetLength(); }), referenceToUtf8);
+
+        PrintThroughput("UTF-16->8 TryToUtf8", MeasureThroughput(bytes, [&]()
+            { TryToUtf8(utf16, reusedUtf8); return reusedUtf8.GetLength(); }), referenceToUtf8);
+
+        PrintThroughput("UTF-16->8 ConvertToUtf8<TrustInput>", MeasureThroughput(bytes, [&]()
+            {
+                ConvertToUtf8<ThrowOnError, CStringAllocPolicy, TrustInput>(
+                    utf16.GetString(), utf16.GetLength(), reusedUtf8);
+                return reusedUtf8.GetLength();
+            }), referenceToUtf8);
+
+        PrintThroughput("UTF-16->8 ToUtf8Parallel", MeasureThroughput(bytes, [&]()
+            { return ToUtf8Parallel(utf16).GetLength(); }), referenceToUtf8);
+
+        const double referenceToUtf16 = MeasureThroughput(bytes, [&]()
+        {
+            ReferenceConvert(utf8.GetString(), utf8.GetLength(), MB_ERR_INVALID_CHARS, reusedUtf16);
+            return reusedUtf16.GetLength();
+        });
+        PrintThroughput("UTF-8->16 MultiByteToWideChar", referenceToUtf16, referenceToUtf16);
+
+        PrintThroughput("UTF-8->16 ToUtf16", MeasureThroughput(bytes, [&]()
+            { ToUtf16(utf8, reusedUtf16); return reusedUtf16.GetLength(); }), referenceToUtf16);
+
+        PrintThroughput("UTF-8->16 ToUtf16Native", MeasureThroughput(bytes, [&]()
+            { return ToUtf16Native(utf8).GetLength(); }), referenceToUtf16);
+
+        PrintThroughput("UTF-8->16 ToUtf16SinglePass", MeasureThroughput(bytes, [&]()
+            { return ToUtf16SinglePass(utf8).GetLength(); }), referenceToUtf16);
+
+        PrintThroughput("UTF-8->16 TryToUtf16", MeasureThroughput(bytes, [&]()
+            { TryToUtf16(utf8, reusedUtf16); return reusedUtf16.GetLength(); }), referenceToUtf16);
+
+        PrintThroughput("UTF-8->16 ConvertToUtf16<TrustInput>", MeasureThroughput(bytes, [&]()
+            {
+                ConvertToUtf16<ThrowOnError, CStringAllocPolicy, TrustInput>(
+                    utf8.GetString(), utf8.GetLength(), reusedUtf16);
+                return reusedUtf16.GetLength();
+            }), referenceToUtf16);
+
+        PrintThroughput("UTF-8->16 ToUtf16Parallel", MeasureThroughput(bytes, [&]()
+            { return ToUtf16Parallel(utf8).GetLength(); }), referenceToUtf16);
+
+        std::cout << '\n';
+    }
+}
+
+
+//
+// Replay
+//
+
+// Check the content of the given file, like the fuzz target does
+void ReplayFile(const wchar_t* fileName)
+{
+    CHandle file(::CreateFileW(fileName, GENERIC_READ, FILE_SHARE_READ, nullptr,
+                               OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr));
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        file.Detach();
+        AtlThrowLastWin32();
+    }
+
+    LARGE_INTEGER fileSize;
+    if (!::GetFileSizeEx(file, &fileSize))
+    {
+        AtlThrowLastWin32();
+    }
+    if (fileSize.QuadPart > INT_MAX)
+    {
+        AtlThrow(HRESULT_FROM_WIN32(ERROR_FILE_TOO_LARGE));
+    }
+
+    std::vector<uint8_t> data(static_cast<size_t>(fileSize.QuadPart));
+    DWORD bytesRead = 0;
+    if (!data.empty()
+        && !::ReadFile(file, data.data(), static_cast<DWORD>(data.size()), &bytesRead, nullptr))
+    {
+        AtlThrowLastWin32();
+    }
+
+    LLVMFuzzerTestOneInput(data.data(), bytesRead);
+}
+
+
+int wmain(int argc, wchar_t* argv[])
+{
+    int iterations = kDefaultIterations;
+    unsigned int seed = 1;
+    size_t textSize = kDefaultTextSize;
+    int replayFirstFile = 0;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (wcscmp(argv[i], L"--replay") == 0)
+        {
+            replayFirstFile = i + 1;
+            break;
+        }
+        else if ((wcscmp(argv[i], L"--iterations") == 0) && (i + 1 < argc))
+        {
+            iterations = static_cast<int>(wcstol(argv[++i], nullptr, 10));
+        }
+        else if ((wcscmp(argv[i], L"--seed") == 0) && (i + 1 < argc))
+        {
+            seed = static_cast<unsigned int>(wcstoul(argv[++i], nullptr, 10));
+        }
+        else if ((wcscmp(argv[i], L"--size") == 0) && (i + 1 < argc))
+        {
+            textSize = static_cast<size_t>(wcstoull(argv[++i], nullptr, 10));
+        }
+        else
+        {
+            std::cerr << "Usage: FuzzUnicodeConvAtl [--iterations count] [--seed seed] [--size bytes]\n"
+                      << "       FuzzUnicodeConvAtl --replay file...\n";
+            return 1;
+        }
+    }
+
+    try
+    {
+        if (replayFirstFile != 0)
+        {
+            for (int i = replayFirstFile; i < argc; ++i)
+            {
+                ReplayFile(argv[i]);
+            }
+            std::cout << "Replayed " << (argc - replayFirstFile) << " inputs: no mismatches.\n";
+            return 0;
+        }
+
+        std::cout << "*** Differential Test of the Unicode Conversion Engines vs. Win32 *** \n"
+                  << "    ================================================================ \n"
+                  << "    by Giovanni Dicanio \n\n";
+
+        RunDifferentialTest(iterations, seed);
+        RunThroughputTest(textSize);
+    }
+    catch (const CAtlException& e)
+    {
+        std::cerr << "Test failed with HRESULT 0x" << std::hex
+                  << static_cast<unsigned long>(HRESULT(e)) << '\n';
+        return 1;
+    }
+
+    return 0;
+}
+
+#endif // UNICODECONVATL_LIBFUZZER